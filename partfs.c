@@ -49,6 +49,12 @@
 
 #include <libfdisk/libfdisk.h>
 
+#include <zstd.h>
+
+#include <zlib.h>
+
+#include <lz4.h>
+
 /*
  * the standard version of this function in libfdisk returns
  * the size in sectors. this returns the size in bytes.
@@ -64,11 +70,30 @@ static off_t __fdisk_partition_get_size(
 #include <unistd.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
+#include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <linux/fs.h>
 
 /*
  * file representations of partitions are named as "pX"
@@ -76,6 +101,244 @@ static off_t __fdisk_partition_get_size(
  */
 #define PARTFS_NAME_PREFIX      "p"
 
+/*
+ * android sparse image format, used to export partitions
+ * as (read-only) files named "pX.simg"
+ */
+#define PARTFS_SIMG_MAGIC               0xed26ff3a
+#define PARTFS_SIMG_HEADER_SIZE         28
+#define PARTFS_SIMG_CHUNK_HEADER_SIZE   12
+#define PARTFS_SIMG_CHUNK_RAW           0xcac1
+#define PARTFS_SIMG_CHUNK_FILL          0xcac2
+#define PARTFS_SIMG_CHUNK_DONT_CARE     0xcac3
+#define PARTFS_SIMG_CHUNK_CRC32         0xcac4
+
+/* largest amount of data described by a single raw chunk */
+#define PARTFS_SIMG_MAX_RAW             (16 << 20)
+
+/* size of the buffer used to fill regions of a partition with a pattern */
+#define PARTFS_FILL_SIZE                (1 << 20)
+
+/*
+ * size of the blocks saved by snapshots before they're first written
+ * to, the slot of a saved block that read as zeros, the longest name
+ * of a snapshot and the most data written back at once on rollback
+ */
+#define PARTFS_SNAP_BLOCK               (64 << 10)
+#define PARTFS_SNAP_ZERO                UINT32_MAX
+#define PARTFS_SNAP_NAME_MAX            32
+#define PARTFS_SNAP_BATCH               (4 << 20)
+
+/*
+ * partitions are exported as zstd compressed files named "pX.zst".
+ * the partition is split into frames of the given (uncompressed)
+ * size. each frame is compressed independently which allows the
+ * frames to be compressed in parallel, and a seek table is appended
+ * so that the result can be accessed via the seekable zstd format.
+ */
+#define PARTFS_ZST_FRAME_SIZE           (1 << 20)
+#define PARTFS_ZST_SKIPPABLE_MAGIC      0x184d2a5e
+#define PARTFS_ZST_SEEKABLE_MAGIC       0x8f92eab1
+
+/*
+ * with a base image, the blocks of a partition that differ from
+ * those in the base are exported as "pX.delta". partitions are
+ * compared in units of the given size by multiple threads.
+ */
+#define PARTFS_DIFF_UNIT                (1 << 20)
+
+/*
+ * block size used by block maps exported as "pX.bmap", and
+ * the largest block map that can be written to the file
+ */
+#define PARTFS_BMAP_BLOCK_SIZE          4096
+#define PARTFS_BMAP_MAX_SIZE            (16 << 20)
+
+/* ext2/3/4 superblock magic number, feature flags and group flags */
+#define PARTFS_EXT_MAGIC                        0xef53
+#define PARTFS_EXT_COMPAT_HAS_JOURNAL           0x0004
+#define PARTFS_EXT_COMPAT_SPARSE_SUPER2         0x0200
+#define PARTFS_EXT_INCOMPAT_META_BG             0x0010
+#define PARTFS_EXT_INCOMPAT_EXTENTS             0x0040
+#define PARTFS_EXT_INCOMPAT_64BIT               0x0080
+#define PARTFS_EXT_RO_COMPAT_SPARSE_SUPER       0x0001
+#define PARTFS_EXT_BG_INODE_UNINIT              0x0001
+#define PARTFS_EXT_BG_BLOCK_UNINIT              0x0002
+
+/*
+ * sector size of the FAT file systems partfs creates, the numbers of
+ * clusters below which a FAT is FAT12 and FAT16, the media descriptor
+ * of fixed disks and the attributes of directory entries
+ */
+#define PARTFS_FAT_SECTOR                       512
+#define PARTFS_FAT12_CLUSTERS                   4085
+#define PARTFS_FAT16_CLUSTERS                   65525
+#define PARTFS_FAT_MEDIA                        0xf8
+#define PARTFS_FAT_ATTR_VOLUME                  0x08
+#define PARTFS_FAT_ATTR_DIR                     0x10
+#define PARTFS_FAT_ATTR_ARCHIVE                 0x20
+#define PARTFS_FAT_ATTR_LFN                     0x0f
+
+/*
+ * characters of a long name held by each of its directory entries,
+ * the most entries a directory can have, and the size of the pieces
+ * in which files are copied into a FAT file system
+ */
+#define PARTFS_FAT_LFN_CHARS                    13
+#define PARTFS_FAT_DIR_MAX                      65536
+#define PARTFS_FAT_COPY_SIZE                    (4 << 20)
+
+/*
+ * the device may be an export of an nbd server, named by a uri of
+ * the form nbd://HOST[:PORT][/EXPORT] or
+ * nbd+unix:///[EXPORT]?socket=PATH. the constants are those of the
+ * nbd protocol's fixed newstyle handshake and transmission phase.
+ */
+#define PARTFS_NBD_PORT                         "10809"
+#define PARTFS_NBD_INIT_MAGIC                   UINT64_C(0x4e42444d41474943)
+#define PARTFS_NBD_OPTS_MAGIC                   UINT64_C(0x49484156454f5054)
+#define PARTFS_NBD_REP_MAGIC                    UINT64_C(0x0003e889045565a9)
+#define PARTFS_NBD_REQUEST_MAGIC                0x25609513
+#define PARTFS_NBD_SIMPLE_REPLY_MAGIC           0x67446698
+#define PARTFS_NBD_STRUCTURED_REPLY_MAGIC       0x668e33ef
+
+#define PARTFS_NBD_FLAG_FIXED_NEWSTYLE          0x0001
+#define PARTFS_NBD_FLAG_NO_ZEROES               0x0002
+
+#define PARTFS_NBD_OPT_EXPORT_NAME              1
+#define PARTFS_NBD_OPT_GO                       7
+#define PARTFS_NBD_OPT_STRUCTURED_REPLY         8
+#define PARTFS_NBD_REP_ACK                      1
+#define PARTFS_NBD_REP_INFO                     3
+#define PARTFS_NBD_REP_ERR_UNSUP                0x80000001
+#define PARTFS_NBD_INFO_EXPORT                  0
+
+#define PARTFS_NBD_FLAG_READ_ONLY               0x0002
+#define PARTFS_NBD_FLAG_SEND_FLUSH              0x0004
+#define PARTFS_NBD_FLAG_SEND_TRIM               0x0020
+#define PARTFS_NBD_FLAG_SEND_WRITE_ZEROES       0x0040
+#define PARTFS_NBD_FLAG_CAN_MULTI_CONN          0x0100
+
+#define PARTFS_NBD_CMD_READ                     0
+#define PARTFS_NBD_CMD_WRITE                    1
+#define PARTFS_NBD_CMD_DISC                     2
+#define PARTFS_NBD_CMD_FLUSH                    3
+#define PARTFS_NBD_CMD_TRIM                     4
+#define PARTFS_NBD_CMD_WRITE_ZEROES             6
+
+#define PARTFS_NBD_REPLY_FLAG_DONE              0x0001
+#define PARTFS_NBD_REPLY_TYPE_NONE              0
+#define PARTFS_NBD_REPLY_TYPE_OFFSET_DATA       1
+#define PARTFS_NBD_REPLY_TYPE_OFFSET_HOLE       2
+#define PARTFS_NBD_REPLY_TYPE_ERROR             0x8000
+
+/*
+ * reads and writes larger than this are split into several
+ * requests, which are sent without waiting for one another
+ */
+#define PARTFS_NBD_MAX_IO                       (4 << 20)
+/* connections made to servers that allow more than one */
+#define PARTFS_NBD_CONNS                        4
+
+/*
+ * the device may be a vmware sparse extent (a monolithicSparse or
+ * streamOptimized vmdk). the constants are those of its header,
+ * which is little endian. offsets and sizes within the extent are
+ * in 512-byte sectors.
+ */
+#define PARTFS_VMDK_MAGIC                       0x564d444b
+#define PARTFS_VMDK_SECTOR                      512
+
+#define PARTFS_VMDK_FLAG_REDUNDANT              (1 << 1)
+#define PARTFS_VMDK_FLAG_COMPRESSED             (1 << 16)
+#define PARTFS_VMDK_FLAG_MARKERS                (1 << 17)
+
+#define PARTFS_VMDK_COMPRESS_DEFLATE            1
+/* grain directory stored in the footer at the end of the extent */
+#define PARTFS_VMDK_GD_AT_END                   UINT64_MAX
+/* grain table entry of a grain that reads as zeros */
+#define PARTFS_VMDK_GTE_ZERO                    1
+/* offset of the unclean shutdown byte within the header */
+#define PARTFS_VMDK_UNCLEAN                     72
+
+/*
+ * size of the blocks of the device held in the block cache, and
+ * the start of the file in which the numbers of the blocks in the
+ * cache are kept between mounts
+ */
+#define PARTFS_CACHE_BLOCK                      (64 << 10)
+#define PARTFS_CACHE_MAGIC                      "PFSHOT\0\1"
+
+/*
+ * most blocks of a partition whose order of first reads is recorded,
+ * how many blocks along a recorded order are read ahead of a reader
+ * of the partition and how many are read at once, and the start of
+ * the file in which the orders are kept between mounts
+ */
+#define PARTFS_TRACE_MAX                        (1 << 18)
+#define PARTFS_TRACE_AHEAD                      64
+#define PARTFS_TRACE_RUN                        16
+#define PARTFS_TRACE_MAGIC                      "PFSSEQ\0\1"
+
+/*
+ * start of the cache file on local storage, the size of its header
+ * and of each entry of its index, and the state recorded in the
+ * header while the file is in use
+ */
+#define PARTFS_SSD_MAGIC                        "PFSSSD\0\2"
+#define PARTFS_SSD_HEADER                       4096
+#define PARTFS_SSD_ENTRY                        32
+#define PARTFS_SSD_INUSE                        1
+/* index entry flag of a block not yet written back to the device */
+#define PARTFS_SSD_DIRTY                        (1 << 0)
+/* no slot of the cache file */
+#define PARTFS_SSD_NONE                         UINT32_MAX
+/*
+ * size of the parts of a block that are written back on their own.
+ * partitions start and end on sector boundaries, so no part of a
+ * block holds the data of two partitions.
+ */
+#define PARTFS_SSD_SECTOR                       512
+#define PARTFS_SSD_SECTORS                      \
+    (PARTFS_CACHE_BLOCK / PARTFS_SSD_SECTOR)
+
+/*
+ * the start of a shared memory segment holding blocks of the device
+ * for several mounts, and the number of slots among which a block is
+ * looked for
+ */
+#define PARTFS_SHM_MAGIC                        "PFSSHM\0\1"
+#define PARTFS_SHM_WAYS                         4
+
+/*
+ * the share of the last ten seconds, in hundredths of a percent, in
+ * which tasks of the cgroup of partfs stalled waiting for memory above
+ * which the memory governor takes memory to be short, the fraction of
+ * the cgroup's memory limit that must be left free, and how often, in
+ * seconds, the governor looks
+ */
+#define PARTFS_MEM_PSI                          1000
+#define PARTFS_MEM_HEADROOM                     16
+#define PARTFS_MEM_INTERVAL                     1
+
+/* kinds of requests affected by injected faults and delays */
+#define PARTFS_INJECT_READ                      (1 << 0)
+#define PARTFS_INJECT_WRITE                     (1 << 1)
+
+/*
+ * amount of data at either end of a device that isn't a file or a
+ * block device that is read in for libfdisk to find the partition
+ * table in
+ */
+#define PARTFS_TABLE_SIZE                       (1 << 20)
+
+/*
+ * range of the device locked on behalf of the partition table: its
+ * first sector, which every kind of table libfdisk reads starts in
+ * and which no partition covers
+ */
+#define PARTFS_LOCK_TABLE                       512
+
 /*
  * options retrieved from the command line
  */
@@ -84,432 +347,12376 @@ struct partfs_options
     /* the device file name as supplied on the command line */
     const char * device;
 
+    /* the base image against which deltas are generated */
+    const char * base;
+
+    /* MiB of file system metadata to pin in memory */
+    unsigned long pinmeta;
+
+    /* whether exports only include blocks in use by the file system */
+    int fsmap;
+
+    /* whether the kernel should cache writes to the partitions */
+    int wbcache;
+
+    /* faults and delays to inject into i/o on the device */
+    const char * inject;
+
+    /*
+     * MiB of device blocks to cache, MiB of them to keep compressed
+     * and where to keep the hot set
+     */
+    unsigned long cache, zcache;
+    const char * cachedir;
+
+    /*
+     * file on local storage in which to cache blocks of the device,
+     * its size in MiB and whether writes are written back later
+     */
+    const char * ssdcache;
+    unsigned long ssdsize;
+    int ssdwb;
+
+    /* MiB of device blocks to share with other mounts of the device */
+    unsigned long shmcache;
+
+    /* threads with which to split up large reads and writes */
+    unsigned long iothreads;
+
+    /* where to keep the blocks saved by snapshots */
+    const char * snapdir;
+
+    /* MiB of memory that may be used for caching and buffering */
+    unsigned long memlimit;
+
+    /*
+     * most reads and writes, and MiB of them, in flight at once on the
+     * mount and on each partition
+     */
+    unsigned long maxreqs, maxmib, partreqs, partmib;
+
     /* whether or not help should be displayed */
     int help;
 };
 
 /*
- * data structure associated with the mounted "device"
+ * a contiguous range of bytes
  */
-struct partfs_device
+struct partfs_extent
 {
-    /* absolute path to the device file */
-    const char * name;
-    /* partition context associated with the device file */
-    struct fdisk_context * ctx;
-    /* stat information about the device file */
-    struct stat st;
+    off_t off, len;
 };
 
 /*
- * data structure associated with each open of a partition
+ * an ordered list of extents that neither overlap
+ * nor are adjacent to one another
  */
-struct partfs_file
+struct partfs_extents
 {
-    /* file descriptor for device file */
-    int desc;
+    struct partfs_extent * v;
+    size_t n, max;
+};
+
+/*
+ * a region of the device file locked in memory
+ */
+struct partfs_pin
+{
+    void * addr;
+    size_t len;
+};
+
+/*
+ * a block in the order recorded by an earlier mount and its place in it
+ */
+struct partfs_trace_ent
+{
+    uint64_t blk;
+    size_t i;
+};
+
+/*
+ * order in which the blocks of a partition are first read, as it is
+ * being recorded and as recorded by an earlier mount of a device with
+ * the same layout. protected by the lock of the block cache.
+ */
+struct partfs_trace
+{
+    /* blocks in the order first read, and which have been */
+    uint64_t * seq;
+    size_t n, max;
+    unsigned char * seen;
+    uint64_t first, nblk;
+
+    /* the earlier order, and the same blocks sorted by number */
+    uint64_t * old;
+    struct partfs_trace_ent * idx;
+    size_t nold;
+
+    /* next block in the earlier order to read ahead and where to stop */
+    size_t ahead, limit;
+};
+
+/*
+ * a named snapshot of a partition. blocks of the partition are saved
+ * to a temporary file just before they are first written to after
+ * the snapshot is taken, so that writing them back rolls the
+ * partition back to the snapshot.
+ */
+struct partfs_snap
+{
+    char name[PARTFS_SNAP_NAME_MAX + 1];
+
+    /* the unlinked file holding the saved blocks, and their number */
+    int fd;
+    uint32_t nsaved;
 
     /*
-     * starting offset and size of the partition (in bytes)
-     * within the device file. these are initialized in open call
-     * and should not be modified after.
+     * for each block of the partition, 1 + the slot of the file
+     * holding it, PARTFS_SNAP_ZERO if it read as zeros, or 0 if it
+     * hasn't been written to since the snapshot was taken
      */
-    off_t start, size;
+    uint32_t * slot;
+    size_t nblk;
+
+    /* set while the partition is rolled back to the snapshot */
+    int busy;
+
+    struct partfs_snap * next;
 };
 
-/* supported command line options */
-static const struct fuse_opt partfs_optspec[] =
+/*
+ * bounds on the reads and writes of a partition, or of the whole
+ * mount, in flight at once, and how long requests waited for them
+ */
+struct partfs_queue
 {
-    /* dev is the name/path of the device file */
-    { "dev=%s", offsetof(struct partfs_options, device), 1 },
+    /* most requests and bytes in flight at once, 0 for no bound */
+    size_t maxreqs, maxbytes;
+    /* requests and bytes in flight */
+    size_t reqs, bytes;
 
-    /* display help */
-    { "--help", offsetof(struct partfs_options, help), 1 },
-    { "-h", offsetof(struct partfs_options, help), 1 },
+    /* requests waiting to be let through, now and at most at once */
+    size_t waiting, maxwaiting;
+    /*
+     * tickets handed out to requests as they arrive and the one to be
+     * let through next, so that requests go through in order
+     */
+    uint64_t ticket, next;
 
-    FUSE_OPT_END,
+    /*
+     * requests let through, those of them that had to wait, and how
+     * long they waited in all and at most, in microseconds
+     */
+    uint64_t admitted, waited, waitus, maxwaitus;
 };
 
 /*
- * extract the partition number from the path name of a partition
- *
- * returns -1 on error
+ * state associated with each partition of the device
  */
-static ssize_t __partfs_parse_path(const char * const path)
+struct partfs_partition
 {
-    size_t n;
-    int r, c;
+    /* metadata of the partition's file system pinned in memory */
+    struct partfs_pin * pin;
+    size_t npin;
 
-    r = sscanf(path, "/" PARTFS_NAME_PREFIX "%zu%n", &n, &c);
-    return (r == 1 && c == (int)strlen(path)) ? ((ssize_t)n - 1) : -1;
-}
+    /*
+     * regions of the partition known to read as zeros because
+     * they were discarded or zeroed and haven't been written to
+     * since. reads of them are served without touching the device
+     * file. protected by its own lock as it is consulted by every
+     * read, including those made with the device lock held.
+     * zgen is incremented whenever a region is about to be
+     * written, so that a region discarded meanwhile isn't noted.
+     */
+    struct partfs_extents zero;
+    uint64_t zgen;
+    pthread_mutex_t lock;
+
+    /*
+     * type of the file system within the partition, NULL if not
+     * recognized. only valid once probed is set.
+     */
+    const char * fstype;
+    int probed;
+
+    /* order in which the partition's blocks are read */
+    struct partfs_trace trace;
+
+    /*
+     * number of handles open for writing. the partition's window
+     * of the device is locked against other processes while any is.
+     */
+    size_t writers;
+
+    /*
+     * snapshots of the partition, newest first. the lock is held
+     * while blocks are saved to them and while they are taken and
+     * dropped.
+     */
+    struct partfs_snap * snap;
+    pthread_mutex_t snaplock;
+
+    /* reads and writes of the partition in flight */
+    struct partfs_queue queue;
+};
 
 /*
- * populate a stat buffer
- *
- * ownership and time stamps are populated from the template
+ * characteristics of the device file when it is a block device
  */
-static void __partfs_stat(struct stat * const st,
-                          const mode_t mode,
-                          const nlink_t nlink,
-                          const off_t size,
-                          const struct stat * const tmpl)
+struct partfs_blkdev
 {
-    memset(st, 0, sizeof(*st));
+    /* logical and physical block sizes */
+    unsigned long lbs, pbs;
+    /* largest request the device accepts, in bytes */
+    size_t maxio;
+    /* whether the device is a spinning disk and can discard blocks */
+    int rotational, discard;
 
-    st->st_mode     = mode;
-    st->st_nlink    = nlink;
+    /*
+     * serializes writes that don't cover whole logical blocks,
+     * which must read in and write back the rest of the blocks
+     */
+    pthread_mutex_t lock;
+};
 
-    st->st_uid      = tmpl->st_uid;
-    st->st_gid      = tmpl->st_gid;
+/*
+ * a request sent to an nbd server, awaiting its reply
+ */
+struct partfs_nbd_req
+{
+    struct partfs_nbd_req * next;
 
-    st->st_size     = size;
+    uint16_t type;
+    uint64_t off;
+    uint32_t len;
+    /* data to be read or written */
+    char * buf;
 
-    st->st_atime    = tmpl->st_atime;
-    st->st_mtime    = tmpl->st_mtime;
-    st->st_ctime    = tmpl->st_ctime;
-}
+    /* set once the reply has been received */
+    int err, done;
+};
 
 /*
- * initial open of the device file and parsing of the partitions
- *
- * pdev must point to an existing structure. existing members will
- * be overwritten without being evaluated. device is the name
- * of the device file to be opened
+ * a connection to an nbd server. replies are received by a thread
+ * of the connection, so that any number of requests may be in
+ * flight on it at once.
  */
-static int partfs_open_device(struct partfs_device * const pdev,
-                              const char * const device)
+struct partfs_nbd_conn
 {
+    struct partfs_nbd * nbd;
+
+    int sock;
+    /* serializes the sending of requests */
+    pthread_mutex_t lock;
+    /* requests sent but not yet completed */
+    struct partfs_nbd_req * pending;
+    /* set if the connection has failed */
     int err;
 
-    pdev->name = NULL;
-    pdev->ctx  = NULL;
+    pthread_t thr;
+};
+
+/*
+ * an export of an nbd server serving as the device
+ */
+struct partfs_nbd
+{
+    /* location of the server and name of the export */
+    char * host, * port, * path, * name;
+
+    /* size of the export and its transmission flags */
+    uint64_t size;
+    uint16_t flags;
+    /* whether replies to reads are structured */
+    int structured;
+
+    struct partfs_nbd_conn * conn;
+    size_t nconn, next;
+    /* set once replies are received by the connections' threads */
+    int running;
+
+    /* protects the lists of pending requests */
+    pthread_mutex_t lock;
+    /* signalled when requests complete */
+    pthread_cond_t cond;
+};
+
+/*
+ * a vmware sparse extent serving as the device. the data of the
+ * virtual disk is stored in grains, located through a two level
+ * lookup: a grain directory whose entries point to grain tables,
+ * whose entries in turn point to grains.
+ */
+struct partfs_vmdk
+{
+    /* the extent file */
+    int fd;
+    /* whether the extent can be written to */
+    int rw;
+
+    /* header flags and the offset of the header in the file */
+    uint32_t flags;
+    off_t hdr;
+
+    /* size of the virtual disk and of a grain, in bytes */
+    uint64_t size, grain;
+
+    /* entries in a grain table and in the grain directory */
+    uint32_t ngte;
+    size_t ngde;
 
     /*
-     * need the absolute path since fuse may not stay
-     * in the same directory in which it was started
+     * the grain directory, its redundant copy if any (both with
+     * their locations in the file), and the grain tables, which
+     * are read in as they are needed. all in host byte order.
      */
-    pdev->name = realpath(device, NULL);
-    err = pdev->name ? 0 : -errno;
+    uint32_t * gd, * rgd;
+    uint64_t gdoff, rgdoff;
+    uint32_t ** gt;
 
-    if (!err) {
-        err = stat(pdev->name, &pdev->st) ? -errno : 0;
+    /* end of the file, where new grains and tables are allocated */
+    off_t end;
+    /* set once the header has been marked as not shut down cleanly */
+    int dirty;
 
-        if (!err) {
-            pdev->ctx = fdisk_new_context();
-            err = pdev->ctx ? 0 : -ENOMEM;
+    /* the most recently decompressed grain of a compressed extent */
+    char * zbuf;
+    uint64_t zgrain;
 
-            if (!err) {
-                /* parse the partition table */
-                err = fdisk_assign_device(pdev->ctx, pdev->name, 1);
-                if (err) {
-                    fdisk_unref_context(pdev->ctx);
-                    pdev->ctx = NULL;
-                }
-            }
-        }
+    /* protects the tables, the end and the decompressed grain */
+    pthread_mutex_t lock;
+};
 
-        if (err) {
-            free((void *)pdev->name);
-            pdev->name = NULL;
-        }
-    }
+/*
+ * faults and delays injected into the i/o on the device,
+ * to see how partfs and its users cope with a slow or
+ * failing device
+ */
+struct partfs_inject
+{
+    /* kinds of requests affected */
+    unsigned int ops;
 
-    return err;
-}
+    /*
+     * range of the delay of each request, and a further delay
+     * added with the given probability, in microseconds
+     */
+    uint64_t dmin, dmax;
+    double ptail;
+    uint64_t tail;
+
+    /* stalls at the start of every period, in milliseconds */
+    uint64_t stall, period;
+    struct timespec t0;
+
+    /* probabilities of failing and of transferring less */
+    double peio, pshort;
+    /* regions of the device that always fail */
+    struct partfs_extents bad;
+
+    /* state of the random number generator */
+    uint64_t state;
+    pthread_mutex_t lock;
+};
 
 /*
- * called just before the main fuse loop starts
- *
- * private_data is the partfs_device
+ * users of the memory accounted for by the memory governor
  */
-static void * partfs_init(struct fuse_conn_info * const conn)
+enum partfs_mem_user
+{
+    /* blocks held in the block cache */
+    PARTFS_MEM_CACHE,
+    /* blocks held in its compressed tier */
+    PARTFS_MEM_ZCACHE,
+    /* blocks being read in ahead of readers */
+    PARTFS_MEM_AHEAD,
+    /* bounce and staging buffers of reads and writes */
+    PARTFS_MEM_BUFFER,
+    /* file system metadata pinned in memory */
+    PARTFS_MEM_PIN,
+
+    PARTFS_MEM_USERS,
+};
+
+/*
+ * accounting of the memory partfs uses for caching and buffering,
+ * which is kept under a limit. when memory is short in the cgroup
+ * partfs runs in, the memory the caches may use is cut down until
+ * it no longer is. the counts are updated atomically, without the
+ * lock, which only guards the thread watching for memory pressure.
+ */
+struct partfs_mem
 {
-    return fuse_get_context()->private_data;
+    /*
+     * bytes that may be used, 0 for no limit, and the bytes that may
+     * be used while memory is short, SIZE_MAX for no limit
+     */
+    size_t limit, target;
+
+    /* bytes in use by each user, in all and the most in use at once */
+    size_t used[PARTFS_MEM_USERS];
+    size_t total, peak;
+
+    /*
+     * directory of the cgroup of partfs, if it has one, and the
+     * share of time stalled for memory last read from it
+     */
+    char * cgroup;
+    unsigned long stall;
+
+    /* times memory was found short and bytes evicted to make room */
+    uint64_t squeezes, evicted;
+
+    /* thread watching for memory pressure and whether to stop it */
+    pthread_t watcher;
+    int watching, stop;
+    pthread_cond_t cond;
+    pthread_mutex_t lock;
+};
+
+/*
+ * a block of the device held in the block cache
+ */
+struct partfs_cblock
+{
+    /* number of the block within the device */
+    uint64_t blk;
+    char * data;
+    /*
+     * length of the data of a block in the compressed tier,
+     * 0 (without data) for a block that reads as zeros
+     */
+    size_t len;
+
+    /* next block in the same bucket of the hash table */
+    struct partfs_cblock * hnext;
+    /* neighbours in the order of use */
+    struct partfs_cblock * prev, * next;
+};
+
+/*
+ * blocks of the device recently read or written, kept in memory so
+ * they needn't be read from the device again. the numbers of the
+ * blocks, the hot set, can be saved when the device is unmounted
+ * and the blocks read in again when it is next mounted.
+ */
+struct partfs_cache
+{
+    /* number of blocks held and the most that may be */
+    size_t n, max;
+
+    /* the blocks by number and in order of use, most recent first */
+    struct partfs_cblock ** hash;
+    size_t nhash;
+    struct partfs_cblock lru;
+
+    /*
+     * incremented whenever the device is written to, so that a
+     * block read while it was being written isn't entered with
+     * stale contents
+     */
+    uint64_t gen;
+
+    /*
+     * blocks evicted from the cache, kept compressed so that more of
+     * the device fits in the same memory: the blocks by number and in
+     * order of use, how many there are and how many read as zeros,
+     * and the memory they take and the most they may take
+     */
+    struct partfs_cblock ** zhash;
+    size_t nzhash;
+    struct partfs_cblock zlru;
+    size_t zn, zeros, zmem, zmax;
+    char * zbuf;
+
+    /*
+     * reads of blocks found in the cache, found in its compressed
+     * tier and not found, and blocks read ahead along the orders
+     * recorded by an earlier mount
+     */
+    uint64_t hits, zhits, misses, ahead;
+
+    /* directory in which the hot set is kept, if any */
+    char * dir;
+    /* thread reading in the saved hot set and whether to stop it */
+    pthread_t prefetch;
+    int prefetching, stop;
+    /* thread reading ahead along the recorded orders, and its wakeup */
+    pthread_t readahead;
+    int reading;
+    pthread_cond_t cond;
+
+    /* blocks kept on local storage, if any */
+    struct partfs_ssd * ssd;
+    /* blocks shared with other mounts of the device, if any */
+    struct partfs_shm * shm;
+
+    /* accounting of the memory the blocks take */
+    struct partfs_mem * mem;
+
+    pthread_mutex_t lock;
+};
+
+/*
+ * data structure associated with the mounted "device"
+ */
+struct partfs_device
+{
+    /* absolute path to the device file */
+    const char * name;
+    /* partition context associated with the device file */
+    struct fdisk_context * ctx;
+    /* stat information about the device file */
+    struct stat st;
+    /* set if the device file is a block device */
+    struct partfs_blkdev * blk;
+    /* set if the device is an export of an nbd server */
+    struct partfs_nbd * nbd;
+    /* set if the device is a vmware sparse extent */
+    struct partfs_vmdk * vmdk;
+    /*
+     * for nbd exports and vmdk extents, a sparse copy of the
+     * regions holding the partition table, which libfdisk reads
+     * as the device file. -1 otherwise.
+     */
+    int table;
+    /*
+     * descriptor of the device file on which the byte ranges shared
+     * with other processes are locked, -1 if they aren't. see
+     * __partfs_range_lock().
+     */
+    int lockdesc;
+    /* faults and delays to inject, if any */
+    struct partfs_inject * inject;
+    /* cache of the blocks of the device, if any */
+    struct partfs_cache * cache;
+    /* threads sharing the work of large reads and writes, if any */
+    struct partfs_pool * pool;
+    /* accounting of the memory used for caching and buffering */
+    struct partfs_mem mem;
+
+    /* directory in which blocks saved by snapshots are kept */
+    char * snapdir;
+
+    /* whether exports only include blocks in use by the file system */
+    int fsmap;
+
+    /* whether the kernel caches writes to the partitions */
+    int wbcache;
+
+    /* the base image against which deltas are generated, if any */
+    struct partfs_device * base;
+
+    /*
+     * state of each partition, indexed by partition number. there
+     * is an entry for each partition the partition table can hold.
+     */
+    struct partfs_partition * part;
+    size_t npart;
+
+    /* limit on and number of bytes of metadata pinned in memory */
+    size_t pinmax, pinned;
+
+    /* number of handles of partitions open for writing */
+    size_t writers;
+
+    /* protects the state of the partitions */
+    pthread_mutex_t lock;
+
+    /*
+     * reads and writes of all partitions in flight. the lock protects
+     * the queues of the partitions as well, and the condition is
+     * signalled whenever a request leaves any of them.
+     */
+    struct partfs_queue queue;
+    pthread_mutex_t qlock;
+    pthread_cond_t qcond;
+};
+
+/*
+ * data structure associated with each open of a partition
+ */
+struct partfs_file
+{
+    /* file descriptor for device file */
+    int desc;
+
+    /*
+     * starting offset and size of the partition (in bytes)
+     * within the device file. these are initialized in open call
+     * and should not be modified after.
+     */
+    off_t start, size;
+
+    /* format in which the partition is presented */
+    const struct partfs_format * fmt;
+    /* state owned by the format, if any */
+    void * priv;
+
+    /* state shared by all files of the partition, if any */
+    struct partfs_partition * part;
+    /* set if the device file is a block device opened for direct i/o */
+    struct partfs_blkdev * blk;
+    /* set if the device is an export of an nbd server */
+    struct partfs_nbd * nbd;
+    /* set if the device is a vmware sparse extent */
+    struct partfs_vmdk * vmdk;
+    /* faults and delays to inject, if any */
+    struct partfs_inject * inject;
+    /* cache of the blocks of the device, if any */
+    struct partfs_cache * cache;
+    /* threads sharing the work of large reads and writes, if any */
+    struct partfs_pool * pool;
+    /* accounting of the memory used for buffers */
+    struct partfs_mem * mem;
+};
+
+/*
+ * a part of a large read or write, carried out by whichever thread
+ * of the pool or the one that made the request gets to it first
+ */
+struct partfs_job
+{
+    const struct partfs_file * pfi;
+    char * buf;
+    size_t len;
+    off_t off;
+    int write;
+
+    /* result, and the parts of the request not done yet */
+    int err;
+    size_t * pending;
+
+    struct partfs_job * next;
+};
+
+/*
+ * threads that carry out the parts of large reads and writes at
+ * once, so that the time a request takes isn't the sum of the time
+ * each part of it takes on a slow device
+ */
+struct partfs_pool
+{
+    pthread_t * thread;
+    size_t nthread, started;
+
+    /* parts waiting for a thread, and whether the threads should exit */
+    struct partfs_job * head, ** tail;
+    int stop;
+
+    /* signalled when parts are queued and when parts are done */
+    pthread_cond_t work, done;
+    pthread_mutex_t lock;
+};
+
+/*
+ * a slot of the cache file on local storage, holding one block
+ */
+struct partfs_sslot
+{
+    /* number of the block within the device and crc-32 of its data */
+    uint64_t blk;
+    uint32_t crc;
+
+    /*
+     * whether the slot holds a block, whether the block hasn't been
+     * written back to the device yet and whether it was used since
+     * the clock hand last passed
+     */
+    unsigned char used, dirty, ref;
+    /*
+     * the sectors of the block written since it was last written
+     * back. only those are written back, as a process writing to
+     * another partition may hold the lock on the rest of the block.
+     */
+    uint64_t sect[PARTFS_SSD_SECTORS / 64];
+
+    /* next slot in the same bucket of the hash table */
+    uint32_t hnext;
+};
+
+/*
+ * blocks of the device kept in a file on fast local storage, behind
+ * the block cache in memory, for devices on slow storage. the file
+ * holds a header, an index with an entry for each slot and the
+ * slots. an entry is written after the data of its slot, and holds
+ * the checksum of that data, so a slot whose write was interrupted
+ * is found out when it is read. the header records whether the file
+ * was in use, in which case only blocks not yet written back are
+ * trusted, as writes to the device may not have reached the file.
+ */
+struct partfs_ssd
+{
+    int fd;
+    /* whether writes go to the file and are written back later */
+    int wb;
+
+    /* the slots, by number of the block held, and the clock hand */
+    struct partfs_sslot * slot;
+    uint32_t nslot, hand;
+    uint32_t * hash;
+    size_t nhash;
+    /* offset of the first slot in the file */
+    off_t data;
+
+    /*
+     * blocks recently read from the device. a block is only entered
+     * when it is read a second time while still here, so that a scan
+     * of the device doesn't displace the blocks that are reused.
+     */
+    uint64_t * seen;
+    size_t nseen;
+
+    /* incremented whenever the device is written to, as in the cache */
+    uint64_t gen;
+
+    /* slots holding blocks not yet written back */
+    size_t ndirty;
+
+    /* the device, opened for writing back blocks */
+    struct partfs_file pfi;
+    off_t size;
+
+    /* reads found and not found, blocks entered and written back */
+    uint64_t hits, misses, admits, writebacks;
+
+    pthread_mutex_t lock;
+};
+
+/*
+ * the start of a shared memory segment, followed by the slots and
+ * then the blocks they hold
+ */
+struct partfs_shm_header
+{
+    char magic[8];
+    /* identity of the device, as from __partfs_cache_key() */
+    uint64_t key;
+    /* number of sets of PARTFS_SHM_WAYS slots, a power of two */
+    uint64_t nset;
+
+    /* mounts attached, and reads found and not found by all of them */
+    uint64_t users, hits, misses;
+};
+
+/*
+ * a slot of a shared memory segment. slots are read without locks:
+ * seq is odd while the slot is being filled, and a reader that sees
+ * seq change while it copies the block out throws the copy away.
+ */
+struct partfs_shm_slot
+{
+    /* number of the block held plus one, 0 if none */
+    uint64_t blk;
+    uint32_t seq;
+    /* set when the block is read, cleared as replacement passes by */
+    uint32_t ref;
+};
+
+/*
+ * blocks of the device in a shared memory segment named after its
+ * identity, so that the mounts of one image by several processes
+ * hold the data they read once between them. only used by mounts
+ * that don't write to the device.
+ */
+struct partfs_shm
+{
+    /* the segment, locked shared for as long as it is attached */
+    int fd;
+    char * name;
+    void * base;
+    size_t size;
+
+    struct partfs_shm_header * hdr;
+    struct partfs_shm_slot * slot;
+    char * data;
+    uint64_t nset;
+};
+
+/*
+ * each partition can be presented in a number of formats. the
+ * raw format presents the partition as is and is named "pX". the
+ * others are named "pX" followed by a suffix. the operations have
+ * the same meaning as their counterparts in struct fuse_operations.
+ */
+struct partfs_format
+{
+    /* suffix appended to the file name of the partition */
+    const char * suffix;
+    /* permission bits removed from those of the device file */
+    mode_t mask;
+
+    /*
+     * size of the file as presented. NULL if the size is that of
+     * the partition itself. a size of zero means that the size can't
+     * be determined in advance, and the file must be read until EOF
+     */
+    int (*length)(struct partfs_file *, off_t *);
+
+    /* NULL if no state needs to be set up */
+    int (*open)(const char *, struct fuse_file_info *);
+    int (*read)(const char *, char *, size_t, off_t,
+                struct fuse_file_info *);
+    /* NULL if the format is read-only */
+    int (*write)(const char *, const char *, size_t, off_t,
+                 struct fuse_file_info *);
+    /* NULL if nothing needs to be done */
+    int (*flush)(const char *, struct fuse_file_info *);
+    void (*release)(const char *, struct fuse_file_info *);
+};
+
+/*
+ * a file system found within a partition
+ */
+struct partfs_fs
+{
+    /* name of the file system type as used by mount(8) */
+    const char * type;
+    /* regions of the partition in use by the file system */
+    struct partfs_extents used;
+    /*
+     * regions holding the file system's metadata. unlike other lists
+     * of extents, these are in order of importance, not of offset.
+     */
+    struct partfs_extents meta;
+};
+
+/*
+ * layout of a FAT file system, in sectors unless noted
+ */
+struct partfs_fat
+{
+    /* 12, 16 or 32, and bytes per sector */
+    unsigned int bits, bps;
+    /* sectors per cluster, reserved sectors and number of FATs */
+    uint32_t spc, rsvd, nfat;
+    /* entries of the FAT12/16 root directory, and its sectors */
+    uint32_t nroot, rootsec;
+    /* sectors per FAT and in all */
+    uint32_t fatsz, nsec;
+    /* first sector of the data area, and clusters in it */
+    uint32_t datasec, nclus;
+    /* first cluster of the FAT32 root directory */
+    uint32_t rootclus;
+};
+
+/*
+ * a file or directory being copied into a FAT file system
+ */
+struct partfs_fat_node
+{
+    /* path of the file on the host, and its name in the directory */
+    char * path;
+    const char * name;
+
+    /* short name, and the number of entries holding the long name */
+    unsigned char sname[11];
+    unsigned int nlfn;
+    /* flags for a short name that is the name in lower case */
+    unsigned char lcase;
+
+    int dir;
+    off_t size;
+    time_t mtime;
+    /* identity of a directory, to notice links to its ancestors */
+    dev_t dev;
+    ino_t ino;
+
+    /* first cluster and number of clusters, 0 for an empty file */
+    uint32_t clus, nclus;
+    /* the directory containing it and, for a directory, its contents */
+    size_t parent, child, nchild;
+};
+
+/*
+ * state shared by the threads copying files and directories
+ * from the host into a FAT file system
+ */
+struct partfs_fat_fill
+{
+    const struct partfs_file * pfi;
+    const struct partfs_fat * fat;
+
+    /*
+     * everything to be copied, level by level, with the
+     * contents of each directory next to each other
+     */
+    struct partfs_fat_node * node;
+    size_t nnode, max;
+
+    /* the volume label entry of the root directory, if any */
+    unsigned char label[32];
+
+    pthread_mutex_t lock;
+    /* the next file or directory to be copied */
+    size_t next;
+    /* first error encountered by any of the threads */
+    int err;
+};
+
+/*
+ * a chunk within an android sparse image
+ */
+struct partfs_simg_chunk
+{
+    /* one of PARTFS_SIMG_CHUNK_* */
+    unsigned int type;
+    /* first block and number of blocks described by the chunk */
+    off_t blk, nblk;
+    /* offset of the chunk's header within the image */
+    off_t off;
+};
+
+/*
+ * layout of an android sparse image describing a partition
+ */
+struct partfs_simg
+{
+    /* block size used by the image */
+    size_t blksz;
+    /* number of blocks in the partition */
+    off_t nblk;
+
+    struct partfs_simg_chunk * chunk;
+    size_t nchunk;
+
+    /* total size of the image */
+    off_t length;
+};
+
+/*
+ * state of the parser used to apply an android sparse image
+ * that is written to a partition
+ */
+enum partfs_simg_wstate
+{
+    PARTFS_SIMG_W_FILE_HEADER,
+    PARTFS_SIMG_W_CHUNK_HEADER,
+    PARTFS_SIMG_W_CHUNK_BODY,
+    PARTFS_SIMG_W_DONE,
+};
+
+struct partfs_simg_writer
+{
+    enum partfs_simg_wstate state;
+    /* number of bytes of the image received so far */
+    off_t pos;
+
+    /*
+     * header being received: the known part of it, the number
+     * of bytes received and the size of the header in the image
+     */
+    unsigned char hdr[PARTFS_SIMG_HEADER_SIZE];
+    size_t hlen, need;
+
+    /* values from the file header */
+    size_t fhdrsz, chdrsz, blksz;
+    off_t nblk_total;
+    uint32_t nchunk;
+
+    /* number of chunks processed and the block at which the next starts */
+    uint32_t chunk;
+    off_t blk;
+
+    /* the current chunk: its type, size and number of bytes yet to come */
+    unsigned int type;
+    off_t nblk, left;
+    /* value of a fill chunk */
+    unsigned char fill[4];
+
+    /* whether "don't care" chunks are punched out of the device file */
+    int punch;
+};
+
+/*
+ * state shared by the threads comparing a partition
+ * with the same partition in the base image
+ */
+struct partfs_diff
+{
+    const struct partfs_file * pfi, * base;
+    /* regions of the partitions that contain data */
+    struct partfs_extents data, bdata;
+
+    size_t blksz;
+    /* bitmap of the blocks that differ */
+    unsigned char * map;
+
+    pthread_mutex_t lock;
+    /* number of units and the next one to be compared */
+    off_t nunit, next;
+    /* first error encountered by any of the threads */
+    int err;
+};
+
+/*
+ * a frame being compressed for a zstd export
+ */
+struct partfs_zst_slot
+{
+    /* index of the frame occupying the slot */
+    size_t idx;
+    /* non-zero once the frame has been compressed */
+    int done;
+    /* zero or a negative errno if compression failed */
+    int err;
+
+    void * buf;
+    size_t len;
+};
+
+/*
+ * state of a zstd export. frames are compressed by a set of worker
+ * threads into a ring of slots while the reader consumes them in
+ * order. a frame can only be compressed once the reader has moved
+ * past the frame previously occupying its slot.
+ */
+struct partfs_zst
+{
+    /* the file being exported */
+    const struct partfs_file * pfi;
+    /* regions of the partition that contain data */
+    struct partfs_extents data;
+
+    size_t nframe;
+    /* compressed size of each frame, for the seek table */
+    uint32_t * csize;
+
+    pthread_t * thr;
+    size_t nthr;
+
+    struct partfs_zst_slot * slot;
+    size_t nslot;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* set to stop the workers */
+    int stop;
+
+    /* next frame to be picked up by a worker */
+    size_t next;
+    /* frame being consumed by the reader and offset within it */
+    size_t cur, fpos;
+    /* number of bytes of the stream consumed by the reader */
+    off_t pos;
+
+    /* the seek table, built once all frames have been consumed */
+    unsigned char * table;
+    size_t tablen;
+};
+
+/* supported command line options */
+static const struct fuse_opt partfs_optspec[] =
+{
+    /* dev is the name/path of the device file */
+    { "dev=%s", offsetof(struct partfs_options, device), 1 },
+    /* only export blocks in use by the file system */
+    { "fsmap", offsetof(struct partfs_options, fsmap), 1 },
+    /* base image against which deltas are generated */
+    { "base=%s", offsetof(struct partfs_options, base), 1 },
+    /* pin file system metadata in memory */
+    { "pinmeta=%lu", offsetof(struct partfs_options, pinmeta), 1 },
+    /* let the kernel cache writes */
+    { "wbcache", offsetof(struct partfs_options, wbcache), 1 },
+    /* inject faults and delays into device i/o */
+    { "inject=%s", offsetof(struct partfs_options, inject), 1 },
+    /* cache blocks of the device and keep the hot set between mounts */
+    { "cache=%lu", offsetof(struct partfs_options, cache), 1 },
+    { "zcache=%lu", offsetof(struct partfs_options, zcache), 1 },
+    { "cachedir=%s", offsetof(struct partfs_options, cachedir), 1 },
+    /* cache blocks of the device in a file on local storage */
+    { "ssdcache=%s", offsetof(struct partfs_options, ssdcache), 1 },
+    { "ssdsize=%lu", offsetof(struct partfs_options, ssdsize), 1 },
+    { "ssdwb", offsetof(struct partfs_options, ssdwb), 1 },
+    /* share cached blocks with other read-only mounts of the device */
+    { "shmcache=%lu", offsetof(struct partfs_options, shmcache), 1 },
+    /* split large reads and writes among threads */
+    { "iothreads=%lu", offsetof(struct partfs_options, iothreads), 1 },
+    /* directory for the blocks saved by snapshots */
+    { "snapdir=%s", offsetof(struct partfs_options, snapdir), 1 },
+    /* limit the memory used for caching and buffering */
+    { "memlimit=%lu", offsetof(struct partfs_options, memlimit), 1 },
+    /* bound the reads and writes in flight */
+    { "maxreqs=%lu", offsetof(struct partfs_options, maxreqs), 1 },
+    { "maxmib=%lu", offsetof(struct partfs_options, maxmib), 1 },
+    { "partreqs=%lu", offsetof(struct partfs_options, partreqs), 1 },
+    { "partmib=%lu", offsetof(struct partfs_options, partmib), 1 },
+
+    /* display help */
+    { "--help", offsetof(struct partfs_options, help), 1 },
+    { "-h", offsetof(struct partfs_options, help), 1 },
+
+    FUSE_OPT_END,
+};
+
+/* supported formats; defined along with their operations below */
+static const struct partfs_format partfs_format_raw;
+static const struct partfs_format partfs_format_simg;
+static const struct partfs_format partfs_format_zst;
+static const struct partfs_format partfs_format_bmap;
+static const struct partfs_format partfs_format_delta;
+
+static const struct partfs_format * const partfs_formats[] =
+{
+    &partfs_format_raw,
+    &partfs_format_simg,
+    &partfs_format_zst,
+    &partfs_format_bmap,
+    &partfs_format_delta,
+
+    NULL,
+};
+
+/*
+ * extract the partition number and format from the path name
+ * of a partition
+ *
+ * returns -1 on error
+ */
+static ssize_t __partfs_parse_path(const char * const path,
+                                   const struct partfs_format ** const fmt)
+{
+    size_t n;
+    int r, c;
+
+    r = sscanf(path, "/" PARTFS_NAME_PREFIX "%zu%n", &n, &c);
+    if (r == 1) {
+        const struct partfs_format * const * f;
+
+        for (f = partfs_formats;
+             *f && strcmp(path + c, (*f)->suffix) != 0;
+             f++)
+            ;
+
+        *fmt = *f;
+        if (!*f) {
+            r = 0;
+        }
+    }
+
+    return (r == 1) ? ((ssize_t)n - 1) : -1;
+}
+
+/* store integers in little endian byte order */
+static void __partfs_put_le16(unsigned char * const b, const uint16_t v)
+{
+    b[0] = v;
+    b[1] = v >> 8;
+}
+
+static void __partfs_put_le32(unsigned char * const b, const uint32_t v)
+{
+    __partfs_put_le16(b, v);
+    __partfs_put_le16(b + 2, v >> 16);
+}
+
+static void __partfs_put_le64(unsigned char * const b, const uint64_t v)
+{
+    __partfs_put_le32(b, v);
+    __partfs_put_le32(b + 4, v >> 32);
+}
+
+/* retrieve little endian integers */
+static uint16_t __partfs_get_le16(const unsigned char * const b)
+{
+    return b[0] | (b[1] << 8);
+}
+
+static uint32_t __partfs_get_le32(const unsigned char * const b)
+{
+    return __partfs_get_le16(b) | ((uint32_t)__partfs_get_le16(b + 2) << 16);
+}
+
+static uint64_t __partfs_get_le64(const unsigned char * const b)
+{
+    return __partfs_get_le32(b) | ((uint64_t)__partfs_get_le32(b + 4) << 32);
+}
+
+static void __partfs_extents_init(struct partfs_extents * const ex)
+{
+    ex->v   = NULL;
+    ex->n   = 0;
+    ex->max = 0;
+}
+
+static void __partfs_extents_free(struct partfs_extents * const ex)
+{
+    free(ex->v);
+    __partfs_extents_init(ex);
+}
+
+/*
+ * add an extent to the end of the list. the extent must not start
+ * before the end of the last extent in the list. if the two are
+ * adjacent, they are merged.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_extents_append(struct partfs_extents * const ex,
+                                   const off_t off, const off_t len)
+{
+    int err;
+
+    err = 0;
+    if (ex->n > 0 && ex->v[ex->n - 1].off + ex->v[ex->n - 1].len == off) {
+        ex->v[ex->n - 1].len += len;
+    } else {
+        if (ex->n == ex->max) {
+            const size_t max = ex->max ? (2 * ex->max) : 16;
+            struct partfs_extent * const v =
+                realloc(ex->v, max * sizeof(*v));
+
+            if (v) {
+                ex->v   = v;
+                ex->max = max;
+            } else {
+                err = -ENOMEM;
+            }
+        }
+
+        if (!err) {
+            ex->v[ex->n].off = off;
+            ex->v[ex->n].len = len;
+            ex->n++;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * find the first extent that ends after the given offset
+ *
+ * returns the number of extents if there is none
+ */
+static size_t __partfs_extents_find(const struct partfs_extents * const ex,
+                                    const off_t off)
+{
+    size_t lo, hi;
+
+    for (lo = 0, hi = ex->n; lo < hi; ) {
+        const size_t mid = (lo + hi) / 2;
+
+        if (ex->v[mid].off + ex->v[mid].len <= off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * whether any extent overlaps the given range
+ */
+static int __partfs_extents_overlap(const struct partfs_extents * const ex,
+                                    const off_t off, const off_t len)
+{
+    const size_t i = __partfs_extents_find(ex, off);
+
+    return i < ex->n && ex->v[i].off < off + len;
+}
+
+/*
+ * make room for a number of extents at the given position
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_extents_open(struct partfs_extents * const ex,
+                                 const size_t i, const size_t n)
+{
+    int err;
+
+    err = 0;
+    if (ex->n + n > ex->max) {
+        const size_t max = MAX(ex->max ? (2 * ex->max) : 16, ex->n + n);
+        struct partfs_extent * const v = realloc(ex->v, max * sizeof(*v));
+
+        if (v) {
+            ex->v   = v;
+            ex->max = max;
+        } else {
+            err = -ENOMEM;
+        }
+    }
+
+    if (!err) {
+        memmove(&ex->v[i + n], &ex->v[i], (ex->n - i) * sizeof(*ex->v));
+        ex->n += n;
+    }
+
+    return err;
+}
+
+/*
+ * add a range to the list, merging it with any extents
+ * that it overlaps or is adjacent to
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_extents_insert(struct partfs_extents * const ex,
+                                   const off_t off, const off_t len)
+{
+    off_t lo, hi;
+    size_t i, j;
+    int err;
+
+    /* find the extents that touch the range */
+    i = (off > 0) ? __partfs_extents_find(ex, off - 1) : 0;
+    for (lo = off, hi = off + len, j = i;
+         j < ex->n && ex->v[j].off <= hi;
+         j++) {
+        lo = MIN(lo, ex->v[j].off);
+        hi = MAX(hi, ex->v[j].off + ex->v[j].len);
+    }
+
+    err = 0;
+    if (i == j) {
+        err = __partfs_extents_open(ex, i, 1);
+    } else {
+        /* keep the first and drop the rest */
+        memmove(&ex->v[i + 1], &ex->v[j], (ex->n - j) * sizeof(*ex->v));
+        ex->n -= j - i - 1;
+    }
+
+    if (!err) {
+        ex->v[i].off = lo;
+        ex->v[i].len = hi - lo;
+    }
+
+    return err;
+}
+
+/*
+ * remove a range from the list, trimming or splitting
+ * the extents that it overlaps
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_extents_remove(struct partfs_extents * const ex,
+                                   const off_t off, const off_t len)
+{
+    const off_t end = off + len;
+    size_t i, j;
+    int err;
+
+    i = __partfs_extents_find(ex, off);
+
+    err = 0;
+    if (i < ex->n && ex->v[i].off < off && ex->v[i].off + ex->v[i].len > end) {
+        /* the range is in the middle of an extent */
+        err = __partfs_extents_open(ex, i + 1, 1);
+        if (!err) {
+            ex->v[i + 1].off = end;
+            ex->v[i + 1].len = ex->v[i].off + ex->v[i].len - end;
+            ex->v[i].len     = off - ex->v[i].off;
+        }
+    } else {
+        if (i < ex->n && ex->v[i].off < off) {
+            /* keep the head of the first extent */
+            ex->v[i].len = off - ex->v[i].off;
+            i++;
+        }
+
+        for (j = i; j < ex->n && ex->v[j].off + ex->v[j].len <= end; j++)
+            ;
+        if (j < ex->n && ex->v[j].off < end) {
+            /* keep the tail of the last extent */
+            ex->v[j].len -= end - ex->v[j].off;
+            ex->v[j].off  = end;
+        }
+
+        memmove(&ex->v[i], &ex->v[j], (ex->n - j) * sizeof(*ex->v));
+        ex->n -= j - i;
+    }
+
+    return err;
+}
+
+/*
+ * the generation of the map of the regions of a partition that read
+ * as zeros, to be passed to __partfs_zero_add()
+ */
+static uint64_t __partfs_zero_gen(const struct partfs_file * const pfi)
+{
+    struct partfs_partition * const part = pfi->part;
+    uint64_t gen;
+
+    gen = 0;
+    if (part) {
+        pthread_mutex_lock(&part->lock);
+        gen = part->zgen;
+        pthread_mutex_unlock(&part->lock);
+    }
+
+    return gen;
+}
+
+/*
+ * note that a region of a partition reads as zeros, unless anything
+ * was written to the partition since the generation gen, which may
+ * have landed on the device after the region was zeroed
+ */
+static void __partfs_zero_add(const struct partfs_file * const pfi,
+                              const off_t off, const off_t len,
+                              const uint64_t gen)
+{
+    struct partfs_partition * const part = pfi->part;
+
+    if (part && len > 0) {
+        pthread_mutex_lock(&part->lock);
+        /*
+         * if the region can't be added, the map is merely
+         * incomplete, and reads of the region hit the device file
+         */
+        if (part->zgen == gen) {
+            __partfs_extents_insert(&part->zero, off, len);
+        }
+        pthread_mutex_unlock(&part->lock);
+    }
+}
+
+/*
+ * note that a region of a partition is about to be written
+ */
+static void __partfs_zero_del(const struct partfs_file * const pfi,
+                              const off_t off, const off_t len)
+{
+    struct partfs_partition * const part = pfi->part;
+
+    if (part && len > 0) {
+        pthread_mutex_lock(&part->lock);
+        part->zgen++;
+        if (__partfs_extents_remove(&part->zero, off, len) != 0) {
+            /*
+             * the map must never claim that written data is zero,
+             * so forget all of it if it can't be updated
+             */
+            __partfs_extents_free(&part->zero);
+        }
+        pthread_mutex_unlock(&part->lock);
+    }
+}
+
+/*
+ * find how much of a region of a partition, starting at its
+ * beginning, either reads as zeros or may contain data. zero is
+ * set to indicate which.
+ */
+static size_t __partfs_zero_span(const struct partfs_file * const pfi,
+                                 const off_t off, const size_t len,
+                                 int * const zero)
+{
+    struct partfs_partition * const part = pfi->part;
+    size_t span;
+
+    *zero = 0;
+    span  = len;
+
+    if (part) {
+        const struct partfs_extents * const ex = &part->zero;
+        size_t i;
+
+        pthread_mutex_lock(&part->lock);
+        i = __partfs_extents_find(ex, off);
+        if (i < ex->n) {
+            if (ex->v[i].off <= off) {
+                *zero = 1;
+                span  = MIN((off_t)len, ex->v[i].off + ex->v[i].len - off);
+            } else {
+                span  = MIN((off_t)len, ex->v[i].off - off);
+            }
+        }
+        pthread_mutex_unlock(&part->lock);
+    }
+
+    return span;
+}
+
+/* store and retrieve big endian integers, as used by nbd */
+static void __partfs_put_be16(unsigned char * const b, const uint16_t v)
+{
+    b[0] = v >> 8;
+    b[1] = v;
+}
+
+static void __partfs_put_be32(unsigned char * const b, const uint32_t v)
+{
+    __partfs_put_be16(b, v >> 16);
+    __partfs_put_be16(b + 2, v);
+}
+
+static void __partfs_put_be64(unsigned char * const b, const uint64_t v)
+{
+    __partfs_put_be32(b, v >> 32);
+    __partfs_put_be32(b + 4, v);
+}
+
+static uint16_t __partfs_get_be16(const unsigned char * const b)
+{
+    return (b[0] << 8) | b[1];
+}
+
+static uint32_t __partfs_get_be32(const unsigned char * const b)
+{
+    return ((uint32_t)__partfs_get_be16(b) << 16) | __partfs_get_be16(b + 2);
+}
+
+static uint64_t __partfs_get_be64(const unsigned char * const b)
+{
+    return ((uint64_t)__partfs_get_be32(b) << 32) | __partfs_get_be32(b + 4);
+}
+
+/*
+ * send or receive exactly the given number of bytes on a socket.
+ * a buffer of NULL when receiving discards the bytes.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_sock_send(const int sock,
+                              const void * const buf, const size_t len)
+{
+    size_t done;
+    int err;
+
+    err = 0;
+    for (done = 0; !err && done < len; ) {
+        const ssize_t n = send(sock, (const char *)buf + done, len - done,
+                               MSG_NOSIGNAL);
+
+        if (n < 0) {
+            err = (errno == EINTR) ? 0 : -errno;
+        } else {
+            done += n;
+        }
+    }
+
+    return err;
+}
+
+static int __partfs_sock_recv(const int sock,
+                              void * const buf, const size_t len)
+{
+    char junk[512];
+    size_t done;
+    int err;
+
+    err = 0;
+    for (done = 0; !err && done < len; ) {
+        const ssize_t n = buf ?
+            recv(sock, (char *)buf + done, len - done, 0) :
+            recv(sock, junk, MIN(len - done, sizeof(junk)), 0);
+
+        if (n < 0) {
+            err = (errno == EINTR) ? 0 : -errno;
+        } else if (n == 0) {
+            /* the server went away */
+            err = -ECONNRESET;
+        } else {
+            done += n;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * whether the device name is an nbd uri
+ */
+static int __partfs_nbd_uri(const char * const device)
+{
+    return strncmp(device, "nbd://", 6) == 0 ||
+        strncmp(device, "nbd+unix://", 11) == 0;
+}
+
+/*
+ * split an nbd uri into the location of the server and the name
+ * of the export
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_parse(struct partfs_nbd * const nbd,
+                              const char * const uri)
+{
+    int err;
+
+    err = -EINVAL;
+    if (strncmp(uri, "nbd+unix:///", 12) == 0) {
+        const char * const q = strchr(uri + 12, '?');
+
+        if (q && strncmp(q, "?socket=", 8) == 0) {
+            nbd->name = strndup(uri + 12, q - (uri + 12));
+            nbd->path = strdup(q + 8);
+            err = (nbd->name && nbd->path) ? 0 : -ENOMEM;
+        }
+    } else if (strncmp(uri, "nbd://", 6) == 0) {
+        const char * const h = uri + 6;
+        const char * const e = h + strcspn(h, "/");
+        const char * p;
+
+        /* ipv6 addresses are enclosed in brackets */
+        if (*h == '[') {
+            const char * const b = memchr(h, ']', e - h);
+
+            p = b ? memchr(b, ':', e - b) : NULL;
+            nbd->host = b ? strndup(h + 1, b - (h + 1)) : NULL;
+        } else {
+            p = memchr(h, ':', e - h);
+            nbd->host = strndup(h, (p ? p : e) - h);
+        }
+
+        nbd->port = p ? strndup(p + 1, e - (p + 1)) : strdup(PARTFS_NBD_PORT);
+        nbd->name = strdup(*e ? e + 1 : e);
+
+        if (nbd->host && nbd->port && nbd->name) {
+            err = (*nbd->host && *nbd->port) ? 0 : -EINVAL;
+        } else {
+            err = -ENOMEM;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * connect to the server
+ *
+ * returns a socket or a negative errno on failure
+ */
+static int __partfs_nbd_connect(const struct partfs_nbd * const nbd)
+{
+    int sock;
+
+    if (nbd->path) {
+        struct sockaddr_un sun;
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+
+        sock = -ENAMETOOLONG;
+        if (strlen(nbd->path) < sizeof(sun.sun_path)) {
+            strcpy(sun.sun_path, nbd->path);
+
+            sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (sock < 0) {
+                sock = -errno;
+            } else if (connect(sock, (struct sockaddr *)&sun,
+                               sizeof(sun)) != 0) {
+                const int err = -errno;
+
+                close(sock);
+                sock = err;
+            }
+        }
+    } else {
+        struct addrinfo hints, * res;
+        int r;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        sock = -EHOSTUNREACH;
+        r = getaddrinfo(nbd->host, nbd->port, &hints, &res);
+        if (r == 0) {
+            const struct addrinfo * ai;
+
+            for (ai = res; sock < 0 && ai; ai = ai->ai_next) {
+                sock = socket(ai->ai_family,
+                              ai->ai_socktype | SOCK_CLOEXEC,
+                              ai->ai_protocol);
+                if (sock < 0) {
+                    sock = -errno;
+                } else if (connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+                    const int err = -errno;
+
+                    close(sock);
+                    sock = err;
+                }
+            }
+
+            freeaddrinfo(res);
+        }
+
+        if (sock >= 0) {
+            /* requests are small and latency matters */
+            const int one = 1;
+
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+    }
+
+    return sock;
+}
+
+/*
+ * send an option during the handshake
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_option(const int sock, const uint32_t opt,
+                               const void * const data, const uint32_t len)
+{
+    unsigned char hdr[16];
+    int err;
+
+    __partfs_put_be64(hdr, PARTFS_NBD_OPTS_MAGIC);
+    __partfs_put_be32(hdr + 8, opt);
+    __partfs_put_be32(hdr + 12, len);
+
+    err = __partfs_sock_send(sock, hdr, sizeof(hdr));
+    if (!err) {
+        err = __partfs_sock_send(sock, data, len);
+    }
+
+    return err;
+}
+
+/*
+ * receive the reply to an option. up to max bytes of the reply's
+ * data are stored in the buffer and the rest is discarded.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_option_reply(const int sock, const uint32_t opt,
+                                     uint32_t * const type,
+                                     void * const buf, const size_t max,
+                                     uint32_t * const len)
+{
+    unsigned char hdr[20];
+    int err;
+
+    err = __partfs_sock_recv(sock, hdr, sizeof(hdr));
+    if (!err) {
+        if (__partfs_get_be64(hdr) != PARTFS_NBD_REP_MAGIC ||
+            __partfs_get_be32(hdr + 8) != opt) {
+            err = -EPROTO;
+        } else {
+            *type = __partfs_get_be32(hdr + 12);
+            *len  = __partfs_get_be32(hdr + 16);
+
+            err = __partfs_sock_recv(sock, buf, MIN(*len, max));
+            if (!err && *len > max) {
+                err = __partfs_sock_recv(sock, NULL, *len - max);
+            }
+        }
+    }
+
+    return err;
+}
+
+/*
+ * negotiate with the server on a new connection, up to the start
+ * of the transmission phase. the size and flags of the export and
+ * whether replies are structured are recorded the first time.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_handshake(struct partfs_nbd * const nbd,
+                                  const int sock, const int first)
+{
+    unsigned char buf[18];
+    uint16_t hflags;
+    int err;
+
+    err = __partfs_sock_recv(sock, buf, 18);
+    if (!err) {
+        hflags = __partfs_get_be16(buf + 16);
+        if (__partfs_get_be64(buf) != PARTFS_NBD_INIT_MAGIC ||
+            __partfs_get_be64(buf + 8) != PARTFS_NBD_OPTS_MAGIC ||
+            !(hflags & PARTFS_NBD_FLAG_FIXED_NEWSTYLE)) {
+            /* oldstyle servers aren't supported */
+            err = -EPROTO;
+        }
+    }
+
+    if (!err) {
+        __partfs_put_be32(buf, hflags & (PARTFS_NBD_FLAG_FIXED_NEWSTYLE |
+                                         PARTFS_NBD_FLAG_NO_ZEROES));
+        err = __partfs_sock_send(sock, buf, 4);
+    }
+
+    if (!err) {
+        uint32_t type, len;
+
+        err = __partfs_nbd_option(
+            sock, PARTFS_NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+        if (!err) {
+            err = __partfs_nbd_option_reply(
+                sock, PARTFS_NBD_OPT_STRUCTURED_REPLY, &type, NULL, 0, &len);
+        }
+        if (!err) {
+            if (first) {
+                nbd->structured = (type == PARTFS_NBD_REP_ACK);
+            } else if (nbd->structured != (type == PARTFS_NBD_REP_ACK)) {
+                err = -EPROTO;
+            }
+        }
+    }
+
+    if (!err) {
+        const size_t nlen = strlen(nbd->name);
+        unsigned char * const go = malloc(4 + nlen + 2);
+        uint32_t type;
+
+        err = -ENOMEM;
+        if (go) {
+            /* the name of the export and no requests for information */
+            __partfs_put_be32(go, nlen);
+            memcpy(go + 4, nbd->name, nlen);
+            __partfs_put_be16(go + 4 + nlen, 0);
+
+            err = __partfs_nbd_option(sock, PARTFS_NBD_OPT_GO, go, 4 + nlen + 2);
+            for (type = PARTFS_NBD_REP_INFO;
+                 !err && type == PARTFS_NBD_REP_INFO; ) {
+                uint32_t len;
+
+                err = __partfs_nbd_option_reply(
+                    sock, PARTFS_NBD_OPT_GO, &type, buf, sizeof(buf), &len);
+                if (!err && type == PARTFS_NBD_REP_INFO && len >= 12 &&
+                    __partfs_get_be16(buf) == PARTFS_NBD_INFO_EXPORT) {
+                    buf[12] = buf[10];
+                    buf[13] = buf[11];
+                    nbd->size  = first ? __partfs_get_be64(buf + 2) : nbd->size;
+                    nbd->flags = first ? __partfs_get_be16(buf + 12) : nbd->flags;
+                }
+            }
+
+            if (!err && type == PARTFS_NBD_REP_ERR_UNSUP) {
+                /*
+                 * older servers only know how to select an export
+                 * by name, to which they reply with its details
+                 */
+                err = __partfs_nbd_option(
+                    sock, PARTFS_NBD_OPT_EXPORT_NAME, nbd->name, nlen);
+                if (!err) {
+                    err = __partfs_sock_recv(sock, buf, 10);
+                }
+                if (!err && !(hflags & PARTFS_NBD_FLAG_NO_ZEROES)) {
+                    err = __partfs_sock_recv(sock, NULL, 124);
+                }
+                if (!err && first) {
+                    nbd->size  = __partfs_get_be64(buf);
+                    nbd->flags = __partfs_get_be16(buf + 8);
+                }
+            } else if (!err && type != PARTFS_NBD_REP_ACK) {
+                /* most likely, the export doesn't exist */
+                err = -ENOENT;
+            }
+
+            free(go);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * complete a request, taking it off the list of pending requests
+ * of its connection
+ *
+ * must be called with the lock of the nbd held
+ */
+static void __partfs_nbd_complete(struct partfs_nbd_conn * const conn,
+                                  struct partfs_nbd_req * const req,
+                                  const int err)
+{
+    struct partfs_nbd_req ** r;
+
+    for (r = &conn->pending; *r && *r != req; r = &(*r)->next)
+        ;
+    if (*r) {
+        *r = req->next;
+    }
+
+    req->err  = req->err ? req->err : err;
+    req->done = 1;
+
+    pthread_cond_broadcast(&conn->nbd->cond);
+}
+
+/*
+ * fail all requests pending on a connection that has broken
+ *
+ * must be called with the lock of the nbd held
+ */
+static void __partfs_nbd_fail(struct partfs_nbd_conn * const conn,
+                              const int err)
+{
+    conn->err = err;
+    while (conn->pending) {
+        __partfs_nbd_complete(conn, conn->pending, err);
+    }
+}
+
+/*
+ * find a pending request by its handle
+ */
+static struct partfs_nbd_req * __partfs_nbd_find(
+    struct partfs_nbd_conn * const conn, const uint64_t handle)
+{
+    struct partfs_nbd_req * req;
+
+    pthread_mutex_lock(&conn->nbd->lock);
+    for (req = conn->pending;
+         req && (uintptr_t)req != handle;
+         req = req->next)
+        ;
+    pthread_mutex_unlock(&conn->nbd->lock);
+
+    return req;
+}
+
+/*
+ * receive a reply, or a chunk of a structured reply, from the
+ * server and apply it to the request it belongs to. data read is
+ * received directly into the request's buffer.
+ *
+ * returns 0 on success or a negative errno if the connection
+ * can't be used anymore
+ */
+static int __partfs_nbd_recv(struct partfs_nbd_conn * const conn)
+{
+    unsigned char hdr[20];
+    struct partfs_nbd_req * req;
+    int err, rerr, done;
+
+    req  = NULL;
+    rerr = 0;
+    done = 1;
+
+    err = __partfs_sock_recv(conn->sock, hdr, 4);
+    if (!err && __partfs_get_be32(hdr) == PARTFS_NBD_SIMPLE_REPLY_MAGIC) {
+        err = __partfs_sock_recv(conn->sock, hdr + 4, 12);
+        if (!err) {
+            req  = __partfs_nbd_find(conn, __partfs_get_be64(hdr + 8));
+            rerr = -(int)__partfs_get_be32(hdr + 4);
+            err  = req ? 0 : -EPROTO;
+        }
+
+        /* data follows only a successful read */
+        if (!err && !rerr && req->type == PARTFS_NBD_CMD_READ) {
+            err = __partfs_sock_recv(conn->sock, req->buf, req->len);
+        }
+    } else if (!err &&
+               __partfs_get_be32(hdr) == PARTFS_NBD_STRUCTURED_REPLY_MAGIC) {
+        err = __partfs_sock_recv(conn->sock, hdr + 4, 16);
+        if (!err) {
+            const uint16_t flags = __partfs_get_be16(hdr + 4);
+            const uint16_t type = __partfs_get_be16(hdr + 6);
+            uint32_t len = __partfs_get_be32(hdr + 16);
+            unsigned char b[12];
+
+            req  = __partfs_nbd_find(conn, __partfs_get_be64(hdr + 8));
+            done = flags & PARTFS_NBD_REPLY_FLAG_DONE;
+            err  = req ? 0 : -EPROTO;
+
+            if (!err && (type == PARTFS_NBD_REPLY_TYPE_OFFSET_DATA ||
+                         type == PARTFS_NBD_REPLY_TYPE_OFFSET_HOLE)) {
+                const size_t blen =
+                    (type == PARTFS_NBD_REPLY_TYPE_OFFSET_DATA) ? 8 : 12;
+
+                err = (len >= blen) ?
+                    __partfs_sock_recv(conn->sock, b, blen) : -EPROTO;
+                if (!err) {
+                    const uint64_t off = __partfs_get_be64(b);
+                    const uint64_t cnt = (blen == 8) ?
+                        (len - blen) : __partfs_get_be32(b + 8);
+
+                    /* the chunk must lie within the request */
+                    err = -EPROTO;
+                    if (req->type == PARTFS_NBD_CMD_READ &&
+                        off >= req->off && off + cnt <= req->off + req->len) {
+                        char * const dst = req->buf + (off - req->off);
+
+                        if (blen == 8) {
+                            err = __partfs_sock_recv(conn->sock, dst, cnt);
+                        } else {
+                            memset(dst, 0, cnt);
+                            err = 0;
+                        }
+                    }
+                    len = 0;
+                }
+            } else if (!err && (type & PARTFS_NBD_REPLY_TYPE_ERROR)) {
+                err = (len >= 4) ?
+                    __partfs_sock_recv(conn->sock, b, 4) : -EPROTO;
+                if (!err) {
+                    rerr = -(int)__partfs_get_be32(b);
+                    rerr = rerr ? rerr : -EIO;
+                    len -= 4;
+                }
+            }
+
+            /* anything else, such as error messages, is ignored */
+            if (!err) {
+                err = __partfs_sock_recv(conn->sock, NULL, len);
+            }
+        }
+    } else if (!err) {
+        err = -EPROTO;
+    }
+
+    if (!err && req) {
+        pthread_mutex_lock(&conn->nbd->lock);
+        if (rerr) {
+            req->err = rerr;
+        }
+        if (done) {
+            __partfs_nbd_complete(conn, req, 0);
+        }
+        pthread_mutex_unlock(&conn->nbd->lock);
+    }
+
+    return err;
+}
+
+/*
+ * receives replies on a connection until it is shut down
+ */
+static void * __partfs_nbd_receiver(void * const arg)
+{
+    struct partfs_nbd_conn * const conn = arg;
+    int err;
+
+    do {
+        err = __partfs_nbd_recv(conn);
+    } while (!err);
+
+    pthread_mutex_lock(&conn->nbd->lock);
+    __partfs_nbd_fail(conn, -EIO);
+    pthread_mutex_unlock(&conn->nbd->lock);
+
+    return NULL;
+}
+
+/*
+ * send a request on a connection. the request is added to the
+ * connection's pending requests before it is sent, since the reply
+ * may arrive before sending has finished.
+ */
+static void __partfs_nbd_send(struct partfs_nbd_conn * const conn,
+                              struct partfs_nbd_req * const req)
+{
+    unsigned char hdr[28];
+    int err, queued;
+
+    __partfs_put_be32(hdr, PARTFS_NBD_REQUEST_MAGIC);
+    __partfs_put_be16(hdr + 4, 0);
+    __partfs_put_be16(hdr + 6, req->type);
+    __partfs_put_be64(hdr + 8, (uintptr_t)req);
+    __partfs_put_be64(hdr + 16, req->off);
+    __partfs_put_be32(hdr + 24, req->len);
+
+    pthread_mutex_lock(&conn->lock);
+
+    pthread_mutex_lock(&conn->nbd->lock);
+    err = conn->err;
+    queued = !err;
+    if (queued) {
+        req->next     = conn->pending;
+        conn->pending = req;
+    }
+    pthread_mutex_unlock(&conn->nbd->lock);
+
+    if (!err) {
+        err = __partfs_sock_send(conn->sock, hdr, sizeof(hdr));
+        if (!err && req->type == PARTFS_NBD_CMD_WRITE) {
+            err = __partfs_sock_send(conn->sock, req->buf, req->len);
+        }
+    }
+
+    pthread_mutex_unlock(&conn->lock);
+
+    if (err) {
+        /*
+         * a partially sent request leaves the connection unusable.
+         * shutting it down makes its receiver fail everything that
+         * is pending on it, this request included. it is left to
+         * the receiver, which may be reading a reply into it.
+         */
+        pthread_mutex_lock(&conn->nbd->lock);
+        if (!queued) {
+            __partfs_nbd_complete(conn, req, err);
+        } else if (conn->nbd->running) {
+            shutdown(conn->sock, SHUT_RDWR);
+        } else {
+            __partfs_nbd_fail(conn, -EIO);
+        }
+        pthread_mutex_unlock(&conn->nbd->lock);
+    }
+}
+
+/*
+ * wait for a request to complete. until the connections' threads
+ * are running, replies are received by the caller.
+ */
+static void __partfs_nbd_wait(struct partfs_nbd_conn * const conn,
+                              struct partfs_nbd_req * const req)
+{
+    struct partfs_nbd * const nbd = conn->nbd;
+
+    if (nbd->running) {
+        pthread_mutex_lock(&nbd->lock);
+        while (!req->done) {
+            pthread_cond_wait(&nbd->cond, &nbd->lock);
+        }
+        pthread_mutex_unlock(&nbd->lock);
+    } else {
+        while (!req->done) {
+            const int err = __partfs_nbd_recv(conn);
+
+            if (err) {
+                __partfs_nbd_fail(conn, err);
+            }
+        }
+    }
+}
+
+/*
+ * choose the connection on which to send the next request, going
+ * round the ones that haven't failed. only the first connection
+ * is used until all of them are up.
+ */
+static struct partfs_nbd_conn * __partfs_nbd_pick(
+    struct partfs_nbd * const nbd)
+{
+    struct partfs_nbd_conn * conn;
+    size_t i;
+
+    conn = &nbd->conn[0];
+
+    pthread_mutex_lock(&nbd->lock);
+    if (nbd->running) {
+        for (i = 0;
+             i < nbd->nconn && nbd->conn[nbd->next % nbd->nconn].err;
+             i++) {
+            nbd->next++;
+        }
+        conn = &nbd->conn[nbd->next++ % nbd->nconn];
+    }
+    pthread_mutex_unlock(&nbd->lock);
+
+    return conn;
+}
+
+/*
+ * perform a command on a range of the export. the range is split
+ * into requests that are spread over the connections and all sent
+ * before any reply is waited for.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_io(struct partfs_nbd * const nbd,
+                           const uint16_t type,
+                           char * const buf, const uint64_t len,
+                           const uint64_t off)
+{
+    const uint64_t max = buf ? PARTFS_NBD_MAX_IO : (UINT64_C(1) << 30);
+    const size_t nreq = MAX((len + max - 1) / max, 1);
+    struct partfs_nbd_req * const req = calloc(nreq, sizeof(*req));
+    int err;
+
+    err = -ENOMEM;
+    if (req) {
+        struct partfs_nbd_conn ** const conn = calloc(nreq, sizeof(*conn));
+
+        if (conn) {
+            size_t i;
+
+            for (i = 0; i < nreq; i++) {
+                req[i].type = type;
+                req[i].off  = off + i * max;
+                req[i].len  = MIN(max, len - i * max);
+                req[i].buf  = buf ? (buf + i * max) : NULL;
+
+                conn[i] = __partfs_nbd_pick(nbd);
+
+                __partfs_nbd_send(conn[i], &req[i]);
+                if (!nbd->running) {
+                    __partfs_nbd_wait(conn[i], &req[i]);
+                }
+            }
+
+            err = 0;
+            for (i = 0; i < nreq; i++) {
+                __partfs_nbd_wait(conn[i], &req[i]);
+                err = err ? err : req[i].err;
+            }
+
+            free(conn);
+        }
+
+        free(req);
+    }
+
+    return err;
+}
+
+/*
+ * read from and write to the export, like pread(2) and pwrite(2)
+ * with pos relative to the start of the export
+ */
+static ssize_t __partfs_nbd_pread(const struct partfs_file * const pfi,
+                                  void * const buf, const size_t len,
+                                  const off_t pos)
+{
+    struct partfs_nbd * const nbd = pfi->nbd;
+    const size_t n = ((uint64_t)pos < nbd->size) ?
+        MIN(len, nbd->size - pos) : 0;
+    const int err = __partfs_nbd_io(nbd, PARTFS_NBD_CMD_READ, buf, n, pos);
+
+    errno = -err;
+    return err ? -1 : (ssize_t)n;
+}
+
+static ssize_t __partfs_nbd_pwrite(const struct partfs_file * const pfi,
+                                   const void * const buf, const size_t len,
+                                   const off_t pos)
+{
+    struct partfs_nbd * const nbd = pfi->nbd;
+    const size_t n = ((uint64_t)pos < nbd->size) ?
+        MIN(len, nbd->size - pos) : 0;
+    int err;
+
+    err = -ENOSPC;
+    if (nbd->flags & PARTFS_NBD_FLAG_READ_ONLY) {
+        err = -EROFS;
+    } else if (n > 0) {
+        err = __partfs_nbd_io(nbd, PARTFS_NBD_CMD_WRITE, (char *)buf, n, pos);
+    }
+
+    errno = -err;
+    return err ? -1 : (ssize_t)n;
+}
+
+/*
+ * discard or zero a region of a partition on the export, if the
+ * server supports it
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_punch(const struct partfs_file * const pfi,
+                              const off_t off, const off_t len,
+                              const int zero)
+{
+    struct partfs_nbd * const nbd = pfi->nbd;
+    const uint16_t flag = zero ?
+        PARTFS_NBD_FLAG_SEND_WRITE_ZEROES : PARTFS_NBD_FLAG_SEND_TRIM;
+    int err;
+
+    err = -EOPNOTSUPP;
+    if ((nbd->flags & flag) && !(nbd->flags & PARTFS_NBD_FLAG_READ_ONLY)) {
+        err = __partfs_nbd_io(nbd,
+                              zero ?
+                              PARTFS_NBD_CMD_WRITE_ZEROES :
+                              PARTFS_NBD_CMD_TRIM,
+                              NULL, len, pfi->start + off);
+    }
+
+    return err;
+}
+
+/*
+ * have the server commit written data to stable storage
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_flush(const struct partfs_file * const pfi)
+{
+    struct partfs_nbd * const nbd = pfi->nbd;
+
+    return (nbd->flags & PARTFS_NBD_FLAG_SEND_FLUSH) ?
+        __partfs_nbd_io(nbd, PARTFS_NBD_CMD_FLUSH, NULL, 0, 0) : 0;
+}
+
+/*
+ * open a connection to a server, start receiving on it
+ * and add it to the connections of the export
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_add(struct partfs_nbd * const nbd, const int first)
+{
+    struct partfs_nbd_conn * const conn = &nbd->conn[nbd->nconn];
+    int err;
+
+    conn->nbd     = nbd;
+    conn->pending = NULL;
+    conn->err     = 0;
+
+    conn->sock = __partfs_nbd_connect(nbd);
+    err = (conn->sock < 0) ? conn->sock : 0;
+    if (!err) {
+        err = __partfs_nbd_handshake(nbd, conn->sock, first);
+        if (err) {
+            close(conn->sock);
+        }
+    }
+
+    if (!err) {
+        pthread_mutex_init(&conn->lock, NULL);
+        nbd->nconn++;
+    }
+
+    return err;
+}
+
+/*
+ * connect to the server named by an nbd uri
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_nbd_open(struct partfs_device * const pdev,
+                             const char * const uri)
+{
+    struct partfs_nbd * const nbd = calloc(1, sizeof(*nbd));
+    int err;
+
+    err = -ENOMEM;
+    if (nbd) {
+        pdev->nbd = nbd;
+        pthread_mutex_init(&nbd->lock, NULL);
+        pthread_cond_init(&nbd->cond, NULL);
+
+        nbd->conn = calloc(PARTFS_NBD_CONNS, sizeof(*nbd->conn));
+        err = nbd->conn ? __partfs_nbd_parse(nbd, uri) : -ENOMEM;
+        if (!err) {
+            err = __partfs_nbd_add(nbd, 1);
+        }
+
+        if (!err) {
+            memset(&pdev->st, 0, sizeof(pdev->st));
+            pdev->st.st_uid   = getuid();
+            pdev->st.st_gid   = getgid();
+            pdev->st.st_atime = time(NULL);
+            pdev->st.st_mtime = pdev->st.st_atime;
+            pdev->st.st_ctime = pdev->st.st_atime;
+
+            pdev->st.st_mode = S_IFREG |
+                ((nbd->flags & PARTFS_NBD_FLAG_READ_ONLY) ? 0444 : 0644);
+            pdev->st.st_size    = nbd->size;
+            pdev->st.st_blksize = PARTFS_NBD_MAX_IO;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * open the remaining connections to the server and start
+ * receiving replies on all of them. this must happen after
+ * fuse has daemonized, since threads don't survive fork().
+ */
+static void __partfs_nbd_start(struct partfs_nbd * const nbd)
+{
+    const size_t nconn = (nbd->flags & PARTFS_NBD_FLAG_CAN_MULTI_CONN) ?
+        PARTFS_NBD_CONNS : 1;
+    size_t i;
+
+    /* a server refusing additional connections isn't fatal */
+    while (nbd->nconn < nconn && __partfs_nbd_add(nbd, 0) == 0)
+        ;
+
+    for (i = 0; i < nbd->nconn; i++) {
+        if (pthread_create(&nbd->conn[i].thr, NULL,
+                           __partfs_nbd_receiver, &nbd->conn[i]) != 0) {
+            /* the connection is useless without its receiver */
+            nbd->conn[i].err = -EIO;
+            shutdown(nbd->conn[i].sock, SHUT_RDWR);
+            nbd->conn[i].thr = pthread_self();
+        }
+    }
+
+    nbd->running = 1;
+}
+
+/*
+ * disconnect from the server and free everything
+ */
+static void __partfs_nbd_close(struct partfs_device * const pdev)
+{
+    struct partfs_nbd * const nbd = pdev->nbd;
+
+    if (nbd) {
+        size_t i;
+
+        for (i = 0; i < nbd->nconn; i++) {
+            struct partfs_nbd_conn * const conn = &nbd->conn[i];
+            unsigned char hdr[28];
+
+            memset(hdr, 0, sizeof(hdr));
+            __partfs_put_be32(hdr, PARTFS_NBD_REQUEST_MAGIC);
+            __partfs_put_be16(hdr + 6, PARTFS_NBD_CMD_DISC);
+
+            pthread_mutex_lock(&conn->lock);
+            __partfs_sock_send(conn->sock, hdr, sizeof(hdr));
+            pthread_mutex_unlock(&conn->lock);
+
+            shutdown(conn->sock, SHUT_RDWR);
+            if (nbd->running && !pthread_equal(conn->thr, pthread_self())) {
+                pthread_join(conn->thr, NULL);
+            }
+
+            close(conn->sock);
+            pthread_mutex_destroy(&conn->lock);
+        }
+
+        pthread_cond_destroy(&nbd->cond);
+        pthread_mutex_destroy(&nbd->lock);
+
+        free(nbd->conn);
+        free(nbd->host);
+        free(nbd->port);
+        free(nbd->path);
+        free(nbd->name);
+        free(nbd);
+
+        pdev->nbd = NULL;
+    }
+}
+
+/*
+ * read from and write to the extent file, retrying short transfers.
+ * reading beyond the end of the file is an error.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_vmdk_load(const struct partfs_vmdk * const vmdk,
+                              void * const buf, const size_t len,
+                              const off_t off)
+{
+    size_t done;
+    int err;
+
+    err = 0;
+    for (done = 0; !err && done < len; ) {
+        const ssize_t n =
+            pread(vmdk->fd, (char *)buf + done, len - done, off + done);
+
+        if (n <= 0) {
+            err = (n < 0) ? -errno : -EIO;
+        } else {
+            done += n;
+        }
+    }
+
+    return err;
+}
+
+static int __partfs_vmdk_store(const struct partfs_vmdk * const vmdk,
+                               const void * const buf, const size_t len,
+                               const off_t off)
+{
+    size_t done;
+    int err;
+
+    err = 0;
+    for (done = 0; !err && done < len; ) {
+        const ssize_t n =
+            pwrite(vmdk->fd, (const char *)buf + done, len - done, off + done);
+
+        if (n <= 0) {
+            err = (n < 0) ? -errno : -EIO;
+        } else {
+            done += n;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * read a grain directory, or a grain table, of n entries
+ * located at the given sector of the extent
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_vmdk_entries(const struct partfs_vmdk * const vmdk,
+                                 const uint64_t sector, const size_t n,
+                                 uint32_t ** const v)
+{
+    unsigned char * const buf = malloc(MAX(n, 1) * 4);
+    uint32_t * const e = malloc(MAX(n, 1) * sizeof(*e));
+    int err;
+
+    err = -ENOMEM;
+    if (buf && e) {
+        err = -EIO;
+        if (sector <= (uint64_t)INT64_MAX / PARTFS_VMDK_SECTOR) {
+            err = __partfs_vmdk_load(
+                vmdk, buf, n * 4, sector * PARTFS_VMDK_SECTOR);
+        }
+    }
+
+    if (!err) {
+        size_t i;
+
+        for (i = 0; i < n; i++) {
+            e[i] = __partfs_get_le32(buf + 4 * i);
+        }
+        *v = e;
+    } else {
+        free(e);
+    }
+
+    free(buf);
+
+    return err;
+}
+
+/*
+ * write an entry of the grain directory or table
+ * located at the given sector of the extent
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_vmdk_entry(const struct partfs_vmdk * const vmdk,
+                               const uint64_t sector, const size_t i,
+                               const uint32_t v)
+{
+    unsigned char b[4];
+
+    __partfs_put_le32(b, v);
+    return __partfs_vmdk_store(
+        vmdk, b, sizeof(b), sector * PARTFS_VMDK_SECTOR + i * 4);
+}
+
+/*
+ * find the grain table for the i-th entry of the grain directory,
+ * reading it in if necessary. *gt is set to NULL if the directory
+ * has no table there.
+ *
+ * must be called with the lock of the extent held
+ */
+static int __partfs_vmdk_table(struct partfs_vmdk * const vmdk,
+                               const size_t i, uint32_t ** const gt)
+{
+    int err;
+
+    err = 0;
+    if (!vmdk->gt[i] && vmdk->gd[i]) {
+        err = __partfs_vmdk_entries(vmdk, vmdk->gd[i], vmdk->ngte,
+                                    &vmdk->gt[i]);
+    }
+
+    *gt = vmdk->gt[i];
+
+    return err;
+}
+
+/*
+ * look up the grain table entry of a grain: the sector at which
+ * the grain is stored or, if it reads as zeros, 0 or
+ * PARTFS_VMDK_GTE_ZERO
+ *
+ * must be called with the lock of the extent held
+ */
+static int __partfs_vmdk_gte(struct partfs_vmdk * const vmdk,
+                             const uint64_t g, uint32_t * const gte)
+{
+    uint32_t * gt;
+    const int err = __partfs_vmdk_table(vmdk, g / vmdk->ngte, &gt);
+
+    *gte = (!err && gt) ? gt[g % vmdk->ngte] : 0;
+
+    return err;
+}
+
+/*
+ * decompress a grain of a compressed extent into a buffer of a
+ * grain's size. the compressed data is preceded by the sector of
+ * the virtual disk at which the grain starts and the size of the
+ * data. the extent isn't changed, so the lock needn't be held.
+ */
+static int __partfs_vmdk_inflate(const struct partfs_vmdk * const vmdk,
+                                 const uint64_t g, const uint32_t gte,
+                                 char * const data)
+{
+    const off_t off = (off_t)gte * PARTFS_VMDK_SECTOR;
+    unsigned char hdr[12];
+    int err;
+
+    err = __partfs_vmdk_load(vmdk, hdr, sizeof(hdr), off);
+    if (!err && (__partfs_get_le64(hdr) !=
+                 g * (vmdk->grain / PARTFS_VMDK_SECTOR) ||
+                 __partfs_get_le32(hdr + 8) > 2 * vmdk->grain)) {
+        err = -EIO;
+    }
+
+    if (!err) {
+        const uint32_t zlen = __partfs_get_le32(hdr + 8);
+        unsigned char * const zbuf = malloc(MAX(zlen, 1));
+
+        err = -ENOMEM;
+        if (zbuf) {
+            uLongf len = vmdk->grain;
+
+            err = __partfs_vmdk_load(vmdk, zbuf, zlen, off + sizeof(hdr));
+            if (!err && uncompress((Bytef *)data, &len, zbuf, zlen) != Z_OK) {
+                err = -EIO;
+            }
+
+            if (!err) {
+                /* the last grain of the disk may be short */
+                memset(data + len, 0, vmdk->grain - len);
+            }
+
+            free(zbuf);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * append data to the extent. the locations of grains and
+ * tables are sector numbers that must fit in 32 bits.
+ *
+ * must be called with the lock of the extent held
+ */
+static int __partfs_vmdk_append(struct partfs_vmdk * const vmdk,
+                                const void * const buf, const size_t len,
+                                uint32_t * const sector)
+{
+    int err;
+
+    err = -ENOSPC;
+    if ((vmdk->end + len) / PARTFS_VMDK_SECTOR <= UINT32_MAX) {
+        err = __partfs_vmdk_store(vmdk, buf, len, vmdk->end);
+    }
+
+    if (!err) {
+        *sector    = vmdk->end / PARTFS_VMDK_SECTOR;
+        vmdk->end += len;
+    }
+
+    return err;
+}
+
+/*
+ * allocate an empty grain table, and a redundant copy if the extent
+ * keeps them, and enter it in the grain directory
+ *
+ * must be called with the lock of the extent held
+ */
+static int __partfs_vmdk_newtable(struct partfs_vmdk * const vmdk,
+                                  const size_t i, uint32_t ** const gt)
+{
+    const size_t len = roundup(vmdk->ngte * 4, PARTFS_VMDK_SECTOR);
+    uint32_t * const t = calloc(vmdk->ngte, sizeof(*t));
+    void * const zeros = calloc(1, len);
+    int err;
+
+    err = (t && zeros) ? 0 : -ENOMEM;
+
+    /* the tables must exist before the directories point to them */
+    if (!err && vmdk->rgd) {
+        err = __partfs_vmdk_append(vmdk, zeros, len, &vmdk->rgd[i]);
+        if (!err) {
+            err = __partfs_vmdk_entry(vmdk, vmdk->rgdoff, i, vmdk->rgd[i]);
+        }
+    }
+    if (!err) {
+        err = __partfs_vmdk_append(vmdk, zeros, len, &vmdk->gd[i]);
+        if (!err) {
+            err = __partfs_vmdk_entry(vmdk, vmdk->gdoff, i, vmdk->gd[i]);
+        }
+    }
+
+    if (!err) {
+        vmdk->gt[i] = t;
+        *gt = t;
+    } else {
+        free(t);
+    }
+
+    free(zeros);
+
+    return err;
+}
+
+/*
+ * allocate a grain at the end of the extent holding the given data
+ * at the given offset within it and zeros elsewhere, and point the
+ * grain table, and its redundant copy, at it
+ *
+ * must be called with the lock of the extent held
+ */
+static int __partfs_vmdk_alloc(struct partfs_vmdk * const vmdk,
+                               const uint64_t g, const void * const data,
+                               const size_t in, const size_t len)
+{
+    const size_t i = g / vmdk->ngte, j = g % vmdk->ngte;
+    char * const buf = calloc(1, vmdk->grain);
+    uint32_t * gt;
+    int err;
+
+    err = buf ? __partfs_vmdk_table(vmdk, i, &gt) : -ENOMEM;
+    if (!err && !gt) {
+        err = __partfs_vmdk_newtable(vmdk, i, &gt);
+    }
+
+    if (!err) {
+        uint32_t sector;
+
+        memcpy(buf + in, data, len);
+        err = __partfs_vmdk_append(vmdk, buf, vmdk->grain, &sector);
+
+        /* the grain must be written before the tables point to it */
+        if (!err) {
+            gt[j] = sector;
+            err = __partfs_vmdk_entry(vmdk, vmdk->gd[i], j, sector);
+        }
+        if (!err && vmdk->rgd && vmdk->rgd[i]) {
+            err = __partfs_vmdk_entry(vmdk, vmdk->rgd[i], j, sector);
+        }
+    }
+
+    free(buf);
+
+    return err;
+}
+
+/*
+ * mark the extent as not shut down cleanly before it is first
+ * modified. the mark is removed when the extent is closed.
+ *
+ * must be called with the lock of the extent held
+ */
+static int __partfs_vmdk_dirty(struct partfs_vmdk * const vmdk)
+{
+    static const unsigned char one = 1;
+    int err;
+
+    err = 0;
+    if (!vmdk->dirty) {
+        err = __partfs_vmdk_store(
+            vmdk, &one, 1, vmdk->hdr + PARTFS_VMDK_UNCLEAN);
+        if (!err) {
+            err = fdatasync(vmdk->fd) ? -errno : 0;
+        }
+
+        vmdk->dirty = !err;
+    }
+
+    return err;
+}
+
+/*
+ * whether a buffer holds nothing but zeros
+ */
+static int __partfs_zeros(const void * const buf, const size_t len)
+{
+    const unsigned char * const b = buf;
+
+    return len == 0 || (b[0] == 0 && memcmp(b, b + 1, len - 1) == 0);
+}
+
+/*
+ * read from and write to the virtual disk, like pread(2) and
+ * pwrite(2). no more than the rest of a grain is transferred.
+ */
+static ssize_t __partfs_vmdk_pread(const struct partfs_file * const pfi,
+                                   void * const buf, const size_t len,
+                                   const off_t pos)
+{
+    struct partfs_vmdk * const vmdk = pfi->vmdk;
+    const uint64_t g = pos / vmdk->grain, in = pos % vmdk->grain;
+    const size_t n = ((uint64_t)pos < vmdk->size) ?
+        MIN(len, MIN(vmdk->grain - in, vmdk->size - pos)) : 0;
+    uint32_t gte;
+    int err, done;
+
+    err = 0;
+    gte = 0;
+    if (n > 0) {
+        pthread_mutex_lock(&vmdk->lock);
+        err = __partfs_vmdk_gte(vmdk, g, &gte);
+        done = err || gte <= PARTFS_VMDK_GTE_ZERO;
+        if (!err && gte <= PARTFS_VMDK_GTE_ZERO) {
+            memset(buf, 0, n);
+        } else if (!err && vmdk->zgrain == g) {
+            memcpy(buf, vmdk->zbuf + in, n);
+            done = 1;
+        }
+        pthread_mutex_unlock(&vmdk->lock);
+
+        /*
+         * grains never move once allocated, so no lock is needed.
+         * compressed grains are decompressed without the lock too,
+         * so that several can be at once, and the last one is kept.
+         */
+        if (!done && (vmdk->flags & PARTFS_VMDK_FLAG_COMPRESSED)) {
+            char * const data = malloc(vmdk->grain);
+
+            err = data ? __partfs_vmdk_inflate(vmdk, g, gte, data) : -ENOMEM;
+            if (!err) {
+                memcpy(buf, data + in, n);
+
+                pthread_mutex_lock(&vmdk->lock);
+                memcpy(vmdk->zbuf, data, vmdk->grain);
+                vmdk->zgrain = g;
+                pthread_mutex_unlock(&vmdk->lock);
+            }
+
+            free(data);
+        } else if (!done) {
+            err = __partfs_vmdk_load(
+                vmdk, buf, n, (off_t)gte * PARTFS_VMDK_SECTOR + in);
+        }
+    }
+
+    errno = -err;
+    return err ? -1 : (ssize_t)n;
+}
+
+/*
+ * a grain that isn't allocated yet is allocated, and written in
+ * its entirety, unless the data to be written to it is all zeros,
+ * in which case there is nothing to do.
+ */
+static ssize_t __partfs_vmdk_pwrite(const struct partfs_file * const pfi,
+                                    const void * const buf, const size_t len,
+                                    const off_t pos)
+{
+    struct partfs_vmdk * const vmdk = pfi->vmdk;
+    const uint64_t g = pos / vmdk->grain, in = pos % vmdk->grain;
+    const size_t n = ((uint64_t)pos < vmdk->size) ?
+        MIN(len, MIN(vmdk->grain - in, vmdk->size - pos)) : 0;
+    uint32_t gte;
+    int err;
+
+    err = -ENOSPC;
+    gte = 0;
+    if (!vmdk->rw) {
+        err = -EROFS;
+    } else if (n > 0) {
+        pthread_mutex_lock(&vmdk->lock);
+        err = __partfs_vmdk_dirty(vmdk);
+        if (!err) {
+            err = __partfs_vmdk_gte(vmdk, g, &gte);
+        }
+        if (!err && gte <= PARTFS_VMDK_GTE_ZERO &&
+            !__partfs_zeros(buf, n)) {
+            err = __partfs_vmdk_alloc(vmdk, g, buf, in, n);
+        }
+        pthread_mutex_unlock(&vmdk->lock);
+
+        if (!err && gte > PARTFS_VMDK_GTE_ZERO) {
+            err = __partfs_vmdk_store(
+                vmdk, buf, n, (off_t)gte * PARTFS_VMDK_SECTOR + in);
+        }
+    }
+
+    errno = -err;
+    return err ? -1 : (ssize_t)n;
+}
+
+/*
+ * flush writes to the extent file
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_vmdk_flush(const struct partfs_file * const pfi,
+                               const int datasync)
+{
+    const int fd = pfi->vmdk->fd;
+
+    return (datasync ? fdatasync(fd) : fsync(fd)) ? -errno : 0;
+}
+
+/*
+ * find the first offset of the virtual disk at or after the
+ * given one that is in a grain that is (SEEK_DATA) or isn't
+ * (SEEK_HOLE) stored in the extent, like lseek(2)
+ */
+static off_t __partfs_vmdk_lseek(struct partfs_vmdk * const vmdk,
+                                 const off_t off, const int whence)
+{
+    const uint64_t ngrain = (vmdk->size + vmdk->grain - 1) / vmdk->grain;
+    uint64_t g;
+    off_t ret;
+    int err, found;
+
+    err   = 0;
+    found = 0;
+
+    pthread_mutex_lock(&vmdk->lock);
+    for (g = off / vmdk->grain; !err && !found && g < ngrain; ) {
+        uint32_t * gt;
+
+        err = __partfs_vmdk_table(vmdk, g / vmdk->ngte, &gt);
+        if (!err && !gt) {
+            /* none of the grains of a missing table are stored */
+            found = (whence == SEEK_HOLE);
+            if (!found) {
+                g = (g / vmdk->ngte + 1) * vmdk->ngte;
+            }
+        } else if (!err) {
+            found = ((gt[g % vmdk->ngte] > PARTFS_VMDK_GTE_ZERO) ==
+                     (whence == SEEK_DATA));
+            if (!found) {
+                g++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&vmdk->lock);
+
+    if (err) {
+        errno = -err;
+        ret   = -1;
+    } else if (found) {
+        ret = MAX(off, (off_t)(g * vmdk->grain));
+    } else if (whence == SEEK_HOLE) {
+        ret = MAX(off, (off_t)vmdk->size);
+    } else {
+        errno = ENXIO;
+        ret   = -1;
+    }
+
+    return ret;
+}
+
+/*
+ * whether the named file is a vmware sparse extent
+ */
+static int __partfs_vmdk_file(const char * const name)
+{
+    const int fd = open(name, O_RDONLY);
+    int ret;
+
+    ret = 0;
+    if (fd >= 0) {
+        unsigned char magic[4];
+
+        ret = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+            __partfs_get_le32(magic) == PARTFS_VMDK_MAGIC;
+        close(fd);
+    }
+
+    return ret;
+}
+
+/*
+ * open a vmware sparse extent and read its grain directory.
+ * monolithicSparse extents can be read and written. compressed
+ * ones, i.e. streamOptimized extents, can only be read.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_vmdk_open(struct partfs_device * const pdev)
+{
+    struct partfs_vmdk * const vmdk = calloc(1, sizeof(*vmdk));
+    int err;
+
+    err = -ENOMEM;
+    if (vmdk) {
+        unsigned char hdr[PARTFS_VMDK_SECTOR];
+
+        pdev->vmdk   = vmdk;
+        vmdk->zgrain = UINT64_MAX;
+        pthread_mutex_init(&vmdk->lock, NULL);
+
+        vmdk->rw = 1;
+        vmdk->fd = open(pdev->name, O_RDWR | O_CLOEXEC);
+        if (vmdk->fd < 0 && (errno == EACCES || errno == EROFS)) {
+            vmdk->rw = 0;
+            vmdk->fd = open(pdev->name, O_RDONLY | O_CLOEXEC);
+        }
+        err = (vmdk->fd < 0) ? -errno : 0;
+
+        if (!err) {
+            err = __partfs_vmdk_load(vmdk, hdr, sizeof(hdr), 0);
+        }
+        if (!err && __partfs_get_le64(hdr + 56) == PARTFS_VMDK_GD_AT_END) {
+            /*
+             * a streamOptimized extent is written sequentially, so
+             * the location of its grain directory is only recorded
+             * in the copy of the header in the footer, which is
+             * followed by the end-of-stream marker
+             */
+            err = -EINVAL;
+            if (pdev->st.st_size >= 3 * PARTFS_VMDK_SECTOR) {
+                vmdk->hdr = pdev->st.st_size - 2 * PARTFS_VMDK_SECTOR;
+                err = __partfs_vmdk_load(vmdk, hdr, sizeof(hdr), vmdk->hdr);
+            }
+        }
+
+        if (!err) {
+            const uint32_t version = __partfs_get_le32(hdr + 4);
+            const uint64_t capacity = __partfs_get_le64(hdr + 12);
+            const uint64_t gs = __partfs_get_le64(hdr + 20);
+
+            vmdk->flags  = __partfs_get_le32(hdr + 8);
+            vmdk->ngte   = __partfs_get_le32(hdr + 44);
+            vmdk->rgdoff = __partfs_get_le64(hdr + 48);
+            vmdk->gdoff  = __partfs_get_le64(hdr + 56);
+
+            err = -EINVAL;
+            if (__partfs_get_le32(hdr) == PARTFS_VMDK_MAGIC &&
+                version >= 1 && version <= 3 &&
+                capacity > 0 &&
+                capacity <= (uint64_t)INT64_MAX / PARTFS_VMDK_SECTOR &&
+                gs > 0 && gs <= (1 << 16) && (gs & (gs - 1)) == 0 &&
+                vmdk->ngte > 0 && vmdk->ngte <= (1 << 16) &&
+                vmdk->gdoff != PARTFS_VMDK_GD_AT_END) {
+                vmdk->size  = capacity * PARTFS_VMDK_SECTOR;
+                vmdk->grain = gs * PARTFS_VMDK_SECTOR;
+                vmdk->ngde  = (capacity + gs * vmdk->ngte - 1) /
+                    (gs * vmdk->ngte);
+                err = 0;
+            }
+        }
+
+        if (!err && (vmdk->flags & (PARTFS_VMDK_FLAG_COMPRESSED |
+                                    PARTFS_VMDK_FLAG_MARKERS))) {
+            vmdk->rw = 0;
+        }
+        if (!err && (vmdk->flags & PARTFS_VMDK_FLAG_COMPRESSED)) {
+            err = (__partfs_get_le16(hdr + 77) ==
+                   PARTFS_VMDK_COMPRESS_DEFLATE) ? 0 : -ENOTSUP;
+            if (!err) {
+                vmdk->zbuf = malloc(vmdk->grain);
+                err = vmdk->zbuf ? 0 : -ENOMEM;
+            }
+        }
+
+        if (!err) {
+            vmdk->gt = calloc(vmdk->ngde, sizeof(*vmdk->gt));
+            err = vmdk->gt ? 0 : -ENOMEM;
+        }
+        if (!err) {
+            err = __partfs_vmdk_entries(vmdk, vmdk->gdoff, vmdk->ngde,
+                                        &vmdk->gd);
+        }
+        if (!err && (vmdk->flags & PARTFS_VMDK_FLAG_REDUNDANT) &&
+            vmdk->rgdoff) {
+            err = __partfs_vmdk_entries(vmdk, vmdk->rgdoff, vmdk->ngde,
+                                        &vmdk->rgd);
+        }
+
+        if (!err) {
+            vmdk->end = roundup(pdev->st.st_size, PARTFS_VMDK_SECTOR);
+
+            pdev->st.st_mode    = S_IFREG |
+                (pdev->st.st_mode & (vmdk->rw ? 07777 : 07555));
+            pdev->st.st_size    = vmdk->size;
+            pdev->st.st_blksize = vmdk->grain;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * mark the extent as shut down cleanly and free everything
+ */
+static void __partfs_vmdk_close(struct partfs_device * const pdev)
+{
+    struct partfs_vmdk * const vmdk = pdev->vmdk;
+
+    if (vmdk) {
+        size_t i;
+
+        if (vmdk->dirty && fdatasync(vmdk->fd) == 0) {
+            static const unsigned char zero = 0;
+
+            if (__partfs_vmdk_store(vmdk, &zero, 1,
+                                    vmdk->hdr + PARTFS_VMDK_UNCLEAN) == 0) {
+                fdatasync(vmdk->fd);
+            }
+        }
+
+        if (vmdk->fd >= 0) {
+            close(vmdk->fd);
+        }
+
+        for (i = 0; vmdk->gt && i < vmdk->ngde; i++) {
+            free(vmdk->gt[i]);
+        }
+        free(vmdk->gt);
+        free(vmdk->gd);
+        free(vmdk->rgd);
+        free(vmdk->zbuf);
+
+        pthread_mutex_destroy(&vmdk->lock);
+        free(vmdk);
+
+        pdev->vmdk = NULL;
+    }
+}
+
+/*
+ * count bytes as in use by a user of memory, or no longer in use
+ */
+static void __partfs_mem_charge(struct partfs_mem * const mem,
+                                const enum partfs_mem_user who,
+                                const size_t len)
+{
+    if (mem && len > 0) {
+        size_t total, peak;
+
+        __atomic_add_fetch(&mem->used[who], len, __ATOMIC_RELAXED);
+        total = __atomic_add_fetch(&mem->total, len, __ATOMIC_RELAXED);
+
+        peak = __atomic_load_n(&mem->peak, __ATOMIC_RELAXED);
+        while (total > peak &&
+               !__atomic_compare_exchange_n(&mem->peak, &peak, total, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+static void __partfs_mem_uncharge(struct partfs_mem * const mem,
+                                  const enum partfs_mem_user who,
+                                  const size_t len)
+{
+    if (mem && len > 0) {
+        __atomic_sub_fetch(&mem->used[who], len, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&mem->total, len, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * allocate memory on behalf of a user, like malloc(3)
+ */
+static void * __partfs_mem_alloc(struct partfs_mem * const mem,
+                                 const enum partfs_mem_user who,
+                                 const size_t len)
+{
+    void * const p = malloc(len);
+
+    if (p) {
+        __partfs_mem_charge(mem, who, len);
+    }
+
+    return p;
+}
+
+/*
+ * free memory allocated by __partfs_mem_alloc() of the given length
+ */
+static void __partfs_mem_free(struct partfs_mem * const mem,
+                              const enum partfs_mem_user who,
+                              void * const p, const size_t len)
+{
+    if (p) {
+        __partfs_mem_uncharge(mem, who, len);
+        free(p);
+    }
+}
+
+/*
+ * whether more memory is in use than may be, in which case the
+ * caches give up blocks and nothing more is read ahead
+ */
+static int __partfs_mem_over(const struct partfs_mem * const mem)
+{
+    return mem &&
+        __atomic_load_n(&mem->total, __ATOMIC_RELAXED) >
+        __atomic_load_n(&mem->target, __ATOMIC_RELAXED);
+}
+
+/*
+ * read from a block device opened for direct i/o. the request is
+ * widened to whole logical blocks and goes through a suitably
+ * aligned buffer unless the caller's is already suitable. no more
+ * than the device accepts in a single request is read.
+ *
+ * pos is relative to the start of the device file. returns the
+ * number of bytes read or -1 with errno set, like pread(2).
+ */
+static ssize_t __partfs_pread_direct(const struct partfs_file * const pfi,
+                                     void * const buf, const size_t len,
+                                     const off_t pos)
+{
+    const struct partfs_blkdev * const blk = pfi->blk;
+    const off_t lo = pos - pos % (off_t)blk->lbs;
+    const off_t hi = MIN(roundup(pos + (off_t)len, (off_t)blk->lbs),
+                         lo + (off_t)blk->maxio);
+    ssize_t n;
+
+    if (lo == pos && (off_t)(pos + len) == hi &&
+        (uintptr_t)buf % blk->lbs == 0) {
+        n = pread(pfi->desc, buf, len, pos);
+    } else {
+        void * tmp;
+
+        n = -1;
+        errno = posix_memalign(&tmp, sysconf(_SC_PAGESIZE), hi - lo);
+        if (errno == 0) {
+            __partfs_mem_charge(pfi->mem, PARTFS_MEM_BUFFER, hi - lo);
+
+            n = pread(pfi->desc, tmp, hi - lo, lo);
+            if (n > 0) {
+                n = MAX(0, MIN(n - (pos - lo), (ssize_t)len));
+                memcpy(buf, (char *)tmp + (pos - lo), n);
+            }
+
+            __partfs_mem_uncharge(pfi->mem, PARTFS_MEM_BUFFER, hi - lo);
+            free(tmp);
+        }
+    }
+
+    return n;
+}
+
+/*
+ * write to a block device opened for direct i/o. the parts of the
+ * first and last logical blocks not covered by the request are
+ * read in first and written back along with it.
+ *
+ * pos is relative to the start of the device file. returns the
+ * number of bytes written or -1 with errno set, like pwrite(2).
+ */
+static ssize_t __partfs_pwrite_direct(const struct partfs_file * const pfi,
+                                      const void * const buf,
+                                      const size_t len, const off_t pos)
+{
+    struct partfs_blkdev * const blk = pfi->blk;
+    const off_t lo = pos - pos % (off_t)blk->lbs;
+    const off_t hi = MIN(roundup(pos + (off_t)len, (off_t)blk->lbs),
+                         lo + (off_t)blk->maxio);
+    ssize_t n;
+
+    if (lo == pos && (off_t)(pos + len) == hi &&
+        (uintptr_t)buf % blk->lbs == 0) {
+        n = pwrite(pfi->desc, buf, len, pos);
+    } else {
+        const size_t cnt = MIN((off_t)len, hi - pos);
+        const int partial = (lo != pos) || ((off_t)(pos + cnt) != hi);
+        void * tmp;
+
+        n = -1;
+        errno = posix_memalign(&tmp, sysconf(_SC_PAGESIZE), hi - lo);
+        if (errno == 0) {
+            __partfs_mem_charge(pfi->mem, PARTFS_MEM_BUFFER, hi - lo);
+
+            if (partial) {
+                pthread_mutex_lock(&blk->lock);
+            }
+
+            /* fetch the first and last blocks if not overwritten */
+            n = 0;
+            if (lo != pos) {
+                n = pread(pfi->desc, tmp, blk->lbs, lo);
+            }
+            if (n >= 0 && (off_t)(pos + cnt) != hi) {
+                n = pread(pfi->desc,
+                          (char *)tmp + (hi - lo - blk->lbs),
+                          blk->lbs, hi - blk->lbs);
+            }
+
+            if (n >= 0) {
+                memcpy((char *)tmp + (pos - lo), buf, cnt);
+
+                n = pwrite(pfi->desc, tmp, hi - lo, lo);
+                if (n >= 0) {
+                    n = MAX(0, MIN(n - (pos - lo), (ssize_t)cnt));
+                }
+            }
+
+            if (partial) {
+                pthread_mutex_unlock(&blk->lock);
+            }
+
+            __partfs_mem_uncharge(pfi->mem, PARTFS_MEM_BUFFER, hi - lo);
+            free(tmp);
+        }
+    }
+
+    if (n == 0 && len > 0) {
+        /* nothing could be written; keep callers from looping */
+        errno = EIO;
+        n = -1;
+    }
+
+    return n;
+}
+
+/*
+ * the next number from the generator of the injection rules
+ * (splitmix64), so that the same seed and the same sequence
+ * of requests inject the same faults
+ *
+ * must be called with the lock of the rules held
+ */
+static uint64_t __partfs_inject_rand(struct partfs_inject * const inj)
+{
+    uint64_t z = (inj->state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* a random number in [0, 1) */
+static double __partfs_inject_unit(const uint64_t r)
+{
+    return (r >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * parse a probability, which must be between 0 and 1
+ *
+ * returns 0 on success or -EINVAL if the text isn't one
+ */
+static int __partfs_inject_prob(const char * const s, char ** const end,
+                                double * const p)
+{
+    *p = strtod(s, end);
+    return (*end != s && *p >= 0 && *p <= 1) ? 0 : -EINVAL;
+}
+
+/*
+ * delay a read (write == 0) or write of the device, or make it
+ * fail or transfer less, according to the injection rules. pos
+ * is the offset within the device file.
+ *
+ * returns the number of bytes to transfer, or -1 with errno set
+ * if the transfer is to fail
+ */
+static ssize_t __partfs_inject(const struct partfs_file * const pfi,
+                               const int write, const off_t pos,
+                               const size_t len)
+{
+    struct partfs_inject * const inj = pfi->inject;
+    ssize_t n;
+
+    n = len;
+    if (inj &&
+        (inj->ops & (write ? PARTFS_INJECT_WRITE : PARTFS_INJECT_READ))) {
+        uint64_t r[5];
+        uint64_t us;
+        size_t i;
+
+        /* every request draws the same amount of random numbers */
+        pthread_mutex_lock(&inj->lock);
+        for (i = 0; i < sizeof(r) / sizeof(*r); i++) {
+            r[i] = __partfs_inject_rand(inj);
+        }
+        pthread_mutex_unlock(&inj->lock);
+
+        /* the width of a range of every delay wraps around to 0 */
+        us = inj->dmax - inj->dmin + 1;
+        us = inj->dmin + (us ? r[0] % us : r[0]);
+        if (__partfs_inject_unit(r[1]) < inj->ptail) {
+            us += inj->tail;
+        }
+        if (inj->period > 0) {
+            struct timespec now;
+            uint64_t ms;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ms = (now.tv_sec - inj->t0.tv_sec) * 1000 +
+                (now.tv_nsec - inj->t0.tv_nsec) / 1000000;
+
+            /* requests made during a stall wait for its end */
+            if (ms % inj->period < inj->stall) {
+                us += (inj->stall - ms % inj->period) * 1000;
+            }
+        }
+        if (us > 0) {
+            struct timespec ts;
+
+            ts.tv_sec  = us / 1000000;
+            ts.tv_nsec = (us % 1000000) * 1000;
+            while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+                ;
+        }
+
+        i = __partfs_extents_find(&inj->bad, pos);
+        if (__partfs_inject_unit(r[2]) < inj->peio ||
+            (i < inj->bad.n && inj->bad.v[i].off < pos + (off_t)len)) {
+            errno = EIO;
+            n     = -1;
+        } else if (len > 1 && __partfs_inject_unit(r[3]) < inj->pshort) {
+            n = 1 + r[4] % (len - 1);
+        }
+    }
+
+    return n;
+}
+
+/*
+ * set up the injection of faults and delays into the i/o on the
+ * device according to a specification: rules separated by colons
+ *
+ *   delay=US[-US]  delay each request by a random time in the range
+ *   tail=P/US      delay a request by a further US with probability P
+ *   stall=MS/MS    stall all requests for the first MS of every MS
+ *   eio=P          fail a request with EIO with probability P
+ *   bad=OFF+LEN    fail requests touching bytes OFF to OFF+LEN-1
+ *   short=P        transfer only part of a request with probability P
+ *   ops=r|w|rw     affect only reads or writes, or both (default)
+ *   seed=N         seed of the random number generator
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_inject_open(struct partfs_device * const pdev,
+                                const char * const spec)
+{
+    struct partfs_inject * const inj = calloc(1, sizeof(*inj));
+    char * const s = strdup(spec);
+    int err;
+
+    err = -ENOMEM;
+    if (inj && s) {
+        char * save, * tok;
+
+        __partfs_extents_init(&inj->bad);
+        inj->ops = PARTFS_INJECT_READ | PARTFS_INJECT_WRITE;
+
+        err = 0;
+        for (tok = strtok_r(s, ":", &save);
+             !err && tok;
+             tok = strtok_r(NULL, ":", &save)) {
+            char * v = strchr(tok, '=');
+            char * e;
+
+            err = -EINVAL;
+            if (v) {
+                *v++ = '\0';
+                e = v;
+
+                if (strcmp(tok, "delay") == 0) {
+                    inj->dmin = strtoull(v, &e, 10);
+                    inj->dmax = (*e == '-') ?
+                        strtoull(e + 1, &e, 10) : inj->dmin;
+                    err = (inj->dmax >= inj->dmin) ? 0 : -EINVAL;
+                } else if (strcmp(tok, "tail") == 0) {
+                    err = __partfs_inject_prob(v, &e, &inj->ptail);
+                    if (!err) {
+                        err = (*e == '/') ? 0 : -EINVAL;
+                    }
+                    if (!err) {
+                        inj->tail = strtoull(e + 1, &e, 10);
+                    }
+                } else if (strcmp(tok, "stall") == 0) {
+                    inj->stall = strtoull(v, &e, 10);
+                    if (*e == '/') {
+                        inj->period = strtoull(e + 1, &e, 10);
+                        err = (inj->period > inj->stall) ? 0 : -EINVAL;
+                    }
+                } else if (strcmp(tok, "eio") == 0) {
+                    err = __partfs_inject_prob(v, &e, &inj->peio);
+                } else if (strcmp(tok, "short") == 0) {
+                    err = __partfs_inject_prob(v, &e, &inj->pshort);
+                } else if (strcmp(tok, "bad") == 0) {
+                    const off_t off = strtoll(v, &e, 0);
+
+                    if (*e == '+' && off >= 0) {
+                        const off_t len = strtoll(e + 1, &e, 0);
+
+                        err = (len > 0) ?
+                            __partfs_extents_insert(&inj->bad, off, len) :
+                            -EINVAL;
+                    }
+                } else if (strcmp(tok, "ops") == 0) {
+                    inj->ops = 0;
+                    for (; *e == 'r' || *e == 'w'; e++) {
+                        inj->ops |= (*e == 'r') ?
+                            PARTFS_INJECT_READ : PARTFS_INJECT_WRITE;
+                    }
+                    err = 0;
+                } else if (strcmp(tok, "seed") == 0) {
+                    inj->state = strtoull(v, &e, 0);
+                    err = 0;
+                }
+
+                if (!err && *e) {
+                    err = -EINVAL;
+                }
+            }
+        }
+
+        if (!err) {
+            clock_gettime(CLOCK_MONOTONIC, &inj->t0);
+            pthread_mutex_init(&inj->lock, NULL);
+            pdev->inject = inj;
+        } else {
+            __partfs_extents_free(&inj->bad);
+        }
+    }
+
+    if (err) {
+        free(inj);
+    }
+    free(s);
+
+    return err;
+}
+
+static void __partfs_inject_close(struct partfs_device * const pdev)
+{
+    struct partfs_inject * const inj = pdev->inject;
+
+    if (inj) {
+        __partfs_extents_free(&inj->bad);
+        pthread_mutex_destroy(&inj->lock);
+        free(inj);
+
+        pdev->inject = NULL;
+    }
+}
+
+/*
+ * read from the device file at an absolute offset, like pread(2),
+ * from whichever kind of device it is
+ */
+static ssize_t __partfs_pread_dev(const struct partfs_file * const pfi,
+                                  void * const buf, const size_t len,
+                                  const off_t pos)
+{
+    ssize_t n;
+
+    n = __partfs_inject(pfi, 0, pos, len);
+    if (n < 0) {
+        /* failed by an injected fault */
+    } else if (pfi->nbd) {
+        n = __partfs_nbd_pread(pfi, buf, n, pos);
+    } else if (pfi->vmdk) {
+        n = __partfs_vmdk_pread(pfi, buf, n, pos);
+    } else if (pfi->blk) {
+        n = __partfs_pread_direct(pfi, buf, n, pos);
+    } else {
+        n = pread(pfi->desc, buf, n, pos);
+    }
+
+    return n;
+}
+
+/*
+ * write to the device file at an absolute offset, like pwrite(2),
+ * to whichever kind of device it is
+ */
+static ssize_t __partfs_pwrite_dev(const struct partfs_file * const pfi,
+                                   const void * const buf, const size_t len,
+                                   const off_t pos)
+{
+    ssize_t n;
+
+    n = __partfs_inject(pfi, 1, pos, len);
+    if (n < 0) {
+        /* failed by an injected fault */
+    } else if (pfi->nbd) {
+        n = __partfs_nbd_pwrite(pfi, buf, n, pos);
+    } else if (pfi->vmdk) {
+        n = __partfs_vmdk_pwrite(pfi, buf, n, pos);
+    } else if (pfi->blk) {
+        n = __partfs_pwrite_direct(pfi, buf, n, pos);
+    } else {
+        n = pwrite(pfi->desc, buf, n, pos);
+    }
+
+    return n;
+}
+
+/*
+ * make sure data written to the device file has reached its storage
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_sync_dev(const struct partfs_file * const pfi,
+                             const int datasync)
+{
+    int err;
+
+    if (pfi->nbd) {
+        err = __partfs_nbd_flush(pfi);
+    } else if (pfi->vmdk) {
+        err = __partfs_vmdk_flush(pfi, datasync);
+    } else {
+        err = (datasync ? fdatasync(pfi->desc) : fsync(pfi->desc)) ?
+            -errno : 0;
+    }
+
+    return err;
+}
+
+static size_t __partfs_cache_hash(const size_t nhash, const uint64_t blk)
+{
+    return ((blk * 0x9e3779b97f4a7c15ULL) >> 32) & (nhash - 1);
+}
+
+/*
+ * find a block in the cache
+ *
+ * must be called with the cache lock held
+ */
+static struct partfs_cblock * __partfs_cache_find(
+    const struct partfs_cache * const cache, const uint64_t blk)
+{
+    struct partfs_cblock * b;
+
+    for (b = cache->hash[__partfs_cache_hash(cache->nhash, blk)];
+         b && b->blk != blk;
+         b = b->hnext)
+        ;
+
+    return b;
+}
+
+/*
+ * make a block the most recently used one
+ *
+ * must be called with the cache lock held
+ */
+static void __partfs_cache_touch(struct partfs_cache * const cache,
+                                 struct partfs_cblock * const b)
+{
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+
+    b->prev = &cache->lru;
+    b->next = cache->lru.next;
+    cache->lru.next->prev = b;
+    cache->lru.next = b;
+}
+
+/*
+ * remove a block from the cache and free it
+ *
+ * must be called with the cache lock held
+ */
+static void __partfs_cache_evict(struct partfs_cache * const cache,
+                                 struct partfs_cblock * const b)
+{
+    struct partfs_cblock ** p;
+
+    for (p = &cache->hash[__partfs_cache_hash(cache->nhash, b->blk)];
+         *p != b;
+         p = &(*p)->hnext)
+        ;
+    *p = b->hnext;
+
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+
+    __partfs_mem_free(cache->mem, PARTFS_MEM_CACHE, b->data,
+                      PARTFS_CACHE_BLOCK);
+    free(b);
+    cache->n--;
+}
+
+/*
+ * find a block in the compressed tier of the cache
+ *
+ * must be called with the cache lock held
+ */
+static struct partfs_cblock * __partfs_cache_zfind(
+    const struct partfs_cache * const cache, const uint64_t blk)
+{
+    struct partfs_cblock * b;
+
+    for (b = cache->nzhash ?
+             cache->zhash[__partfs_cache_hash(cache->nzhash, blk)] : NULL;
+         b && b->blk != blk;
+         b = b->hnext)
+        ;
+
+    return b;
+}
+
+/*
+ * remove a block from the compressed tier of the cache and free it
+ *
+ * must be called with the cache lock held
+ */
+static void __partfs_cache_zevict(struct partfs_cache * const cache,
+                                  struct partfs_cblock * const b)
+{
+    struct partfs_cblock ** p;
+
+    for (p = &cache->zhash[__partfs_cache_hash(cache->nzhash, b->blk)];
+         *p != b;
+         p = &(*p)->hnext)
+        ;
+    *p = b->hnext;
+
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+
+    cache->zmem -= sizeof(*b) + b->len;
+    cache->zeros -= b->len == 0;
+    cache->zn--;
+
+    __partfs_mem_free(cache->mem, PARTFS_MEM_ZCACHE, b->data, b->len);
+    __partfs_mem_free(cache->mem, PARTFS_MEM_ZCACHE, b, sizeof(*b));
+}
+
+/*
+ * keep a block being evicted from the cache in the compressed tier,
+ * evicting the least recently used blocks there to make room. blocks
+ * of zeros are kept without data, and blocks that don't compress to
+ * less than seven eighths of their size aren't kept at all, nor are
+ * any while memory is short.
+ *
+ * must be called with the cache lock held
+ */
+static void __partfs_cache_zput(struct partfs_cache * const cache,
+                                const struct partfs_cblock * const b)
+{
+    if (cache->zmax > 0 && !__partfs_mem_over(cache->mem)) {
+        const int zeros = __partfs_zeros(b->data, PARTFS_CACHE_BLOCK);
+        const int len = zeros ? 0 :
+            LZ4_compress_default(b->data, cache->zbuf, PARTFS_CACHE_BLOCK,
+                                 PARTFS_CACHE_BLOCK - PARTFS_CACHE_BLOCK / 8);
+        struct partfs_cblock * z;
+
+        z = NULL;
+        if (zeros || len > 0) {
+            z = __partfs_mem_alloc(cache->mem, PARTFS_MEM_ZCACHE, sizeof(*z));
+        }
+        if (z) {
+            z->blk  = b->blk;
+            z->len  = zeros ? 0 : len;
+            z->data = NULL;
+            if (z->len > 0) {
+                z->data = __partfs_mem_alloc(cache->mem, PARTFS_MEM_ZCACHE,
+                                             z->len);
+                if (z->data) {
+                    memcpy(z->data, cache->zbuf, z->len);
+                }
+            }
+
+            if (z->len > 0 && !z->data) {
+                __partfs_mem_free(cache->mem, PARTFS_MEM_ZCACHE,
+                                  z, sizeof(*z));
+            } else {
+                const size_t h = __partfs_cache_hash(cache->nzhash, z->blk);
+
+                while (cache->zn > 0 &&
+                       cache->zmem + sizeof(*z) + z->len > cache->zmax) {
+                    __partfs_cache_zevict(cache, cache->zlru.prev);
+                }
+
+                z->hnext = cache->zhash[h];
+                cache->zhash[h] = z;
+
+                z->prev = &cache->zlru;
+                z->next = cache->zlru.next;
+                cache->zlru.next->prev = z;
+                cache->zlru.next = z;
+
+                cache->zmem += sizeof(*z) + z->len;
+                cache->zeros += z->len == 0;
+                cache->zn++;
+            }
+        }
+    }
+}
+
+/*
+ * take a block out of the compressed tier of the cache
+ *
+ * returns the uncompressed data of the block, to be
+ * freed by the caller, or NULL if it isn't there
+ *
+ * must be called with the cache lock held
+ */
+static char * __partfs_cache_zget(struct partfs_cache * const cache,
+                                  const uint64_t blk)
+{
+    struct partfs_cblock * const z = __partfs_cache_zfind(cache, blk);
+    char * data;
+
+    data = NULL;
+    if (z) {
+        data = __partfs_mem_alloc(cache->mem, PARTFS_MEM_CACHE,
+                                  PARTFS_CACHE_BLOCK);
+        if (data && z->len == 0) {
+            memset(data, 0, PARTFS_CACHE_BLOCK);
+        } else if (data &&
+                   LZ4_decompress_safe(z->data, data, z->len,
+                                       PARTFS_CACHE_BLOCK) !=
+                   PARTFS_CACHE_BLOCK) {
+            __partfs_mem_free(cache->mem, PARTFS_MEM_CACHE, data,
+                              PARTFS_CACHE_BLOCK);
+            data = NULL;
+        }
+
+        __partfs_cache_zevict(cache, z);
+    }
+
+    return data;
+}
+
+/*
+ * evict blocks from the compressed tier of the cache, least recently
+ * used first, until memory is no longer short. they are the coldest,
+ * so they give way before any block of the cache itself.
+ *
+ * must be called with the cache lock held
+ */
+static void __partfs_cache_ztrim(struct partfs_cache * const cache)
+{
+    while (cache->zn > 0 && __partfs_mem_over(cache->mem)) {
+        __atomic_add_fetch(&cache->mem->evicted,
+                           sizeof(*cache->zlru.prev) + cache->zlru.prev->len,
+                           __ATOMIC_RELAXED);
+        __partfs_cache_zevict(cache, cache->zlru.prev);
+    }
+}
+
+/*
+ * enter a block read from the device into the cache, taking over
+ * its data, unless the block is already there or the device has
+ * been written to since the read began (gen is the generation of
+ * the cache at the time), in which case the data may be stale.
+ * the least recently used blocks are evicted to make room, into the
+ * compressed tier if there is one, and for as long as memory is
+ * short, once the compressed tier has given way. the block isn't
+ * entered if memory is short even then. it is taken out of the
+ * compressed tier if it was there.
+ *
+ * returns whether the block was entered
+ *
+ * must be called with the cache lock held
+ */
+static int __partfs_cache_insert(struct partfs_cache * const cache,
+                                 const uint64_t blk, char * const data,
+                                 const uint64_t gen)
+{
+    int ret;
+
+    ret = 0;
+    if (gen == cache->gen && !__partfs_cache_find(cache, blk)) {
+        struct partfs_cblock * const b = malloc(sizeof(*b));
+
+        if (b) {
+            const size_t h = __partfs_cache_hash(cache->nhash, blk);
+            struct partfs_cblock * const z = __partfs_cache_zfind(cache, blk);
+
+            if (z) {
+                __partfs_cache_zevict(cache, z);
+            }
+            __partfs_cache_ztrim(cache);
+            while (cache->n > 0 &&
+                   (cache->n >= cache->max ||
+                    __partfs_mem_over(cache->mem))) {
+                if (cache->n < cache->max) {
+                    /* evicted only because memory is short */
+                    __atomic_add_fetch(&cache->mem->evicted,
+                                       PARTFS_CACHE_BLOCK, __ATOMIC_RELAXED);
+                }
+                __partfs_cache_zput(cache, cache->lru.prev);
+                __partfs_cache_evict(cache, cache->lru.prev);
+            }
+
+            if (__partfs_mem_over(cache->mem)) {
+                free(b);
+            } else {
+                b->blk  = blk;
+                b->data = data;
+
+                b->hnext = cache->hash[h];
+                cache->hash[h] = b;
+
+                b->prev = &cache->lru;
+                b->next = cache->lru.next;
+                cache->lru.next->prev = b;
+                cache->lru.next = b;
+
+                cache->n++;
+                ret = 1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * evict blocks from the compressed tier of the cache and then from
+ * the cache itself, least recently used first, until memory is no
+ * longer short
+ *
+ * must be called with the cache lock held
+ */
+static void __partfs_cache_trim(struct partfs_cache * const cache)
+{
+    __partfs_cache_ztrim(cache);
+    while (cache->n > 0 && __partfs_mem_over(cache->mem)) {
+        __atomic_add_fetch(&cache->mem->evicted,
+                           PARTFS_CACHE_BLOCK, __ATOMIC_RELAXED);
+        __partfs_cache_evict(cache, cache->lru.prev);
+    }
+}
+
+/*
+ * find the slot of the cache file on local storage holding a block
+ *
+ * returns the slot or PARTFS_SSD_NONE
+ *
+ * must be called with the lock of the cache file held
+ */
+static uint32_t __partfs_ssd_find(const struct partfs_ssd * const ssd,
+                                  const uint64_t blk)
+{
+    uint32_t i;
+
+    for (i = ssd->hash[__partfs_cache_hash(ssd->nhash, blk)];
+         i != PARTFS_SSD_NONE && ssd->slot[i].blk != blk;
+         i = ssd->slot[i].hnext)
+        ;
+
+    return i;
+}
+
+/*
+ * format the index entry of a slot: the number of the block plus
+ * one (0 for an empty slot), its flags, the checksum of its data
+ * and the sectors of it not yet written back
+ */
+static void __partfs_ssd_pack(const struct partfs_sslot * const sl,
+                              unsigned char * const e)
+{
+    size_t i;
+
+    __partfs_put_le64(e, sl->used ? sl->blk + 1 : 0);
+    __partfs_put_le32(e + 8, sl->dirty ? PARTFS_SSD_DIRTY : 0);
+    __partfs_put_le32(e + 12, sl->crc);
+    for (i = 0; i < sizeof(sl->sect) / sizeof(*sl->sect); i++) {
+        __partfs_put_le64(e + 16 + 8 * i, sl->sect[i]);
+    }
+}
+
+/*
+ * write the index entry of a slot to the cache file
+ *
+ * returns 0 on success or a negative errno on failure
+ *
+ * must be called with the lock of the cache file held
+ */
+static int __partfs_ssd_entry(const struct partfs_ssd * const ssd,
+                              const uint32_t i)
+{
+    unsigned char e[PARTFS_SSD_ENTRY];
+
+    __partfs_ssd_pack(&ssd->slot[i], e);
+
+    return pwrite(ssd->fd, e, sizeof(e),
+                  PARTFS_SSD_HEADER + (off_t)i * PARTFS_SSD_ENTRY) ==
+        sizeof(e) ? 0 : -EIO;
+}
+
+/*
+ * enter the block held by a slot into the hash table
+ *
+ * must be called with the lock of the cache file held
+ */
+static void __partfs_ssd_link(struct partfs_ssd * const ssd,
+                              const uint32_t i)
+{
+    const size_t h = __partfs_cache_hash(ssd->nhash, ssd->slot[i].blk);
+
+    ssd->slot[i].hnext = ssd->hash[h];
+    ssd->hash[h] = i;
+}
+
+/*
+ * empty a slot of the cache file. a block that hasn't been
+ * written back to the device is lost.
+ *
+ * must be called with the lock of the cache file held
+ */
+static void __partfs_ssd_evict(struct partfs_ssd * const ssd,
+                               const uint32_t i)
+{
+    struct partfs_sslot * const sl = &ssd->slot[i];
+
+    if (sl->used) {
+        uint32_t * p;
+
+        for (p = &ssd->hash[__partfs_cache_hash(ssd->nhash, sl->blk)];
+             *p != i;
+             p = &ssd->slot[*p].hnext)
+            ;
+        *p = sl->hnext;
+
+        ssd->ndirty -= sl->dirty;
+        sl->used  = 0;
+        sl->dirty = 0;
+        memset(sl->sect, 0, sizeof(sl->sect));
+        __partfs_ssd_entry(ssd, i);
+    }
+}
+
+/*
+ * read the block held by a slot, checking it against its checksum
+ *
+ * returns 0 on success or a negative errno on failure
+ *
+ * must be called with the lock of the cache file held
+ */
+static int __partfs_ssd_load(const struct partfs_ssd * const ssd,
+                             const uint32_t i, char * const data)
+{
+    int err;
+
+    err = pread(ssd->fd, data, PARTFS_CACHE_BLOCK,
+                ssd->data + (off_t)i * PARTFS_CACHE_BLOCK) ==
+        PARTFS_CACHE_BLOCK ? 0 : -EIO;
+    if (!err && ssd->slot[i].crc !=
+        crc32(0, (const Bytef *)data, PARTFS_CACHE_BLOCK)) {
+        err = -EIO;
+    }
+
+    return err;
+}
+
+/*
+ * write the sectors of the block held by a slot that were written to
+ * back to the device, in runs of consecutive sectors. the part of
+ * the last block beyond the end of the device is left out.
+ *
+ * returns 0 on success or a negative errno on failure
+ *
+ * must be called with the lock of the cache file held
+ */
+static int __partfs_ssd_writeback(struct partfs_ssd * const ssd,
+                                  const uint32_t i)
+{
+    struct partfs_sslot * const sl = &ssd->slot[i];
+    char * const data = __partfs_mem_alloc(
+        ssd->pfi.mem, PARTFS_MEM_BUFFER, PARTFS_CACHE_BLOCK);
+    int err;
+
+    err = data ? __partfs_ssd_load(ssd, i, data) : -ENOMEM;
+    if (!err) {
+        const off_t pos = sl->blk * PARTFS_CACHE_BLOCK;
+        const size_t len = (pos < ssd->size) ?
+            MIN(PARTFS_CACHE_BLOCK, ssd->size - pos) : 0;
+        size_t s, e;
+
+        for (s = 0; !err && s < PARTFS_SSD_SECTORS; s = e) {
+            for (e = s;
+                 e < PARTFS_SSD_SECTORS &&
+                     ((sl->sect[s / 64] >> (s % 64)) & 1) ==
+                     ((sl->sect[e / 64] >> (e % 64)) & 1);
+                 e++)
+                ;
+
+            if ((sl->sect[s / 64] >> (s % 64)) & 1) {
+                const size_t end = MIN(e * PARTFS_SSD_SECTOR, len);
+                size_t done;
+
+                for (done = s * PARTFS_SSD_SECTOR; !err && done < end; ) {
+                    const ssize_t n = __partfs_pwrite_dev(
+                        &ssd->pfi, data + done, end - done, pos + done);
+
+                    if (n < 0) {
+                        err = -errno;
+                    } else {
+                        done += n;
+                    }
+                }
+            }
+        }
+    }
+
+    if (!err) {
+        sl->dirty = 0;
+        memset(sl->sect, 0, sizeof(sl->sect));
+        ssd->ndirty--;
+        ssd->writebacks++;
+        err = __partfs_ssd_entry(ssd, i);
+    }
+
+    __partfs_mem_free(ssd->pfi.mem, PARTFS_MEM_BUFFER,
+                      data, PARTFS_CACHE_BLOCK);
+
+    return err;
+}
+
+/*
+ * write the blocks from first to last that haven't
+ * been written back yet to the device
+ *
+ * returns 0 on success or a negative errno on failure
+ *
+ * must be called with the lock of the cache file held
+ */
+static int __partfs_ssd_flush(struct partfs_ssd * const ssd,
+                              const uint64_t first, const uint64_t last)
+{
+    uint32_t i;
+    int err;
+
+    err = 0;
+    for (i = 0; ssd->ndirty > 0 && i < ssd->nslot; i++) {
+        if (ssd->slot[i].used && ssd->slot[i].dirty &&
+            ssd->slot[i].blk >= first && ssd->slot[i].blk <= last) {
+            const int e = __partfs_ssd_writeback(ssd, i);
+
+            err = err ? err : e;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * store a block in the cache file, in the slot that already holds it
+ * or else in one chosen by the clock hand. a block in the chosen slot
+ * that hasn't been written back is written back first. the bytes of
+ * the block from lo to hi are to be written back; none are if they
+ * are the same.
+ *
+ * returns 0 on success or a negative errno on failure
+ *
+ * must be called with the lock of the cache file held
+ */
+static int __partfs_ssd_store(struct partfs_ssd * const ssd,
+                              const char * const data, const uint64_t blk,
+                              const size_t lo, const size_t hi)
+{
+    const int dirty = hi > lo;
+    uint32_t i, n;
+    int err;
+
+    i = __partfs_ssd_find(ssd, blk);
+    for (n = 0; i == PARTFS_SSD_NONE && n < 2 * ssd->nslot; n++) {
+        struct partfs_sslot * const sl = &ssd->slot[ssd->hand];
+
+        if (sl->used && sl->ref) {
+            sl->ref = 0;
+        } else if (!sl->used || !sl->dirty ||
+                   __partfs_ssd_writeback(ssd, ssd->hand) == 0) {
+            i = ssd->hand;
+            __partfs_ssd_evict(ssd, i);
+        }
+
+        ssd->hand = (ssd->hand + 1) % ssd->nslot;
+    }
+
+    err = -ENOSPC;
+    if (i != PARTFS_SSD_NONE) {
+        struct partfs_sslot * const sl = &ssd->slot[i];
+
+        err = pwrite(ssd->fd, data, PARTFS_CACHE_BLOCK,
+                     ssd->data + (off_t)i * PARTFS_CACHE_BLOCK) ==
+            PARTFS_CACHE_BLOCK ? 0 : -EIO;
+
+        if (!sl->used) {
+            sl->used = 1;
+            sl->blk  = blk;
+            __partfs_ssd_link(ssd, i);
+        }
+        if (!err) {
+            size_t s;
+
+            for (s = lo / PARTFS_SSD_SECTOR;
+                 dirty && s < (hi + PARTFS_SSD_SECTOR - 1) / PARTFS_SSD_SECTOR;
+                 s++) {
+                sl->sect[s / 64] |= (uint64_t)1 << (s % 64);
+            }
+
+            sl->crc = crc32(0, (const Bytef *)data, PARTFS_CACHE_BLOCK);
+            ssd->ndirty += dirty && !sl->dirty;
+            sl->dirty = sl->dirty || dirty;
+            sl->ref   = 1;
+            err = __partfs_ssd_entry(ssd, i);
+        }
+
+        if (err) {
+            /* what the slot holds is unknown */
+            __partfs_ssd_evict(ssd, i);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * read a block from the cache file
+ *
+ * returns 0 on success or -ENOENT if the block isn't there
+ */
+static int __partfs_ssd_read(struct partfs_ssd * const ssd,
+                             char * const data, const uint64_t blk)
+{
+    uint32_t i;
+    int err;
+
+    pthread_mutex_lock(&ssd->lock);
+    i = __partfs_ssd_find(ssd, blk);
+    err = -ENOENT;
+    if (i != PARTFS_SSD_NONE) {
+        err = __partfs_ssd_load(ssd, i, data);
+        if (err && !ssd->slot[i].dirty) {
+            /* the slot is damaged; the device still has the block */
+            __partfs_ssd_evict(ssd, i);
+            err = -ENOENT;
+        } else if (!err) {
+            ssd->slot[i].ref = 1;
+        }
+    }
+    if (err == -ENOENT) {
+        ssd->misses++;
+    } else {
+        ssd->hits++;
+    }
+    pthread_mutex_unlock(&ssd->lock);
+
+    return err;
+}
+
+/*
+ * whether the cache file holds a block
+ */
+static int __partfs_ssd_has(struct partfs_ssd * const ssd,
+                            const uint64_t blk)
+{
+    int ret;
+
+    pthread_mutex_lock(&ssd->lock);
+    ret = __partfs_ssd_find(ssd, blk) != PARTFS_SSD_NONE;
+    pthread_mutex_unlock(&ssd->lock);
+
+    return ret;
+}
+
+/*
+ * offer a block read from the device to the cache file. it is
+ * stored if it was read recently too, unless the device has been
+ * written to since the read began (gen is the generation of the
+ * cache file at the time).
+ */
+static void __partfs_ssd_admit(struct partfs_ssd * const ssd,
+                               const char * const data, const uint64_t blk,
+                               const uint64_t gen)
+{
+    uint64_t * const seen =
+        &ssd->seen[__partfs_cache_hash(ssd->nseen, blk)];
+
+    pthread_mutex_lock(&ssd->lock);
+    if (gen == ssd->gen && __partfs_ssd_find(ssd, blk) == PARTFS_SSD_NONE) {
+        if (*seen == blk + 1) {
+            if (__partfs_ssd_store(ssd, data, blk, 0, 0) == 0) {
+                ssd->admits++;
+            }
+            *seen = 0;
+        } else {
+            *seen = blk + 1;
+        }
+    }
+    pthread_mutex_unlock(&ssd->lock);
+}
+
+/*
+ * the generation of the cache file, to be passed to
+ * __partfs_ssd_admit() for blocks read from the device afterward
+ */
+static uint64_t __partfs_ssd_gen(struct partfs_ssd * const ssd)
+{
+    uint64_t gen;
+
+    pthread_mutex_lock(&ssd->lock);
+    gen = ssd->gen;
+    pthread_mutex_unlock(&ssd->lock);
+
+    return gen;
+}
+
+/*
+ * bring the blocks in the cache file covering a region of the device
+ * up to date after it was written to, or, if writes are written back
+ * later, write the region to the cache file in place of the device.
+ * parts of blocks not written are read from the cache file if it has
+ * them or else from the device.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_ssd_pwrite(struct partfs_ssd * const ssd,
+                               const void * const buf, const size_t len,
+                               const off_t pos)
+{
+    char * const data = __partfs_mem_alloc(
+        ssd->pfi.mem, PARTFS_MEM_BUFFER, PARTFS_CACHE_BLOCK);
+    int err;
+
+    err = data ? 0 : -ENOMEM;
+    if (!err && len > 0) {
+        const uint64_t last = (pos + len - 1) / PARTFS_CACHE_BLOCK;
+        uint64_t blk;
+
+        pthread_mutex_lock(&ssd->lock);
+        ssd->gen++;
+        for (blk = pos / PARTFS_CACHE_BLOCK; !err && blk <= last; blk++) {
+            const off_t lo = MAX(pos, (off_t)(blk * PARTFS_CACHE_BLOCK));
+            const off_t hi = MIN(pos + (off_t)len,
+                                 (off_t)((blk + 1) * PARTFS_CACHE_BLOCK));
+            const uint32_t i = __partfs_ssd_find(ssd, blk);
+
+            if (i == PARTFS_SSD_NONE && !ssd->wb) {
+                /* not cached; the device has been written already */
+            } else {
+                if (hi - lo == PARTFS_CACHE_BLOCK) {
+                    /* the whole block is written */
+                } else if (i != PARTFS_SSD_NONE) {
+                    err = __partfs_ssd_load(ssd, i, data);
+                } else {
+                    size_t done;
+
+                    for (done = 0; !err && done < PARTFS_CACHE_BLOCK; ) {
+                        const ssize_t n = __partfs_pread_dev(
+                            &ssd->pfi, data + done, PARTFS_CACHE_BLOCK - done,
+                            blk * PARTFS_CACHE_BLOCK + done);
+
+                        if (n < 0) {
+                            err = -errno;
+                        } else if (n == 0) {
+                            memset(data + done, 0,
+                                   PARTFS_CACHE_BLOCK - done);
+                            done = PARTFS_CACHE_BLOCK;
+                        } else {
+                            done += n;
+                        }
+                    }
+                }
+
+                if (err && !ssd->wb) {
+                    /* the block can't be brought up to date */
+                    __partfs_ssd_evict(ssd, i);
+                    err = 0;
+                } else if (!err) {
+                    memcpy(data + (lo - blk * PARTFS_CACHE_BLOCK),
+                           (const char *)buf + (lo - pos), hi - lo);
+                    err = __partfs_ssd_store(
+                        ssd, data, blk,
+                        lo - blk * PARTFS_CACHE_BLOCK,
+                        ssd->wb ? hi - blk * PARTFS_CACHE_BLOCK :
+                        lo - blk * PARTFS_CACHE_BLOCK);
+                    if (!ssd->wb) {
+                        err = 0;
+                    }
+                }
+            }
+        }
+        pthread_mutex_unlock(&ssd->lock);
+    }
+
+    __partfs_mem_free(ssd->pfi.mem, PARTFS_MEM_BUFFER,
+                      data, PARTFS_CACHE_BLOCK);
+
+    return err;
+}
+
+/*
+ * remove the blocks covering a region of the device from the cache
+ * file after it was discarded or zeroed. blocks not yet written back
+ * are kept: the region was written back before it was discarded, so
+ * they were written since, while discarding it.
+ */
+static void __partfs_ssd_drop(struct partfs_ssd * const ssd,
+                              const off_t pos, const off_t len)
+{
+    const uint64_t first = pos / PARTFS_CACHE_BLOCK;
+    const uint64_t last = (pos + len - 1) / PARTFS_CACHE_BLOCK;
+
+    pthread_mutex_lock(&ssd->lock);
+    ssd->gen++;
+    if (last - first >= ssd->nslot) {
+        uint32_t i;
+
+        for (i = 0; i < ssd->nslot; i++) {
+            if (ssd->slot[i].used && !ssd->slot[i].dirty &&
+                ssd->slot[i].blk >= first && ssd->slot[i].blk <= last) {
+                __partfs_ssd_evict(ssd, i);
+            }
+        }
+    } else {
+        uint64_t blk;
+
+        for (blk = first; blk <= last; blk++) {
+            const uint32_t i = __partfs_ssd_find(ssd, blk);
+
+            if (i != PARTFS_SSD_NONE && !ssd->slot[i].dirty) {
+                __partfs_ssd_evict(ssd, i);
+            }
+        }
+    }
+    pthread_mutex_unlock(&ssd->lock);
+}
+
+/*
+ * find the regions of a partition that contain data, that is the
+ * regions that are not holes in the device file. the offsets of
+ * the resulting extents are relative to the start of the partition.
+ *
+ * if the device file doesn't support finding holes, the whole
+ * partition is treated as data. so is a partition of an nbd
+ * export, whose device file only holds the partition table. the
+ * holes of a vmdk extent are the grains that aren't stored in it.
+ * blocks of the partition in the cache file on local storage that
+ * haven't been written back are written back first, so that they
+ * aren't taken for holes.
+ */
+static int __partfs_map_data(const struct partfs_file * const pfi,
+                             struct partfs_extents * const ex)
+{
+    struct partfs_ssd * const ssd = pfi->cache ? pfi->cache->ssd : NULL;
+    const off_t end = pfi->start + pfi->size;
+    off_t off;
+    int err;
+
+    err = 0;
+    if (ssd && pfi->size > 0) {
+        pthread_mutex_lock(&ssd->lock);
+        err = __partfs_ssd_flush(ssd, pfi->start / PARTFS_CACHE_BLOCK,
+                                 (end - 1) / PARTFS_CACHE_BLOCK);
+        pthread_mutex_unlock(&ssd->lock);
+    }
+
+    for (off = pfi->start; !err && off < end; ) {
+        off_t data, hole;
+
+        if (pfi->vmdk) {
+            data = __partfs_vmdk_lseek(pfi->vmdk, off, SEEK_DATA);
+        } else if (pfi->nbd) {
+            data  = -1;
+            errno = EOPNOTSUPP;
+        } else {
+            data = lseek(pfi->desc, off, SEEK_DATA);
+        }
+        if (data < 0) {
+            /* ENXIO means there is no more data in the file */
+            data = (errno == ENXIO) ? end : off;
+            hole = end;
+        } else {
+            hole = pfi->vmdk ?
+                __partfs_vmdk_lseek(pfi->vmdk, data, SEEK_HOLE) :
+                lseek(pfi->desc, data, SEEK_HOLE);
+            if (hole < 0) {
+                hole = end;
+            }
+        }
+
+        data = MIN(data, end);
+        hole = MIN(hole, end);
+
+        if (hole > data) {
+            err = __partfs_extents_append(
+                ex, data - pfi->start, hole - data);
+            off = hole;
+        } else {
+            off = end;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * the first slot of the set in which a block is held, if anywhere
+ */
+static struct partfs_shm_slot * __partfs_shm_set(
+    const struct partfs_shm * const shm, const uint64_t blk)
+{
+    return &shm->slot[__partfs_cache_hash(shm->nset, blk) *
+                      PARTFS_SHM_WAYS];
+}
+
+/*
+ * read a block from the shared memory segment
+ *
+ * returns 0 on success or -ENOENT if the block isn't there
+ */
+static int __partfs_shm_read(const struct partfs_shm * const shm,
+                             char * const data, const uint64_t blk)
+{
+    struct partfs_shm_slot * const set = __partfs_shm_set(shm, blk);
+    size_t i;
+    int err;
+
+    err = -ENOENT;
+    for (i = 0; err && i < PARTFS_SHM_WAYS; i++) {
+        struct partfs_shm_slot * const sl = &set[i];
+        const uint32_t seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+
+        if (!(seq & 1) &&
+            __atomic_load_n(&sl->blk, __ATOMIC_RELAXED) == blk + 1) {
+            memcpy(data, shm->data + (sl - shm->slot) * PARTFS_CACHE_BLOCK,
+                   PARTFS_CACHE_BLOCK);
+
+            /* the copy only counts if the slot didn't change meanwhile */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&sl->seq, __ATOMIC_RELAXED) == seq) {
+                __atomic_store_n(&sl->ref, 1, __ATOMIC_RELAXED);
+                err = 0;
+            }
+        }
+    }
+
+    __atomic_fetch_add(err ? &shm->hdr->misses : &shm->hdr->hits, 1,
+                       __ATOMIC_RELAXED);
+
+    return err;
+}
+
+/*
+ * whether the shared memory segment holds a block
+ */
+static int __partfs_shm_has(const struct partfs_shm * const shm,
+                            const uint64_t blk)
+{
+    const struct partfs_shm_slot * const set = __partfs_shm_set(shm, blk);
+    size_t i;
+    int ret;
+
+    for (i = 0, ret = 0; !ret && i < PARTFS_SHM_WAYS; i++) {
+        ret = __atomic_load_n(&set[i].blk, __ATOMIC_RELAXED) == blk + 1;
+    }
+
+    return ret;
+}
+
+/*
+ * store a block read from the device in the shared memory segment,
+ * in an empty slot of its set or else one whose block wasn't read
+ * since replacement last passed by. the block is left out if another
+ * mount is filling the chosen slot at the same time.
+ */
+static void __partfs_shm_store(const struct partfs_shm * const shm,
+                               const char * const data, const uint64_t blk)
+{
+    struct partfs_shm_slot * const set = __partfs_shm_set(shm, blk);
+    struct partfs_shm_slot * sl;
+    size_t i;
+
+    sl = NULL;
+    for (i = 0; i < 3 * PARTFS_SHM_WAYS; i++) {
+        struct partfs_shm_slot * const s = &set[i % PARTFS_SHM_WAYS];
+        const uint64_t b = __atomic_load_n(&s->blk, __ATOMIC_RELAXED);
+
+        if (b == blk + 1) {
+            /* another mount stored it already */
+            sl = NULL;
+            break;
+        } else if (!sl && (b == 0 ||
+                           (i >= PARTFS_SHM_WAYS &&
+                            !__atomic_exchange_n(&s->ref, 0,
+                                                 __ATOMIC_RELAXED)))) {
+            sl = s;
+        }
+    }
+
+    if (sl) {
+        uint32_t seq = __atomic_load_n(&sl->seq, __ATOMIC_RELAXED);
+
+        if (!(seq & 1) &&
+            __atomic_compare_exchange_n(&sl->seq, &seq, seq + 1, 0,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            __atomic_store_n(&sl->blk, blk + 1, __ATOMIC_RELAXED);
+            memcpy(shm->data + (sl - shm->slot) * PARTFS_CACHE_BLOCK, data,
+                   PARTFS_CACHE_BLOCK);
+            __atomic_store_n(&sl->ref, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&sl->seq, seq + 2, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/*
+ * read whole blocks from the device, starting at blk, zero
+ * filling whatever lies beyond the end of the device file
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_cache_read(const struct partfs_file * const pfi,
+                               char * const data, const uint64_t blk,
+                               const size_t nblk)
+{
+    const size_t len = nblk * PARTFS_CACHE_BLOCK;
+    size_t done;
+    int err;
+
+    err = 0;
+    for (done = 0; !err && done < len; ) {
+        const ssize_t n = __partfs_pread_dev(
+            pfi, data + done, len - done, blk * PARTFS_CACHE_BLOCK + done);
+
+        if (n < 0) {
+            err = -errno;
+        } else if (n == 0) {
+            memset(data + done, 0, len - done);
+            done = len;
+        } else {
+            done += n;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * read whole blocks of the device, starting at blk, for the cache.
+ * blocks held in the shared memory segment or the cache file on
+ * local storage are read from there. the blocks read from the device
+ * are stored in the segment and offered to the cache file.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_cache_fill(const struct partfs_file * const pfi,
+                               char * const data, const uint64_t blk,
+                               const size_t nblk)
+{
+    struct partfs_ssd * const ssd = pfi->cache->ssd;
+    struct partfs_shm * const shm = pfi->cache->shm;
+    size_t i, run;
+    int err;
+
+    err = 0;
+    for (i = 0; !err && i < nblk; i += run) {
+        char * const buf = data + i * PARTFS_CACHE_BLOCK;
+        int found;
+
+        found = shm ? __partfs_shm_read(shm, buf, blk + i) : -ENOENT;
+        if (found == -ENOENT && ssd) {
+            found = __partfs_ssd_read(ssd, buf, blk + i);
+            if (found == 0 && shm) {
+                __partfs_shm_store(shm, buf, blk + i);
+            }
+        }
+
+        run = 1;
+        if (found == 0) {
+            /* read from the segment or the cache file */
+        } else if (found != -ENOENT) {
+            err = found;
+        } else {
+            const uint64_t gen = ssd ? __partfs_ssd_gen(ssd) : 0;
+            size_t j;
+
+            /* read up to the next block held by either */
+            while (i + run < nblk &&
+                   !(shm && __partfs_shm_has(shm, blk + i + run)) &&
+                   !(ssd && __partfs_ssd_has(ssd, blk + i + run))) {
+                run++;
+            }
+
+            err = __partfs_cache_read(pfi, buf, blk + i, run);
+            for (j = 0; !err && j < run; j++) {
+                if (shm) {
+                    __partfs_shm_store(shm, buf + j * PARTFS_CACHE_BLOCK,
+                                       blk + i + j);
+                }
+                if (ssd) {
+                    __partfs_ssd_admit(ssd, buf + j * PARTFS_CACHE_BLOCK,
+                                       blk + i + j, gen);
+                }
+            }
+        }
+    }
+
+    return err;
+}
+
+/*
+ * note that a block of a partition was read. the first read of
+ * each block is appended to the order being recorded. if it is
+ * in the order recorded by an earlier mount, reading ahead along
+ * that order is extended past it.
+ *
+ * must be called with the cache lock held
+ */
+static void __partfs_trace_touch(struct partfs_cache * const cache,
+                                 const struct partfs_file * const pfi,
+                                 const uint64_t blk)
+{
+    struct partfs_trace * const tr = &pfi->part->trace;
+
+    if (!tr->seen && tr->n < PARTFS_TRACE_MAX) {
+        tr->first = pfi->start / PARTFS_CACHE_BLOCK;
+        tr->nblk  = (pfi->start + pfi->size + PARTFS_CACHE_BLOCK - 1) /
+            PARTFS_CACHE_BLOCK - tr->first;
+        tr->seen  = calloc((tr->nblk + 7) / 8, 1);
+    }
+
+    if (tr->seen && blk >= tr->first && blk - tr->first < tr->nblk &&
+        !(tr->seen[(blk - tr->first) / 8] & (1 << ((blk - tr->first) % 8)))) {
+        tr->seen[(blk - tr->first) / 8] |= 1 << ((blk - tr->first) % 8);
+
+        if (tr->n == tr->max && tr->max < PARTFS_TRACE_MAX) {
+            const size_t max = MIN(MAX(tr->max * 2, 1024), PARTFS_TRACE_MAX);
+            uint64_t * const seq = realloc(tr->seq, max * sizeof(*seq));
+
+            if (seq) {
+                tr->seq = seq;
+                tr->max = max;
+            }
+        }
+        if (tr->n < tr->max) {
+            tr->seq[tr->n++] = blk;
+        }
+    }
+
+    if (tr->nold > 0) {
+        size_t lo, hi;
+
+        /* find the block in the earlier order */
+        for (lo = 0, hi = tr->nold; lo < hi; ) {
+            const size_t mid = lo + (hi - lo) / 2;
+
+            if (tr->idx[mid].blk < blk) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo < tr->nold && tr->idx[lo].blk == blk) {
+            const size_t i = tr->idx[lo].i;
+            const size_t ahead =
+                MAX(MIN(PARTFS_TRACE_AHEAD, cache->max / 4), 1);
+
+            tr->ahead = MAX(tr->ahead, i + 1);
+            tr->limit = MAX(tr->limit, MIN(tr->nold, i + 1 + ahead));
+            if (tr->ahead < tr->limit) {
+                pthread_cond_signal(&cache->cond);
+            }
+        }
+    }
+}
+
+/*
+ * read from the device through the cache, like pread(2). no more
+ * than the rest of a block is read. a block that isn't in the cache
+ * is taken from its compressed tier or read from the device in its
+ * entirety, and entered into it.
+ */
+static ssize_t __partfs_cache_pread(const struct partfs_file * const pfi,
+                                    void * const buf, const size_t len,
+                                    const off_t pos)
+{
+    struct partfs_cache * const cache = pfi->cache;
+    const uint64_t blk = pos / PARTFS_CACHE_BLOCK;
+    const size_t in = pos % PARTFS_CACHE_BLOCK;
+    const size_t n = MIN(len, PARTFS_CACHE_BLOCK - in);
+    struct partfs_cblock * b;
+    char * data;
+    uint64_t gen;
+    ssize_t ret;
+
+    pthread_mutex_lock(&cache->lock);
+    data = NULL;
+    b = __partfs_cache_find(cache, blk);
+    if (b) {
+        __partfs_cache_touch(cache, b);
+        memcpy(buf, b->data + in, n);
+        cache->hits++;
+    } else if ((data = __partfs_cache_zget(cache, blk)) != NULL) {
+        memcpy(buf, data + in, n);
+        if (!__partfs_cache_insert(cache, blk, data, cache->gen)) {
+            __partfs_mem_free(cache->mem, PARTFS_MEM_CACHE, data,
+                              PARTFS_CACHE_BLOCK);
+        }
+        cache->zhits++;
+    } else {
+        cache->misses++;
+    }
+    if (pfi->part && cache->dir) {
+        __partfs_trace_touch(cache, pfi, blk);
+    }
+    gen = cache->gen;
+    pthread_mutex_unlock(&cache->lock);
+
+    ret = n;
+    if (!b && !data) {
+        int err;
+
+        data = __partfs_mem_alloc(cache->mem, PARTFS_MEM_CACHE,
+                                  PARTFS_CACHE_BLOCK);
+
+        err = data ? __partfs_cache_fill(pfi, data, blk, 1) : -ENOMEM;
+        if (!err) {
+            memcpy(buf, data + in, n);
+
+            pthread_mutex_lock(&cache->lock);
+            if (__partfs_cache_insert(cache, blk, data, gen)) {
+                data = NULL;
+            }
+            pthread_mutex_unlock(&cache->lock);
+        }
+
+        __partfs_mem_free(cache->mem, PARTFS_MEM_CACHE, data,
+                          PARTFS_CACHE_BLOCK);
+
+        if (err) {
+            errno = -err;
+            ret   = -1;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * bring the cached blocks covering a region of the device up to
+ * date after it was written to. compressed blocks are dropped.
+ * unless writes are written back later, the blocks in the cache
+ * file on local storage are brought up to date too.
+ */
+static void __partfs_cache_update(const struct partfs_file * const pfi,
+                                  const void * const buf, const size_t len,
+                                  const off_t pos)
+{
+    struct partfs_cache * const cache = pfi->cache;
+
+    if (cache && len > 0) {
+        const uint64_t last = (pos + len - 1) / PARTFS_CACHE_BLOCK;
+        uint64_t blk;
+
+        pthread_mutex_lock(&cache->lock);
+        cache->gen++;
+        for (blk = pos / PARTFS_CACHE_BLOCK; blk <= last; blk++) {
+            struct partfs_cblock * b = __partfs_cache_find(cache, blk);
+
+            if (b) {
+                const off_t lo = MAX(pos, (off_t)(blk * PARTFS_CACHE_BLOCK));
+                const off_t hi = MIN(pos + (off_t)len,
+                                     (off_t)((blk + 1) * PARTFS_CACHE_BLOCK));
+
+                memcpy(b->data + (lo - blk * PARTFS_CACHE_BLOCK),
+                       (const char *)buf + (lo - pos), hi - lo);
+                __partfs_cache_touch(cache, b);
+            } else if ((b = __partfs_cache_zfind(cache, blk)) != NULL) {
+                __partfs_cache_zevict(cache, b);
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        if (cache->ssd && !cache->ssd->wb) {
+            __partfs_ssd_pwrite(cache->ssd, buf, len, pos);
+        }
+    }
+}
+
+/*
+ * remove the blocks covering a region of the device from the
+ * cache after it was discarded or zeroed
+ */
+static void __partfs_cache_drop(const struct partfs_file * const pfi,
+                                const off_t pos, const off_t len)
+{
+    struct partfs_cache * const cache = pfi->cache;
+
+    if (cache && len > 0) {
+        const uint64_t first = pos / PARTFS_CACHE_BLOCK;
+        const uint64_t last = (pos + len - 1) / PARTFS_CACHE_BLOCK;
+
+        pthread_mutex_lock(&cache->lock);
+        cache->gen++;
+        if (last - first >= cache->n) {
+            /* fewer blocks are cached than the region covers */
+            struct partfs_cblock * b, * next;
+
+            for (b = cache->lru.next; b != &cache->lru; b = next) {
+                next = b->next;
+                if (b->blk >= first && b->blk <= last) {
+                    __partfs_cache_evict(cache, b);
+                }
+            }
+        } else {
+            uint64_t blk;
+
+            for (blk = first; blk <= last; blk++) {
+                struct partfs_cblock * const b =
+                    __partfs_cache_find(cache, blk);
+
+                if (b) {
+                    __partfs_cache_evict(cache, b);
+                }
+            }
+        }
+        if (last - first >= cache->zn) {
+            struct partfs_cblock * b, * next;
+
+            for (b = cache->zlru.next; b != &cache->zlru; b = next) {
+                next = b->next;
+                if (b->blk >= first && b->blk <= last) {
+                    __partfs_cache_zevict(cache, b);
+                }
+            }
+        } else {
+            uint64_t blk;
+
+            for (blk = first; blk <= last; blk++) {
+                struct partfs_cblock * const b =
+                    __partfs_cache_zfind(cache, blk);
+
+                if (b) {
+                    __partfs_cache_zevict(cache, b);
+                }
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        if (cache->ssd) {
+            __partfs_ssd_drop(cache->ssd, pos, len);
+        }
+    }
+}
+
+/*
+ * set up a cache of up to mib mebibytes of blocks of the device,
+ * with a compressed tier of up to zmib mebibytes behind it
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_cache_open(struct partfs_device * const pdev,
+                               const unsigned long mib,
+                               const unsigned long zmib)
+{
+    struct partfs_cache * const cache = calloc(1, sizeof(*cache));
+    int err;
+
+    err = -ENOMEM;
+    if (cache) {
+        cache->mem   = &pdev->mem;
+        cache->max   = MAX(((size_t)mib << 20) / PARTFS_CACHE_BLOCK, 1);
+        for (cache->nhash = 1; cache->nhash < cache->max; cache->nhash <<= 1)
+            ;
+        cache->hash  = calloc(cache->nhash, sizeof(*cache->hash));
+        cache->lru.prev = cache->lru.next = &cache->lru;
+
+        /* sized for blocks compressing to an eighth, as text and code do */
+        cache->zmax  = (size_t)zmib << 20;
+        if (cache->zmax > 0) {
+            for (cache->nzhash = 1;
+                 cache->nzhash < cache->zmax / (PARTFS_CACHE_BLOCK / 8);
+                 cache->nzhash <<= 1)
+                ;
+            cache->zhash = calloc(cache->nzhash, sizeof(*cache->zhash));
+            cache->zbuf  = __partfs_mem_alloc(cache->mem, PARTFS_MEM_ZCACHE,
+                                              PARTFS_CACHE_BLOCK);
+        }
+        cache->zlru.prev = cache->zlru.next = &cache->zlru;
+
+        if (cache->hash &&
+            (cache->zmax == 0 || (cache->zhash && cache->zbuf))) {
+            pthread_mutex_init(&cache->lock, NULL);
+            pthread_cond_init(&cache->cond, NULL);
+            pdev->cache = cache;
+            err = 0;
+        } else {
+            __partfs_mem_free(cache->mem, PARTFS_MEM_ZCACHE, cache->zbuf,
+                              PARTFS_CACHE_BLOCK);
+            free(cache->zhash);
+            free(cache->hash);
+            free(cache);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * read from the device file at an offset relative to the start
+ * of the partition. the part of the request that lies beyond the
+ * end of the device file or that is known to read as zeros is
+ * filled with zeros.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_pread_serial(const struct partfs_file * const pfi,
+                                 void * const buf, const size_t len,
+                                 const off_t off)
+{
+    size_t done;
+    int err;
+
+    err = 0;
+    for (done = 0; !err && done < len; ) {
+        int zero;
+        const size_t span =
+            __partfs_zero_span(pfi, off + done, len - done, &zero);
+        ssize_t n;
+
+        if (zero) {
+            /* known to be zeros; no need to read the device */
+            memset((char *)buf + done, 0, span);
+            n = span;
+        } else {
+            const off_t pos = pfi->start + off + done;
+
+            n = pfi->cache ?
+                __partfs_cache_pread(pfi, (char *)buf + done, span, pos) :
+                __partfs_pread_dev(pfi, (char *)buf + done, span, pos);
+            if (n < 0) {
+                err = -errno;
+            } else if (n == 0) {
+                memset((char *)buf + done, 0, len - done);
+                n = len - done;
+            }
+        }
+
+        if (!err) {
+            done += n;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * save the blocks of a partition that are about to be written to or
+ * punched out in each of its snapshots that doesn't have them yet.
+ * they are read as they were before, through the caches. a block
+ * that can't be saved isn't written to, so a snapshot is never left
+ * with a block missing.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_snap_save(const struct partfs_file * const pfi,
+                              const off_t off, const off_t len)
+{
+    struct partfs_partition * const part = pfi->part;
+    int err;
+
+    err = 0;
+    if (part && len > 0) {
+        const off_t first = off / PARTFS_SNAP_BLOCK;
+        const off_t last = (off + len - 1) / PARTFS_SNAP_BLOCK;
+        unsigned char * buf;
+        off_t b;
+
+        buf = NULL;
+
+        pthread_mutex_lock(&part->snaplock);
+        for (b = first; !err && part->snap && b <= last; b++) {
+            const off_t pos = b * PARTFS_SNAP_BLOCK;
+            const size_t n = MIN(PARTFS_SNAP_BLOCK, pfi->size - pos);
+            struct partfs_snap * sn;
+            int zero;
+
+            /* not read until a snapshot turns out to need it */
+            zero = -1;
+            for (sn = part->snap; !err && sn; sn = sn->next) {
+                if ((size_t)b < sn->nblk && !sn->slot[b]) {
+                    if (!buf) {
+                        buf = __partfs_mem_alloc(pfi->mem, PARTFS_MEM_BUFFER,
+                                                 PARTFS_SNAP_BLOCK);
+                        err = buf ? 0 : -ENOMEM;
+                    }
+                    if (!err && zero < 0) {
+                        err = __partfs_pread_serial(pfi, buf, n, pos);
+                        zero = !err && __partfs_zeros(buf, n);
+                    }
+
+                    if (!err && zero) {
+                        sn->slot[b] = PARTFS_SNAP_ZERO;
+                    } else if (!err) {
+                        const ssize_t w = pwrite(
+                            sn->fd, buf, n,
+                            (off_t)sn->nsaved * PARTFS_SNAP_BLOCK);
+
+                        err = (w < 0) ? -errno :
+                            (((size_t)w < n) ? -ENOSPC : 0);
+                        if (!err) {
+                            sn->slot[b] = ++sn->nsaved;
+                        }
+                    }
+                }
+            }
+        }
+        pthread_mutex_unlock(&part->snaplock);
+
+        __partfs_mem_free(pfi->mem, PARTFS_MEM_BUFFER, buf, PARTFS_SNAP_BLOCK);
+    }
+
+    return err;
+}
+
+/*
+ * write to the device file at an offset relative
+ * to the start of the partition
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_pwrite_serial(const struct partfs_file * const pfi,
+                                  const void * const buf, const size_t len,
+                                  const off_t off)
+{
+    struct partfs_ssd * const ssd = pfi->cache ? pfi->cache->ssd : NULL;
+    size_t done;
+    int err;
+
+    err = __partfs_snap_save(pfi, off, len);
+    if (!err) {
+        __partfs_zero_del(pfi, off, len);
+    }
+
+    if (!err && ssd && ssd->wb) {
+        /* written to the device when written back */
+        err = __partfs_ssd_pwrite(ssd, buf, len, pfi->start + off);
+        if (!err) {
+            __partfs_cache_update(pfi, buf, len, pfi->start + off);
+        }
+    } else {
+        for (done = 0; !err && done < len; ) {
+            const off_t pos = pfi->start + off + done;
+            const ssize_t n = __partfs_pwrite_dev(
+                pfi, (const char *)buf + done, len - done, pos);
+
+            if (n < 0) {
+                err = -errno;
+            } else {
+                __partfs_cache_update(pfi, (const char *)buf + done, n, pos);
+                done += n;
+            }
+        }
+    }
+
+    return err;
+}
+
+/*
+ * carry out a part of a large read or write and note that it's done
+ */
+static void __partfs_pool_job(struct partfs_pool * const pool,
+                              struct partfs_job * const job)
+{
+    const int err = job->write ?
+        __partfs_pwrite_serial(job->pfi, job->buf, job->len, job->off) :
+        __partfs_pread_serial(job->pfi, job->buf, job->len, job->off);
+
+    pthread_mutex_lock(&pool->lock);
+    job->err = err;
+    if (--*job->pending == 0) {
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * take the next part waiting for a thread, if any
+ *
+ * must be called with the pool lock held
+ */
+static struct partfs_job * __partfs_pool_next(struct partfs_pool * const pool)
+{
+    struct partfs_job * const job = pool->head;
+
+    if (job) {
+        pool->head = job->next;
+        if (!pool->head) {
+            pool->tail = &pool->head;
+        }
+    }
+
+    return job;
+}
+
+/*
+ * carry out parts of requests until the device is closed
+ */
+static void * __partfs_pool_worker(void * const arg)
+{
+    struct partfs_pool * const pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        struct partfs_job * const job = __partfs_pool_next(pool);
+
+        if (!job) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        } else {
+            pthread_mutex_unlock(&pool->lock);
+            __partfs_pool_job(pool, job);
+            pthread_mutex_lock(&pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * size of the parts into which large requests are split: the unit
+ * in which the device is read, a grain of a vmdk extent or a block
+ * of the cache. 0 if requests aren't split: the requests of an nbd
+ * export are split already and all in flight at once, and a block
+ * device takes large requests as they are.
+ */
+static size_t __partfs_pool_chunk(const struct partfs_file * const pfi)
+{
+    size_t chunk;
+
+    chunk = 0;
+    if (pfi->pool && pfi->pool->started > 0 && !pfi->nbd && !pfi->blk) {
+        chunk = pfi->vmdk ?
+            MAX(pfi->vmdk->grain, PARTFS_CACHE_BLOCK) : PARTFS_CACHE_BLOCK;
+    }
+
+    return chunk;
+}
+
+/*
+ * split a read or write at an offset relative to the start of the
+ * partition into parts aligned to chunk on the device, and have the
+ * threads of the pool carry them out. the calling thread carries
+ * out parts too rather than wait idly.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_pool_io(const struct partfs_file * const pfi,
+                            char * const buf, const size_t len,
+                            const off_t off, const int write,
+                            const size_t chunk)
+{
+    struct partfs_pool * const pool = pfi->pool;
+    const off_t pos = pfi->start + off;
+    const size_t head = chunk - pos % chunk;
+    const size_t n = 1 + (len - MIN(head, len) + chunk - 1) / chunk;
+    struct partfs_job * const jobs = calloc(n, sizeof(*jobs));
+    size_t pending, i, done;
+    int err;
+
+    err = -ENOMEM;
+    if (jobs) {
+        for (i = 0, done = 0; i < n; i++) {
+            jobs[i].pfi     = pfi;
+            jobs[i].buf     = buf + done;
+            jobs[i].len     = MIN(i ? chunk : head, len - done);
+            jobs[i].off     = off + done;
+            jobs[i].write   = write;
+            jobs[i].pending = &pending;
+            jobs[i].next    = (i + 1 < n) ? &jobs[i + 1] : NULL;
+            done += jobs[i].len;
+        }
+        pending = n;
+
+        pthread_mutex_lock(&pool->lock);
+        if (n > 1) {
+            *pool->tail = &jobs[1];
+            pool->tail  = &jobs[n - 1].next;
+            pthread_cond_broadcast(&pool->work);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        __partfs_pool_job(pool, &jobs[0]);
+
+        pthread_mutex_lock(&pool->lock);
+        while (pending > 0) {
+            struct partfs_job * const job = __partfs_pool_next(pool);
+
+            if (!job) {
+                pthread_cond_wait(&pool->done, &pool->lock);
+            } else {
+                pthread_mutex_unlock(&pool->lock);
+                __partfs_pool_job(pool, job);
+                pthread_mutex_lock(&pool->lock);
+            }
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        for (i = 0, err = 0; !err && i < n; i++) {
+            err = jobs[i].err;
+        }
+
+        free(jobs);
+    }
+
+    return err;
+}
+
+/*
+ * read from the device file at an offset relative to the start of
+ * the partition, like __partfs_pread_serial(). a large read is split
+ * into parts read at once by the threads of the pool, if there is one.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_pread_full(const struct partfs_file * const pfi,
+                               void * const buf, const size_t len,
+                               const off_t off)
+{
+    const size_t chunk = __partfs_pool_chunk(pfi);
+
+    return (chunk > 0 && len >= 2 * chunk) ?
+        __partfs_pool_io(pfi, buf, len, off, 0, chunk) :
+        __partfs_pread_serial(pfi, buf, len, off);
+}
+
+/*
+ * write to the device file at an offset relative to the start of
+ * the partition, like __partfs_pwrite_serial(). a large write is
+ * split into parts written at once, as with __partfs_pread_full().
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_pwrite_full(const struct partfs_file * const pfi,
+                                const void * const buf, const size_t len,
+                                const off_t off)
+{
+    const size_t chunk = __partfs_pool_chunk(pfi);
+
+    return (chunk > 0 && len >= 2 * chunk) ?
+        __partfs_pool_io(pfi, (char *)buf, len, off, 1, chunk) :
+        __partfs_pwrite_serial(pfi, buf, len, off);
+}
+
+/*
+ * read part of a partition, reading only the regions covered by
+ * the given extents. everything else is filled with zeros.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_load_data(const struct partfs_file * const pfi,
+                              const struct partfs_extents * const data,
+                              const off_t off,
+                              void * const buf, const size_t len)
+{
+    const off_t end = off + len;
+    size_t i;
+    int err;
+
+    memset(buf, 0, len);
+
+    err = 0;
+    for (i = __partfs_extents_find(data, off);
+         !err && i < data->n && data->v[i].off < end;
+         i++) {
+        const off_t lo = MAX(data->v[i].off, off);
+        const off_t hi = MIN(data->v[i].off + data->v[i].len, end);
+
+        err = __partfs_pread_full(pfi, (char *)buf + (lo - off), hi - lo, lo);
+    }
+
+    return err;
+}
+
+/*
+ * fill a region of the partition with a 32-bit pattern
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_fill(const struct partfs_file * const pfi,
+                         const off_t off, const off_t len,
+                         const unsigned char pat[4])
+{
+    const size_t bsz = MIN(len, PARTFS_FILL_SIZE);
+    unsigned char * const buf =
+        __partfs_mem_alloc(pfi->mem, PARTFS_MEM_BUFFER, bsz);
+    int err;
+
+    err = -ENOMEM;
+    if (buf) {
+        off_t done;
+        size_t i;
+
+        for (i = 0; i < bsz; i++) {
+            buf[i] = pat[i % 4];
+        }
+
+        err = 0;
+        for (done = 0; !err && done < len; done += bsz) {
+            err = __partfs_pwrite_full(
+                pfi, buf, MIN((off_t)bsz, len - done), off + done);
+        }
+
+        __partfs_mem_free(pfi->mem, PARTFS_MEM_BUFFER, buf, bsz);
+    }
+
+    return err;
+}
+
+/*
+ * discard or zero a region of a partition on a block device. the
+ * device only deals in whole logical blocks, so any partial blocks
+ * at either end are written with zeros if necessary.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_blkdev_punch(const struct partfs_file * const pfi,
+                                 const off_t off, const off_t len,
+                                 const int zero)
+{
+    static const unsigned char zeros[4];
+    const struct partfs_blkdev * const blk = pfi->blk;
+    const off_t lo = roundup(pfi->start + off, (off_t)blk->lbs) - pfi->start;
+    const off_t hi = off + len - (pfi->start + off + len) % (off_t)blk->lbs;
+    int err;
+
+    err = 0;
+    if (lo < hi) {
+        uint64_t range[2];
+
+        range[0] = pfi->start + lo;
+        range[1] = hi - lo;
+
+        if (zero) {
+            /* the kernel discards or writes zeros as the device allows */
+            err = ioctl(pfi->desc, BLKZEROOUT, range) ? -errno : 0;
+        } else if (blk->discard) {
+            err = ioctl(pfi->desc, BLKDISCARD, range) ? -errno : 0;
+            if (err == -EOPNOTSUPP) {
+                err = 0;
+            }
+        }
+    }
+
+    if (!err && zero) {
+        if (lo < hi) {
+            err = __partfs_fill(pfi, off, lo - off, zeros);
+            if (!err) {
+                err = __partfs_fill(pfi, hi, off + len - hi, zeros);
+            }
+        } else {
+            err = __partfs_fill(pfi, off, len, zeros);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * deallocate a region of the partition by punching a hole in the
+ * device file. if zero is set, the region must read back as zeros,
+ * so zeros are written if the device file can't have holes punched.
+ * otherwise, the contents of the region don't matter and it is left
+ * as it is.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_punch(const struct partfs_file * const pfi,
+                          const off_t off, const off_t len,
+                          const int zero)
+{
+    struct partfs_ssd * const ssd = pfi->cache ? pfi->cache->ssd : NULL;
+    int err;
+
+    err = __partfs_snap_save(pfi, off, len);
+    if (!err && len > 0 && ssd) {
+        /*
+         * blocks not yet written back mustn't be written
+         * back over the region once it is discarded
+         */
+        pthread_mutex_lock(&ssd->lock);
+        err = __partfs_ssd_flush(
+            ssd, (pfi->start + off) / PARTFS_CACHE_BLOCK,
+            (pfi->start + off + len - 1) / PARTFS_CACHE_BLOCK);
+        pthread_mutex_unlock(&ssd->lock);
+    }
+
+    if (!err && len > 0) {
+        /*
+         * writes to the partition while it is punched, including
+         * the zeros written where it can't be, keep the region out
+         * of the map of zeros
+         */
+        const uint64_t gen = __partfs_zero_gen(pfi);
+        int zeroed;
+
+        if (pfi->nbd) {
+            err = __partfs_nbd_punch(pfi, off, len, zero);
+            zeroed = zero && !err;
+        } else if (pfi->vmdk) {
+            /* grains can't be freed; zeros are written instead */
+            err    = -EOPNOTSUPP;
+            zeroed = 0;
+        } else if (pfi->blk) {
+            err = __partfs_blkdev_punch(pfi, off, len, zero);
+            zeroed = zero && !err;
+        } else {
+            err = fallocate(pfi->desc,
+                            FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                            pfi->start + off, len) ? -errno : 0;
+            zeroed = !err;
+        }
+        if (err == -EOPNOTSUPP || err == -ENOSYS) {
+            static const unsigned char zeros[4];
+
+            err = zero ? __partfs_fill(pfi, off, len, zeros) : 0;
+            zeroed = zero && !err;
+        }
+
+        if (zeroed) {
+            __partfs_zero_add(pfi, off, len, gen);
+        }
+
+        __partfs_cache_drop(pfi, pfi->start + off, len);
+    }
+
+    return err;
+}
+
+/*
+ * create the file in which a snapshot keeps the blocks it saves, in
+ * the directory given when mounting, or $TMPDIR, or /var/tmp, which
+ * is meant for files too large for a tmpfs. the file is unlinked, so
+ * it goes away with the mount.
+ *
+ * returns a file descriptor or a negative errno on failure
+ */
+static int __partfs_snap_file(const struct partfs_device * const pdev)
+{
+    const char * const tmp = getenv("TMPDIR");
+    const char * const dir = pdev->snapdir ?
+        pdev->snapdir : ((tmp && *tmp) ? tmp : "/var/tmp");
+    int fd;
+
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+        /* the file system can't create unnamed files */
+        char * path;
+
+        errno = ENOMEM;
+        if (asprintf(&path, "%s/partfs-snap-XXXXXX", dir) >= 0) {
+            fd = mkostemp(path, O_CLOEXEC);
+            if (fd >= 0) {
+                unlink(path);
+            }
+            free(path);
+        }
+    }
+
+    return (fd < 0) ? -errno : fd;
+}
+
+static void __partfs_snap_free(struct partfs_snap * const sn)
+{
+    if (sn->fd >= 0) {
+        close(sn->fd);
+    }
+    free(sn->slot);
+    free(sn);
+}
+
+/*
+ * find a snapshot of a partition by name
+ *
+ * returns the link to it in the list of snapshots, or to the end
+ * of the list if there is none. must be called with the snapshot
+ * lock of the partition held.
+ */
+static struct partfs_snap ** __partfs_snap_find(
+    struct partfs_partition * const part, const char * const name)
+{
+    struct partfs_snap ** sp;
+
+    for (sp = &part->snap;
+         *sp && strcmp((*sp)->name, name) != 0;
+         sp = &(*sp)->next)
+        ;
+
+    return sp;
+}
+
+/*
+ * whether a partition has a snapshot of the given name
+ */
+static int __partfs_snap_has(struct partfs_partition * const part,
+                             const char * const name)
+{
+    int has;
+
+    pthread_mutex_lock(&part->snaplock);
+    has = *__partfs_snap_find(part, name) != NULL;
+    pthread_mutex_unlock(&part->snaplock);
+
+    return has;
+}
+
+/*
+ * create a snapshot of a partition without adding it to the partition.
+ * nothing is copied until the partition is written to.
+ *
+ * returns 0 on success or a negative errno on failure, -ENOENT if the
+ * partition table has no partition at n
+ */
+static int __partfs_snap_new(struct partfs_device * const pdev,
+                             const size_t n, const char * const name,
+                             struct partfs_snap ** const snp)
+{
+    struct partfs_snap * const sn = calloc(1, sizeof(*sn));
+    struct fdisk_partition * pa;
+    off_t size;
+    int err;
+
+    pa   = NULL;
+    size = 0;
+    if (fdisk_get_partition(pdev->ctx, n, &pa) == 0) {
+        size = __fdisk_partition_get_size(pdev->ctx, pa);
+    }
+    fdisk_unref_partition(pa);
+
+    err = -ENOMEM;
+    if (sn) {
+        snprintf(sn->name, sizeof(sn->name), "%s", name);
+        sn->nblk = (size + PARTFS_SNAP_BLOCK - 1) / PARTFS_SNAP_BLOCK;
+        sn->slot = calloc(MAX(sn->nblk, 1), sizeof(*sn->slot));
+        sn->fd   = -1;
+
+        err = (size > 0) ? 0 : -ENOENT;
+        if (!err && !sn->slot) {
+            err = -ENOMEM;
+        }
+        if (!err) {
+            sn->fd = __partfs_snap_file(pdev);
+            err = (sn->fd < 0) ? sn->fd : 0;
+        }
+    }
+
+    if (err && sn) {
+        __partfs_snap_free(sn);
+    }
+    *snp = err ? NULL : sn;
+
+    return err;
+}
+
+/*
+ * whether the snapshot of a partition of the given name is being rolled
+ * back to, so can't be replaced. must be called with the snapshot lock
+ * of the partition held.
+ */
+static int __partfs_snap_busy(struct partfs_partition * const part,
+                              const char * const name)
+{
+    struct partfs_snap * const old = *__partfs_snap_find(part, name);
+
+    return old && old->busy;
+}
+
+/*
+ * add a snapshot made by __partfs_snap_new() to a partition, replacing
+ * any of the same name, which must not be busy. must be called with the
+ * snapshot lock of the partition held.
+ */
+static void __partfs_snap_put(struct partfs_partition * const part,
+                              struct partfs_snap * const sn)
+{
+    struct partfs_snap ** const sp = __partfs_snap_find(part, sn->name);
+
+    if (*sp) {
+        struct partfs_snap * const old = *sp;
+
+        *sp = old->next;
+        __partfs_snap_free(old);
+    }
+
+    sn->next   = part->snap;
+    part->snap = sn;
+}
+
+/*
+ * take a snapshot of a partition, replacing any of the same name
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_snap_take(struct partfs_device * const pdev,
+                              const size_t n, const char * const name)
+{
+    struct partfs_partition * const part = &pdev->part[n];
+    struct partfs_snap * sn;
+    int err;
+
+    err = __partfs_snap_new(pdev, n, name, &sn);
+    if (!err) {
+        pthread_mutex_lock(&part->snaplock);
+        err = __partfs_snap_busy(part, name) ? -EBUSY : 0;
+        if (!err) {
+            __partfs_snap_put(part, sn);
+        }
+        pthread_mutex_unlock(&part->snaplock);
+
+        if (err) {
+            __partfs_snap_free(sn);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * discard a snapshot of a partition and the blocks it saved
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_snap_drop(struct partfs_device * const pdev,
+                              const size_t n, const char * const name)
+{
+    struct partfs_partition * const part = &pdev->part[n];
+    struct partfs_snap ** sp;
+    int err;
+
+    pthread_mutex_lock(&part->snaplock);
+    sp  = __partfs_snap_find(part, name);
+    err = !*sp ? -ENOENT : ((*sp)->busy ? -EBUSY : 0);
+    if (!err) {
+        struct partfs_snap * const sn = *sp;
+
+        *sp = sn->next;
+        __partfs_snap_free(sn);
+    }
+    pthread_mutex_unlock(&part->snaplock);
+
+    return err;
+}
+
+/*
+ * roll a partition opened by __partfs_xattr_begin() back to one of
+ * its snapshots by writing back the blocks the snapshot saved, in
+ * runs of blocks that were saved one after the other. the snapshot is
+ * kept, so the partition can be rolled back to it again, and the
+ * blocks written back are saved by the partition's other snapshots
+ * like any other writes. no one else may have the partition open for
+ * writing.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_snap_rollback(struct partfs_device * const pdev,
+                                  const struct partfs_file * const pfi,
+                                  const char * const name)
+{
+    struct partfs_partition * const part = pfi->part;
+    struct partfs_snap * sn;
+    int err;
+
+    sn = NULL;
+
+    /* the caller itself has it open for writing */
+    pthread_mutex_lock(&pdev->lock);
+    err = (part->writers > 1) ? -EBUSY : 0;
+    pthread_mutex_unlock(&pdev->lock);
+
+    if (!err) {
+        pthread_mutex_lock(&part->snaplock);
+        sn  = *__partfs_snap_find(part, name);
+        err = !sn ? -ENOENT : (sn->busy ? -EBUSY : 0);
+        if (!err) {
+            sn->busy = 1;
+        }
+        pthread_mutex_unlock(&part->snaplock);
+    }
+
+    if (!err) {
+        unsigned char * const buf = __partfs_mem_alloc(
+            pfi->mem, PARTFS_MEM_BUFFER, PARTFS_SNAP_BATCH);
+        size_t b, e;
+
+        err = buf ? 0 : -ENOMEM;
+        for (b = 0; !err && b < sn->nblk; b = e) {
+            const uint32_t slot = sn->slot[b];
+            const off_t pos = (off_t)b * PARTFS_SNAP_BLOCK;
+            size_t len;
+
+            for (e = b + 1;
+                 slot && e < sn->nblk &&
+                     (e - b) * PARTFS_SNAP_BLOCK < PARTFS_SNAP_BATCH &&
+                     sn->slot[e] == ((slot == PARTFS_SNAP_ZERO) ?
+                                     slot : slot + (e - b));
+                 e++)
+                ;
+            len = MIN((off_t)(e - b) * PARTFS_SNAP_BLOCK, pfi->size - pos);
+
+            if (slot == PARTFS_SNAP_ZERO) {
+                err = __partfs_punch(pfi, pos, len, 1);
+            } else if (slot) {
+                const ssize_t r = pread(
+                    sn->fd, buf, len, (off_t)(slot - 1) * PARTFS_SNAP_BLOCK);
+
+                err = (r < 0) ? -errno : (((size_t)r < len) ? -EIO : 0);
+                if (!err) {
+                    err = __partfs_pwrite_full(pfi, buf, len, pos);
+                }
+            }
+        }
+
+        __partfs_mem_free(pfi->mem, PARTFS_MEM_BUFFER, buf, PARTFS_SNAP_BATCH);
+
+        pthread_mutex_lock(&part->snaplock);
+        sn->busy = 0;
+        pthread_mutex_unlock(&part->snaplock);
+    }
+
+    return err;
+}
+
+/*
+ * find the regions covered by both lists of extents
+ */
+static int __partfs_extents_intersect(const struct partfs_extents * const a,
+                                      const struct partfs_extents * const b,
+                                      struct partfs_extents * const ex)
+{
+    size_t i, j;
+    int err;
+
+    err = 0;
+    for (i = 0, j = 0; !err && i < a->n && j < b->n; ) {
+        const off_t aend = a->v[i].off + a->v[i].len;
+        const off_t bend = b->v[j].off + b->v[j].len;
+        const off_t lo = MAX(a->v[i].off, b->v[j].off);
+        const off_t hi = MIN(aend, bend);
+
+        if (lo < hi) {
+            err = __partfs_extents_append(ex, lo, hi - lo);
+        }
+
+        if (aend < bend) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    return err;
+}
+
+/* mark a range of bits in a bitmap, ignoring those beyond nbits */
+static void __partfs_bitmap_set(unsigned char * const map,
+                                const uint64_t nbits,
+                                uint64_t first, uint64_t n)
+{
+    n = (first < nbits) ? MIN(n, nbits - first) : 0;
+    for (; n > 0; first++, n--) {
+        map[first / 8] |= 1 << (first % 8);
+    }
+}
+
+/*
+ * convert a bitmap in which each bit represents a unit of the
+ * given size to a list of extents, limited to the given size
+ */
+static int __partfs_bitmap_extents(const unsigned char * const map,
+                                   const uint64_t nbits,
+                                   const size_t unit, const off_t limit,
+                                   struct partfs_extents * const ex)
+{
+    uint64_t i;
+    int err;
+
+    err = 0;
+    for (i = 0; !err && i < nbits; i++) {
+        if (map[i / 8] & (1 << (i % 8))) {
+            const off_t off = i * unit;
+
+            if (off < limit) {
+                err = __partfs_extents_append(
+                    ex, off, MIN((off_t)unit, limit - off));
+            }
+        }
+    }
+
+    return err;
+}
+
+/*
+ * whether an ext2/3/4 block group contains
+ * a backup of the superblock and descriptors
+ */
+static int __partfs_ext_has_backup(const uint32_t ro_compat, uint32_t g)
+{
+    int ret;
+
+    ret = 1;
+    if ((ro_compat & PARTFS_EXT_RO_COMPAT_SPARSE_SUPER) && g > 1) {
+        static const unsigned int base[] = { 3, 5, 7 };
+        size_t i;
+
+        ret = 0;
+        for (i = 0; !ret && i < sizeof(base) / sizeof(*base); i++) {
+            uint32_t p;
+
+            for (p = base[i]; p < g; p *= base[i])
+                ;
+            ret = (p == g);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * add blocks of a file system to a list of metadata, ignoring
+ * any part of them that lies beyond the end of the partition
+ */
+static int __partfs_fs_meta(const struct partfs_fs * const fs,
+                            const struct partfs_file * const pfi,
+                            struct partfs_extents * const meta,
+                            const uint64_t blk, const uint64_t nblk,
+                            const size_t bs)
+{
+    const off_t off = blk * bs;
+    int err;
+
+    err = 0;
+    if (nblk > 0 && off < pfi->size) {
+        err = __partfs_extents_append(
+            meta, off, MIN((off_t)(nblk * bs), pfi->size - off));
+    }
+
+    return err;
+}
+
+/*
+ * determine the blocks in use by an ext2/3/4 file system. blocks
+ * are taken from the block bitmaps. bitmaps of groups that haven't
+ * been initialized aren't read; instead only the superblock backup
+ * and the metadata belonging to those groups are considered in use.
+ *
+ * returns -EINVAL if the partition doesn't contain an ext2/3/4 file
+ * system or -ENOTSUP if it uses an unsupported layout
+ */
+static int __partfs_probe_ext(const struct partfs_file * const pfi,
+                              struct partfs_fs * const fs)
+{
+    unsigned char sb[1024];
+    int err;
+
+    err = __partfs_pread_full(pfi, sb, sizeof(sb), 1024);
+    if (!err && __partfs_get_le16(sb + 56) != PARTFS_EXT_MAGIC) {
+        err = -EINVAL;
+    }
+
+    if (!err) {
+        const uint32_t compat   = __partfs_get_le32(sb + 92);
+        const uint32_t incompat = __partfs_get_le32(sb + 96);
+        const uint32_t ro       = __partfs_get_le32(sb + 100);
+        const int is64 = !!(incompat & PARTFS_EXT_INCOMPAT_64BIT);
+
+        const uint32_t logbs = __partfs_get_le32(sb + 24);
+        const size_t bs = (logbs <= 6) ? ((size_t)1024 << logbs) : 0;
+
+        const uint64_t nblk = __partfs_get_le32(sb + 4) |
+            (is64 ? ((uint64_t)__partfs_get_le32(sb + 336) << 32) : 0);
+        const uint32_t first = __partfs_get_le32(sb + 20);
+        const uint32_t bpg   = __partfs_get_le32(sb + 32);
+        const uint32_t ipg   = __partfs_get_le32(sb + 40);
+        const size_t isz = __partfs_get_le32(sb + 76) ?
+            __partfs_get_le16(sb + 88) : 128;
+        const size_t dsz = is64 ? __partfs_get_le16(sb + 254) : 32;
+        const uint32_t rsv = __partfs_get_le16(sb + 206);
+
+        /* a group's block bitmap fits in a single block */
+        if (!bs || !bpg || bpg > 8 * bs || !ipg || !isz || dsz < 32 ||
+            nblk <= first ||
+            (incompat & PARTFS_EXT_INCOMPAT_META_BG) ||
+            (compat & PARTFS_EXT_COMPAT_SPARSE_SUPER2)) {
+            err = -ENOTSUP;
+        } else {
+            const uint32_t ngrp = (nblk - first + bpg - 1) / bpg;
+            const uint64_t gdtblk = ((uint64_t)ngrp * dsz + bs - 1) / bs;
+            const uint64_t itblk = ((uint64_t)ipg * isz + bs - 1) / bs;
+
+            unsigned char * const map = calloc((nblk + 7) / 8, 1);
+            unsigned char * const gdt = malloc(gdtblk * bs);
+            unsigned char * const bmp = malloc(bs);
+
+            err = -ENOMEM;
+            if (map && gdt && bmp) {
+                err = __partfs_pread_full(
+                    pfi, gdt, gdtblk * bs, ((off_t)first + 1) * bs);
+            }
+
+            if (!err) {
+                struct partfs_extents itab;
+                uint32_t g;
+                size_t i;
+
+                /* boot block(s), superblock and descriptors */
+                __partfs_bitmap_set(map, nblk, 0, first + 1 + gdtblk + rsv);
+                err = __partfs_fs_meta(
+                    fs, pfi, &fs->meta, 0, first + 1 + gdtblk + rsv, bs);
+
+                /*
+                 * the bitmaps are listed as metadata first, followed
+                 * by the parts of the inode tables that are in use
+                 */
+                __partfs_extents_init(&itab);
+
+                for (g = 0; !err && g < ngrp; g++) {
+                    const unsigned char * const d = gdt + (size_t)g * dsz;
+                    const uint64_t start = first + (uint64_t)g * bpg;
+                    const uint64_t len = MIN(bpg, nblk - start);
+
+                    uint64_t bb = __partfs_get_le32(d);
+                    uint64_t ib = __partfs_get_le32(d + 4);
+                    uint64_t it = __partfs_get_le32(d + 8);
+
+                    if (dsz >= 64) {
+                        bb |= (uint64_t)__partfs_get_le32(d + 32) << 32;
+                        ib |= (uint64_t)__partfs_get_le32(d + 36) << 32;
+                        it |= (uint64_t)__partfs_get_le32(d + 40) << 32;
+                    }
+
+                    if (__partfs_ext_has_backup(ro, g)) {
+                        __partfs_bitmap_set(
+                            map, nblk, start, 1 + gdtblk + rsv);
+                    }
+
+                    __partfs_bitmap_set(map, nblk, bb, 1);
+                    __partfs_bitmap_set(map, nblk, ib, 1);
+                    __partfs_bitmap_set(map, nblk, it, itblk);
+
+                    err = __partfs_fs_meta(fs, pfi, &fs->meta, bb, 1, bs);
+                    if (!err) {
+                        err = __partfs_fs_meta(fs, pfi, &fs->meta, ib, 1, bs);
+                    }
+                    if (!err &&
+                        !(__partfs_get_le16(d + 18) &
+                          PARTFS_EXT_BG_INODE_UNINIT)) {
+                        uint64_t unused = __partfs_get_le16(d + 28);
+
+                        if (dsz >= 64) {
+                            unused |= (uint64_t)__partfs_get_le16(d + 60) << 16;
+                        }
+
+                        err = __partfs_fs_meta(
+                            fs, pfi, &itab, it,
+                            ((ipg - MIN(unused, ipg)) * isz + bs - 1) / bs,
+                            bs);
+                    }
+
+                    if (!err &&
+                        !(__partfs_get_le16(d + 18) &
+                          PARTFS_EXT_BG_BLOCK_UNINIT) &&
+                        bb < nblk) {
+                        err = __partfs_pread_full(pfi, bmp, bs, bb * bs);
+                        if (!err) {
+                            uint64_t b;
+
+                            for (b = 0; b < len; b++) {
+                                if (bmp[b / 8] & (1 << (b % 8))) {
+                                    map[(start + b) / 8] |=
+                                        1 << ((start + b) % 8);
+                                }
+                            }
+                        }
+                    }
+                }
+
+                for (i = 0; !err && i < itab.n; i++) {
+                    err = __partfs_extents_append(
+                        &fs->meta, itab.v[i].off, itab.v[i].len);
+                }
+
+                __partfs_extents_free(&itab);
+            }
+
+            if (!err) {
+                fs->type = (incompat & PARTFS_EXT_INCOMPAT_EXTENTS) ?
+                    "ext4" :
+                    ((compat & PARTFS_EXT_COMPAT_HAS_JOURNAL) ?
+                     "ext3" : "ext2");
+                err = __partfs_bitmap_extents(
+                    map, nblk, bs, pfi->size, &fs->used);
+            }
+
+            free(bmp);
+            free(gdt);
+            free(map);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * read the layout of a FAT file system from its boot sector
+ *
+ * returns -EINVAL if the sector isn't that of a FAT file system
+ */
+static int __partfs_fat_parse(const unsigned char * const bs,
+                              struct partfs_fat * const fat)
+{
+    uint64_t datasec;
+    int err;
+
+    memset(fat, 0, sizeof(*fat));
+    fat->bps   = __partfs_get_le16(bs + 11);
+    fat->spc   = bs[13];
+    fat->rsvd  = __partfs_get_le16(bs + 14);
+    fat->nfat  = bs[16];
+    fat->nroot = __partfs_get_le16(bs + 17);
+    fat->fatsz = __partfs_get_le16(bs + 22) ?
+        __partfs_get_le16(bs + 22) : __partfs_get_le32(bs + 36);
+    fat->nsec  = __partfs_get_le16(bs + 19) ?
+        __partfs_get_le16(bs + 19) : __partfs_get_le32(bs + 32);
+
+    fat->rootsec = (fat->nroot * 32 + fat->bps - 1) / MAX(fat->bps, 1);
+    datasec = (uint64_t)fat->rsvd + (uint64_t)fat->nfat * fat->fatsz +
+        fat->rootsec;
+
+    err = -EINVAL;
+    if (__partfs_get_le16(bs + 510) == 0xaa55 &&
+        fat->bps >= 512 && fat->bps <= 4096 &&
+        !(fat->bps & (fat->bps - 1)) &&
+        fat->spc && !(fat->spc & (fat->spc - 1)) &&
+        fat->rsvd && fat->nfat && fat->fatsz && fat->nsec > datasec) {
+        fat->datasec = datasec;
+        fat->nclus   = (fat->nsec - fat->datasec) / fat->spc;
+        fat->bits    = (fat->nclus < PARTFS_FAT12_CLUSTERS) ? 12 :
+            ((fat->nclus < PARTFS_FAT16_CLUSTERS) ? 16 : 32);
+
+        if (fat->bits == 32) {
+            fat->rootclus = __partfs_get_le32(bs + 44);
+        }
+
+        err = 0;
+    }
+
+    return err;
+}
+
+/*
+ * get the entry of a cluster in a FAT read into memory
+ */
+static uint32_t __partfs_fat_get(const unsigned char * const tab,
+                                 const unsigned int bits, const uint32_t c)
+{
+    const size_t pos = (size_t)c * bits / 8;
+    uint32_t ent;
+
+    if (bits == 12) {
+        ent = __partfs_get_le16(tab + pos);
+        ent = (c & 1) ? (ent >> 4) : (ent & 0xfff);
+    } else if (bits == 16) {
+        ent = __partfs_get_le16(tab + pos);
+    } else {
+        ent = __partfs_get_le32(tab + pos) & 0x0fffffff;
+    }
+
+    return ent;
+}
+
+/*
+ * set the entry of a cluster in a FAT held in memory. the entries of
+ * FAT12 share bytes, and the top bits of FAT32 entries are reserved.
+ */
+static void __partfs_fat_set(unsigned char * const tab,
+                             const unsigned int bits, const uint32_t c,
+                             const uint32_t ent)
+{
+    const size_t pos = (size_t)c * bits / 8;
+
+    if (bits == 12) {
+        const uint16_t old = __partfs_get_le16(tab + pos);
+
+        __partfs_put_le16(tab + pos,
+                          (c & 1) ?
+                          ((old & 0x000f) | (ent << 4)) :
+                          ((old & 0xf000) | (ent & 0x0fff)));
+    } else if (bits == 16) {
+        __partfs_put_le16(tab + pos, ent);
+    } else {
+        __partfs_put_le32(tab + pos,
+                          (__partfs_get_le32(tab + pos) & 0xf0000000) |
+                          (ent & 0x0fffffff));
+    }
+}
+
+/*
+ * determine the clusters in use by a FAT12/16/32 file system. the
+ * reserved area, the FATs, and the root directory are always in use.
+ *
+ * returns -EINVAL if the partition doesn't contain a FAT file system
+ */
+static int __partfs_probe_fat(const struct partfs_file * const pfi,
+                              struct partfs_fs * const fs)
+{
+    unsigned char bs[512];
+    struct partfs_fat fat;
+    int err;
+
+    err = __partfs_pread_full(pfi, bs, sizeof(bs), 0);
+    if (!err) {
+        err = __partfs_fat_parse(bs, &fat);
+    }
+
+    if (!err) {
+        const size_t len = (size_t)fat.fatsz * fat.bps;
+        unsigned char * const tab = malloc(len);
+
+        err = -ENOMEM;
+        if (tab) {
+            err = __partfs_pread_full(
+                pfi, tab, len, (off_t)fat.rsvd * fat.bps);
+        }
+
+        if (!err) {
+            const off_t meta = (off_t)fat.datasec * fat.bps;
+            const off_t csz = (off_t)fat.spc * fat.bps;
+            uint32_t c;
+
+            err = __partfs_extents_append(
+                &fs->used, 0, MIN(meta, pfi->size));
+            if (!err) {
+                err = __partfs_extents_append(
+                    &fs->meta, 0, MIN(meta, pfi->size));
+            }
+
+            /* clusters are numbered from 2 */
+            for (c = 2; !err && c < fat.nclus + 2; c++) {
+                const size_t pos = (size_t)c * fat.bits / 8;
+
+                /* an entry of a FAT12 is read as the two bytes it spans */
+                if (pos + (fat.bits + 7) / 8 <= len &&
+                    __partfs_fat_get(tab, fat.bits, c)) {
+                    const off_t off = meta + (c - 2) * csz;
+
+                    if (off < pfi->size) {
+                        err = __partfs_extents_append(
+                            &fs->used, off, MIN(csz, pfi->size - off));
+                    }
+                }
+            }
+
+            fs->type = "vfat";
+        }
+
+        free(tab);
+    }
+
+    return err;
+}
+
+/*
+ * lay out a FAT file system of nsec sectors with the given kind of
+ * FAT, or the one suited to its size if bits is 0, and clusters of
+ * spc sectors, or the usual size for its size and kind if spc is 0.
+ * the cluster size is adjusted if the number of clusters doesn't
+ * suit the kind of FAT.
+ *
+ * returns 0 on success or -EINVAL if no such file system fits
+ */
+static int __partfs_fat_layout(struct partfs_fat * const fat,
+                               const uint32_t nsec, const unsigned int bits,
+                               const uint32_t spc)
+{
+    static const struct
+    {
+        unsigned int bits;
+        uint32_t nsec, spc;
+    } sizes[] = {
+        /* cluster sizes as recommended by microsoft's specification */
+        { 16,      32680,   2 }, { 16,     262144,   4 },
+        { 16,     524288,   8 }, { 16,    1048576,  16 },
+        { 16,    2097152,  32 }, { 16,    4194304,  64 },
+        { 16, UINT32_MAX, 128 },
+        { 32,     532480,   1 }, { 32,   16777216,   8 },
+        { 32,   33554432,  16 }, { 32,   67108864,  32 },
+        { 32, UINT32_MAX,  64 },
+    };
+    int err;
+
+    memset(fat, 0, sizeof(*fat));
+    fat->bps  = PARTFS_FAT_SECTOR;
+    fat->nsec = nsec;
+    fat->nfat = 2;
+
+    fat->bits = bits;
+    if (!fat->bits) {
+        fat->bits = (nsec < (16 << 20) / PARTFS_FAT_SECTOR) ? 12 :
+            ((nsec < (512 << 20) / PARTFS_FAT_SECTOR) ? 16 : 32);
+    }
+
+    fat->spc = spc;
+    if (!fat->spc && fat->bits == 12) {
+        for (fat->spc = 1;
+             fat->spc < 128 && nsec / fat->spc >= PARTFS_FAT12_CLUSTERS;
+             fat->spc <<= 1)
+            ;
+    } else if (!fat->spc) {
+        size_t i;
+
+        for (i = 0; sizes[i].bits != fat->bits || nsec > sizes[i].nsec; i++)
+            ;
+        fat->spc = sizes[i].spc;
+    }
+
+    fat->rsvd     = (fat->bits == 32) ? 32 : 1;
+    fat->nroot    = (fat->bits == 32) ? 0 : 512;
+    fat->rootsec  = (fat->nroot * 32 + fat->bps - 1) / fat->bps;
+    fat->rootclus = (fat->bits == 32) ? 2 : 0;
+
+    err = -EAGAIN;
+    while (err == -EAGAIN) {
+        uint64_t need;
+
+        /* fewer clusters take less space in the FATs; settle on that */
+        fat->fatsz = 1;
+        do {
+            fat->datasec = fat->rsvd + fat->nfat * fat->fatsz + fat->rootsec;
+            fat->nclus   = (nsec > fat->datasec) ?
+                (nsec - fat->datasec) / fat->spc : 0;
+
+            need = (((uint64_t)fat->nclus + 2) * fat->bits + 7) / 8;
+            need = (need + fat->bps - 1) / fat->bps;
+        } while (need > fat->fatsz && (fat->fatsz = need));
+
+        err = 0;
+        if (fat->nclus == 0) {
+            err = -EINVAL;
+        } else if ((fat->bits == 12 &&
+                    fat->nclus >= PARTFS_FAT12_CLUSTERS) ||
+                   (fat->bits == 16 &&
+                    fat->nclus >= PARTFS_FAT16_CLUSTERS)) {
+            err = (fat->spc < 128) ? -EAGAIN : -EINVAL;
+            fat->spc <<= 1;
+        } else if ((fat->bits == 16 &&
+                    fat->nclus < PARTFS_FAT12_CLUSTERS) ||
+                   (fat->bits == 32 &&
+                    fat->nclus < PARTFS_FAT16_CLUSTERS)) {
+            err = (fat->spc > 1) ? -EAGAIN : -EINVAL;
+            fat->spc >>= 1;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * create a FAT file system in a partition laid out by
+ * __partfs_fat_layout(). only the boot sector (and, for FAT32, its
+ * backup and the fsinfo sectors), the start of each FAT and the
+ * volume label are written. the rest of the metadata is zeroed by
+ * punching holes, and so is the data area, where the contents don't
+ * matter, so formatting takes hardly any i/o even on large partitions.
+ *
+ * label is the volume label, if any, and id the volume serial number
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_fat_format(const struct partfs_file * const pfi,
+                               const struct partfs_fat * const fat,
+                               const char * const label, const uint32_t id)
+{
+    /* up to the end of the root directory */
+    const off_t meta =
+        ((off_t)fat->datasec + (fat->rootclus ? fat->spc : 0)) * fat->bps;
+    const size_t rlen = (size_t)fat->rsvd * fat->bps;
+    unsigned char * const rsvd = calloc(1, rlen);
+    unsigned char name[11];
+    int err;
+
+    /* volume labels are upper case and padded with spaces */
+    memset(name, ' ', sizeof(name));
+    if (label) {
+        size_t i;
+
+        for (i = 0; i < sizeof(name) && label[i]; i++) {
+            name[i] = toupper((unsigned char)label[i]);
+        }
+    }
+
+    err = -ENOMEM;
+    if (rsvd) {
+        /* the metadata must read as zeros; the data area needn't */
+        err = __partfs_punch(pfi, 0, MIN(meta, pfi->size), 1);
+        if (!err && meta < pfi->size) {
+            err = __partfs_punch(pfi, meta, pfi->size - meta, 0);
+        }
+    }
+
+    if (!err) {
+        unsigned char * const bs = rsvd;
+        /* the extended boot record follows the bpb */
+        unsigned char * const ebr = bs + ((fat->bits == 32) ? 64 : 36);
+
+        memcpy(bs, (fat->bits == 32) ? "\xeb\x58\x90" : "\xeb\x3c\x90", 3);
+        memcpy(bs + 3, "MSWIN4.1", 8);
+        __partfs_put_le16(bs + 11, fat->bps);
+        bs[13] = fat->spc;
+        __partfs_put_le16(bs + 14, fat->rsvd);
+        bs[16] = fat->nfat;
+        __partfs_put_le16(bs + 17, fat->nroot);
+        if (fat->bits != 32 && fat->nsec < 65536) {
+            __partfs_put_le16(bs + 19, fat->nsec);
+        } else {
+            __partfs_put_le32(bs + 32, fat->nsec);
+        }
+        bs[21] = PARTFS_FAT_MEDIA;
+        if (fat->bits != 32) {
+            __partfs_put_le16(bs + 22, fat->fatsz);
+        }
+        __partfs_put_le16(bs + 24, 63);
+        __partfs_put_le16(bs + 26, 255);
+        __partfs_put_le32(bs + 28, pfi->start / fat->bps);
+
+        if (fat->bits == 32) {
+            __partfs_put_le32(bs + 36, fat->fatsz);
+            __partfs_put_le32(bs + 44, fat->rootclus);
+            /* the fsinfo sector, and the backup of the boot sectors */
+            __partfs_put_le16(bs + 48, 1);
+            __partfs_put_le16(bs + 50, 6);
+        }
+
+        ebr[0] = 0x80;
+        ebr[2] = 0x29;
+        __partfs_put_le32(ebr + 3, id);
+        memcpy(ebr + 7, label ? name : (const unsigned char *)"NO NAME    ",
+               11);
+        memcpy(ebr + 18,
+               (fat->bits == 12) ? "FAT12   " :
+               ((fat->bits == 16) ? "FAT16   " : "FAT32   "), 8);
+
+        /* not bootable: have the bios try the next device */
+        memcpy(ebr + 26, "\xcd\x18\xf4\xeb\xfd", 5);
+        __partfs_put_le16(bs + 510, 0xaa55);
+
+        if (fat->bits == 32) {
+            unsigned char * const fsi = rsvd + fat->bps;
+
+            __partfs_put_le32(fsi, 0x41615252);
+            __partfs_put_le32(fsi + 484, 0x61417272);
+            /* the root directory takes the first cluster */
+            __partfs_put_le32(fsi + 488, fat->nclus - 1);
+            __partfs_put_le32(fsi + 492, fat->rootclus + 1);
+            __partfs_put_le32(fsi + 508, 0xaa550000);
+
+            memcpy(rsvd + 6 * fat->bps, rsvd, 2 * fat->bps);
+        }
+
+        err = __partfs_pwrite_full(pfi, rsvd, rlen, 0);
+    }
+
+    if (!err) {
+        unsigned char sec[PARTFS_FAT_SECTOR];
+        uint32_t i;
+
+        /* the media descriptor, and the end of the root's chain */
+        memset(sec, 0, sizeof(sec));
+        if (fat->bits == 12) {
+            memcpy(sec, "\xf8\xff\xff", 3);
+        } else if (fat->bits == 16) {
+            memcpy(sec, "\xf8\xff\xff\xff", 4);
+        } else {
+            memcpy(sec, "\xf8\xff\xff\x0f\xff\xff\xff\x0f"
+                   "\xff\xff\xff\x0f", 12);
+        }
+        for (i = 0; !err && i < fat->nfat; i++) {
+            err = __partfs_pwrite_full(
+                pfi, sec, sizeof(sec),
+                (off_t)(fat->rsvd + i * fat->fatsz) * fat->bps);
+        }
+
+        if (!err && label) {
+            memset(sec, 0, sizeof(sec));
+            memcpy(sec, name, sizeof(name));
+            sec[11] = PARTFS_FAT_ATTR_VOLUME;
+            err = __partfs_pwrite_full(
+                pfi, sec, 32,
+                (off_t)(fat->datasec - fat->rootsec) * fat->bps);
+        }
+    }
+
+    free(rsvd);
+
+    return err;
+}
+
+/*
+ * offset within the partition of a cluster of a FAT file system
+ */
+static off_t __partfs_fat_offset(const struct partfs_fat * const fat,
+                                 const uint32_t clus)
+{
+    return ((off_t)fat->datasec + (off_t)(clus - 2) * fat->spc) * fat->bps;
+}
+
+/*
+ * convert the name of a file on the host, in utf-8, to the utf-16 of
+ * a long name, which holds up to 255 characters
+ *
+ * returns the number of characters or a negative errno if the name
+ * can't be given to a file on a FAT file system
+ */
+static int __partfs_fat_utf16(const char * const name, uint16_t * const u)
+{
+    const unsigned char * s;
+    int len, err;
+
+    for (s = (const unsigned char *)name, len = 0, err = 0; !err && *s; ) {
+        uint32_t c = *s++;
+        /* the number of bytes following the first one */
+        unsigned int k =
+            (c >= 0xf0) ? 3 : ((c >= 0xe0) ? 2 : ((c >= 0xc0) ? 1 : 0));
+
+        err = (c >= 0xf8 || (c >= 0x80 && c < 0xc0)) ? -EILSEQ : 0;
+        c &= k ? (0x3f >> k) : 0x7f;
+        for (; !err && k > 0; k--, s++) {
+            err = ((*s & 0xc0) == 0x80) ? 0 : -EILSEQ;
+            c = (c << 6) | (*s & 0x3f);
+        }
+
+        if (!err && c > 0x10ffff) {
+            err = -EILSEQ;
+        } else if (!err && (c < 0x20 || (c < 0x80 && strchr(
+                                              "\"*/:<>?\\|", c)))) {
+            err = -EINVAL;
+        } else if (!err && len + ((c >= 0x10000) ? 2 : 1) > 255) {
+            err = -ENAMETOOLONG;
+        } else if (!err && c >= 0x10000) {
+            /* a surrogate pair */
+            u[len++] = 0xd800 + ((c - 0x10000) >> 10);
+            u[len++] = 0xdc00 + ((c - 0x10000) & 0x3ff);
+        } else if (!err) {
+            u[len++] = c;
+        }
+    }
+
+    /* windows drops dots and spaces at the end of a name */
+    if (!err && (len == 0 || u[len - 1] == '.' || u[len - 1] == ' ')) {
+        err = -EINVAL;
+    }
+
+    return err ? err : len;
+}
+
+/*
+ * whether a character of a name may appear in a short name as is
+ */
+static int __partfs_fat_short_char(const int c)
+{
+    return c < 0x80 && (isalnum(c) || (c && strchr("!#$%&'()-@^_`{}~", c)));
+}
+
+/*
+ * check whether the name of a file can serve as its short name, e.g.
+ * "README.TXT" or "boot.ini", and fill in the short name. windows
+ * and linux take flags in the entry to mean that the base name or
+ * extension of a short name is in lower case.
+ *
+ * returns 1 if it can or 0 if the file needs a long name
+ */
+static int __partfs_fat_short(const char * const name,
+                              unsigned char * const sname,
+                              unsigned char * const lcase)
+{
+    const char * const dot = strchr(name, '.');
+    const size_t blen = dot ? (size_t)(dot - name) : strlen(name);
+    const size_t elen = dot ? strlen(dot + 1) : 0;
+    unsigned int lower, upper;
+    int ok;
+
+    memset(sname, ' ', 11);
+    lower = 0;
+    upper = 0;
+
+    ok = blen >= 1 && blen <= 8 &&
+        (!dot || (elen >= 1 && elen <= 3 && !strchr(dot + 1, '.')));
+    if (ok) {
+        size_t i;
+
+        for (i = 0; ok && name[i]; i++) {
+            const int c = (unsigned char)name[i];
+            /* 1 for the base name, 2 for the extension */
+            const unsigned int part = (dot && name + i > dot) ? 2 : 1;
+
+            if (name + i != dot) {
+                ok = __partfs_fat_short_char(c);
+                lower |= islower(c) ? part : 0;
+                upper |= isupper(c) ? part : 0;
+                sname[(part == 1) ? i : (8 + i - blen - 1)] = toupper(c);
+            }
+        }
+    }
+
+    *lcase = ((lower & 1) ? 0x08 : 0) | ((lower & 2) ? 0x10 : 0);
+
+    return ok && !(lower & upper);
+}
+
+/*
+ * make up a short name for a file with a long name, as windows does:
+ * the characters of the name that may appear in a short name, upper
+ * cased, with a numeric tail "~N", and the extension of the name
+ */
+static void __partfs_fat_alias(const char * const name,
+                               unsigned char * const sname,
+                               const unsigned int tail)
+{
+    const char * const dot = strrchr(name, '.');
+    /* a leading dot doesn't start an extension */
+    const char * const end = (dot && dot != name) ? dot : NULL;
+    unsigned char base[8];
+    char num[12];
+    size_t blen, elen, nlen;
+    const char * p;
+
+    memset(sname, ' ', 11);
+    blen = 0;
+    elen = 0;
+
+    for (p = name; *p && p != end && blen < sizeof(base); p++) {
+        const int c = (unsigned char)*p;
+
+        /* spaces and dots are dropped, other characters replaced */
+        if (c != ' ' && c != '.' && (c & 0xc0) != 0x80) {
+            base[blen++] = __partfs_fat_short_char(c) ? toupper(c) : '_';
+        }
+    }
+    for (p = end ? end + 1 : ""; *p && elen < 3; p++) {
+        const int c = (unsigned char)*p;
+
+        if (c != ' ' && (c & 0xc0) != 0x80) {
+            sname[8 + elen++] = __partfs_fat_short_char(c) ?
+                toupper(c) : '_';
+        }
+    }
+
+    nlen = snprintf(num, sizeof(num), "~%u", tail);
+    blen = MIN(blen, 8 - nlen);
+    memcpy(sname, base, blen);
+    memcpy(sname + blen, num, nlen);
+}
+
+static int __partfs_fat_cmp(const void * const a, const void * const b)
+{
+    const struct partfs_fat_node * const x = a, * const y = b;
+    const int r = strcasecmp(x->name, y->name);
+
+    return r ? r : strcmp(x->name, y->name);
+}
+
+/*
+ * give the files in a directory their short names and count the
+ * entries holding their long names. the files are in the order of
+ * their names, so names that differ only in case are next to each
+ * other, but FAT can't tell them apart.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_fat_names(struct partfs_fat_fill * const fill,
+                              const size_t d)
+{
+    struct partfs_fat_node * const node = fill->node;
+    const size_t first = node[d].child, end = first + node[d].nchild;
+    unsigned int tail;
+    size_t i, j;
+    int err;
+
+    for (i = first, tail = 0, err = 0; !err && i < end; i++) {
+        uint16_t u[255];
+        const int len = __partfs_fat_utf16(node[i].name, u);
+        int dup;
+
+        err = (len < 0) ? len : 0;
+        if (!err && i > first &&
+            strcasecmp(node[i - 1].name, node[i].name) == 0) {
+            err = -EEXIST;
+        }
+
+        if (!err) {
+            node[i].nlfn = 0;
+            dup = !__partfs_fat_short(node[i].name,
+                                      node[i].sname, &node[i].lcase);
+            do {
+                /* the name isn't a short name, or that name is taken */
+                if (dup) {
+                    node[i].nlfn  = (len + PARTFS_FAT_LFN_CHARS - 1) /
+                        PARTFS_FAT_LFN_CHARS;
+                    node[i].lcase = 0;
+                    __partfs_fat_alias(node[i].name, node[i].sname, ++tail);
+                }
+
+                for (j = first, dup = 0; !dup && j < i; j++) {
+                    dup = memcmp(node[j].sname, node[i].sname, 11) == 0;
+                }
+            } while (dup && tail < 999999);
+
+            err = dup ? -EEXIST : 0;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * add a file or directory found on the host to those to be copied.
+ * the path is freed if it can't be added.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_fat_add(struct partfs_fat_fill * const fill,
+                            char * const path, const struct stat * const st,
+                            const size_t parent)
+{
+    int err;
+
+    err = 0;
+    if (fill->nnode == fill->max) {
+        const size_t max = fill->max ? (2 * fill->max) : 64;
+        struct partfs_fat_node * const node =
+            realloc(fill->node, max * sizeof(*node));
+
+        if (node) {
+            fill->node = node;
+            fill->max  = max;
+        } else {
+            err = -ENOMEM;
+        }
+    }
+
+    if (!err && !S_ISDIR(st->st_mode) && st->st_size > UINT32_MAX) {
+        err = -EFBIG;
+    }
+
+    if (!err) {
+        struct partfs_fat_node * const f = &fill->node[fill->nnode++];
+        const char * const slash = strrchr(path, '/');
+
+        memset(f, 0, sizeof(*f));
+        f->path   = path;
+        f->name   = slash ? slash + 1 : path;
+        f->dir    = S_ISDIR(st->st_mode);
+        f->size   = f->dir ? 0 : st->st_size;
+        f->mtime  = st->st_mtime;
+        f->dev    = st->st_dev;
+        f->ino    = st->st_ino;
+        f->parent = parent;
+    } else {
+        free(path);
+    }
+
+    return err;
+}
+
+/*
+ * whether a directory is the given one or one containing it
+ */
+static int __partfs_fat_ancestor(const struct partfs_fat_fill * const fill,
+                                 size_t d, const struct stat * const st)
+{
+    int found;
+
+    found = fill->node[d].dev == st->st_dev &&
+        fill->node[d].ino == st->st_ino;
+    while (!found && d != 0) {
+        d = fill->node[d].parent;
+        found = fill->node[d].dev == st->st_dev &&
+            fill->node[d].ino == st->st_ino;
+    }
+
+    return found;
+}
+
+/*
+ * collect the files and directories to be copied from a directory on
+ * the host, level by level. regular files and directories are copied,
+ * following symbolic links, and anything else is skipped.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_fat_scan(struct partfs_fat_fill * const fill,
+                             const char * const path)
+{
+    struct stat st;
+    size_t i;
+    int err;
+
+    err = (stat(path, &st) == 0) ? 0 : -errno;
+    if (!err && !S_ISDIR(st.st_mode)) {
+        err = -ENOTDIR;
+    }
+    if (!err) {
+        char * const root = strdup(path);
+
+        err = root ? __partfs_fat_add(fill, root, &st, 0) : -ENOMEM;
+    }
+
+    for (i = 0; !err && i < fill->nnode; i++) {
+        if (fill->node[i].dir) {
+            DIR * const dir = opendir(fill->node[i].path);
+            struct dirent * de;
+
+            err = dir ? 0 : -errno;
+            fill->node[i].child = fill->nnode;
+
+            while (!err && (de = readdir(dir)) != NULL) {
+                char * p;
+
+                p = NULL;
+                if (strcmp(de->d_name, ".") != 0 &&
+                    strcmp(de->d_name, "..") != 0 &&
+                    asprintf(&p, "%s/%s",
+                             fill->node[i].path, de->d_name) < 0) {
+                    err = -ENOMEM;
+                    p   = NULL;
+                }
+
+                if (p && stat(p, &st) != 0) {
+                    err = -errno;
+                } else if (p && S_ISDIR(st.st_mode) &&
+                           __partfs_fat_ancestor(fill, i, &st)) {
+                    /* a link to a directory containing it never ends */
+                    err = -ELOOP;
+                } else if (p && (S_ISREG(st.st_mode) ||
+                                 S_ISDIR(st.st_mode))) {
+                    err = __partfs_fat_add(fill, p, &st, i);
+                    p   = NULL;
+                }
+
+                free(p);
+            }
+
+            if (dir) {
+                closedir(dir);
+            }
+
+            if (!err) {
+                fill->node[i].nchild = fill->nnode - fill->node[i].child;
+                qsort(fill->node + fill->node[i].child,
+                      fill->node[i].nchild, sizeof(*fill->node),
+                      __partfs_fat_cmp);
+
+                err = __partfs_fat_names(fill, i);
+            }
+        }
+    }
+
+    return err;
+}
+
+/*
+ * check that a FAT file system holds nothing but its volume label,
+ * and keep a copy of the label's entry
+ *
+ * returns 0 if it's empty or a negative errno if not
+ */
+static int __partfs_fat_empty(struct partfs_fat_fill * const fill,
+                              const unsigned char * const tab)
+{
+    const struct partfs_fat * const fat = fill->fat;
+    const size_t len = fat->rootclus ?
+        (size_t)fat->spc * fat->bps : (size_t)fat->rootsec * fat->bps;
+    unsigned char * const root = malloc(len);
+    int err;
+
+    err = -ENOMEM;
+    if (root) {
+        err = __partfs_pread_full(
+            fill->pfi, root, len,
+            fat->rootclus ?
+            __partfs_fat_offset(fat, fat->rootclus) :
+            (off_t)(fat->datasec - fat->rootsec) * fat->bps);
+    }
+
+    if (!err) {
+        size_t i;
+        uint32_t c;
+
+        /* an entry starting with 0 ends the directory */
+        for (i = 0; !err && i < len && root[i]; i += 32) {
+            const unsigned int attr = root[i + 11];
+
+            if (root[i] == 0xe5) {
+                /* a deleted entry */
+            } else if ((attr & 0x3f) != PARTFS_FAT_ATTR_LFN &&
+                       (attr & PARTFS_FAT_ATTR_VOLUME) && !fill->label[0]) {
+                memcpy(fill->label, root + i, sizeof(fill->label));
+            } else {
+                err = -ENOTEMPTY;
+            }
+        }
+
+        /* only the root directory of FAT32 takes a cluster */
+        for (c = 2; !err && c < fat->nclus + 2; c++) {
+            const uint32_t ent = __partfs_fat_get(tab, fat->bits, c);
+
+            if (c == fat->rootclus ? ent < 0x0ffffff8 : ent != 0) {
+                err = -ENOTEMPTY;
+            }
+        }
+    }
+
+    free(root);
+
+    return err;
+}
+
+/*
+ * the number of entries of a directory, including the long names
+ * of the files in it
+ */
+static size_t __partfs_fat_nent(const struct partfs_fat_fill * const fill,
+                                const size_t d)
+{
+    const struct partfs_fat_node * const node = fill->node;
+    size_t n, i;
+
+    /* "." and "..", or the volume label in the root */
+    n = d ? 2 : !!fill->label[0];
+    for (i = node[d].child; i < node[d].child + node[d].nchild; i++) {
+        n += 1 + node[i].nlfn;
+    }
+
+    return n;
+}
+
+/*
+ * give each directory and file clusters of its own, one after the
+ * other in the order they were found, and chain them in the FAT.
+ * the root directory of FAT32 keeps its first cluster and grows from
+ * there; that of FAT12/16 has a fixed number of entries.
+ *
+ * returns the first cluster left free or 0 if everything doesn't fit
+ */
+static uint32_t __partfs_fat_alloc(struct partfs_fat_fill * const fill,
+                                   unsigned char * const tab)
+{
+    const struct partfs_fat * const fat = fill->fat;
+    const uint64_t csz = (uint64_t)fat->spc * fat->bps;
+    const uint32_t eoc = (fat->bits == 12) ? 0xfff :
+        ((fat->bits == 16) ? 0xffff : 0x0fffffff);
+    uint64_t next;
+    size_t i;
+
+    next = fat->rootclus ? fat->rootclus : 2;
+    for (i = 0; next && i < fill->nnode; i++) {
+        struct partfs_fat_node * const f = &fill->node[i];
+        uint64_t len;
+
+        len = f->size;
+        if (f->dir) {
+            const size_t n = __partfs_fat_nent(fill, i);
+
+            /* a directory takes a cluster, even if it's empty */
+            len = MAX(n, 1) * 32;
+            if (n > PARTFS_FAT_DIR_MAX || (i == 0 && !fat->rootclus &&
+                                           n > fat->nroot)) {
+                next = 0;
+            } else if (i == 0 && !fat->rootclus) {
+                len = 0;
+            }
+        }
+
+        if (next) {
+            const uint64_t n = (len + csz - 1) / csz;
+
+            if (next + n > (uint64_t)fat->nclus + 2) {
+                next = 0;
+            } else if (n > 0) {
+                uint64_t c;
+
+                f->clus  = next;
+                f->nclus = n;
+                for (c = next; c + 1 < next + n; c++) {
+                    __partfs_fat_set(tab, fat->bits, c, c + 1);
+                }
+                __partfs_fat_set(tab, fat->bits, c, eoc);
+
+                next += n;
+            }
+        }
+    }
+
+    return next;
+}
+
+/*
+ * fill in a directory entry with the time of a file in local time, as
+ * FAT keeps it. times FAT can't represent are set to its epoch, 1980.
+ */
+static void __partfs_fat_dirent(unsigned char * const ent,
+                                const unsigned char * const sname,
+                                const unsigned int attr,
+                                const unsigned char lcase,
+                                const uint32_t clus, const uint32_t size,
+                                const time_t mtime)
+{
+    struct tm tm;
+    uint16_t date, tod;
+
+    date = (1 << 5) | 1;
+    tod  = 0;
+    if (localtime_r(&mtime, &tm) && tm.tm_year >= 80 && tm.tm_year < 208) {
+        date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) |
+            tm.tm_mday;
+        tod  = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    }
+
+    memset(ent, 0, 32);
+    memcpy(ent, sname, 11);
+    ent[11] = attr;
+    ent[12] = lcase;
+    /* created, accessed and modified */
+    __partfs_put_le16(ent + 14, tod);
+    __partfs_put_le16(ent + 16, date);
+    __partfs_put_le16(ent + 18, date);
+    __partfs_put_le16(ent + 20, clus >> 16);
+    __partfs_put_le16(ent + 22, tod);
+    __partfs_put_le16(ent + 24, date);
+    __partfs_put_le16(ent + 26, clus);
+    __partfs_put_le32(ent + 28, size);
+}
+
+/*
+ * fill in the entries holding the long name of a file, which precede
+ * its short name entry, the end of the name first
+ */
+static void __partfs_fat_lfn(unsigned char * const ent,
+                             const struct partfs_fat_node * const f)
+{
+    /* where the characters held by an entry are */
+    static const unsigned char pos[PARTFS_FAT_LFN_CHARS] = {
+        1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30,
+    };
+    uint16_t u[255];
+    const int len = __partfs_fat_utf16(f->name, u);
+    unsigned char sum;
+    unsigned int k, i;
+
+    for (i = 0, sum = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + f->sname[i];
+    }
+
+    for (k = f->nlfn; k > 0; k--) {
+        unsigned char * const e = ent + (f->nlfn - k) * 32;
+
+        memset(e, 0, 32);
+        e[0]  = k | ((k == f->nlfn) ? 0x40 : 0);
+        e[11] = PARTFS_FAT_ATTR_LFN;
+        e[13] = sum;
+
+        /* the name ends with a 0, and the rest is padded */
+        for (i = 0; i < PARTFS_FAT_LFN_CHARS; i++) {
+            const int c = (k - 1) * PARTFS_FAT_LFN_CHARS + i;
+
+            __partfs_put_le16(e + pos[i],
+                              (c < len) ? u[c] : ((c == len) ? 0 : 0xffff));
+        }
+    }
+}
+
+/*
+ * fill in the entries of a directory: "." and "..", except in the
+ * root directory, and those of the files and directories in it
+ */
+static void __partfs_fat_mkdir(const struct partfs_fat_fill * const fill,
+                               const size_t d, unsigned char * ent)
+{
+    const struct partfs_fat_node * const node = fill->node;
+    size_t i;
+
+    if (d > 0) {
+        const size_t up = node[d].parent;
+
+        /* ".." in a directory in the root refers to cluster 0 */
+        __partfs_fat_dirent(ent, (const unsigned char *)".          ",
+                            PARTFS_FAT_ATTR_DIR, 0,
+                            node[d].clus, 0, node[d].mtime);
+        __partfs_fat_dirent(ent + 32, (const unsigned char *)"..         ",
+                            PARTFS_FAT_ATTR_DIR, 0,
+                            up ? node[up].clus : 0, 0, node[up].mtime);
+        ent += 64;
+    } else if (fill->label[0]) {
+        memcpy(ent, fill->label, sizeof(fill->label));
+        ent += 32;
+    }
+
+    for (i = node[d].child; i < node[d].child + node[d].nchild; i++) {
+        __partfs_fat_lfn(ent, &node[i]);
+        ent += 32 * node[i].nlfn;
+
+        __partfs_fat_dirent(ent, node[i].sname,
+                            node[i].dir ?
+                            PARTFS_FAT_ATTR_DIR : PARTFS_FAT_ATTR_ARCHIVE,
+                            node[i].lcase, node[i].clus, node[i].size,
+                            node[i].mtime);
+        ent += 32;
+    }
+}
+
+/*
+ * copy directories and files into the file system in parallel. each
+ * thread takes the next one to be copied, and copies a file in large
+ * pieces, so the pool can split them further.
+ */
+static size_t __partfs_fat_next(struct partfs_fat_fill * const fill,
+                                const int err)
+{
+    size_t i;
+
+    pthread_mutex_lock(&fill->lock);
+    if (err && !fill->err) {
+        fill->err = err;
+    }
+    i = fill->err ? fill->nnode : fill->next++;
+    pthread_mutex_unlock(&fill->lock);
+
+    return MIN(i, fill->nnode);
+}
+
+static void * __partfs_fat_worker(void * const arg)
+{
+    struct partfs_fat_fill * const fill = arg;
+    const struct partfs_fat * const fat = fill->fat;
+    unsigned char * const buf = __partfs_mem_alloc(
+        fill->pfi->mem, PARTFS_MEM_BUFFER, PARTFS_FAT_COPY_SIZE);
+    size_t i;
+    int err;
+
+    err = buf ? 0 : -ENOMEM;
+    for (i = __partfs_fat_next(fill, err);
+         i < fill->nnode;
+         i = __partfs_fat_next(fill, err)) {
+        const struct partfs_fat_node * const f = &fill->node[i];
+        /* the root directory of FAT12/16 precedes the data area */
+        const int fixed = i == 0 && !fat->rootclus;
+        const off_t off = fixed ?
+            (off_t)(fat->datasec - fat->rootsec) * fat->bps :
+            __partfs_fat_offset(fat, f->clus);
+
+        if (f->dir) {
+            const size_t len = fixed ?
+                (size_t)fat->rootsec * fat->bps :
+                (size_t)f->nclus * fat->spc * fat->bps;
+            unsigned char * const dir = calloc(1, len);
+
+            err = -ENOMEM;
+            if (dir) {
+                __partfs_fat_mkdir(fill, i, dir);
+                err = __partfs_pwrite_full(fill->pfi, dir, len, off);
+            }
+
+            free(dir);
+        } else if (f->size > 0) {
+            const int fd = open(f->path, O_RDONLY);
+            off_t done;
+
+            err = (fd >= 0) ? 0 : -errno;
+            for (done = 0; !err && done < f->size; ) {
+                const ssize_t n = pread(
+                    fd, buf, MIN(PARTFS_FAT_COPY_SIZE, f->size - done),
+                    done);
+
+                if (n < 0) {
+                    err = -errno;
+                } else if (n == 0) {
+                    /* the file was truncated after it was found */
+                    err = -EIO;
+                } else {
+                    err = __partfs_pwrite_full(fill->pfi, buf, n, off + done);
+                    done += n;
+                }
+            }
+
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    __partfs_mem_free(fill->pfi->mem, PARTFS_MEM_BUFFER, buf,
+                      PARTFS_FAT_COPY_SIZE);
+
+    return NULL;
+}
+
+/*
+ * copy the files and directories in a directory on the host into the
+ * root directory of an empty FAT file system, such as one created by
+ * __partfs_fat_format(). the whole tree is laid out up front, so each
+ * file and directory takes contiguous clusters, and everything is
+ * written at once by several threads, without going through the
+ * file system. the FATs are written last, so the file system is still
+ * empty if copying fails.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_fat_populate(const struct partfs_file * const pfi,
+                                 const char * const path)
+{
+    struct partfs_fat_fill fill;
+    struct partfs_fat fat;
+    unsigned char bs[512];
+    unsigned char * tab;
+    uint32_t next;
+    size_t i;
+    int err;
+
+    memset(&fill, 0, sizeof(fill));
+    fill.pfi = pfi;
+    fill.fat = &fat;
+    pthread_mutex_init(&fill.lock, NULL);
+
+    tab  = NULL;
+    next = 0;
+
+    err = __partfs_pread_full(pfi, bs, sizeof(bs), 0);
+    if (!err) {
+        err = __partfs_fat_parse(bs, &fat);
+    }
+    if (!err && ((uint64_t)fat.nclus + 2) * fat.bits / 8 + 2 >
+        (uint64_t)fat.fatsz * fat.bps) {
+        /* the FATs are too small for the clusters */
+        err = -EINVAL;
+    }
+    if (!err) {
+        tab = malloc((size_t)fat.fatsz * fat.bps);
+        err = tab ?
+            __partfs_pread_full(pfi, tab, (size_t)fat.fatsz * fat.bps,
+                                (off_t)fat.rsvd * fat.bps) :
+            -ENOMEM;
+    }
+
+    if (!err) {
+        err = __partfs_fat_empty(&fill, tab);
+    }
+    if (!err) {
+        err = __partfs_fat_scan(&fill, path);
+    }
+    if (!err) {
+        next = __partfs_fat_alloc(&fill, tab);
+        err  = next ? 0 : -ENOSPC;
+    }
+
+    if (!err) {
+        /* as when comparing partitions, a spinning disk gets one */
+        const long ncpu = (pfi->blk && pfi->blk->rotational) ?
+            1 : sysconf(_SC_NPROCESSORS_ONLN);
+        const size_t nthr = MAX(1, MIN((size_t)MAX(ncpu, 1), fill.nnode));
+        pthread_t * const thr = calloc(nthr, sizeof(*thr));
+
+        err = thr ? 0 : -ENOMEM;
+        for (i = 0; !err && i < nthr; ) {
+            err = -pthread_create(
+                &thr[i], NULL, __partfs_fat_worker, &fill);
+            if (!err) {
+                i++;
+            }
+        }
+
+        /* the workers stop early if any of them fails */
+        if (err) {
+            __partfs_fat_next(&fill, err);
+        }
+        while (i > 0) {
+            pthread_join(thr[--i], NULL);
+        }
+
+        free(thr);
+
+        if (!err) {
+            err = fill.err;
+        }
+    }
+
+    if (!err) {
+        /* only the part of the FATs describing what was copied */
+        const size_t len = MIN(
+            (size_t)fat.fatsz * fat.bps,
+            ((size_t)next * fat.bits / 8 + 2 + fat.bps - 1) /
+            fat.bps * fat.bps);
+
+        for (i = 0; !err && i < fat.nfat; i++) {
+            err = __partfs_pwrite_full(
+                pfi, tab, len,
+                (off_t)(fat.rsvd + i * fat.fatsz) * fat.bps);
+        }
+    }
+
+    if (!err && fat.bits == 32) {
+        /* the fsinfo sector and its backup after the boot sector's */
+        const uint32_t fsi = __partfs_get_le16(bs + 48);
+        const uint32_t bk = __partfs_get_le16(bs + 50);
+        unsigned char sec[PARTFS_FAT_SECTOR];
+
+        if (fsi > 0 && fsi < fat.rsvd &&
+            __partfs_pread_full(pfi, sec, sizeof(sec),
+                                (off_t)fsi * fat.bps) == 0 &&
+            __partfs_get_le32(sec) == 0x41615252) {
+            __partfs_put_le32(sec + 488,
+                              fat.nclus - (next - fat.rootclus));
+            __partfs_put_le32(sec + 492, next);
+
+            err = __partfs_pwrite_full(
+                pfi, sec, sizeof(sec), (off_t)fsi * fat.bps);
+            if (!err && bk > 0 && bk + fsi < fat.rsvd) {
+                err = __partfs_pwrite_full(
+                    pfi, sec, sizeof(sec), (off_t)(bk + fsi) * fat.bps);
+            }
+        }
+    }
+
+    for (i = 0; i < fill.nnode; i++) {
+        free(fill.node[i].path);
+    }
+    free(fill.node);
+    free(tab);
+    pthread_mutex_destroy(&fill.lock);
+
+    return err;
+}
+
+/*
+ * functions used to detect and parse supported file systems
+ */
+static int (* const partfs_fs_probes[])(const struct partfs_file *,
+                                        struct partfs_fs *) =
+{
+    __partfs_probe_ext,
+    __partfs_probe_fat,
+
+    NULL,
+};
+
+static void __partfs_fs_free(struct partfs_fs * const fs)
+{
+    __partfs_extents_free(&fs->meta);
+    __partfs_extents_free(&fs->used);
+}
+
+/*
+ * detect the file system within a partition and
+ * determine which regions of the partition it uses
+ *
+ * returns 0 on success, -EINVAL if the file system is not
+ * recognized or another negative errno on failure
+ */
+static int __partfs_probe_fs(const struct partfs_file * const pfi,
+                             struct partfs_fs * const fs)
+{
+    size_t i;
+    int err;
+
+    err = -EINVAL;
+    for (i = 0; err == -EINVAL && partfs_fs_probes[i]; i++) {
+        fs->type = NULL;
+        __partfs_extents_init(&fs->used);
+        __partfs_extents_init(&fs->meta);
+
+        err = partfs_fs_probes[i](pfi, fs);
+        if (err) {
+            __partfs_fs_free(fs);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * find the regions of a partition to be exported: those that
+ * contain data and, if enabled, are in use by the file system.
+ * if the file system isn't recognized, all data is exported.
+ */
+static int __partfs_map_export(const struct partfs_file * const pfi,
+                               struct partfs_extents * const ex)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    int err;
+
+    if (!pdev->fsmap) {
+        err = __partfs_map_data(pfi, ex);
+    } else {
+        struct partfs_extents data;
+
+        __partfs_extents_init(&data);
+
+        err = __partfs_map_data(pfi, &data);
+        if (!err) {
+            struct partfs_fs fs;
+
+            if (__partfs_probe_fs(pfi, &fs) == 0) {
+                err = __partfs_extents_intersect(&data, &fs.used, ex);
+                __partfs_fs_free(&fs);
+            } else {
+                *ex = data;
+                __partfs_extents_init(&data);
+            }
+        }
+
+        __partfs_extents_free(&data);
+    }
+
+    return err;
+}
+
+/*
+ * populate a stat buffer
+ *
+ * ownership and time stamps are populated from the template
+ */
+static void __partfs_stat(struct stat * const st,
+                          const mode_t mode,
+                          const nlink_t nlink,
+                          const off_t size,
+                          const struct stat * const tmpl)
+{
+    memset(st, 0, sizeof(*st));
+
+    st->st_mode     = mode;
+    st->st_nlink    = nlink;
+
+    st->st_uid      = tmpl->st_uid;
+    st->st_gid      = tmpl->st_gid;
+
+    st->st_size     = size;
+    st->st_blksize  = tmpl->st_blksize;
+
+    st->st_atime    = tmpl->st_atime;
+    st->st_mtime    = tmpl->st_mtime;
+    st->st_ctime    = tmpl->st_ctime;
+}
+
+/*
+ * read a number from an attribute of the request queue of a block
+ * device in sysfs. the queue of a partition belongs to the whole
+ * disk, so the parent's is tried as well.
+ *
+ * returns def if the attribute can't be read
+ */
+static unsigned long __partfs_sysfs_queue(const struct stat * const st,
+                                          const char * const attr,
+                                          const unsigned long def)
+{
+    static const char * const dir[] = { "queue", "../queue", NULL };
+    unsigned long val;
+    size_t i;
+    int found;
+
+    for (i = 0, found = 0; !found && dir[i]; i++) {
+        char path[PATH_MAX];
+        FILE * f;
+
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s/%s",
+                 major(st->st_rdev), minor(st->st_rdev), dir[i], attr);
+
+        f = fopen(path, "r");
+        if (f) {
+            found = (fscanf(f, "%lu", &val) == 1);
+            fclose(f);
+        }
+    }
+
+    return found ? val : def;
+}
+
+/*
+ * gather the size and queue limits of a block device. the stat
+ * information is changed to present the device as a regular file
+ * with the device's size.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_blkdev_open(struct partfs_device * const pdev)
+{
+    struct partfs_blkdev * const blk = malloc(sizeof(*blk));
+    int err;
+
+    err = -ENOMEM;
+    if (blk) {
+        const int desc = open(pdev->name, O_RDONLY);
+        uint64_t size;
+        int lbs, pbs;
+
+        err = -errno;
+        if (desc >= 0) {
+            err = 0;
+            if (ioctl(desc, BLKGETSIZE64, &size) != 0 ||
+                ioctl(desc, BLKSSZGET, &lbs) != 0 ||
+                ioctl(desc, BLKPBSZGET, &pbs) != 0) {
+                err = -errno;
+            }
+
+            close(desc);
+        }
+
+        if (!err) {
+            const struct stat * const st = &pdev->st;
+
+            blk->lbs = __partfs_sysfs_queue(st, "logical_block_size", lbs);
+            blk->pbs = __partfs_sysfs_queue(st, "physical_block_size", pbs);
+            blk->maxio = __partfs_sysfs_queue(st, "max_sectors_kb", 128) << 10;
+            blk->rotational = __partfs_sysfs_queue(st, "rotational", 1);
+            blk->discard = __partfs_sysfs_queue(st, "discard_max_bytes", 0) > 0;
+
+            /* requests must be made up of whole logical blocks */
+            blk->maxio = MAX(blk->maxio - blk->maxio % blk->lbs, blk->lbs);
+
+            pthread_mutex_init(&blk->lock, NULL);
+
+            pdev->st.st_mode    = S_IFREG | (pdev->st.st_mode & 07777);
+            pdev->st.st_size    = size;
+            pdev->st.st_blksize = blk->maxio;
+
+            pdev->blk = blk;
+        } else {
+            free(blk);
+        }
+    }
+
+    return err;
+}
+
+static void __partfs_blkdev_close(struct partfs_device * const pdev)
+{
+    if (pdev->blk) {
+        pthread_mutex_destroy(&pdev->blk->lock);
+        free(pdev->blk);
+        pdev->blk = NULL;
+    }
+}
+
+/*
+ * copy a region of the device into the copy of its partition table
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_table_copy(const struct partfs_device * const pdev,
+                               const struct partfs_file * const pfi,
+                               const off_t off, const size_t len)
+{
+    char * const buf = malloc(len);
+    int err;
+
+    err = -ENOMEM;
+    if (buf) {
+        err = __partfs_pread_full(pfi, buf, len, off);
+        if (!err && pwrite(pdev->table, buf, len, off) != (ssize_t)len) {
+            err = -EIO;
+        }
+
+        free(buf);
+    }
+
+    return err;
+}
+
+/*
+ * make a sparse copy of the regions of a device that isn't a file
+ * that libfdisk reads to find the partitions: both ends of the
+ * device, where the primary and backup gpt headers and the dos
+ * partition table live, and the chain of extended boot records of
+ * a dos extended partition, which may be anywhere. the device name
+ * is set to a path that names the copy.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_table_open(struct partfs_device * const pdev)
+{
+    const off_t size = pdev->st.st_size;
+    const off_t head = MIN(size, PARTFS_TABLE_SIZE);
+    struct partfs_file pfi;
+    int err;
+
+    memset(&pfi, 0, sizeof(pfi));
+    pfi.desc = -1;
+    pfi.size = size;
+    pfi.nbd  = pdev->nbd;
+    pfi.vmdk = pdev->vmdk;
+
+    pdev->table = memfd_create("partfs", MFD_CLOEXEC);
+    err = (pdev->table < 0) ? -errno : 0;
+    if (!err) {
+        err = ftruncate(pdev->table, size) ? -errno : 0;
+    }
+    if (!err) {
+        err = __partfs_table_copy(pdev, &pfi, 0, head);
+    }
+    if (!err && size > head) {
+        const off_t tail = MAX(head, size - PARTFS_TABLE_SIZE);
+
+        err = __partfs_table_copy(pdev, &pfi, tail, size - tail);
+    }
+
+    if (!err && head >= 512) {
+        unsigned char mbr[512];
+        int i;
+
+        err = (pread(pdev->table, mbr, sizeof(mbr), 0) == sizeof(mbr)) ?
+            0 : -EIO;
+        for (i = 0; !err && i < 4; i++) {
+            const unsigned char * const e = mbr + 0x1be + 16 * i;
+
+            if (mbr[510] == 0x55 && mbr[511] == 0xaa &&
+                (e[4] == 0x05 || e[4] == 0x0f || e[4] == 0x85)) {
+                const uint64_t ext = __partfs_get_le32(e + 8);
+                uint64_t ebr;
+                int n;
+
+                /*
+                 * the second entry of each record points to
+                 * the next record, relative to the extended
+                 * partition. the length of the chain is bounded
+                 * in case it loops.
+                 */
+                for (ebr = ext, n = 0; !err && ebr && n < 1024; n++) {
+                    unsigned char rec[512];
+
+                    err = -EIO;
+                    if ((ebr + 1) * 512 <= (uint64_t)size) {
+                        err = __partfs_table_copy(pdev, &pfi, ebr * 512, 512);
+                    }
+                    if (!err &&
+                        pread(pdev->table, rec, 512, ebr * 512) != 512) {
+                        err = -EIO;
+                    }
+
+                    if (!err) {
+                        const uint64_t next = __partfs_get_le32(rec + 0x1d2);
+
+                        ebr = (rec[510] == 0x55 && rec[511] == 0xaa &&
+                               next) ? (ext + next) : 0;
+                    }
+                }
+            }
+        }
+    }
+
+    if (!err) {
+        char * name;
+
+        /* the copy is reopened through /proc like any device file */
+        err = (asprintf(&name, "/proc/self/fd/%d", pdev->table) < 0) ?
+            -ENOMEM : 0;
+        if (!err) {
+            free((void *)pdev->name);
+            pdev->name = name;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * lock or unlock a byte range of the device file against other
+ * processes. the locks are open file description locks, so they are
+ * held by partfs as a whole rather than by one of its threads, and
+ * conflict with those of any other process sharing the device file,
+ * including other instances of partfs. a length of 0 reaches to
+ * the end of the file and beyond.
+ *
+ * two kinds of ranges are locked:
+ *
+ *   the first sector, which stands for the partition table, is
+ *   locked for reading from the time the table is read until partfs
+ *   exits. processes that change the table lock it for writing.
+ *
+ *   the window of a partition is locked for writing while any
+ *   handle of the partition is open for writing. as grains are
+ *   allocated at the end of a vmdk no matter which partition they
+ *   belong to, all of a vmdk but the table is locked instead.
+ *
+ * a kernel too old for open file description locks is not an error;
+ * nothing is locked then.
+ *
+ * returns 0 on success, -EBUSY if another process holds a conflicting
+ * lock or another negative errno on failure
+ */
+static int __partfs_range_lock(const struct partfs_device * const pdev,
+                               const short type,
+                               const off_t start, const off_t len)
+{
+    int err;
+
+    err = 0;
+    if (pdev->lockdesc >= 0) {
+        struct flock fl;
+
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type   = type;
+        fl.l_whence = SEEK_SET;
+        fl.l_start  = start;
+        fl.l_len    = len;
+
+        err = fcntl(pdev->lockdesc, F_OFD_SETLK, &fl) ? -errno : 0;
+        if (err == -EAGAIN || err == -EACCES) {
+            err = -EBUSY;
+        } else if (err == -EINVAL) {
+            err = 0;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * open the descriptor on which ranges of the device file are locked
+ * and lock the partition table for reading. nbd exports aren't files
+ * partfs can lock; the server arbitrates between its clients.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_lock_open(struct partfs_device * const pdev)
+{
+    int err;
+
+    /* locking for writing takes a descriptor open for writing */
+    pdev->lockdesc = open(pdev->name, O_RDWR | O_CLOEXEC);
+    if (pdev->lockdesc < 0 && (errno == EACCES || errno == EROFS)) {
+        pdev->lockdesc = open(pdev->name, O_RDONLY | O_CLOEXEC);
+    }
+    err = (pdev->lockdesc < 0) ? -errno : 0;
+
+    if (!err) {
+        err = __partfs_range_lock(pdev, F_RDLCK, 0, PARTFS_LOCK_TABLE);
+    }
+
+    return err;
+}
+
+/*
+ * initial open of the device file and parsing of the partitions
+ *
+ * pdev must point to an existing structure. existing members will
+ * be overwritten without being evaluated. device is the name
+ * of the device file to be opened
+ */
+static int partfs_open_device(struct partfs_device * const pdev,
+                              const char * const device)
+{
+    int err;
+
+    pdev->name   = NULL;
+    pdev->ctx    = NULL;
+    pdev->blk    = NULL;
+    pdev->nbd    = NULL;
+    pdev->vmdk   = NULL;
+    pdev->table  = -1;
+    pdev->lockdesc = -1;
+    pdev->inject = NULL;
+    pdev->cache  = NULL;
+    pdev->pool   = NULL;
+    memset(&pdev->mem, 0, sizeof(pdev->mem));
+    pdev->mem.target = SIZE_MAX;
+    pdev->snapdir = NULL;
+    pdev->fsmap  = 0;
+    pdev->wbcache = 0;
+    pdev->base   = NULL;
+    pdev->part   = NULL;
+    pdev->npart  = 0;
+    pdev->pinmax = 0;
+    pdev->pinned = 0;
+    pdev->writers = 0;
+    memset(&pdev->queue, 0, sizeof(pdev->queue));
+
+    if (__partfs_nbd_uri(device)) {
+        err = __partfs_nbd_open(pdev, device);
+    } else {
+        /*
+         * need the absolute path since fuse may not stay
+         * in the same directory in which it was started
+         */
+        pdev->name = realpath(device, NULL);
+        err = pdev->name ? 0 : -errno;
+
+        if (!err) {
+            err = stat(pdev->name, &pdev->st) ? -errno : 0;
+        }
+        if (!err && S_ISBLK(pdev->st.st_mode)) {
+            err = __partfs_blkdev_open(pdev);
+        } else if (!err && S_ISREG(pdev->st.st_mode) &&
+                   __partfs_vmdk_file(pdev->name)) {
+            err = __partfs_vmdk_open(pdev);
+        }
+
+        /*
+         * keep the partition table from being changed by cooperating
+         * processes for as long as partfs presents its partitions
+         */
+        if (!err) {
+            err = __partfs_lock_open(pdev);
+        }
+    }
+
+    if (!err && (pdev->nbd || pdev->vmdk)) {
+        err = __partfs_table_open(pdev);
+    }
+
+    if (!err) {
+        pdev->ctx = fdisk_new_context();
+        err = pdev->ctx ? 0 : -ENOMEM;
+
+        if (!err) {
+            /* parse the partition table */
+            err = fdisk_assign_device(pdev->ctx, pdev->name, 1);
+            if (!err) {
+                pdev->npart = fdisk_get_npartitions(pdev->ctx);
+                pdev->part  = calloc(MAX(pdev->npart, 1),
+                                     sizeof(*pdev->part));
+                if (!pdev->part) {
+                    fdisk_deassign_device(pdev->ctx, 0);
+                    err = -ENOMEM;
+                }
+            }
+            if (err) {
+                fdisk_unref_context(pdev->ctx);
+                pdev->ctx = NULL;
+            } else {
+                size_t i;
+
+                for (i = 0; i < pdev->npart; i++) {
+                    __partfs_extents_init(&pdev->part[i].zero);
+                    pthread_mutex_init(&pdev->part[i].lock, NULL);
+                    pthread_mutex_init(&pdev->part[i].snaplock, NULL);
+                }
+                pthread_mutex_init(&pdev->lock, NULL);
+                pthread_mutex_init(&pdev->mem.lock, NULL);
+                pthread_cond_init(&pdev->mem.cond, NULL);
+                pthread_mutex_init(&pdev->qlock, NULL);
+                pthread_cond_init(&pdev->qcond, NULL);
+            }
+        }
+    }
+
+    if (err) {
+        __partfs_nbd_close(pdev);
+        __partfs_vmdk_close(pdev);
+        __partfs_blkdev_close(pdev);
+        if (pdev->table >= 0) {
+            close(pdev->table);
+        }
+        if (pdev->lockdesc >= 0) {
+            close(pdev->lockdesc);
+        }
+        free((void *)pdev->name);
+        pdev->name = NULL;
+    }
+
+    return err;
+}
+
+/*
+ * open the device file for access to the device as a whole
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_file_open(struct partfs_device * const pdev,
+                              const int flags,
+                              struct partfs_file * const pfi)
+{
+    /*
+     * open the existing disk/device file. block devices are
+     * accessed directly, bypassing the page cache, unless they
+     * don't support it. writes of partial blocks must read in
+     * the rest of the blocks, so write-only access isn't enough.
+     * neither is it for other device files, as blocks are read
+     * to save them in snapshots before they are written to.
+     */
+    pfi->blk  = pdev->blk;
+    pfi->nbd  = pdev->nbd;
+    pfi->vmdk = pdev->vmdk;
+    pfi->inject = pdev->inject;
+    pfi->cache  = pdev->cache;
+    pfi->pool   = pdev->pool;
+    pfi->mem    = &pdev->mem;
+    pfi->desc = -1;
+    if (pfi->blk) {
+        pfi->desc = open(pdev->name,
+                         ((flags & O_ACCMODE) == O_WRONLY) ?
+                         ((flags & ~O_ACCMODE) | O_RDWR | O_DIRECT) :
+                         (flags | O_DIRECT));
+        if (pfi->desc < 0) {
+            pfi->blk = NULL;
+        }
+    }
+    if (pfi->desc < 0 && (flags & O_ACCMODE) == O_WRONLY) {
+        pfi->desc = open(pdev->name, (flags & ~O_ACCMODE) | O_RDWR);
+    }
+    if (pfi->desc < 0) {
+        pfi->desc = open(pdev->name, flags);
+    }
+
+    pfi->start = 0;
+    pfi->size  = pdev->st.st_size;
+    pfi->part  = NULL;
+
+    return (pfi->desc < 0) ? -errno : 0;
+}
+
+/*
+ * open the device file and fill in the location of the partition
+ * within it. the format and its state are not touched.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_file_init(struct partfs_device * const pdev,
+                              const size_t n, const int flags,
+                              struct partfs_file * const pfi)
+{
+    int err;
+
+    err = __partfs_file_open(pdev, flags, pfi);
+    if (!err) {
+        struct fdisk_partition * pa;
+
+        /*
+         * the partition table of a base image given with -o base
+         * may have fewer slots than that of the device
+         */
+        pa = NULL;
+        if (fdisk_get_partition(pdev->ctx, n, &pa) != 0) {
+            close(pfi->desc);
+            err = -ENOENT;
+        }
+
+        if (!err) {
+            /*
+             * get/save the starting offset
+             * and size of the partition
+             */
+            pfi->start = fdisk_get_sector_size(pdev->ctx) *
+                fdisk_partition_get_start(pa);
+            pfi->size  = __fdisk_partition_get_size(pdev->ctx, pa);
+            pfi->part  = (n < pdev->npart) ? &pdev->part[n] : NULL;
+        }
+
+        fdisk_unref_partition(pa);
+    }
+
+    return err;
+}
+
+/*
+ * release the memory pinned for the metadata of a partition
+ *
+ * must be called with the device lock held
+ */
+static void __partfs_unpin(struct partfs_device * const pdev,
+                           struct partfs_partition * const part)
+{
+    size_t i;
+
+    for (i = 0; i < part->npin; i++) {
+        munmap(part->pin[i].addr, part->pin[i].len);
+        pdev->pinned -= part->pin[i].len;
+        __partfs_mem_uncharge(&pdev->mem, PARTFS_MEM_PIN, part->pin[i].len);
+    }
+
+    free(part->pin);
+    part->pin  = NULL;
+    part->npin = 0;
+}
+
+/*
+ * lock the metadata of the file system within a partition in
+ * memory so that it stays in the page cache while bulk data passes
+ * through. metadata is pinned in order of importance until the
+ * limit for the device is reached or memory is short. anything
+ * previously pinned for the partition is released first.
+ *
+ * must be called with the device lock held
+ */
+static void __partfs_pin(struct partfs_device * const pdev, const size_t n)
+{
+    struct partfs_partition * const part = &pdev->part[n];
+    struct partfs_file pfi;
+
+    __partfs_unpin(pdev, part);
+
+    /*
+     * the device file of an nbd export or a vmdk extent only
+     * holds a copy of its partition table, so there is nothing
+     * to map
+     */
+    if (pdev->table < 0 && __partfs_file_init(pdev, n, O_RDONLY, &pfi) == 0) {
+        struct partfs_fs fs;
+
+        if (__partfs_probe_fs(&pfi, &fs) == 0) {
+            const off_t pg = sysconf(_SC_PAGESIZE);
+            int err;
+
+            part->pin = calloc(MAX(fs.meta.n, 1), sizeof(*part->pin));
+            err = part->pin ? 0 : -ENOMEM;
+
+            while (!err &&
+                   part->npin < fs.meta.n && pdev->pinned < pdev->pinmax &&
+                   !__partfs_mem_over(&pdev->mem)) {
+                const struct partfs_extent * const e =
+                    &fs.meta.v[part->npin];
+                const off_t lo = (pfi.start + e->off) & ~(pg - 1);
+                const size_t len = MIN(
+                    ((pfi.start + e->off + e->len + pg - 1) & ~(pg - 1)) - lo,
+                    pdev->pinmax - pdev->pinned);
+                void * const addr =
+                    mmap(NULL, len, PROT_READ, MAP_SHARED, pfi.desc, lo);
+
+                err = (addr == MAP_FAILED) ? -errno : 0;
+                if (!err && mlock(addr, len) != 0) {
+                    /* most likely RLIMIT_MEMLOCK has been reached */
+                    err = -errno;
+                    munmap(addr, len);
+                }
+
+                if (!err) {
+                    part->pin[part->npin].addr = addr;
+                    part->pin[part->npin].len  = len;
+                    part->npin++;
+
+                    pdev->pinned += len;
+                    __partfs_mem_charge(&pdev->mem, PARTFS_MEM_PIN, len);
+                }
+            }
+
+            __partfs_fs_free(&fs);
+        }
+
+        close(pfi.desc);
+    }
+}
+
+/*
+ * pin the metadata of the file systems within all partitions
+ */
+static void __partfs_pin_all(struct partfs_device * const pdev)
+{
+    struct fdisk_table * tb;
+    struct fdisk_iter * it;
+    struct fdisk_partition * pa;
+
+    tb = NULL;
+    fdisk_get_partitions(pdev->ctx, &tb);
+
+    it = fdisk_new_iter(FDISK_ITER_FORWARD);
+    while (fdisk_table_next_partition(tb, it, &pa) == 0) {
+        const size_t n = fdisk_partition_get_partno(pa);
+
+        if (n < pdev->npart) {
+            __partfs_pin(pdev, n);
+        }
+    }
+
+    fdisk_free_iter(it);
+    fdisk_unref_table(tb);
+}
+
+/*
+ * fold data into a 64-bit fnv-1a hash
+ */
+static uint64_t __partfs_fnv(uint64_t h, const void * const buf,
+                             const size_t len)
+{
+    const unsigned char * const b = buf;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ b[i]) * 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/*
+ * hash of the identity of the device: the device and inode numbers,
+ * size and modification time of an image, or the location, name and
+ * size of an nbd export. with weak, the modification time is left
+ * out, so that the device is recognized even after it was written to.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_cache_key(const struct partfs_device * const pdev,
+                              const int weak, uint64_t * const key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int err;
+
+    if (pdev->nbd) {
+        const struct partfs_nbd * const nbd = pdev->nbd;
+        const char * const where = nbd->path ? nbd->path : nbd->host;
+
+        h = __partfs_fnv(h, where, strlen(where) + 1);
+        if (nbd->port) {
+            h = __partfs_fnv(h, nbd->port, strlen(nbd->port) + 1);
+        }
+        h = __partfs_fnv(h, nbd->name, strlen(nbd->name) + 1);
+        h = __partfs_fnv(h, &nbd->size, sizeof(nbd->size));
+        err = 0;
+    } else {
+        struct stat st;
+
+        err = (pdev->vmdk ?
+               fstat(pdev->vmdk->fd, &st) : stat(pdev->name, &st)) ?
+            -errno : 0;
+        if (!err) {
+            h = __partfs_fnv(h, &st.st_dev, sizeof(st.st_dev));
+            h = __partfs_fnv(h, &st.st_ino, sizeof(st.st_ino));
+            h = __partfs_fnv(h, &st.st_rdev, sizeof(st.st_rdev));
+            h = __partfs_fnv(h, &st.st_size, sizeof(st.st_size));
+            if (!weak) {
+                h = __partfs_fnv(h, &st.st_mtim, sizeof(st.st_mtim));
+            }
+        }
+    }
+
+    *key = h;
+
+    return err;
+}
+
+/*
+ * name of the file in which the hot set of the cache is kept
+ * between mounts. it is named after the identity of the device,
+ * so that a hot set is only used for the device it was saved for.
+ *
+ * returns the name, to be freed by the caller, or NULL
+ */
+static char * __partfs_cache_path(const struct partfs_device * const pdev)
+{
+    uint64_t h;
+    char * path;
+
+    path = NULL;
+    if (__partfs_cache_key(pdev, 0, &h) == 0 &&
+        asprintf(&path, "%s/%016llx.hot",
+                 pdev->cache->dir, (unsigned long long)h) < 0) {
+        path = NULL;
+    }
+
+    return path;
+}
+
+/*
+ * save the numbers of the blocks in the cache, most recently used
+ * first, as the hot set of the device. the file is replaced as a
+ * whole, so a crash leaves either the old or the new hot set.
+ */
+static void __partfs_cache_save(const struct partfs_device * const pdev)
+{
+    struct partfs_cache * const cache = pdev->cache;
+    char * const path = __partfs_cache_path(pdev);
+    char * tmp;
+
+    if (path && cache->n > 0 && asprintf(&tmp, "%s.tmp", path) >= 0) {
+        FILE * const f = fopen(tmp, "wb");
+        int err;
+
+        err = f ? 0 : -errno;
+        if (!err) {
+            const struct partfs_cblock * b;
+            unsigned char hdr[16];
+
+            memcpy(hdr, PARTFS_CACHE_MAGIC, 8);
+            __partfs_put_le32(hdr + 8, PARTFS_CACHE_BLOCK);
+            __partfs_put_le32(hdr + 12, cache->n);
+            if (fwrite(hdr, sizeof(hdr), 1, f) != 1) {
+                err = -EIO;
+            }
+
+            for (b = cache->lru.next; !err && b != &cache->lru; b = b->next) {
+                unsigned char e[8];
+
+                __partfs_put_le64(e, b->blk);
+                if (fwrite(e, sizeof(e), 1, f) != 1) {
+                    err = -EIO;
+                }
+            }
+
+            if (fclose(f) != 0 && !err) {
+                err = -errno;
+            }
+        }
+
+        if (!err && rename(tmp, path) != 0) {
+            err = -errno;
+        }
+        if (err) {
+            unlink(tmp);
+        }
+
+        free(tmp);
+    }
+
+    free(path);
+}
+
+/*
+ * read in the hot set saved by a previous mount of the device. the
+ * blocks are read least recently used first, so that the order of
+ * use is restored, and no more are read than the cache holds. this
+ * stops early if the device is being unmounted or memory is short.
+ */
+static void * __partfs_cache_prefetch(void * const arg)
+{
+    struct partfs_device * const pdev = arg;
+    struct partfs_cache * const cache = pdev->cache;
+    char * const path = __partfs_cache_path(pdev);
+    FILE * const f = path ? fopen(path, "rb") : NULL;
+    unsigned char hdr[16];
+    struct partfs_file pfi;
+
+    if (f && fread(hdr, sizeof(hdr), 1, f) == 1 &&
+        memcmp(hdr, PARTFS_CACHE_MAGIC, 8) == 0 &&
+        __partfs_get_le32(hdr + 8) == PARTFS_CACHE_BLOCK &&
+        __partfs_file_open(pdev, O_RDONLY, &pfi) == 0) {
+        const size_t max = MIN(__partfs_get_le32(hdr + 12), cache->max);
+        uint64_t * const blks = __partfs_mem_alloc(
+            cache->mem, PARTFS_MEM_AHEAD, MAX(max, 1) * sizeof(*blks));
+        size_t n;
+        int stop;
+
+        for (n = 0; blks && n < max; n++) {
+            unsigned char e[8];
+
+            if (fread(e, sizeof(e), 1, f) != 1) {
+                break;
+            }
+            blks[n] = __partfs_get_le64(e);
+        }
+
+        stop = 0;
+        while (!stop && n-- > 0) {
+            const uint64_t blk = blks[n];
+            uint64_t gen;
+            int found;
+
+            pthread_mutex_lock(&cache->lock);
+            stop  = cache->stop || __partfs_mem_over(cache->mem);
+            found = __partfs_cache_find(cache, blk) != NULL;
+            gen   = cache->gen;
+            pthread_mutex_unlock(&cache->lock);
+
+            if (!stop && !found &&
+                (off_t)(blk * PARTFS_CACHE_BLOCK) < pdev->st.st_size) {
+                char * data = __partfs_mem_alloc(cache->mem, PARTFS_MEM_CACHE,
+                                                 PARTFS_CACHE_BLOCK);
+
+                if (data && __partfs_cache_fill(&pfi, data, blk, 1) == 0) {
+                    pthread_mutex_lock(&cache->lock);
+                    if (__partfs_cache_insert(cache, blk, data, gen)) {
+                        data = NULL;
+                    }
+                    pthread_mutex_unlock(&cache->lock);
+                }
+
+                __partfs_mem_free(cache->mem, PARTFS_MEM_CACHE, data,
+                                  PARTFS_CACHE_BLOCK);
+            }
+        }
+
+        __partfs_mem_free(cache->mem, PARTFS_MEM_AHEAD, blks,
+                          MAX(max, 1) * sizeof(*blks));
+        close(pfi.desc);
+    }
+
+    if (f) {
+        fclose(f);
+    }
+    free(path);
+
+    return NULL;
+}
+
+/*
+ * name of the file in which the orders in which the blocks of the
+ * partitions were first read are kept between mounts. unlike the
+ * hot set, it is named after the layout of the partitions rather
+ * than the identity of the device, since the contents of an image
+ * built again in the same way differ but are read in the same order.
+ *
+ * returns the name, to be freed by the caller, or NULL
+ */
+static char * __partfs_trace_path(const struct partfs_device * const pdev)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t n;
+    char * path;
+
+    for (n = 0; n < pdev->npart; n++) {
+        struct fdisk_partition * pa;
+        uint64_t v[2];
+
+        v[0] = v[1] = UINT64_MAX;
+
+        pa = NULL;
+        if (fdisk_get_partition(pdev->ctx, n, &pa) == 0) {
+            v[0] = fdisk_partition_get_start(pa);
+            v[1] = __fdisk_partition_get_size(pdev->ctx, pa);
+        }
+        fdisk_unref_partition(pa);
+
+        h = __partfs_fnv(h, v, sizeof(v));
+    }
+
+    if (asprintf(&path, "%s/%016llx.seq",
+                 pdev->cache->dir, (unsigned long long)h) < 0) {
+        path = NULL;
+    }
+
+    return path;
+}
+
+static int __partfs_trace_cmp(const void * const a, const void * const b)
+{
+    const struct partfs_trace_ent * const x = a, * const y = b;
+
+    return (x->blk > y->blk) - (x->blk < y->blk);
+}
+
+/*
+ * read in the orders recorded by an earlier mount of
+ * a device with the same layout, if there are any
+ */
+static void __partfs_trace_load(struct partfs_device * const pdev)
+{
+    char * const path = __partfs_trace_path(pdev);
+    FILE * const f = path ? fopen(path, "rb") : NULL;
+    unsigned char hdr[16];
+
+    if (f && fread(hdr, sizeof(hdr), 1, f) == 1 &&
+        memcmp(hdr, PARTFS_TRACE_MAGIC, 8) == 0 &&
+        __partfs_get_le32(hdr + 8) == PARTFS_CACHE_BLOCK &&
+        __partfs_get_le32(hdr + 12) == pdev->npart) {
+        size_t n;
+        int err;
+
+        err = 0;
+        for (n = 0; !err && n < pdev->npart; n++) {
+            struct partfs_trace * const tr = &pdev->part[n].trace;
+            unsigned char b[8];
+            size_t cnt, i;
+
+            err = (fread(b, 4, 1, f) == 1) ? 0 : -EIO;
+            cnt = err ? 0 : MIN(__partfs_get_le32(b), PARTFS_TRACE_MAX);
+
+            if (cnt > 0) {
+                tr->old = malloc(cnt * sizeof(*tr->old));
+                tr->idx = malloc(cnt * sizeof(*tr->idx));
+                err = (tr->old && tr->idx) ? 0 : -ENOMEM;
+            }
+            for (i = 0; !err && i < cnt; i++) {
+                err = (fread(b, 8, 1, f) == 1) ? 0 : -EIO;
+                if (!err) {
+                    tr->old[i]     = __partfs_get_le64(b);
+                    tr->idx[i].blk = tr->old[i];
+                    tr->idx[i].i   = i;
+                }
+            }
+
+            if (!err && cnt > 0) {
+                qsort(tr->idx, cnt, sizeof(*tr->idx), __partfs_trace_cmp);
+                tr->nold = cnt;
+            }
+        }
+    }
+
+    if (f) {
+        fclose(f);
+    }
+    free(path);
+}
+
+/*
+ * save the orders in which the blocks of the partitions were first
+ * read during this mount. the earlier orders are kept for partitions
+ * that weren't read at all. the file is replaced as a whole.
+ */
+static void __partfs_trace_save(const struct partfs_device * const pdev)
+{
+    char * const path = __partfs_trace_path(pdev);
+    size_t n, total;
+    char * tmp;
+
+    for (n = 0, total = 0; n < pdev->npart; n++) {
+        total += pdev->part[n].trace.n;
+    }
+
+    if (path && total > 0 && asprintf(&tmp, "%s.tmp", path) >= 0) {
+        FILE * const f = fopen(tmp, "wb");
+        int err;
+
+        err = f ? 0 : -errno;
+        if (!err) {
+            unsigned char hdr[16];
+
+            memcpy(hdr, PARTFS_TRACE_MAGIC, 8);
+            __partfs_put_le32(hdr + 8, PARTFS_CACHE_BLOCK);
+            __partfs_put_le32(hdr + 12, pdev->npart);
+            if (fwrite(hdr, sizeof(hdr), 1, f) != 1) {
+                err = -EIO;
+            }
+
+            for (n = 0; !err && n < pdev->npart; n++) {
+                const struct partfs_trace * const tr = &pdev->part[n].trace;
+                const uint64_t * const seq = tr->n ? tr->seq : tr->old;
+                const size_t cnt = tr->n ? tr->n : tr->nold;
+                unsigned char b[8];
+                size_t i;
+
+                __partfs_put_le32(b, cnt);
+                if (fwrite(b, 4, 1, f) != 1) {
+                    err = -EIO;
+                }
+                for (i = 0; !err && i < cnt; i++) {
+                    __partfs_put_le64(b, seq[i]);
+                    if (fwrite(b, 8, 1, f) != 1) {
+                        err = -EIO;
+                    }
+                }
+            }
+
+            if (fclose(f) != 0 && !err) {
+                err = -errno;
+            }
+        }
+
+        if (!err && rename(tmp, path) != 0) {
+            err = -errno;
+        }
+        if (err) {
+            unlink(tmp);
+        }
+
+        free(tmp);
+    }
+
+    free(path);
+}
+
+/*
+ * read ahead of the partitions' readers along the orders recorded
+ * by an earlier mount, no further than requested by
+ * __partfs_trace_touch(), until the device is unmounted. runs of
+ * the order that are consecutive on the device are read at once.
+ */
+static void * __partfs_trace_readahead(void * const arg)
+{
+    struct partfs_device * const pdev = arg;
+    struct partfs_cache * const cache = pdev->cache;
+    char * const buf = __partfs_mem_alloc(
+        cache->mem, PARTFS_MEM_AHEAD, PARTFS_TRACE_RUN * PARTFS_CACHE_BLOCK);
+    struct partfs_file pfi;
+
+    if (buf && __partfs_file_open(pdev, O_RDONLY, &pfi) == 0) {
+        pthread_mutex_lock(&cache->lock);
+        while (!cache->stop) {
+            struct partfs_trace * tr;
+            uint64_t blk, gen;
+            size_t n, run;
+
+            for (n = 0, tr = NULL; !tr && n < pdev->npart; n++) {
+                if (pdev->part[n].trace.ahead < pdev->part[n].trace.limit) {
+                    tr = &pdev->part[n].trace;
+                }
+            }
+
+            run = 0;
+            if (!tr) {
+                pthread_cond_wait(&cache->cond, &cache->lock);
+            } else if (__partfs_mem_over(cache->mem)) {
+                /* memory is short: what was to be read ahead isn't */
+                tr->ahead = tr->limit;
+            } else {
+                /* skip what is cached already */
+                while (tr->ahead < tr->limit &&
+                       __partfs_cache_find(cache, tr->old[tr->ahead])) {
+                    tr->ahead++;
+                }
+
+                blk = (tr->ahead < tr->limit) ? tr->old[tr->ahead] : 0;
+                while (tr->ahead < tr->limit && run < PARTFS_TRACE_RUN &&
+                       tr->old[tr->ahead] == blk + run &&
+                       !__partfs_cache_find(cache, blk + run) &&
+                       (off_t)((blk + run) * PARTFS_CACHE_BLOCK) <
+                       pdev->st.st_size) {
+                    tr->ahead++;
+                    run++;
+                }
+                if (run == 0 && tr->ahead < tr->limit) {
+                    /* beyond the end of the device */
+                    tr->ahead++;
+                }
+            }
+
+            if (run > 0) {
+                gen = cache->gen;
+                pthread_mutex_unlock(&cache->lock);
+                n = (__partfs_cache_fill(&pfi, buf, blk, run) == 0) ? run : 0;
+                pthread_mutex_lock(&cache->lock);
+
+                while (n-- > 0) {
+                    char * const data = __partfs_mem_alloc(
+                        cache->mem, PARTFS_MEM_CACHE, PARTFS_CACHE_BLOCK);
+
+                    if (data) {
+                        memcpy(data, buf + n * PARTFS_CACHE_BLOCK,
+                               PARTFS_CACHE_BLOCK);
+                        if (__partfs_cache_insert(cache, blk + n, data, gen)) {
+                            cache->ahead++;
+                        } else {
+                            __partfs_mem_free(cache->mem, PARTFS_MEM_CACHE,
+                                              data, PARTFS_CACHE_BLOCK);
+                        }
+                    }
+                }
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        close(pfi.desc);
+    }
+
+    __partfs_mem_free(cache->mem, PARTFS_MEM_AHEAD, buf,
+                      PARTFS_TRACE_RUN * PARTFS_CACHE_BLOCK);
+
+    return NULL;
+}
+
+/*
+ * release the recorded orders of the blocks of the partitions
+ */
+static void __partfs_trace_free(struct partfs_trace * const tr)
+{
+    free(tr->seq);
+    free(tr->seen);
+    free(tr->old);
+    free(tr->idx);
+
+    memset(tr, 0, sizeof(*tr));
+}
+
+/*
+ * write the header of the cache file on local storage
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_ssd_header(const struct partfs_ssd * const ssd,
+                               const uint32_t state, const uint64_t key,
+                               const uint64_t wkey)
+{
+    unsigned char hdr[PARTFS_SSD_HEADER];
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, PARTFS_SSD_MAGIC, 8);
+    __partfs_put_le32(hdr + 8, PARTFS_CACHE_BLOCK);
+    __partfs_put_le32(hdr + 12, state);
+    __partfs_put_le64(hdr + 16, ssd->nslot);
+    __partfs_put_le64(hdr + 24, key);
+    __partfs_put_le64(hdr + 32, wkey);
+
+    return (pwrite(ssd->fd, hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+            fdatasync(ssd->fd) == 0) ? 0 : -EIO;
+}
+
+/*
+ * take up the slots listed in the index of the cache file. if the
+ * file was left in use or was last used with a different device,
+ * only the blocks not yet written back are taken up, and only if
+ * the device is the same one, though it may have been written to;
+ * they are written back straight away.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_ssd_load_index(struct partfs_ssd * const ssd,
+                                   const unsigned char * const hdr,
+                                   const uint64_t key, const uint64_t wkey)
+{
+    const size_t len = (size_t)ssd->nslot * PARTFS_SSD_ENTRY;
+    unsigned char * const idx = malloc(len);
+    int err;
+
+    err = idx ? 0 : -ENOMEM;
+    if (!err && pread(ssd->fd, idx, len, PARTFS_SSD_HEADER) != (ssize_t)len) {
+        err = -EIO;
+    }
+
+    if (!err) {
+        const int clean = __partfs_get_le32(hdr + 12) != PARTFS_SSD_INUSE &&
+            __partfs_get_le64(hdr + 24) == key;
+        const int same = __partfs_get_le64(hdr + 32) == wkey;
+        uint32_t i;
+
+        for (i = 0; i < ssd->nslot; i++) {
+            const unsigned char * const e = idx + (size_t)i * PARTFS_SSD_ENTRY;
+            const uint64_t blk = __partfs_get_le64(e);
+            const int dirty = __partfs_get_le32(e + 8) & PARTFS_SSD_DIRTY;
+
+            if (blk > 0 && (dirty ? same : clean)) {
+                struct partfs_sslot * const sl = &ssd->slot[i];
+                size_t j;
+
+                sl->used  = 1;
+                sl->dirty = dirty;
+                sl->blk   = blk - 1;
+                sl->crc   = __partfs_get_le32(e + 12);
+                for (j = 0; j < sizeof(sl->sect) / sizeof(*sl->sect); j++) {
+                    sl->sect[j] = __partfs_get_le64(e + 16 + 8 * j);
+                }
+                __partfs_ssd_link(ssd, i);
+                ssd->ndirty += dirty;
+            }
+        }
+
+        /*
+         * the device is changed by this, so nothing else can be kept.
+         * neither can the blocks written back, as only the sectors of
+         * them written before were.
+         */
+        if (!clean && ssd->ndirty > 0) {
+            __partfs_ssd_flush(ssd, 0, UINT64_MAX);
+            __partfs_sync_dev(&ssd->pfi, 1);
+
+            for (i = 0; i < ssd->nslot; i++) {
+                if (ssd->slot[i].used && !ssd->slot[i].dirty) {
+                    __partfs_ssd_evict(ssd, i);
+                }
+            }
+        }
+    }
+
+    free(idx);
+
+    return err;
+}
+
+/*
+ * set up a cache file of mib mebibytes on local storage for the
+ * blocks of the device, creating it if necessary. with wb, writes
+ * go to the cache file and are written back to the device later:
+ * when the blocks are evicted, on fsync(2) and when unmounted.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_ssd_open(struct partfs_device * const pdev,
+                             const char * const path,
+                             const unsigned long mib, const int wb)
+{
+    struct partfs_ssd * const ssd = calloc(1, sizeof(*ssd));
+    uint64_t key, wkey;
+    int err;
+
+    err = -ENOMEM;
+    if (ssd) {
+        ssd->wb    = wb;
+        ssd->nslot = MIN(MAX(((uint64_t)mib << 20) / PARTFS_CACHE_BLOCK, 1),
+                         PARTFS_SSD_NONE - 1);
+        for (ssd->nhash = 1; ssd->nhash < ssd->nslot; ssd->nhash <<= 1)
+            ;
+        ssd->nseen = ssd->nhash;
+        ssd->data  = roundup(PARTFS_SSD_HEADER +
+                             (off_t)ssd->nslot * PARTFS_SSD_ENTRY,
+                             PARTFS_SSD_HEADER);
+        ssd->size  = pdev->st.st_size;
+
+        ssd->slot = calloc(ssd->nslot, sizeof(*ssd->slot));
+        ssd->hash = malloc(ssd->nhash * sizeof(*ssd->hash));
+        ssd->seen = calloc(ssd->nseen, sizeof(*ssd->seen));
+        if (ssd->slot && ssd->hash && ssd->seen) {
+            memset(ssd->hash, 0xff, ssd->nhash * sizeof(*ssd->hash));
+            err = 0;
+        }
+
+        /* a read-only device can't take the writes back */
+        if (!err && wb &&
+            ((pdev->vmdk && !pdev->vmdk->rw) ||
+             (pdev->nbd && (pdev->nbd->flags & PARTFS_NBD_FLAG_READ_ONLY)))) {
+            err = -EROFS;
+        }
+
+        ssd->fd = -1;
+        if (!err) {
+            ssd->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            err = (ssd->fd < 0) ? -errno : 0;
+        }
+        if (!err) {
+            err = __partfs_file_open(pdev, O_RDWR, &ssd->pfi);
+            if (!wb && (err == -EACCES || err == -EROFS)) {
+                /*
+                 * without wb, nothing is written back but blocks left
+                 * in the file by a crash, which are kept if the device
+                 * can't be written
+                 */
+                err = __partfs_file_open(pdev, O_RDONLY, &ssd->pfi);
+            }
+            if (err) {
+                close(ssd->fd);
+                ssd->fd = -1;
+            }
+        }
+        if (!err) {
+            unsigned char hdr[PARTFS_SSD_HEADER];
+
+            if (__partfs_cache_key(pdev, 0, &key) != 0 ||
+                __partfs_cache_key(pdev, 1, &wkey) != 0) {
+                key = wkey = 0;
+            }
+
+            pthread_mutex_init(&ssd->lock, NULL);
+
+            if (pread(ssd->fd, hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+                memcmp(hdr, PARTFS_SSD_MAGIC, 8) == 0 &&
+                __partfs_get_le32(hdr + 8) == PARTFS_CACHE_BLOCK &&
+                __partfs_get_le64(hdr + 16) == ssd->nslot &&
+                key != 0) {
+                err = __partfs_ssd_load_index(ssd, hdr, key, wkey);
+            } else if (ftruncate(ssd->fd, 0) != 0 ||
+                       ftruncate(ssd->fd, ssd->data + (off_t)ssd->nslot *
+                                 PARTFS_CACHE_BLOCK) != 0) {
+                err = -errno;
+            }
+
+            if (!err) {
+                /* rewrite the index to match what was taken up */
+                const size_t len = (size_t)ssd->nslot * PARTFS_SSD_ENTRY;
+                unsigned char * const idx = malloc(len);
+                uint32_t i;
+
+                err = idx ? 0 : -ENOMEM;
+                for (i = 0; !err && i < ssd->nslot; i++) {
+                    __partfs_ssd_pack(&ssd->slot[i],
+                                      idx + (size_t)i * PARTFS_SSD_ENTRY);
+                }
+                if (!err && pwrite(ssd->fd, idx, len, PARTFS_SSD_HEADER) !=
+                    (ssize_t)len) {
+                    err = -EIO;
+                }
+
+                free(idx);
+            }
+            if (!err) {
+                err = __partfs_ssd_header(ssd, PARTFS_SSD_INUSE, 0, wkey);
+            }
+
+            if (err) {
+                pthread_mutex_destroy(&ssd->lock);
+                close(ssd->pfi.desc);
+                close(ssd->fd);
+                ssd->fd = -1;
+            }
+        }
+
+        if (!err) {
+            pdev->cache->ssd = ssd;
+        } else {
+            free(ssd->seen);
+            free(ssd->hash);
+            free(ssd->slot);
+            free(ssd);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * write back the blocks in the cache file on local storage that
+ * haven't been yet and close it. it is marked as no longer in use,
+ * along with the identity of the device as it now is, unless some
+ * couldn't be written back, so that those are next time.
+ */
+static void __partfs_ssd_close(struct partfs_device * const pdev)
+{
+    struct partfs_ssd * const ssd = pdev->cache->ssd;
+
+    if (ssd) {
+        uint64_t key, wkey;
+
+        __partfs_ssd_flush(ssd, 0, UINT64_MAX);
+        if (__partfs_sync_dev(&ssd->pfi, 1) == 0 && ssd->ndirty == 0 &&
+            __partfs_cache_key(pdev, 0, &key) == 0 &&
+            __partfs_cache_key(pdev, 1, &wkey) == 0) {
+            __partfs_ssd_header(ssd, 0, key, wkey);
+        }
+
+        pthread_mutex_destroy(&ssd->lock);
+        close(ssd->pfi.desc);
+        close(ssd->fd);
+        free(ssd->seen);
+        free(ssd->hash);
+        free(ssd->slot);
+        free(ssd);
+
+        pdev->cache->ssd = NULL;
+    }
+}
+
+/*
+ * size of a shared memory segment with nset sets of slots. the
+ * blocks start on a page boundary.
+ */
+static size_t __partfs_shm_size(const uint64_t nset)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t meta = sizeof(struct partfs_shm_header) +
+        nset * PARTFS_SHM_WAYS * sizeof(struct partfs_shm_slot);
+
+    return roundup(meta, page) + nset * PARTFS_SHM_WAYS * PARTFS_CACHE_BLOCK;
+}
+
+/*
+ * attach to the shared memory segment holding blocks of the device,
+ * or create one of up to mib mebibytes if no other mount has. the
+ * segment is locked shared for as long as it is attached, so the
+ * kernel keeps count of the mounts using it, even those that exit
+ * without detaching. a mount that finds it can lock the segment
+ * exclusively knows that it's the only user; it sets the segment up
+ * if it is new or was left in an unknown state, and otherwise only
+ * clears out the slots left half filled.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_shm_open(struct partfs_device * const pdev,
+                             const unsigned long mib)
+{
+    struct partfs_shm * const shm = calloc(1, sizeof(*shm));
+    int err;
+
+    err = -ENOMEM;
+    if (shm) {
+        uint64_t key;
+        int excl;
+
+        shm->fd   = -1;
+        shm->base = MAP_FAILED;
+
+        err = __partfs_cache_key(pdev, 0, &key);
+        if (!err && asprintf(&shm->name, "/partfs-%016llx",
+                             (unsigned long long)key) < 0) {
+            shm->name = NULL;
+            err = -ENOMEM;
+        }
+        if (!err) {
+            shm->fd = shm_open(shm->name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+            err = (shm->fd < 0) ? -errno : 0;
+        }
+
+        /* the mounts already attached hold it shared */
+        excl = 0;
+        if (!err) {
+            excl = flock(shm->fd, LOCK_EX | LOCK_NB) == 0;
+            if (!excl) {
+                err = flock(shm->fd, LOCK_SH) ? -errno : 0;
+            }
+        }
+
+        if (!err) {
+            struct stat st;
+
+            err = fstat(shm->fd, &st) ? -errno : 0;
+            if (!err && st.st_size > 0) {
+                shm->size = st.st_size;
+                shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, shm->fd, 0);
+                err = (shm->base == MAP_FAILED) ? -errno : 0;
+            }
+            if (!err && shm->base != MAP_FAILED) {
+                const struct partfs_shm_header * const hdr = shm->base;
+
+                if (shm->size < sizeof(*hdr) ||
+                    memcmp(hdr->magic, PARTFS_SHM_MAGIC,
+                           sizeof(hdr->magic)) != 0 ||
+                    hdr->key != key || hdr->nset == 0 ||
+                    (hdr->nset & (hdr->nset - 1)) != 0 ||
+                    shm->size != __partfs_shm_size(hdr->nset)) {
+                    err = excl ? 0 : -EINVAL;
+                    munmap(shm->base, shm->size);
+                    shm->base = MAP_FAILED;
+                }
+            }
+        }
+
+        if (!err && shm->base == MAP_FAILED) {
+            const uint64_t nslot =
+                MAX(((uint64_t)mib << 20) / PARTFS_CACHE_BLOCK,
+                    PARTFS_SHM_WAYS);
+            uint64_t nset;
+
+            for (nset = 1; nset * 2 * PARTFS_SHM_WAYS <= nslot; nset <<= 1)
+                ;
+
+            /* a new segment, or one left behind in an unknown state */
+            shm->size = __partfs_shm_size(nset);
+            err = (ftruncate(shm->fd, 0) ||
+                   ftruncate(shm->fd, shm->size)) ? -errno : 0;
+            if (!err) {
+                shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, shm->fd, 0);
+                err = (shm->base == MAP_FAILED) ? -errno : 0;
+            }
+            if (!err) {
+                struct partfs_shm_header * const hdr = shm->base;
+
+                hdr->key  = key;
+                hdr->nset = nset;
+                memcpy(hdr->magic, PARTFS_SHM_MAGIC, sizeof(hdr->magic));
+            }
+        }
+
+        if (!err) {
+            const size_t page = sysconf(_SC_PAGESIZE);
+
+            shm->hdr  = shm->base;
+            shm->nset = shm->hdr->nset;
+            shm->slot = (void *)(shm->hdr + 1);
+            shm->data = (char *)shm->base +
+                roundup(sizeof(*shm->hdr) + shm->nset * PARTFS_SHM_WAYS *
+                        sizeof(*shm->slot), page);
+
+            if (excl) {
+                uint64_t i;
+
+                /* slots being filled by mounts that are gone */
+                for (i = 0; i < shm->nset * PARTFS_SHM_WAYS; i++) {
+                    if (shm->slot[i].seq & 1) {
+                        shm->slot[i].blk = 0;
+                        shm->slot[i].seq++;
+                    }
+                }
+                shm->hdr->users = 0;
+
+                err = flock(shm->fd, LOCK_SH) ? -errno : 0;
+            }
+        }
+
+        if (!err) {
+            __atomic_fetch_add(&shm->hdr->users, 1, __ATOMIC_RELAXED);
+
+            /* blocks shared with other mounts can't be written to */
+            pdev->st.st_mode &= ~0222;
+            pdev->cache->shm = shm;
+        } else {
+            if (shm->base != MAP_FAILED) {
+                munmap(shm->base, shm->size);
+            }
+            if (shm->fd >= 0) {
+                close(shm->fd);
+            }
+            free(shm->name);
+            free(shm);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * detach from the shared memory segment, removing it if no other
+ * mount is attached to it
+ */
+static void __partfs_shm_close(struct partfs_device * const pdev)
+{
+    struct partfs_shm * const shm = pdev->cache->shm;
+
+    if (shm) {
+        __atomic_fetch_sub(&shm->hdr->users, 1, __ATOMIC_RELAXED);
+        munmap(shm->base, shm->size);
+
+        if (flock(shm->fd, LOCK_EX | LOCK_NB) == 0) {
+            shm_unlink(shm->name);
+        }
+        close(shm->fd);
+        free(shm->name);
+        free(shm);
+
+        pdev->cache->shm = NULL;
+    }
+}
+
+/*
+ * stop reading in the hot set and ahead, save the new hot set and
+ * orders of reads, close the cache file and free the cache
+ */
+static void __partfs_cache_close(struct partfs_device * const pdev)
+{
+    struct partfs_cache * const cache = pdev->cache;
+
+    if (cache) {
+        size_t i;
+
+        pthread_mutex_lock(&cache->lock);
+        cache->stop = 1;
+        pthread_cond_broadcast(&cache->cond);
+        pthread_mutex_unlock(&cache->lock);
+
+        if (cache->prefetching) {
+            pthread_join(cache->prefetch, NULL);
+        }
+        if (cache->reading) {
+            pthread_join(cache->readahead, NULL);
+        }
+
+        __partfs_ssd_close(pdev);
+        __partfs_shm_close(pdev);
+
+        if (cache->dir) {
+            __partfs_cache_save(pdev);
+            __partfs_trace_save(pdev);
+        }
+        for (i = 0; i < pdev->npart; i++) {
+            __partfs_trace_free(&pdev->part[i].trace);
+        }
+
+        while (cache->lru.next != &cache->lru) {
+            __partfs_cache_evict(cache, cache->lru.next);
+        }
+        while (cache->zlru.next != &cache->zlru) {
+            __partfs_cache_zevict(cache, cache->zlru.next);
+        }
+
+        pthread_cond_destroy(&cache->cond);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->hash);
+        free(cache->zhash);
+        __partfs_mem_free(cache->mem, PARTFS_MEM_ZCACHE, cache->zbuf,
+                          PARTFS_CACHE_BLOCK);
+        free(cache->dir);
+        free(cache);
+
+        pdev->cache = NULL;
+    }
+}
+
+/*
+ * set up a pool of threads to share the work of large reads and
+ * writes. the threads themselves are started by partfs_init(), as
+ * they would not survive fuse daemonizing.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_pool_open(struct partfs_device * const pdev,
+                              const size_t nthread)
+{
+    struct partfs_pool * const pool = calloc(1, sizeof(*pool));
+    int err;
+
+    err = -ENOMEM;
+    if (pool) {
+        pool->thread = calloc(nthread, sizeof(*pool->thread));
+        if (pool->thread) {
+            pool->nthread = nthread;
+            pool->tail    = &pool->head;
+            pthread_cond_init(&pool->work, NULL);
+            pthread_cond_init(&pool->done, NULL);
+            pthread_mutex_init(&pool->lock, NULL);
+
+            pdev->pool = pool;
+            err = 0;
+        } else {
+            free(pool);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * start the threads of the pool. if not all of them can be started,
+ * requests are shared among those that were.
+ */
+static void __partfs_pool_start(struct partfs_pool * const pool)
+{
+    while (pool->started < pool->nthread &&
+           pthread_create(&pool->thread[pool->started], NULL,
+                          __partfs_pool_worker, pool) == 0) {
+        pool->started++;
+    }
+}
+
+/*
+ * stop the threads of the pool and free it
+ */
+static void __partfs_pool_close(struct partfs_device * const pdev)
+{
+    struct partfs_pool * const pool = pdev->pool;
+
+    if (pool) {
+        size_t i;
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stop = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < pool->started; i++) {
+            pthread_join(pool->thread[i], NULL);
+        }
+
+        pthread_cond_destroy(&pool->work);
+        pthread_cond_destroy(&pool->done);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->thread);
+        free(pool);
+
+        pdev->pool = NULL;
+    }
+}
+
+/*
+ * find the directory of the cgroup partfs runs in, in the unified
+ * cgroup hierarchy
+ *
+ * returns the directory, to be freed by the caller, or NULL
+ */
+static char * __partfs_mem_cgroup(void)
+{
+    FILE * const f = fopen("/proc/self/cgroup", "re");
+    char * dir;
+
+    dir = NULL;
+    if (f) {
+        char * line;
+        size_t size;
+
+        line = NULL;
+        size = 0;
+        while (!dir && getline(&line, &size, f) > 0) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                if (asprintf(&dir, "/sys/fs/cgroup%s", line + 3) < 0) {
+                    dir = NULL;
+                }
+            }
+        }
+
+        free(line);
+        fclose(f);
+    }
+
+    return dir;
+}
+
+/*
+ * read a small file, such as one of a cgroup, into a string
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_mem_file(const char * const dir, const char * const name,
+                             char * const buf, const size_t size)
+{
+    char * path;
+    int err;
+
+    err = -ENOMEM;
+    buf[0] = '\0';
+    if (asprintf(&path, "%s/%s", dir, name) >= 0) {
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+        const ssize_t n = (fd >= 0) ? read(fd, buf, size - 1) : -1;
+
+        err = (n < 0) ? -errno : 0;
+        buf[MAX(n, 0)] = '\0';
+
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(path);
+    }
+
+    return err;
+}
+
+/*
+ * whether memory is short in the cgroup partfs runs in: its tasks
+ * stalled waiting for memory for too much of the last ten seconds,
+ * or it is close to its memory limit. outside of a cgroup, or if the
+ * cgroup doesn't say, the stalls of the whole system count. the page
+ * cache that can be reclaimed without a stall, which fills up to the
+ * limit as partitions are read and written, doesn't count.
+ */
+static int __partfs_mem_short(struct partfs_mem * const mem)
+{
+    char buf[512];
+    int ret;
+
+    ret = 0;
+    if ((mem->cgroup &&
+         __partfs_mem_file(mem->cgroup, "memory.pressure",
+                           buf, sizeof(buf)) == 0) ||
+        __partfs_mem_file("/proc/pressure", "memory", buf, sizeof(buf)) == 0) {
+        const char * const some = strstr(buf, "some avg10=");
+
+        if (some) {
+            const unsigned long stall =
+                strtod(some + strlen("some avg10="), NULL) * 100;
+
+            __atomic_store_n(&mem->stall, stall, __ATOMIC_RELAXED);
+            ret = stall >= PARTFS_MEM_PSI;
+        }
+    }
+
+    if (mem->cgroup &&
+        __partfs_mem_file(mem->cgroup, "memory.max", buf, sizeof(buf)) == 0 &&
+        isdigit((unsigned char)buf[0])) {
+        /* "max" if the cgroup has no limit */
+        const unsigned long long max = strtoull(buf, NULL, 10);
+
+        if (__partfs_mem_file(mem->cgroup, "memory.current",
+                              buf, sizeof(buf)) == 0 &&
+            isdigit((unsigned char)buf[0])) {
+            unsigned long long cur = strtoull(buf, NULL, 10);
+            char stat[4096];
+
+            if (__partfs_mem_file(mem->cgroup, "memory.stat",
+                                  stat, sizeof(stat)) == 0) {
+                const char * const f = strstr(stat, "inactive_file ");
+
+                if (f && (f == stat || f[-1] == '\n')) {
+                    cur -= MIN(cur, strtoull(f + strlen("inactive_file "),
+                                             NULL, 10));
+                }
+            }
+
+            if (cur + max / PARTFS_MEM_HEADROOM > max) {
+                ret = 1;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * look for memory becoming short every PARTFS_MEM_INTERVAL seconds.
+ * for as long as it is, the memory partfs may use is halved each
+ * time, down from what it uses, and the caches are trimmed to fit.
+ * once it no longer is, the memory that may be used grows back by an
+ * eighth of the limit each time.
+ */
+static void * __partfs_mem_watch(void * const arg)
+{
+    struct partfs_device * const pdev = arg;
+    struct partfs_mem * const mem = &pdev->mem;
+
+    pthread_mutex_lock(&mem->lock);
+    while (!mem->stop) {
+        size_t target = __atomic_load_n(&mem->target, __ATOMIC_RELAXED);
+        struct timespec ts;
+
+        pthread_mutex_unlock(&mem->lock);
+
+        if (__partfs_mem_short(mem)) {
+            target = MIN(target,
+                         __atomic_load_n(&mem->total, __ATOMIC_RELAXED)) / 2;
+            __atomic_add_fetch(&mem->squeezes, 1, __ATOMIC_RELAXED);
+        } else {
+            target = MIN(mem->limit, target + mem->limit / 8);
+        }
+        __atomic_store_n(&mem->target, target, __ATOMIC_RELAXED);
+
+        if (pdev->cache && __partfs_mem_over(mem)) {
+            pthread_mutex_lock(&pdev->cache->lock);
+            __partfs_cache_trim(pdev->cache);
+            pthread_mutex_unlock(&pdev->cache->lock);
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += PARTFS_MEM_INTERVAL;
+
+        pthread_mutex_lock(&mem->lock);
+        if (!mem->stop) {
+            pthread_cond_timedwait(&mem->cond, &mem->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&mem->lock);
+
+    return NULL;
+}
+
+/*
+ * start watching for memory becoming short, if there is a limit to
+ * keep to. like the other threads, it is started by partfs_init(),
+ * as it would not survive fuse daemonizing.
+ */
+static void __partfs_mem_start(struct partfs_device * const pdev)
+{
+    struct partfs_mem * const mem = &pdev->mem;
+
+    if (mem->limit > 0) {
+        mem->cgroup   = __partfs_mem_cgroup();
+        mem->watching = pthread_create(
+            &mem->watcher, NULL, __partfs_mem_watch, pdev) == 0;
+    }
+}
+
+/*
+ * stop watching for memory becoming short. the memory in use is
+ * still accounted for until the device is closed.
+ */
+static void __partfs_mem_stop(struct partfs_device * const pdev)
+{
+    struct partfs_mem * const mem = &pdev->mem;
+
+    if (mem->watching) {
+        pthread_mutex_lock(&mem->lock);
+        mem->stop = 1;
+        pthread_cond_broadcast(&mem->cond);
+        pthread_mutex_unlock(&mem->lock);
+
+        pthread_join(mem->watcher, NULL);
+        mem->watching = 0;
+    }
+
+    free(mem->cgroup);
+    mem->cgroup = NULL;
+}
+
+/*
+ * called just before the main fuse loop starts
+ *
+ * private_data is the partfs_device
+ */
+static void * partfs_init(struct fuse_conn_info * const conn)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+
+    if (pdev->nbd) {
+        __partfs_nbd_start(pdev->nbd);
+    }
+    if (pdev->base && pdev->base->nbd) {
+        __partfs_nbd_start(pdev->base->nbd);
+    }
+    if (pdev->pool) {
+        __partfs_pool_start(pdev->pool);
+    }
+    __partfs_mem_start(pdev);
+
+    if (pdev->wbcache) {
+        /*
+         * have the kernel hold on to dirty pages and write them
+         * back in requests as large as the connection allows. a
+         * libfuse too old to know about writeback caching still
+         * gets large writes rather than one page at a time.
+         */
+        conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+        conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+#endif
+    }
+
+    /*
+     * read in the blocks that were in use when last unmounted, and
+     * read ahead of the partitions' readers along the orders in which
+     * they read the blocks when a device of this layout was last mounted
+     */
+    if (pdev->cache && pdev->cache->dir) {
+        pdev->cache->prefetching = pthread_create(
+            &pdev->cache->prefetch, NULL,
+            __partfs_cache_prefetch, pdev) == 0;
+
+        __partfs_trace_load(pdev);
+        pdev->cache->reading = pthread_create(
+            &pdev->cache->readahead, NULL,
+            __partfs_trace_readahead, pdev) == 0;
+    }
+
+    /*
+     * memory locks are not inherited across fork(), so metadata
+     * is pinned here rather than before fuse daemonizes
+     */
+    if (pdev->pinmax > 0) {
+        pthread_mutex_lock(&pdev->lock);
+        __partfs_pin_all(pdev);
+        pthread_mutex_unlock(&pdev->lock);
+    }
+
+    return pdev;
+}
+
+/*
+ * release the resources associated with a device
+ * opened with partfs_open_device()
+ */
+static void partfs_close_device(struct partfs_device * const pdev)
+{
+    size_t i;
+
+    /* before the cache goes, as it trims the cache */
+    __partfs_mem_stop(pdev);
+
+    /* before the partitions go, as the cache records their reads */
+    __partfs_cache_close(pdev);
+    __partfs_pool_close(pdev);
+
+    for (i = 0; i < pdev->npart; i++) {
+        __partfs_unpin(pdev, &pdev->part[i]);
+
+        __partfs_extents_free(&pdev->part[i].zero);
+        pthread_mutex_destroy(&pdev->part[i].lock);
+
+        while (pdev->part[i].snap) {
+            struct partfs_snap * const sn = pdev->part[i].snap;
+
+            pdev->part[i].snap = sn->next;
+            __partfs_snap_free(sn);
+        }
+        pthread_mutex_destroy(&pdev->part[i].snaplock);
+    }
+    free(pdev->part);
+    free(pdev->snapdir);
+    pthread_cond_destroy(&pdev->mem.cond);
+    pthread_mutex_destroy(&pdev->mem.lock);
+    pthread_cond_destroy(&pdev->qcond);
+    pthread_mutex_destroy(&pdev->qlock);
+    pthread_mutex_destroy(&pdev->lock);
+
+    fdisk_deassign_device(pdev->ctx, 0);
+    fdisk_unref_context(pdev->ctx);
+    __partfs_nbd_close(pdev);
+    __partfs_vmdk_close(pdev);
+    __partfs_blkdev_close(pdev);
+    __partfs_inject_close(pdev);
+    if (pdev->table >= 0) {
+        close(pdev->table);
+    }
+    if (pdev->lockdesc >= 0) {
+        close(pdev->lockdesc);
+    }
+    free((void *)pdev->name);
+}
+
+/* called just before fuse exits */
+static void partfs_destroy(void * const priv)
+{
+    struct partfs_device * const pdev = priv;
+
+    if (pdev->base) {
+        partfs_close_device(pdev->base);
+    }
+
+    partfs_close_device(pdev);
+}
+
+/*
+ * get attributes--stat(2), essentially--for a file or directory
+ */
+static int partfs_getattr(const char * const path, struct stat * const st)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    int ret;
+
+    if (strcmp(path, "/") == 0) {
+        __partfs_stat(st, S_IFDIR | 0755, 2, 0, &pdev->st);
+        ret = 0;
+    } else {
+        const struct partfs_format * fmt;
+        ssize_t n;
+
+        ret = -ENOENT;
+
+        /*
+         * extract the partition number from the path name
+         * and gather statistics for it
+         */
+        n = __partfs_parse_path(path, &fmt);
+        if (n >= 0) {
+            struct fdisk_partition * pa;
+            off_t size;
+
+            pa = NULL;
+            fdisk_get_partition(pdev->ctx, n, &pa);
+
+            size = __fdisk_partition_get_size(pdev->ctx, pa);
+            ret = 0;
+
+            fdisk_unref_partition(pa);
+
+            /*
+             * formats other than the raw one may need to
+             * look at the partition to determine their size
+             */
+            if (fmt->length) {
+                struct partfs_file pfi;
+
+                ret = __partfs_file_init(pdev, n, O_RDONLY, &pfi);
+                if (ret == 0) {
+                    pfi.fmt  = fmt;
+                    pfi.priv = NULL;
+
+                    ret = fmt->length(&pfi, &size);
+                    close(pfi.desc);
+                }
+            }
+
+            if (ret == 0) {
+                __partfs_stat(st, pdev->st.st_mode & ~fmt->mask, 1,
+                              size, &pdev->st);
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * list directory contents
+ */
+static int partfs_readdir(const char * const path,
+                          void * const buf,
+                          fuse_fill_dir_t fill,
+                          off_t offs,
+                          struct fuse_file_info * const fi)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+
+    int ret;
+
+    ret = -ENOENT;
+    if (strcmp(path, "/") == 0) {
+        struct fdisk_table * tb;
+        struct fdisk_iter * it;
+        struct fdisk_partition * pa;
+
+        struct stat st;
+
+        /*
+         * use ownership and time stamps from the device file
+         * for the top level directory
+         */
+        __partfs_stat(&st, S_IFDIR | 0755, 2, 0, &pdev->st);
+        fill(buf, ".",  &st, 0);
+
+        /* fuse will fill in information for the parent directoy */
+        fill(buf, "..", NULL, 0);
+
+        /* load the entire partition table */
+        tb = NULL;
+        fdisk_get_partitions(pdev->ctx, &tb);
+
+        /* return directory entries and information for each partition */
+        it = fdisk_new_iter(FDISK_ITER_FORWARD);
+        while (fdisk_table_next_partition(tb, it, &pa) == 0) {
+            char num[16];
+
+            snprintf(num, sizeof(num),
+                     PARTFS_NAME_PREFIX "%zu",
+                     fdisk_partition_get_partno(pa) + 1);
+
+            __partfs_stat(&st, pdev->st.st_mode, 1,
+                          __fdisk_partition_get_size(pdev->ctx, pa),
+                          &pdev->st);
+
+            fill(buf, num, &st, 0);
+        }
+
+        fdisk_free_iter(it);
+        fdisk_unref_table(tb);
+
+        ret = 0;
+    }
+
+    return ret;
+}
+
+/*
+ * lock the window of a partition being opened for writing against
+ * other processes, unless it is already open for writing
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_window_lock(struct partfs_device * const pdev,
+                                const struct partfs_file * const pfi)
+{
+    struct partfs_partition * const part = pfi->part;
+    int err;
+
+    err = 0;
+    if (part && pfi->size > 0) {
+        pthread_mutex_lock(&pdev->lock);
+        if (pdev->vmdk) {
+            if (pdev->writers == 0) {
+                err = __partfs_range_lock(pdev, F_WRLCK,
+                                          PARTFS_LOCK_TABLE, 0);
+            }
+        } else if (part->writers == 0) {
+            err = __partfs_range_lock(pdev, F_WRLCK, pfi->start, pfi->size);
+        }
+        if (!err) {
+            part->writers++;
+            pdev->writers++;
+        }
+        pthread_mutex_unlock(&pdev->lock);
+    }
+
+    return err;
+}
+
+/*
+ * undo __partfs_window_lock() as a handle open for writing is closed.
+ * blocks of the window still waiting in the cache file to be written
+ * back are written first, as another process may write the window as
+ * soon as the lock is released.
+ */
+static void __partfs_window_unlock(struct partfs_device * const pdev,
+                                   const struct partfs_file * const pfi)
+{
+    struct partfs_partition * const part = pfi->part;
+
+    if (part && pfi->size > 0) {
+        struct partfs_ssd * const ssd = pfi->cache ? pfi->cache->ssd : NULL;
+
+        if (ssd) {
+            pthread_mutex_lock(&ssd->lock);
+            __partfs_ssd_flush(ssd, pfi->start / PARTFS_CACHE_BLOCK,
+                               (pfi->start + pfi->size - 1) /
+                               PARTFS_CACHE_BLOCK);
+            pthread_mutex_unlock(&ssd->lock);
+        }
+
+        pthread_mutex_lock(&pdev->lock);
+        part->writers--;
+        pdev->writers--;
+        if (pdev->vmdk) {
+            if (pdev->writers == 0) {
+                __partfs_range_lock(pdev, F_UNLCK, PARTFS_LOCK_TABLE, 0);
+            }
+        } else if (part->writers == 0) {
+            __partfs_range_lock(pdev, F_UNLCK, pfi->start, pfi->size);
+        }
+        pthread_mutex_unlock(&pdev->lock);
+    }
+}
+
+/*
+ * open a file (partition) within the device
+ */
+static int partfs_open(const char * const path,
+                       struct fuse_file_info * const fi)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    struct partfs_file * const pfi = malloc(sizeof(*pfi));
+    int err;
+
+    err = -ENOMEM;
+    if (pfi) {
+        const ssize_t n = __partfs_parse_path(path, &pfi->fmt);
+        int flags = fi->flags;
+
+        pfi->priv = NULL;
+
+        if (pdev->wbcache && pfi->fmt == &partfs_format_raw) {
+            /*
+             * when caching writes, the kernel reads in the rest of
+             * partially written pages through any handle and takes
+             * care of appending itself
+             */
+            if ((flags & O_ACCMODE) == O_WRONLY) {
+                flags = (flags & ~O_ACCMODE) | O_RDWR;
+            }
+            flags &= ~O_APPEND;
+        }
+
+        err = -EACCES;
+        if ((flags & O_ACCMODE) != O_RDONLY &&
+            pdev->cache && pdev->cache->shm) {
+            /* other mounts would go on reading what was overwritten */
+            err = -EROFS;
+        } else if ((flags & O_ACCMODE) == O_RDONLY || pfi->fmt->write) {
+            err = __partfs_file_init(pdev, n, flags, pfi);
+        }
+
+        /* other processes may be writing other partitions */
+        if (!err && (flags & O_ACCMODE) != O_RDONLY) {
+            err = __partfs_window_lock(pdev, pfi);
+            if (err) {
+                close(pfi->desc);
+            }
+        }
+
+        if (!err) {
+            /* save the file structure */
+            fi->fh = (uintptr_t)pfi;
+
+            if (pfi->fmt->open) {
+                err = pfi->fmt->open(path, fi);
+                if (err) {
+                    if ((flags & O_ACCMODE) != O_RDONLY) {
+                        __partfs_window_unlock(pdev, pfi);
+                    }
+                    close(pfi->desc);
+                }
+            }
+        }
+
+        if (err) {
+            free(pfi);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * this function is not actually part of the fuse api but
+ * has an signature similar to what it would probably look
+ * like if it was.
+ *
+ * path is the path name to the file
+ * off is the offset to which to seek within the open
+ *   file/partition; whence is assumed to be SEEK_SET
+ * fi is the file information associated with the open() call
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int partfs_lseek(const char * const path,
+                        const off_t off,
+                        struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    int ret;
+
+    ret = -EINVAL;
+    if (off >= 0 && off <= pfi->size) {
+        /*
+         * off refers to an offset within a partition; however,
+         * the file system actually opens the device file itself
+         * underneath the covers, so the lseek actually seeks to
+         * the appropriate location within the device file
+         */
+        ret = (lseek(pfi->desc, pfi->start + off, SEEK_SET) >= 0) ? 0 : -errno;
+    }
+
+    return ret;
+}
+
+/*
+ * read data from a partition in the raw format
+ */
+static int __partfs_raw_read(const char * const path,
+                             char * const buf, size_t len,
+                             off_t off,
+                             struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+
+    int ret;
+
+    ret = partfs_lseek(path, off, fi);
+    if (ret == 0) {
+        const size_t n = MIN(pfi->size - off, len);
+
+        ret = __partfs_pread_full(pfi, buf, n, off);
+        if (ret == 0) {
+            ret = n;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * write data to a partition in the raw format
+ */
+static int __partfs_raw_write(const char * const path,
+                              const char * const buf, const size_t len,
+                              const off_t off,
+                              struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+
+    int ret;
+
+    ret = partfs_lseek(path, off, fi);
+    if (off >= 0) {
+        if (ret != 0) {
+            /*
+             * if offset was positive, but the lseek failed, then
+             * the offset is beyond the end of the partition
+             */
+            ret = -EFBIG;
+        } else {
+            const size_t n = MIN(pfi->size - off, len);
+
+            ret = __partfs_pwrite_full(pfi, buf, n, off);
+            if (ret == 0) {
+                ret = n;
+            }
+        }
+    }
+
+    return ret;
+}
+
+static const struct partfs_format partfs_format_raw =
+{
+    .suffix         = "",
+    .mask           = 0,
+
+    .read           = __partfs_raw_read,
+    .write          = __partfs_raw_write,
+};
+
+static void __partfs_simg_free(struct partfs_simg * const simg)
+{
+    free(simg->chunk);
+    simg->chunk  = NULL;
+    simg->nchunk = 0;
+}
+
+/*
+ * block size of a sparse image describing a partition of the given
+ * size: the largest block size (up to 4k) that divides the partition
+ */
+static size_t __partfs_simg_blksz(const off_t size)
+{
+    size_t blksz;
+
+    for (blksz = 4096; blksz > 1 && size % blksz != 0; blksz /= 2)
+        ;
+
+    return blksz;
+}
+
+/*
+ * add a chunk to the end of a sparse image
+ */
+static int __partfs_simg_add(struct partfs_simg * const simg,
+                             const unsigned int type,
+                             const off_t blk, const off_t nblk)
+{
+    struct partfs_simg_chunk * const chunk =
+        realloc(simg->chunk, (simg->nchunk + 1) * sizeof(*chunk));
+    int err;
+
+    err = -ENOMEM;
+    if (chunk) {
+        simg->chunk = chunk;
+
+        chunk[simg->nchunk].type = type;
+        chunk[simg->nchunk].blk  = blk;
+        chunk[simg->nchunk].nblk = nblk;
+        chunk[simg->nchunk].off  = simg->length;
+        simg->nchunk++;
+
+        simg->length += PARTFS_SIMG_CHUNK_HEADER_SIZE;
+        if (type == PARTFS_SIMG_CHUNK_RAW) {
+            simg->length += nblk * simg->blksz;
+        } else if (type == PARTFS_SIMG_CHUNK_FILL) {
+            simg->length += sizeof(uint32_t);
+        }
+
+        err = 0;
+    }
+
+    return err;
+}
+
+/*
+ * determine the layout of a sparse image describing a partition
+ * of the given size. the extents describe the regions that are to
+ * be included in the image; everything else is marked as "don't
+ * care". extents are expanded as necessary to the block size.
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_simg_layout(struct partfs_simg * const simg,
+                                const off_t size,
+                                const struct partfs_extents * const ex)
+{
+    const off_t maxraw = PARTFS_SIMG_MAX_RAW;
+    off_t blk;
+    size_t i;
+    int err;
+
+    simg->blksz  = __partfs_simg_blksz(size);
+    simg->nblk   = size / simg->blksz;
+    simg->chunk  = NULL;
+    simg->nchunk = 0;
+    simg->length = PARTFS_SIMG_HEADER_SIZE;
+
+    err = 0;
+    for (i = 0, blk = 0; !err && i <= ex->n; i++) {
+        off_t first, last;
+
+        if (i < ex->n) {
+            first = ex->v[i].off / simg->blksz;
+            last  = (ex->v[i].off + ex->v[i].len + simg->blksz - 1) /
+                simg->blksz;
+        } else {
+            first = last = simg->nblk;
+        }
+
+        /* rounding may have caused the extent to overlap the last one */
+        first = MAX(first, blk);
+
+        if (first > blk) {
+            err = __partfs_simg_add(
+                simg, PARTFS_SIMG_CHUNK_DONT_CARE, blk, first - blk);
+        }
+
+        for (blk = first; !err && blk < last; ) {
+            const off_t n = MIN(last - blk, maxraw / (off_t)simg->blksz);
+
+            err = __partfs_simg_add(simg, PARTFS_SIMG_CHUNK_RAW, blk, n);
+            blk += n;
+        }
+
+        blk = MAX(blk, first);
+    }
+
+    if (err) {
+        __partfs_simg_free(simg);
+    }
+
+    return err;
+}
+
+/*
+ * read from a sparse image. headers are generated on the fly,
+ * and the data is read from the partition.
+ *
+ * returns the number of bytes read or a negative errno
+ */
+static int __partfs_simg_read(const struct partfs_simg * const simg,
+                              const struct partfs_file * const pfi,
+                              char * const buf, size_t len, off_t off)
+{
+    size_t done;
+    int err;
+
+    len = (off < simg->length) ? MIN(len, simg->length - off) : 0;
+
+    err = 0;
+    for (done = 0; !err && done < len; ) {
+        unsigned char hdr[PARTFS_SIMG_HEADER_SIZE];
+        off_t pos, end;
+        size_t n;
+
+        pos = off + done;
+
+        if (pos < PARTFS_SIMG_HEADER_SIZE) {
+            __partfs_put_le32(hdr, PARTFS_SIMG_MAGIC);
+            __partfs_put_le16(hdr + 4, 1);
+            __partfs_put_le16(hdr + 6, 0);
+            __partfs_put_le16(hdr + 8, PARTFS_SIMG_HEADER_SIZE);
+            __partfs_put_le16(hdr + 10, PARTFS_SIMG_CHUNK_HEADER_SIZE);
+            __partfs_put_le32(hdr + 12, simg->blksz);
+            __partfs_put_le32(hdr + 16, simg->nblk);
+            __partfs_put_le32(hdr + 20, simg->nchunk);
+            __partfs_put_le32(hdr + 24, 0);
+
+            n = MIN(len - done, PARTFS_SIMG_HEADER_SIZE - pos);
+            memcpy(buf + done, hdr + pos, n);
+        } else {
+            const struct partfs_simg_chunk * c;
+            size_t lo, hi;
+
+            /* find the last chunk that starts at or before pos */
+            for (lo = 0, hi = simg->nchunk; hi - lo > 1; ) {
+                const size_t mid = (lo + hi) / 2;
+
+                if (simg->chunk[mid].off <= pos) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+
+            c   = &simg->chunk[lo];
+            end = (lo + 1 < simg->nchunk) ?
+                simg->chunk[lo + 1].off : simg->length;
+
+            pos -= c->off;
+            if (pos < PARTFS_SIMG_CHUNK_HEADER_SIZE) {
+                __partfs_put_le16(hdr, c->type);
+                __partfs_put_le16(hdr + 2, 0);
+                __partfs_put_le32(hdr + 4, c->nblk);
+                __partfs_put_le32(hdr + 8, end - c->off);
+
+                n = MIN(len - done, PARTFS_SIMG_CHUNK_HEADER_SIZE - pos);
+                memcpy(buf + done, hdr + pos, n);
+            } else {
+                pos -= PARTFS_SIMG_CHUNK_HEADER_SIZE;
+                n = MIN(len - done, end - c->off -
+                        PARTFS_SIMG_CHUNK_HEADER_SIZE - pos);
+
+                if (c->type == PARTFS_SIMG_CHUNK_RAW) {
+                    err = __partfs_pread_full(
+                        pfi, buf + done, n, c->blk * simg->blksz + pos);
+                } else {
+                    /* fill chunks generated by partfs are always zero */
+                    memset(buf + done, 0, n);
+                }
+            }
+        }
+
+        done += n;
+    }
+
+    return err ? err : (int)done;
+}
+
+/*
+ * whether a file was opened for writing
+ */
+static int __partfs_file_writable(const struct fuse_file_info * const fi)
+{
+    return (fi->flags & O_ACCMODE) != O_RDONLY;
+}
+
+/*
+ * parse the header of a chunk once it has been received
+ */
+static int __partfs_simg_chunk(const struct partfs_file * const pfi,
+                               struct partfs_simg_writer * const w)
+{
+    const off_t nblk  = __partfs_get_le32(w->hdr + 4);
+    const off_t total = __partfs_get_le32(w->hdr + 8);
+    int err;
+
+    w->type = __partfs_get_le16(w->hdr);
+    w->nblk = nblk;
+    w->left = total - (off_t)w->chdrsz;
+
+    err = -EINVAL;
+    if (w->blk + nblk > w->nblk_total ||
+        (w->blk + nblk) * (off_t)w->blksz > pfi->size) {
+        err = -EFBIG;
+    } else if (w->type == PARTFS_SIMG_CHUNK_RAW) {
+        err = (w->left == nblk * (off_t)w->blksz) ? 0 : -EINVAL;
+    } else if (w->type == PARTFS_SIMG_CHUNK_FILL ||
+               w->type == PARTFS_SIMG_CHUNK_CRC32) {
+        err = (w->left == sizeof(w->fill)) ? 0 : -EINVAL;
+    } else if (w->type == PARTFS_SIMG_CHUNK_DONT_CARE) {
+        err = (w->left == 0) ? 0 : -EINVAL;
+    }
+
+    return err;
+}
+
+/*
+ * finish the current chunk and move on to the next
+ */
+static void __partfs_simg_next(struct partfs_simg_writer * const w)
+{
+    if (w->type != PARTFS_SIMG_CHUNK_CRC32) {
+        w->blk += w->nblk;
+    }
+
+    w->chunk++;
+    w->state = (w->chunk < w->nchunk) ?
+        PARTFS_SIMG_W_CHUNK_HEADER : PARTFS_SIMG_W_DONE;
+    w->hlen  = 0;
+}
+
+/*
+ * apply part of an android sparse image to a partition. the
+ * image must be written sequentially. raw chunks are written to
+ * the partition and fill chunks are expanded, with zero fills
+ * punched out of the device file. "don't care" chunks are punched
+ * out if requested, otherwise the contents are left as they were.
+ *
+ * returns the number of bytes consumed or a negative errno
+ */
+static int __partfs_simg_write(const struct partfs_file * const pfi,
+                               struct partfs_simg_writer * const w,
+                               const char * const buf, const size_t len,
+                               const off_t off)
+{
+    size_t done;
+    int err;
+
+    err = (off == w->pos) ? 0 : -ESPIPE;
+    for (done = 0; !err && done < len; ) {
+        const size_t avail = len - done;
+        size_t n;
+
+        n = 0;
+        switch (w->state) {
+        case PARTFS_SIMG_W_FILE_HEADER:
+        case PARTFS_SIMG_W_CHUNK_HEADER:
+            /*
+             * headers may be larger than the ones known to partfs.
+             * only the known part is kept; the rest is skipped.
+             */
+            n = MIN(avail, w->need - w->hlen);
+            if (w->hlen < sizeof(w->hdr)) {
+                memcpy(w->hdr + w->hlen, buf + done,
+                       MIN(n, sizeof(w->hdr) - w->hlen));
+            }
+            w->hlen += n;
+
+            if (w->state == PARTFS_SIMG_W_FILE_HEADER &&
+                w->hlen == PARTFS_SIMG_HEADER_SIZE && !w->blksz) {
+                w->fhdrsz     = __partfs_get_le16(w->hdr + 8);
+                w->chdrsz     = __partfs_get_le16(w->hdr + 10);
+                w->blksz      = __partfs_get_le32(w->hdr + 12);
+                w->nblk_total = __partfs_get_le32(w->hdr + 16);
+                w->nchunk     = __partfs_get_le32(w->hdr + 20);
+                w->need       = w->fhdrsz;
+
+                if (__partfs_get_le32(w->hdr) != PARTFS_SIMG_MAGIC ||
+                    __partfs_get_le16(w->hdr + 4) != 1 ||
+                    w->fhdrsz < PARTFS_SIMG_HEADER_SIZE ||
+                    w->chdrsz < PARTFS_SIMG_CHUNK_HEADER_SIZE ||
+                    !w->blksz || (w->blksz % 4) != 0) {
+                    err = -EINVAL;
+                }
+            }
+
+            if (!err && w->hlen == w->need) {
+                if (w->state == PARTFS_SIMG_W_FILE_HEADER) {
+                    w->state = w->nchunk ?
+                        PARTFS_SIMG_W_CHUNK_HEADER : PARTFS_SIMG_W_DONE;
+                    w->need  = w->chdrsz;
+                    w->hlen  = 0;
+                } else {
+                    err = __partfs_simg_chunk(pfi, w);
+                    if (!err) {
+                        w->state = PARTFS_SIMG_W_CHUNK_BODY;
+                    }
+                }
+            }
+            break;
+
+        case PARTFS_SIMG_W_CHUNK_BODY:
+            n = MIN((off_t)avail, w->left);
+
+            if (w->type == PARTFS_SIMG_CHUNK_RAW) {
+                err = __partfs_pwrite_full(
+                    pfi, buf + done, n,
+                    w->blk * w->blksz + (w->nblk * w->blksz - w->left));
+            } else if (n > 0) {
+                memcpy(w->fill + (sizeof(w->fill) - w->left),
+                       buf + done, n);
+            }
+            w->left -= n;
+            break;
+
+        case PARTFS_SIMG_W_DONE:
+            /* trailing data after the last chunk */
+            err = -EINVAL;
+            break;
+        }
+
+        if (!err && w->state == PARTFS_SIMG_W_CHUNK_BODY && w->left == 0) {
+            const off_t boff = w->blk * w->blksz;
+            const off_t blen = w->nblk * w->blksz;
+
+            if (w->type == PARTFS_SIMG_CHUNK_FILL) {
+                /* zero fills are punched out rather than written */
+                if (__partfs_get_le32(w->fill) == 0) {
+                    err = __partfs_punch(pfi, boff, blen, 1);
+                } else {
+                    err = __partfs_fill(pfi, boff, blen, w->fill);
+                }
+            } else if (w->type == PARTFS_SIMG_CHUNK_DONT_CARE && w->punch) {
+                err = __partfs_punch(pfi, boff, blen, 0);
+            }
+
+            if (!err) {
+                __partfs_simg_next(w);
+            }
+        }
+
+        done += n;
+    }
+
+    if (!err) {
+        w->pos += done;
+    }
+
+    return err ? err : (int)done;
+}
+
+static int __partfs_simg_length(struct partfs_file * const pfi,
+                                off_t * const len)
+{
+    struct partfs_extents data;
+    struct partfs_simg simg;
+    int err;
+
+    __partfs_extents_init(&data);
+
+    err = __partfs_map_export(pfi, &data);
+    if (!err) {
+        err = __partfs_simg_layout(&simg, pfi->size, &data);
+        if (!err) {
+            *len = simg.length;
+            __partfs_simg_free(&simg);
+        }
+    }
+
+    __partfs_extents_free(&data);
+
+    return err;
+}
+
+/*
+ * set up an open file to have an android sparse image written to it
+ */
+static int __partfs_simg_wopen(struct fuse_file_info * const fi,
+                               const int punch)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_simg_writer * const w = calloc(1, sizeof(*w));
+    int err;
+
+    err = -ENOMEM;
+    if (w) {
+        w->state = PARTFS_SIMG_W_FILE_HEADER;
+        w->need  = PARTFS_SIMG_HEADER_SIZE;
+        w->punch = punch;
+
+        pfi->priv = w;
+
+        /* writes must arrive in order, not via the page cache */
+        fi->direct_io = 1;
+        err = 0;
+    }
+
+    return err;
+}
+
+static int __partfs_simg_open(const char * const path,
+                              struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    int err;
+
+    if (__partfs_file_writable(fi)) {
+        /* the image is used to populate the partition */
+        err = __partfs_simg_wopen(fi, 1);
+    } else {
+        struct partfs_simg * const simg = malloc(sizeof(*simg));
+
+        err = -ENOMEM;
+        if (simg) {
+            struct partfs_extents data;
+
+            __partfs_extents_init(&data);
+
+            err = __partfs_map_export(pfi, &data);
+            if (!err) {
+                err = __partfs_simg_layout(simg, pfi->size, &data);
+            }
+
+            __partfs_extents_free(&data);
+
+            if (!err) {
+                pfi->priv = simg;
+            } else {
+                free(simg);
+            }
+        }
+    }
+
+    return err;
+}
+
+static int __partfs_simg_pread(const char * const path,
+                               char * const buf, size_t len,
+                               off_t off,
+                               struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+
+    return __partfs_file_writable(fi) ?
+        -EINVAL : __partfs_simg_read(pfi->priv, pfi, buf, len, off);
+}
+
+static int __partfs_simg_pwrite(const char * const path,
+                                const char * const buf, const size_t len,
+                                const off_t off,
+                                struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+
+    return __partfs_simg_write(pfi, pfi->priv, buf, len, off);
+}
+
+static int __partfs_simg_flush(const char * const path,
+                               struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    const struct partfs_simg_writer * const w = pfi->priv;
+
+    /* report an image that was cut short when it is closed */
+    return (__partfs_file_writable(fi) &&
+            w->pos > 0 && w->state != PARTFS_SIMG_W_DONE) ? -EIO : 0;
+}
+
+static void __partfs_simg_release(const char * const path,
+                                  struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+
+    if (!__partfs_file_writable(fi)) {
+        __partfs_simg_free(pfi->priv);
+    }
+
+    free(pfi->priv);
+}
+
+/*
+ * the partition as an android sparse image. holes in the
+ * device file are described by "don't care" chunks. writing
+ * a sparse image to the file populates the partition with it.
+ */
+static const struct partfs_format partfs_format_simg =
+{
+    .suffix         = ".simg",
+    .mask           = 0,
+
+    .length         = __partfs_simg_length,
+    .open           = __partfs_simg_open,
+    .read           = __partfs_simg_pread,
+    .write          = __partfs_simg_pwrite,
+    .flush          = __partfs_simg_flush,
+    .release        = __partfs_simg_release,
+};
+
+/*
+ * worker thread that compresses frames for a zstd export
+ */
+static void * __partfs_zst_worker(void * const arg)
+{
+    struct partfs_zst * const zst = arg;
+    ZSTD_CCtx * const cctx = ZSTD_createCCtx();
+    void * const src = __partfs_mem_alloc(
+        zst->pfi->mem, PARTFS_MEM_BUFFER, PARTFS_ZST_FRAME_SIZE);
+
+    pthread_mutex_lock(&zst->lock);
+    while (!zst->stop) {
+        if (zst->next < zst->nframe && zst->next < zst->cur + zst->nslot) {
+            const size_t idx = zst->next++;
+            struct partfs_zst_slot * const s = &zst->slot[idx % zst->nslot];
+            const size_t len = MIN(
+                PARTFS_ZST_FRAME_SIZE,
+                zst->pfi->size - (off_t)idx * PARTFS_ZST_FRAME_SIZE);
+            int err;
+
+            s->idx  = idx;
+            s->done = 0;
+            pthread_mutex_unlock(&zst->lock);
+
+            err = (cctx && src) ? 0 : -ENOMEM;
+            if (!err) {
+                err = __partfs_load_data(
+                    zst->pfi, &zst->data,
+                    (off_t)idx * PARTFS_ZST_FRAME_SIZE, src, len);
+            }
+            if (!err) {
+                s->len = ZSTD_compressCCtx(
+                    cctx,
+                    s->buf, ZSTD_compressBound(PARTFS_ZST_FRAME_SIZE),
+                    src, len,
+                    ZSTD_CLEVEL_DEFAULT);
+                if (ZSTD_isError(s->len)) {
+                    err = -EIO;
+                }
+            }
+
+            pthread_mutex_lock(&zst->lock);
+            s->err  = err;
+            s->done = 1;
+            pthread_cond_broadcast(&zst->cond);
+        } else {
+            pthread_cond_wait(&zst->cond, &zst->lock);
+        }
+    }
+    pthread_mutex_unlock(&zst->lock);
+
+    __partfs_mem_free(zst->pfi->mem, PARTFS_MEM_BUFFER,
+                      src, PARTFS_ZST_FRAME_SIZE);
+    ZSTD_freeCCtx(cctx);
+
+    return NULL;
+}
+
+/*
+ * build the seek table that follows the last frame
+ */
+static int __partfs_zst_table(struct partfs_zst * const zst)
+{
+    int err;
+
+    zst->tablen = 8 + 8 * zst->nframe + 9;
+    zst->table  = malloc(zst->tablen);
+
+    err = -ENOMEM;
+    if (zst->table) {
+        unsigned char * p = zst->table;
+        size_t i;
+
+        __partfs_put_le32(p, PARTFS_ZST_SKIPPABLE_MAGIC);
+        __partfs_put_le32(p + 4, zst->tablen - 8);
+        p += 8;
+
+        for (i = 0; i < zst->nframe; i++, p += 8) {
+            __partfs_put_le32(p, zst->csize[i]);
+            __partfs_put_le32(
+                p + 4,
+                MIN(PARTFS_ZST_FRAME_SIZE,
+                    zst->pfi->size - (off_t)i * PARTFS_ZST_FRAME_SIZE));
+        }
+
+        /* number of frames, descriptor (no checksums) and magic */
+        __partfs_put_le32(p, zst->nframe);
+        p[4] = 0;
+        __partfs_put_le32(p + 5, PARTFS_ZST_SEEKABLE_MAGIC);
+
+        err = 0;
+    }
+
+    return err;
+}
+
+static int __partfs_zst_length(struct partfs_file * const pfi,
+                               off_t * const len)
+{
+    /* the compressed size isn't known until the partition is read */
+    *len = 0;
+    return 0;
+}
+
+static void __partfs_zst_release(const char * const path,
+                                 struct fuse_file_info * const fi);
+
+static int __partfs_zst_open(const char * const path,
+                             struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_zst * const zst = calloc(1, sizeof(*zst));
+    int err;
+
+    err = -ENOMEM;
+    if (zst) {
+        long ncpu;
+        size_t nthr;
+
+        pfi->priv = zst;
+
+        zst->pfi    = pfi;
+        zst->nframe = (pfi->size + PARTFS_ZST_FRAME_SIZE - 1) /
+            PARTFS_ZST_FRAME_SIZE;
+
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthr       = MAX(1, MIN((size_t)MAX(ncpu, 1), zst->nframe));
+        zst->nslot = 2 * nthr;
+
+        __partfs_extents_init(&zst->data);
+        pthread_mutex_init(&zst->lock, NULL);
+        pthread_cond_init(&zst->cond, NULL);
+
+        zst->csize = calloc(MAX(zst->nframe, 1), sizeof(*zst->csize));
+        zst->thr   = calloc(nthr, sizeof(*zst->thr));
+        zst->slot  = calloc(zst->nslot, sizeof(*zst->slot));
+
+        if (zst->csize && zst->thr && zst->slot) {
+            size_t i;
+
+            err = 0;
+            for (i = 0; !err && i < zst->nslot; i++) {
+                zst->slot[i].buf = __partfs_mem_alloc(
+                    pfi->mem, PARTFS_MEM_BUFFER,
+                    ZSTD_compressBound(PARTFS_ZST_FRAME_SIZE));
+                if (!zst->slot[i].buf) {
+                    err = -ENOMEM;
+                }
+            }
+
+            if (!err) {
+                /* only regions that are exported are read */
+                err = __partfs_map_export(pfi, &zst->data);
+            }
+
+            /* only the threads started are joined on release */
+            for (i = 0; !err && i < nthr; i++) {
+                err = -pthread_create(
+                    &zst->thr[i], NULL, __partfs_zst_worker, zst);
+                if (!err) {
+                    zst->nthr++;
+                }
+            }
+        }
+
+        if (err) {
+            __partfs_zst_release(path, fi);
+            pfi->priv = NULL;
+        } else {
+            /* the file has no size, so it must be read sequentially */
+            fi->direct_io   = 1;
+            fi->nonseekable = 1;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * read from a zstd export. the stream can only be read
+ * sequentially since it is generated on the fly.
+ */
+static int __partfs_zst_read(const char * const path,
+                             char * const buf, size_t len,
+                             off_t off,
+                             struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_zst * const zst = pfi->priv;
+    size_t done;
+    int err;
+
+    pthread_mutex_lock(&zst->lock);
+
+    err = (off == zst->pos) ? 0 : -ESPIPE;
+    for (done = 0; !err && done < len; ) {
+        size_t n;
+
+        if (zst->cur < zst->nframe) {
+            struct partfs_zst_slot * const s =
+                &zst->slot[zst->cur % zst->nslot];
+
+            while (!(s->idx == zst->cur && s->done)) {
+                pthread_cond_wait(&zst->cond, &zst->lock);
+            }
+
+            err = s->err;
+            if (!err) {
+                n = MIN(len - done, s->len - zst->fpos);
+                memcpy(buf + done, (char *)s->buf + zst->fpos, n);
+
+                zst->fpos += n;
+                if (zst->fpos == s->len) {
+                    /* frame consumed; its slot can be reused */
+                    zst->csize[zst->cur] = s->len;
+                    zst->cur++;
+                    zst->fpos = 0;
+                    pthread_cond_broadcast(&zst->cond);
+                }
+            }
+        } else {
+            if (!zst->table) {
+                err = __partfs_zst_table(zst);
+            }
+
+            if (!err) {
+                n = MIN(len - done, zst->tablen - zst->fpos);
+                memcpy(buf + done, zst->table + zst->fpos, n);
+                zst->fpos += n;
+
+                /* end of the stream */
+                if (n == 0) {
+                    len = done;
+                }
+            }
+        }
+
+        if (!err) {
+            done += n;
+        }
+    }
+
+    zst->pos += done;
+
+    pthread_mutex_unlock(&zst->lock);
+
+    return err ? err : (int)done;
+}
+
+static void __partfs_zst_release(const char * const path,
+                                 struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_zst * const zst = pfi->priv;
+    size_t i;
+
+    pthread_mutex_lock(&zst->lock);
+    zst->stop = 1;
+    pthread_cond_broadcast(&zst->cond);
+    pthread_mutex_unlock(&zst->lock);
+
+    for (i = 0; i < zst->nthr; i++) {
+        pthread_join(zst->thr[i], NULL);
+    }
+
+    for (i = 0; zst->slot && i < zst->nslot; i++) {
+        __partfs_mem_free(pfi->mem, PARTFS_MEM_BUFFER, zst->slot[i].buf,
+                          ZSTD_compressBound(PARTFS_ZST_FRAME_SIZE));
+    }
+
+    pthread_cond_destroy(&zst->cond);
+    pthread_mutex_destroy(&zst->lock);
+
+    __partfs_extents_free(&zst->data);
+    free(zst->table);
+    free(zst->slot);
+    free(zst->thr);
+    free(zst->csize);
+    free(zst);
+}
+
+/*
+ * the partition as a zstd compressed stream using the seekable
+ * format. frames are compressed in parallel as the file is read.
+ */
+static const struct partfs_format partfs_format_zst =
+{
+    .suffix         = ".zst",
+    .mask           = 0222,
+
+    .length         = __partfs_zst_length,
+    .open           = __partfs_zst_open,
+    .read           = __partfs_zst_read,
+    .release        = __partfs_zst_release,
+};
+
+/*
+ * compare units of a partition to the base image in parallel. each
+ * thread takes the next unit to be compared. units that are holes in
+ * both images are skipped without being read.
+ */
+static off_t __partfs_diff_next(struct partfs_diff * const diff,
+                                const int err)
+{
+    off_t u;
+
+    pthread_mutex_lock(&diff->lock);
+    if (err && !diff->err) {
+        diff->err = err;
+    }
+    u = diff->err ? diff->nunit : diff->next++;
+    pthread_mutex_unlock(&diff->lock);
+
+    return MIN(u, diff->nunit);
+}
+
+static void * __partfs_diff_worker(void * const arg)
+{
+    struct partfs_diff * const diff = arg;
+    struct partfs_mem * const mem = diff->pfi->mem;
+    unsigned char * const a =
+        __partfs_mem_alloc(mem, PARTFS_MEM_BUFFER, PARTFS_DIFF_UNIT);
+    unsigned char * const b =
+        __partfs_mem_alloc(mem, PARTFS_MEM_BUFFER, PARTFS_DIFF_UNIT);
+    off_t u;
+    int err;
+
+    err = (a && b) ? 0 : -ENOMEM;
+    for (u = __partfs_diff_next(diff, err);
+         u < diff->nunit;
+         u = __partfs_diff_next(diff, err)) {
+        const off_t off = u * PARTFS_DIFF_UNIT;
+        const size_t len = MIN(PARTFS_DIFF_UNIT, diff->pfi->size - off);
+
+        if (__partfs_extents_overlap(&diff->data, off, len) ||
+            __partfs_extents_overlap(&diff->bdata, off, len)) {
+            err = __partfs_load_data(diff->pfi, &diff->data, off, a, len);
+            if (!err) {
+                err = __partfs_load_data(
+                    diff->base, &diff->bdata, off, b, len);
+            }
+
+            if (!err) {
+                size_t i;
+
+                /*
+                 * units are a multiple of 8 blocks, so threads
+                 * never update the same byte of the bitmap
+                 */
+                for (i = 0; i < len; i += diff->blksz) {
+                    if (memcmp(a + i, b + i, diff->blksz) != 0) {
+                        const off_t blk = (off + i) / diff->blksz;
+
+                        diff->map[blk / 8] |= 1 << (blk % 8);
+                    }
+                }
+            }
+        }
+    }
+
+    __partfs_mem_free(mem, PARTFS_MEM_BUFFER, b, PARTFS_DIFF_UNIT);
+    __partfs_mem_free(mem, PARTFS_MEM_BUFFER, a, PARTFS_DIFF_UNIT);
+
+    return NULL;
+}
+
+/*
+ * build a sparse image containing the blocks of a partition
+ * that differ from those of the same partition in the base image.
+ * if the partitions are not the same size, the whole partition
+ * is included.
+ */
+static int __partfs_diff(const struct partfs_file * const pfi,
+                         const struct partfs_file * const base,
+                         struct partfs_simg * const simg)
+{
+    struct partfs_extents changed;
+    int err;
+
+    __partfs_extents_init(&changed);
+
+    if (base->size != pfi->size) {
+        err = __partfs_map_export(pfi, &changed);
+    } else {
+        struct partfs_diff diff;
+
+        diff.pfi   = pfi;
+        diff.base  = base;
+        diff.blksz = __partfs_simg_blksz(pfi->size);
+        diff.nunit = (pfi->size + PARTFS_DIFF_UNIT - 1) / PARTFS_DIFF_UNIT;
+        diff.next  = 0;
+        diff.err   = 0;
+        diff.map   = calloc((pfi->size / diff.blksz + 7) / 8, 1);
+
+        __partfs_extents_init(&diff.data);
+        __partfs_extents_init(&diff.bdata);
+        pthread_mutex_init(&diff.lock, NULL);
+
+        err = diff.map ? 0 : -ENOMEM;
+        if (!err) {
+            err = __partfs_map_data(pfi, &diff.data);
+        }
+        if (!err) {
+            err = __partfs_map_data(base, &diff.bdata);
+        }
+
+        if (!err) {
+            /*
+             * a spinning disk only slows down when
+             * read from in several places at once
+             */
+            const long ncpu =
+                ((pfi->blk && pfi->blk->rotational) ||
+                 (base->blk && base->blk->rotational)) ?
+                1 : sysconf(_SC_NPROCESSORS_ONLN);
+            const size_t nthr = MAX(1, MIN(ncpu, diff.nunit));
+            pthread_t * const thr = calloc(nthr, sizeof(*thr));
+            size_t i;
+
+            err = thr ? 0 : -ENOMEM;
+            for (i = 0; !err && i < nthr; ) {
+                err = -pthread_create(
+                    &thr[i], NULL, __partfs_diff_worker, &diff);
+                if (!err) {
+                    i++;
+                }
+            }
+
+            /* the workers stop early if any of them fails */
+            if (err) {
+                __partfs_diff_next(&diff, err);
+            }
+            while (i > 0) {
+                pthread_join(thr[--i], NULL);
+            }
+
+            free(thr);
+        }
+
+        if (!err) {
+            err = diff.err;
+        }
+        if (!err) {
+            err = __partfs_bitmap_extents(
+                diff.map, pfi->size / diff.blksz, diff.blksz,
+                pfi->size, &changed);
+        }
+
+        pthread_mutex_destroy(&diff.lock);
+        __partfs_extents_free(&diff.bdata);
+        __partfs_extents_free(&diff.data);
+        free(diff.map);
+    }
+
+    if (!err) {
+        err = __partfs_simg_layout(simg, pfi->size, &changed);
+    }
+
+    __partfs_extents_free(&changed);
+
+    return err;
+}
+
+static int __partfs_delta_length(struct partfs_file * const pfi,
+                                 off_t * const len)
+{
+    /* the partitions aren't compared until the delta is opened */
+    *len = 0;
+    return 0;
+}
+
+static int __partfs_delta_open(const char * const path,
+                               struct fuse_file_info * const fi)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    struct partfs_file * const pfi = (void *)fi->fh;
+    int err;
+
+    if (__partfs_file_writable(fi)) {
+        /* the image is applied on top of the partition's contents */
+        err = __partfs_simg_wopen(fi, 0);
+    } else if (!pdev->base) {
+        err = -ENOENT;
+    } else {
+        const struct partfs_format * fmt;
+        const ssize_t n = __partfs_parse_path(path, &fmt);
+        struct partfs_file base;
+
+        err = __partfs_file_init(pdev->base, n, O_RDONLY, &base);
+        if (!err) {
+            struct partfs_simg * const simg = malloc(sizeof(*simg));
+
+            err = -ENOMEM;
+            if (simg) {
+                err = __partfs_diff(pfi, &base, simg);
+                if (!err) {
+                    pfi->priv = simg;
+                } else {
+                    free(simg);
+                }
+            }
+
+            close(base.desc);
+        }
+    }
+
+    if (!err) {
+        /* the size of the file is not known in advance */
+        fi->direct_io = 1;
+    }
+
+    return err;
+}
+
+/*
+ * the blocks that differ from the base image as an android sparse
+ * image. writing such an image to the file applies it in place.
+ */
+static const struct partfs_format partfs_format_delta =
+{
+    .suffix         = ".delta",
+    .mask           = 0,
+
+    .length         = __partfs_delta_length,
+    .open           = __partfs_delta_open,
+    .read           = __partfs_simg_pread,
+    .write          = __partfs_simg_pwrite,
+    .flush          = __partfs_simg_flush,
+    .release        = __partfs_simg_release,
+};
+
+/*
+ * generated text presented as a file
+ */
+struct partfs_text
+{
+    char * buf;
+    size_t len;
+};
+
+/*
+ * generate a block map of the partition in the format used by
+ * bmaptool. the map lists the blocks that would be exported.
+ */
+static int __partfs_bmap_build(struct partfs_file * const pfi,
+                               struct partfs_text * const txt)
+{
+    const off_t bs = PARTFS_BMAP_BLOCK_SIZE;
+    struct partfs_extents ex, blk;
+    int err;
+
+    __partfs_extents_init(&ex);
+    __partfs_extents_init(&blk);
+
+    err = __partfs_map_export(pfi, &ex);
+    if (!err) {
+        size_t i;
+
+        /* convert the extents to (inclusive) ranges of blocks */
+        for (i = 0; !err && i < ex.n; i++) {
+            off_t first = ex.v[i].off / bs;
+            const off_t last = (ex.v[i].off + ex.v[i].len - 1) / bs;
+
+            if (blk.n > 0) {
+                first = MAX(first, blk.v[blk.n - 1].off +
+                            blk.v[blk.n - 1].len);
+            }
+            if (first <= last) {
+                err = __partfs_extents_append(&blk, first, last - first + 1);
+            }
+        }
+    }
+
+    if (!err) {
+        FILE * const f = open_memstream(&txt->buf, &txt->len);
+
+        err = -ENOMEM;
+        if (f) {
+            off_t mapped;
+            size_t i;
+
+            for (i = 0, mapped = 0; i < blk.n; i++) {
+                mapped += blk.v[i].len;
+            }
+
+            fprintf(f, "<?xml version=\"1.0\" ?>\n");
+            fprintf(f, "<bmap version=\"1.2\">\n");
+            fprintf(f, "    <ImageSize> %lld </ImageSize>\n",
+                    (long long)pfi->size);
+            fprintf(f, "    <BlockSize> %lld </BlockSize>\n", (long long)bs);
+            fprintf(f, "    <BlocksCount> %lld </BlocksCount>\n",
+                    (long long)((pfi->size + bs - 1) / bs));
+            fprintf(f, "    <MappedBlocksCount> %lld </MappedBlocksCount>\n",
+                    (long long)mapped);
+            fprintf(f, "    <BlockMap>\n");
+            for (i = 0; i < blk.n; i++) {
+                if (blk.v[i].len == 1) {
+                    fprintf(f, "        <Range> %lld </Range>\n",
+                            (long long)blk.v[i].off);
+                } else {
+                    fprintf(f, "        <Range> %lld-%lld </Range>\n",
+                            (long long)blk.v[i].off,
+                            (long long)(blk.v[i].off + blk.v[i].len - 1));
+                }
+            }
+            fprintf(f, "    </BlockMap>\n");
+            fprintf(f, "</bmap>\n");
+
+            err = fclose(f) ? -ENOMEM : 0;
+        }
+    }
+
+    __partfs_extents_free(&blk);
+    __partfs_extents_free(&ex);
+
+    return err;
+}
+
+static int __partfs_bmap_length(struct partfs_file * const pfi,
+                                off_t * const len)
+{
+    struct partfs_text txt;
+    int err;
+
+    err = __partfs_bmap_build(pfi, &txt);
+    if (!err) {
+        *len = txt.len;
+        free(txt.buf);
+    }
+
+    return err;
+}
+
+static int __partfs_bmap_open(const char * const path,
+                              struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_text * const txt = calloc(1, sizeof(*txt));
+    int err;
+
+    err = -ENOMEM;
+    if (txt) {
+        err = 0;
+        if (__partfs_file_writable(fi)) {
+            /* the map is collected and applied when the file is closed */
+            fi->direct_io = 1;
+        } else {
+            err = __partfs_bmap_build(pfi, txt);
+        }
+
+        if (!err) {
+            pfi->priv = txt;
+        } else {
+            free(txt);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * collect a block map written to the file
+ */
+static int __partfs_bmap_write(const char * const path,
+                               const char * const buf, const size_t len,
+                               const off_t off,
+                               struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_text * const txt = pfi->priv;
+    const size_t end = off + len;
+    int err;
+
+    err = 0;
+    if (off < 0 || end > PARTFS_BMAP_MAX_SIZE) {
+        err = -EFBIG;
+    } else if (end > txt->len) {
+        /* keep the text nul-terminated for parsing */
+        char * const b = realloc(txt->buf, end + 1);
+
+        if (b) {
+            memset(b + txt->len, 0, end + 1 - txt->len);
+            txt->buf = b;
+            txt->len = end;
+        } else {
+            err = -ENOMEM;
+        }
+    }
+
+    if (!err) {
+        memcpy(txt->buf + off, buf, len);
+    }
+
+    return err ? err : (int)len;
+}
+
+/*
+ * apply a block map that was written to the file by punching out
+ * the blocks of the partition that are not mapped. the contents of
+ * the mapped blocks are then expected to be written to the partition,
+ * e.g. by bmaptool, so that populating the partition from data and a
+ * block map touches only the mapped blocks.
+ */
+static int __partfs_bmap_apply(const struct partfs_file * const pfi,
+                               const struct partfs_text * const txt)
+{
+    struct partfs_extents map;
+    const char * p;
+    long long bs;
+    int err;
+
+    __partfs_extents_init(&map);
+
+    err = -EINVAL;
+    p = strstr(txt->buf, "<BlockSize>");
+    if (p && sscanf(p + strlen("<BlockSize>"), "%lld", &bs) == 1 && bs > 0) {
+        p = strstr(p, "<BlockMap>");
+        err = p ? 0 : -EINVAL;
+    }
+
+    for (p = p ? strstr(p, "<Range") : NULL;
+         !err && p;
+         p = strstr(p + 1, "<Range")) {
+        const char * const q = strchr(p, '>');
+        long long first, last;
+        int r;
+
+        r = q ? sscanf(q + 1, " %lld-%lld", &first, &last) : 0;
+        if (r == 1) {
+            last = first;
+        }
+
+        err = -EINVAL;
+        if (r >= 1 && first >= 0 && last >= first &&
+            (map.n == 0 ||
+             first * bs >= map.v[map.n - 1].off + map.v[map.n - 1].len)) {
+            err = __partfs_extents_append(
+                &map, first * bs, (last - first + 1) * bs);
+        }
+    }
+
+    if (!err) {
+        off_t off;
+        size_t i;
+
+        for (i = 0, off = 0; !err && i <= map.n && off < pfi->size; i++) {
+            const off_t end = (i < map.n) ?
+                MIN(map.v[i].off, pfi->size) : pfi->size;
+
+            err = __partfs_punch(pfi, off, end - off, 0);
+            if (i < map.n) {
+                off = map.v[i].off + map.v[i].len;
+            }
+        }
+    }
+
+    __partfs_extents_free(&map);
+
+    return err;
+}
+
+static int __partfs_bmap_flush(const char * const path,
+                               struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_text * const txt = pfi->priv;
+    int err;
+
+    err = 0;
+    if (__partfs_file_writable(fi) && txt->len > 0) {
+        err = __partfs_bmap_apply(pfi, txt);
+
+        /* the map is only applied once */
+        free(txt->buf);
+        txt->buf = NULL;
+        txt->len = 0;
+    }
+
+    return err;
+}
+
+static int __partfs_text_read(const char * const path,
+                              char * const buf, size_t len,
+                              off_t off,
+                              struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    const struct partfs_text * const txt = pfi->priv;
+
+    int ret;
+
+    ret = -EINVAL;
+    if (!__partfs_file_writable(fi)) {
+        len = (off < (off_t)txt->len) ? MIN(len, txt->len - off) : 0;
+        memcpy(buf, txt->buf + off, len);
+        ret = len;
+    }
+
+    return ret;
+}
+
+static void __partfs_text_release(const char * const path,
+                                  struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_text * const txt = pfi->priv;
+
+    free(txt->buf);
+    free(txt);
+}
+
+/*
+ * block map of the partition, suitable for flashing the raw
+ * partition with bmaptool. writing a block map to the file
+ * punches out the blocks that it doesn't map.
+ */
+static const struct partfs_format partfs_format_bmap =
+{
+    .suffix         = ".bmap",
+    .mask           = 0,
+
+    .length         = __partfs_bmap_length,
+    .open           = __partfs_bmap_open,
+    .read           = __partfs_text_read,
+    .write          = __partfs_bmap_write,
+    .flush          = __partfs_bmap_flush,
+    .release        = __partfs_text_release,
+};
+
+/*
+ * whether a request of len bytes fits within the bounds of a queue.
+ * a request larger than the bound on bytes goes through on its own.
+ */
+static int __partfs_queue_fits(const struct partfs_queue * const q,
+                               const size_t len)
+{
+    return (q->maxreqs == 0 || q->reqs < q->maxreqs) &&
+        (q->maxbytes == 0 || q->bytes == 0 || q->bytes + len <= q->maxbytes);
+}
+
+/*
+ * count a request of len bytes as in flight in a queue, after it
+ * waited for us microseconds if wait is set
+ *
+ * must be called with the queue lock held
+ */
+static void __partfs_queue_admit(struct partfs_queue * const q,
+                                 const size_t len,
+                                 const int wait, const uint64_t us)
+{
+    q->reqs++;
+    q->bytes += len;
+    q->admitted++;
+
+    if (wait) {
+        q->waiting--;
+        q->waited++;
+        q->waitus += us;
+        q->maxwaitus = MAX(q->maxwaitus, us);
+    }
+}
+
+/*
+ * wait until a read or write of len bytes of a partition can be let
+ * through without exceeding the bounds on what is in flight, for the
+ * partition and for the mount, so that a burst of large requests is
+ * held up here rather than piling up in the device. requests of a
+ * partition are let through in the order they arrived.
+ */
+static void __partfs_queue_enter(struct partfs_device * const pdev,
+                                 struct partfs_partition * const part,
+                                 const size_t len)
+{
+    struct partfs_queue * const pq = part ? &part->queue : NULL;
+    struct partfs_queue * const mq = &pdev->queue;
+    struct timespec t0, t1;
+    uint64_t ticket, us;
+    int wait;
+
+    pthread_mutex_lock(&pdev->qlock);
+    ticket = pq ? pq->ticket++ : 0;
+    for (wait = 0;
+         (pq && (ticket != pq->next || !__partfs_queue_fits(pq, len))) ||
+             !__partfs_queue_fits(mq, len);
+         wait = 1) {
+        if (!wait) {
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            if (pq) {
+                pq->waiting++;
+                pq->maxwaiting = MAX(pq->maxwaiting, pq->waiting);
+            }
+            mq->waiting++;
+            mq->maxwaiting = MAX(mq->maxwaiting, mq->waiting);
+        }
+        pthread_cond_wait(&pdev->qcond, &pdev->qlock);
+    }
+
+    us = 0;
+    if (wait) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        us = (t1.tv_sec - t0.tv_sec) * 1000000 +
+            (t1.tv_nsec - t0.tv_nsec) / 1000;
+    }
+
+    if (pq) {
+        __partfs_queue_admit(pq, len, wait, us);
+
+        /* the next request of the partition may be waiting its turn */
+        pq->next++;
+        if (pq->waiting > 0) {
+            pthread_cond_broadcast(&pdev->qcond);
+        }
+    }
+    __partfs_queue_admit(mq, len, wait, us);
+    pthread_mutex_unlock(&pdev->qlock);
+}
+
+/*
+ * take a request let through by __partfs_queue_enter() out of flight
+ */
+static void __partfs_queue_leave(struct partfs_device * const pdev,
+                                 struct partfs_partition * const part,
+                                 const size_t len)
+{
+    pthread_mutex_lock(&pdev->qlock);
+    if (part) {
+        part->queue.reqs--;
+        part->queue.bytes -= len;
+    }
+    pdev->queue.reqs--;
+    pdev->queue.bytes -= len;
+
+    if (pdev->queue.waiting > 0) {
+        pthread_cond_broadcast(&pdev->qcond);
+    }
+    pthread_mutex_unlock(&pdev->qlock);
+}
+
+/*
+ * read data from a partition
+ */
+static int partfs_read(const char * const path,
+                       char * const buf, size_t len,
+                       off_t off,
+                       struct fuse_file_info * const fi)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    struct partfs_file * const pfi = (void *)fi->fh;
+    int ret;
+
+    __partfs_queue_enter(pdev, pfi->part, len);
+    ret = pfi->fmt->read(path, buf, len, off, fi);
+    __partfs_queue_leave(pdev, pfi->part, len);
+
+    return ret;
+}
+
+/*
+ * write data to a partition
+ */
+static int partfs_write(const char * const path,
+                        const char * const buf, const size_t len,
+                        const off_t off,
+                        struct fuse_file_info * const fi)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    struct partfs_file * const pfi = (void *)fi->fh;
+    int ret;
+
+    __partfs_queue_enter(pdev, pfi->part, len);
+    ret = pfi->fmt->write(path, buf, len, off, fi);
+    __partfs_queue_leave(pdev, pfi->part, len);
+
+    return ret;
+}
+
+/*
+ * flush is called each time a file descriptor
+ * referring to an open partition is closed
+ */
+static int partfs_flush(const char * const path,
+                        struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+
+    return pfi->fmt->flush ? pfi->fmt->flush(path, fi) : 0;
+}
+
+/*
+ * make sure data written to a partition has reached the device
+ * file's storage. when the kernel caches writes, it sends any
+ * dirty pages before calling this. blocks in the cache file on
+ * local storage are written back first.
+ */
+static int partfs_fsync(const char * const path, const int datasync,
+                        struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    struct partfs_ssd * const ssd = pfi->cache ? pfi->cache->ssd : NULL;
+    int ret;
+
+    ret = 0;
+    if (ssd) {
+        pthread_mutex_lock(&ssd->lock);
+        ret = __partfs_ssd_flush(ssd, 0, UINT64_MAX);
+        pthread_mutex_unlock(&ssd->lock);
+    }
+    if (!ret) {
+        ret = __partfs_sync_dev(pfi, datasync);
+    }
+
+    return ret;
+}
+
+/*
+ * release is called when a partition is closed
+ */
+static int partfs_release(const char * const path,
+                          struct fuse_file_info * const fi)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    struct partfs_file * const pfi = (void *)fi->fh;
+    const int desc = pfi->desc;
+
+    if (pfi->fmt->release) {
+        pfi->fmt->release(path, fi);
+    }
+    if (__partfs_file_writable(fi)) {
+        __partfs_window_unlock(pdev, pfi);
+    }
+
+    free(pfi);
+
+    /*
+     * the file system may have been created or changed, e.g. by
+     * mkfs, so it is probed again when next needed and its
+     * metadata is located and pinned again
+     */
+    if (__partfs_file_writable(fi)) {
+        const struct partfs_format * fmt;
+        const ssize_t n = __partfs_parse_path(path, &fmt);
+
+        if (n >= 0 && (size_t)n < pdev->npart) {
+            pthread_mutex_lock(&pdev->lock);
+            pdev->part[n].probed = 0;
+            if (pdev->pinmax > 0) {
+                __partfs_pin(pdev, n);
+            }
+            pthread_mutex_unlock(&pdev->lock);
+        }
+    }
+
+    /*
+     * fuse ignores this error, but return it anyway
+     */
+    return close(desc) ? -errno : 0;
+}
+
+/*
+ * truncate doesn't actually change the size of the partition, but
+ * implementing it allows using the > operator on the command line
+ * to cat data into it.
+ *
+ * function succeeds if size is less than existing size (without
+ * doing anything) and fails if size is larger.
+ */
+static int partfs_truncate(const char * const path, const off_t off)
+{
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    const struct partfs_format * fmt;
+    const ssize_t n = __partfs_parse_path(path, &fmt);
+    int ret;
+
+    ret = -ENOENT;
+    if (n >= 0) {
+        struct fdisk_partition * pa;
+
+        pa = NULL;
+        fdisk_get_partition(pdev->ctx, n, &pa);
+
+        ret = -EFBIG;
+        if (!fmt->write) {
+            ret = -EACCES;
+        } else if (off <= __fdisk_partition_get_size(pdev->ctx, pa)) {
+            ret = 0;
+        }
+
+        fdisk_unref_partition(pa);
+    }
+
+    return ret;
+}
+
+/*
+ * discard or zero a range of a partition, or make sure space is
+ * allocated for it. discarded and zeroed ranges are remembered
+ * so that reads of them don't have to touch the device file until
+ * they are written again. the size of a partition can't change.
+ */
+static int partfs_fallocate(const char * const path, const int mode,
+                            const off_t off, const off_t len,
+                            struct fuse_file_info * const fi)
+{
+    struct partfs_file * const pfi = (void *)fi->fh;
+    int ret;
+
+    if (pfi->fmt != &partfs_format_raw) {
+        ret = -EOPNOTSUPP;
+    } else if (off < 0 || len <= 0) {
+        ret = -EINVAL;
+    } else if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        /*
+         * discards (from a loop device, for instance) arrive as
+         * punched holes. a zeroed range reads back the same way,
+         * so both are handled by punching a hole in the device
+         * file. the part of the range beyond the end of the
+         * partition is ignored.
+         */
+        ret = -EOPNOTSUPP;
+        if (!(mode & FALLOC_FL_PUNCH_HOLE) || (mode & FALLOC_FL_KEEP_SIZE)) {
+            ret = 0;
+            if (off < pfi->size) {
+                ret = __partfs_punch(pfi, off, MIN(len, pfi->size - off), 1);
+            }
+        }
+    } else if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        ret = -EOPNOTSUPP;
+    } else if (pfi->blk || pfi->nbd || pfi->vmdk) {
+        /*
+         * every block of a device is always allocated. grains
+         * of a vmdk extent are allocated when written to.
+         */
+        ret = (off + len > pfi->size && !(mode & FALLOC_FL_KEEP_SIZE)) ?
+            -EFBIG : 0;
+    } else if (off + len > pfi->size) {
+        ret = (mode & FALLOC_FL_KEEP_SIZE) ? 0 : -EFBIG;
+        if (off < pfi->size) {
+            ret = fallocate(pfi->desc, FALLOC_FL_KEEP_SIZE,
+                            pfi->start + off, pfi->size - off) ? -errno : ret;
+        }
+    } else {
+        ret = fallocate(pfi->desc, FALLOC_FL_KEEP_SIZE,
+                        pfi->start + off, len) ? -errno : 0;
+    }
+
+    return ret;
+}
+
+/*
+ * extended attributes of the partition files. they describe the
+ * partition as found in the partition table and are served from
+ * the table that libfdisk keeps in memory.
+ */
+struct partfs_xattr
+{
+    const char * name;
+
+    /*
+     * format the value of the attribute into the buffer. NULL for
+     * attributes that can only be written.
+     *
+     * returns the length of the value, which may exceed the size
+     * of the buffer, or -ENODATA if the partition doesn't have it
+     */
+    int (*get)(struct partfs_device *, size_t,
+               struct fdisk_partition *, char *, size_t);
+
+    /*
+     * carry out the request written to the attribute, for attributes
+     * that act on the partition or mount when written. NULL for those
+     * that can only be read.
+     *
+     * returns 0 on success or a negative errno on failure
+     */
+    int (*set)(struct partfs_device *, size_t, const char *, size_t);
+};
+
+/*
+ * format a string as the value of an attribute
+ */
+static int __partfs_xattr_string(const char * const str,
+                                 char * const buf, const size_t size)
+{
+    return (str && *str) ? snprintf(buf, size, "%s", str) : -ENODATA;
+}
+
+static int __partfs_xattr_type(struct partfs_device * const pdev,
+                               const size_t n,
+                               struct fdisk_partition * const pa,
+                               char * const buf, const size_t size)
+{
+    const struct fdisk_parttype * const t = fdisk_partition_get_type(pa);
+    int ret;
+
+    ret = -ENODATA;
+    if (t) {
+        /* gpt types are guids; dos types only have a code */
+        ret = fdisk_parttype_get_string(t) ?
+            __partfs_xattr_string(fdisk_parttype_get_string(t), buf, size) :
+            snprintf(buf, size, "0x%02x", fdisk_parttype_get_code(t));
+    }
+
+    return ret;
+}
+
+static int __partfs_xattr_name(struct partfs_device * const pdev,
+                               const size_t n,
+                               struct fdisk_partition * const pa,
+                               char * const buf, const size_t size)
+{
+    return __partfs_xattr_string(fdisk_partition_get_name(pa), buf, size);
+}
+
+static int __partfs_xattr_uuid(struct partfs_device * const pdev,
+                               const size_t n,
+                               struct fdisk_partition * const pa,
+                               char * const buf, const size_t size)
+{
+    return __partfs_xattr_string(fdisk_partition_get_uuid(pa), buf, size);
+}
+
+static int __partfs_xattr_start(struct partfs_device * const pdev,
+                                const size_t n,
+                                struct fdisk_partition * const pa,
+                                char * const buf, const size_t size)
+{
+    return snprintf(buf, size, "%llu",
+                    (unsigned long long)fdisk_get_sector_size(pdev->ctx) *
+                    fdisk_partition_get_start(pa));
+}
+
+static int __partfs_xattr_size(struct partfs_device * const pdev,
+                               const size_t n,
+                               struct fdisk_partition * const pa,
+                               char * const buf, const size_t size)
+{
+    return snprintf(buf, size, "%llu", (unsigned long long)
+                    __fdisk_partition_get_size(pdev->ctx, pa));
+}
+
+static int __partfs_xattr_attrs(struct partfs_device * const pdev,
+                                const size_t n,
+                                struct fdisk_partition * const pa,
+                                char * const buf, const size_t size)
+{
+    return __partfs_xattr_string(fdisk_partition_get_attrs(pa), buf, size);
+}
+
+/*
+ * open a partition to be changed as requested by writing to an
+ * attribute of its file, and lock it against other processes as when
+ * it is opened for writing
+ *
+ * returns 0 on success or a negative errno on failure
+ */
+static int __partfs_xattr_begin(struct partfs_device * const pdev,
+                                const size_t n,
+                                struct partfs_file * const pfi)
+{
+    int err;
+
+    err = (n < pdev->npart) ? 0 : -ENOENT;
+    if (!err && pdev->cache && pdev->cache->shm) {
+        err = -EROFS;
+    }
+
+    if (!err) {
+        err = __partfs_file_init(pdev, n, O_RDWR, pfi);
+    }
+    if (!err) {
+        pfi->fmt  = &partfs_format_raw;
+        pfi->priv = NULL;
+
+        err = __partfs_window_lock(pdev, pfi);
+        if (err) {
+            close(pfi->desc);
+        }
+    }
+
+    return err;
+}
+
+/*
+ * finish changing a partition opened by __partfs_xattr_begin(). the
+ * changes are flushed to the device, and the file system in the
+ * partition is probed and pinned again as after running mkfs.
+ *
+ * returns err, or a negative errno if flushing the changes failed
+ */
+static int __partfs_xattr_end(struct partfs_device * const pdev,
+                              const size_t n,
+                              struct partfs_file * const pfi, int err)
+{
+    if (!err) {
+        err = __partfs_sync_dev(pfi, 1);
+    }
+
+    __partfs_window_unlock(pdev, pfi);
+    close(pfi->desc);
+
+    pthread_mutex_lock(&pdev->lock);
+    pdev->part[n].probed = 0;
+    if (pdev->pinmax > 0) {
+        __partfs_pin(pdev, n);
+    }
+    pthread_mutex_unlock(&pdev->lock);
+
+    return err;
+}
+
+/*
+ * create a file system in a partition as described by the value
+ * written, of the form TYPE[:OPTION=VALUE]... TYPE is vfat, for the
+ * kind of FAT suited to the size of the partition, or fat12, fat16
+ * or fat32. the options are:
+ *
+ *   label=NAME     volume label, up to 11 characters
+ *   cluster=BYTES  size of a cluster, a power of 2 from 512 to 65536
+ *   id=HEX         volume serial number (default: from the time)
+ *
+ * the partition is locked against other processes while it is
+ * formatted, as when it is opened for writing.
+ */
+static int __partfs_xattr_format(struct partfs_device * const pdev,
+                                 const size_t n,
+                                 const char * const val, const size_t size)
+{
+    char * const s = strndup(val, size);
+    const char * label;
+    unsigned int bits;
+    uint32_t spc, id;
+    int err;
+
+    label = NULL;
+    bits  = 0;
+    spc   = 0;
+    id    = time(NULL) ^ (n << 24);
+
+    err = -ENOMEM;
+    if (s) {
+        char * tok, * save;
+
+        tok = strtok_r(s, ":", &save);
+        err = -EINVAL;
+        if (tok && (strcmp(tok, "vfat") == 0 || strcmp(tok, "fat") == 0)) {
+            err = 0;
+        } else if (tok && strncmp(tok, "fat", 3) == 0) {
+            bits = atoi(tok + 3);
+            err  = (bits == 12 || bits == 16 || bits == 32) ? 0 : -EINVAL;
+        }
+
+        for (tok = strtok_r(NULL, ":", &save);
+             !err && tok;
+             tok = strtok_r(NULL, ":", &save)) {
+            char * v = strchr(tok, '=');
+            char * e;
+
+            err = -EINVAL;
+            if (v) {
+                *v++ = '\0';
+                e = v;
+
+                if (strcmp(tok, "label") == 0) {
+                    label = v;
+                    e     = v + strlen(v);
+                    err   = (strlen(v) <= 11) ? 0 : -EINVAL;
+                } else if (strcmp(tok, "cluster") == 0) {
+                    const unsigned long c = strtoul(v, &e, 0);
+
+                    spc = c / PARTFS_FAT_SECTOR;
+                    err = (c >= PARTFS_FAT_SECTOR && c <= 65536 &&
+                           !(c & (c - 1))) ? 0 : -EINVAL;
+                } else if (strcmp(tok, "id") == 0) {
+                    id  = strtoul(v, &e, 16);
+                    err = 0;
+                }
+
+                if (!err && *e) {
+                    err = -EINVAL;
+                }
+            }
+        }
+    }
+
+    if (!err) {
+        struct partfs_file pfi;
+
+        err = __partfs_xattr_begin(pdev, n, &pfi);
+        if (!err) {
+            struct partfs_fat fat;
+
+            err = (pfi.size / PARTFS_FAT_SECTOR <= UINT32_MAX) ?
+                0 : -EFBIG;
+            if (!err) {
+                err = __partfs_fat_layout(
+                    &fat, pfi.size / PARTFS_FAT_SECTOR, bits, spc);
+            }
+            if (!err) {
+                err = __partfs_fat_format(&pfi, &fat, label, id);
+            }
+
+            err = __partfs_xattr_end(pdev, n, &pfi, err);
+        }
+    }
+
+    free(s);
+
+    return err;
+}
+
+/*
+ * copy the files and directories in a directory on the host, named
+ * by its absolute path, into the empty FAT file system in a partition.
+ * the partition is locked as when formatting it. the directory is read
+ * with the privileges of partfs, so only root or the user partfs runs
+ * as may name one; with allow_other, anyone else could otherwise copy
+ * files they can't read into a partition they can.
+ */
+static int __partfs_xattr_populate(struct partfs_device * const pdev,
+                                   const size_t n,
+                                   const char * const val, const size_t size)
+{
+    const uid_t uid = fuse_get_context()->uid;
+    char * const path = strndup(val, size);
+    int err;
+
+    err = -ENOMEM;
+    if (path) {
+        struct partfs_file pfi;
+
+        err = (uid == 0 || uid == getuid()) ? 0 : -EPERM;
+        if (!err) {
+            /* the daemon's working directory is no use to the caller */
+            err = (path[0] == '/') ? __partfs_xattr_begin(pdev, n, &pfi) :
+                -EINVAL;
+        }
+        if (!err) {
+            err = __partfs_fat_populate(&pfi, path);
+            err = __partfs_xattr_end(pdev, n, &pfi, err);
+        }
+    }
+
+    free(path);
+
+    return err;
+}
+
+/*
+ * copy the name of a snapshot written to an attribute. names are
+ * made of letters, digits, dots, dashes and underscores.
+ *
+ * returns 0 on success or -EINVAL if the name isn't valid
+ */
+static int __partfs_xattr_snapname(const char * const val, const size_t size,
+                                   char * const name)
+{
+    size_t i;
+    int err;
+
+    err = (size > 0 && size <= PARTFS_SNAP_NAME_MAX) ? 0 : -EINVAL;
+    for (i = 0; !err && i < size; i++) {
+        const int c = (unsigned char)val[i];
+
+        err = (c < 0x80 && (isalnum(c) || (c && strchr("._-", c)))) ?
+            0 : -EINVAL;
+        name[i] = c;
+    }
+    name[i] = '\0';
+
+    return err;
+}
+
+/*
+ * the names of the snapshots of a partition, newest first, or of all
+ * the partitions for the root directory, separated by spaces. names
+ * that don't fit in the buffer are left out.
+ */
+static int __partfs_xattr_snaps(struct partfs_device * const pdev,
+                                const size_t n,
+                                struct fdisk_partition * const pa,
+                                char * const buf, const size_t size)
+{
+    /* only the root directory has no partition table entry */
+    const size_t first = pa ? n : 0, end = pa ? (n + 1) : pdev->npart;
+    size_t i, len;
+
+    for (i = first, len = 0; i < end && i < pdev->npart; i++) {
+        struct partfs_partition * const part = &pdev->part[i];
+        const struct partfs_snap * sn;
+
+        pthread_mutex_lock(&part->snaplock);
+        for (sn = part->snap; sn; sn = sn->next) {
+            const size_t l = strlen(sn->name);
+            const char * p;
+            int dup;
+
+            /* the root lists each name once */
+            for (p = buf, dup = 0; !dup && p < buf + len;
+                 p += strcspn(p, " ") + 1) {
+                dup = strncmp(p, sn->name, l) == 0 &&
+                    (p[l] == ' ' || p[l] == '\0');
+            }
+
+            if (!dup && len + !!len + l < size) {
+                len += sprintf(buf + len, "%s%s", len ? " " : "", sn->name);
+            }
+        }
+        pthread_mutex_unlock(&part->snaplock);
+    }
+
+    return len ? (int)len : -ENODATA;
+}
+
+/*
+ * take a snapshot of a partition, or of all of them when written to
+ * the root directory, under the name written
+ */
+static int __partfs_xattr_snapshot(struct partfs_device * const pdev,
+                                   const size_t n,
+                                   const char * const val, const size_t size)
+{
+    char name[PARTFS_SNAP_NAME_MAX + 1];
+    int err;
+
+    err = __partfs_xattr_snapname(val, size, name);
+    if (!err) {
+        err = (n < pdev->npart) ? __partfs_snap_take(pdev, n, name) : -ENOENT;
+    }
+
+    return err;
+}
+
+static int __partfs_xattr_snapall(struct partfs_device * const pdev,
+                                  const size_t n,
+                                  const char * const val, const size_t size)
+{
+    struct partfs_snap ** const sn = calloc(MAX(pdev->npart, 1),
+                                            sizeof(*sn));
+    char name[PARTFS_SNAP_NAME_MAX + 1];
+    size_t i, taken;
+    int err, locked;
+
+    err = sn ? __partfs_xattr_snapname(val, size, name) : -ENOMEM;
+    for (i = 0, taken = 0; !err && i < pdev->npart; i++) {
+        /* slots of the partition table without a partition are skipped */
+        err = __partfs_snap_new(pdev, i, name, &sn[i]);
+        if (err == -ENOENT) {
+            err = 0;
+        } else if (!err) {
+            taken++;
+        }
+    }
+    if (!err && !taken) {
+        err = -ENOENT;
+    }
+
+    /*
+     * a snapshot of only some of the partitions is no use, so the new
+     * snapshots replace those of the same name only if none of them is
+     * busy. nothing else holds the snapshot locks of two partitions.
+     */
+    locked = !err;
+    for (i = 0; locked && i < pdev->npart; i++) {
+        if (sn[i]) {
+            pthread_mutex_lock(&pdev->part[i].snaplock);
+        }
+    }
+    for (i = 0; locked && !err && i < pdev->npart; i++) {
+        if (sn[i] && __partfs_snap_busy(&pdev->part[i], name)) {
+            err = -EBUSY;
+        }
+    }
+    for (i = 0; locked && i < pdev->npart; i++) {
+        if (sn[i]) {
+            if (!err) {
+                __partfs_snap_put(&pdev->part[i], sn[i]);
+            }
+            pthread_mutex_unlock(&pdev->part[i].snaplock);
+            if (!err) {
+                sn[i] = NULL;
+            }
+        }
+    }
+
+    /* only the snapshots made here are dropped on failure */
+    for (i = 0; sn && i < pdev->npart; i++) {
+        if (sn[i]) {
+            __partfs_snap_free(sn[i]);
+        }
+    }
+    free(sn);
+
+    return err;
+}
+
+/*
+ * roll a partition back to the snapshot named, or all partitions that
+ * have a snapshot of that name when written to the root directory
+ */
+static int __partfs_xattr_rollback(struct partfs_device * const pdev,
+                                   const size_t n,
+                                   const char * const val, const size_t size)
+{
+    char name[PARTFS_SNAP_NAME_MAX + 1];
+    struct partfs_file pfi;
+    int err;
+
+    err = __partfs_xattr_snapname(val, size, name);
+    if (!err) {
+        err = __partfs_xattr_begin(pdev, n, &pfi);
+    }
+    if (!err) {
+        err = __partfs_snap_rollback(pdev, &pfi, name);
+        err = __partfs_xattr_end(pdev, n, &pfi, err);
+    }
+
+    return err;
+}
+
+static int __partfs_xattr_rollall(struct partfs_device * const pdev,
+                                  const size_t n,
+                                  const char * const val, const size_t size)
+{
+    char name[PARTFS_SNAP_NAME_MAX + 1];
+    size_t i, found;
+    int err;
+
+    err = __partfs_xattr_snapname(val, size, name);
+    for (i = 0, found = 0; !err && i < pdev->npart; i++) {
+        if (__partfs_snap_has(&pdev->part[i], name)) {
+            err = __partfs_xattr_rollback(pdev, i, val, size);
+            found++;
+        }
+    }
+
+    return (!err && !found) ? -ENOENT : err;
+}
+
+/*
+ * discard the snapshot named of a partition, or of all partitions
+ * when written to the root directory
+ */
+static int __partfs_xattr_drop(struct partfs_device * const pdev,
+                               const size_t n,
+                               const char * const val, const size_t size)
+{
+    char name[PARTFS_SNAP_NAME_MAX + 1];
+    int err;
+
+    err = __partfs_xattr_snapname(val, size, name);
+    if (!err) {
+        err = (n < pdev->npart) ? __partfs_snap_drop(pdev, n, name) : -ENOENT;
+    }
+
+    return err;
 }
 
-/* called just before fuse exits */
-static void partfs_destroy(void * const priv)
+static int __partfs_xattr_dropall(struct partfs_device * const pdev,
+                                  const size_t n,
+                                  const char * const val, const size_t size)
 {
-    struct partfs_device * const pdev = priv;
+    char name[PARTFS_SNAP_NAME_MAX + 1];
+    size_t i, found;
+    int err;
 
-    fdisk_deassign_device(pdev->ctx, 0);
-    fdisk_unref_context(pdev->ctx);
-    free((void *)pdev->name);
+    err = __partfs_xattr_snapname(val, size, name);
+    for (i = 0, found = 0; !err && i < pdev->npart; i++) {
+        if (__partfs_snap_drop(pdev, i, name) == 0) {
+            found++;
+        }
+    }
+
+    return (!err && !found) ? -ENOENT : err;
 }
 
 /*
- * get attributes--stat(2), essentially--for a file or directory
+ * the file system type is the only attribute that requires
+ * reading the partition. it is probed once and remembered until
+ * the partition is written to.
  */
-static int partfs_getattr(const char * const path, struct stat * const st)
+static int __partfs_xattr_fstype(struct partfs_device * const pdev,
+                                 const size_t n,
+                                 struct fdisk_partition * const pa,
+                                 char * const buf, const size_t size)
 {
-    struct partfs_device * const pdev = fuse_get_context()->private_data;
     int ret;
 
-    if (strcmp(path, "/") == 0) {
-        __partfs_stat(st, S_IFDIR | 0755, 2, 0, &pdev->st);
-        ret = 0;
-    } else {
-        ssize_t n;
-
-        ret = -ENOENT;
+    ret = -ENODATA;
+    if (n < pdev->npart) {
+        struct partfs_partition * const part = &pdev->part[n];
 
-        /*
-         * extract the partition number from the path name
-         * and gather statistics for it
-         */
-        n = __partfs_parse_path(path);
-        if (n >= 0) {
-            struct fdisk_partition * pa;
+        pthread_mutex_lock(&pdev->lock);
+        if (!part->probed) {
+            struct partfs_file pfi;
 
-            pa = NULL;
-            fdisk_get_partition(pdev->ctx, n, &pa);
+            part->fstype = NULL;
+            if (__partfs_file_init(pdev, n, O_RDONLY, &pfi) == 0) {
+                struct partfs_fs fs;
 
-            __partfs_stat(st, pdev->st.st_mode, 1,
-                          __fdisk_partition_get_size(pdev->ctx, pa),
-                          &pdev->st);
+                if (__partfs_probe_fs(&pfi, &fs) == 0) {
+                    part->fstype = fs.type;
+                    __partfs_fs_free(&fs);
+                }
 
-            fdisk_unref_partition(pa);
-            ret = 0;
+                close(pfi.desc);
+                part->probed = 1;
+            }
         }
+
+        ret = __partfs_xattr_string(part->fstype, buf, size);
+        pthread_mutex_unlock(&pdev->lock);
     }
 
     return ret;
 }
 
 /*
- * list directory contents
+ * reads and writes of a partition, or of all partitions for the
+ * root directory, in flight and waiting to be let through: the
+ * requests and bytes in flight and the bounds on them (0 for none),
+ * the requests waiting now and at most at once, the requests let
+ * through and those that waited, and the average and longest wait
+ * in milliseconds
  */
-static int partfs_readdir(const char * const path,
-                          void * const buf,
-                          fuse_fill_dir_t fill,
-                          off_t offs,
-                          struct fuse_file_info * const fi)
+static int __partfs_xattr_queue(struct partfs_device * const pdev,
+                                const size_t n,
+                                struct fdisk_partition * const pa,
+                                char * const buf, const size_t size)
 {
-    struct partfs_device * const pdev = fuse_get_context()->private_data;
-
     int ret;
 
-    ret = -ENOENT;
-    if (strcmp(path, "/") == 0) {
-        struct fdisk_table * tb;
-        struct fdisk_iter * it;
-        struct fdisk_partition * pa;
-
-        struct stat st;
-
-        /*
-         * use ownership and time stamps from the device file
-         * for the top level directory
-         */
-        __partfs_stat(&st, S_IFDIR | 0755, 2, 0, &pdev->st);
-        fill(buf, ".",  &st, 0);
-
-        /* fuse will fill in information for the parent directoy */
-        fill(buf, "..", NULL, 0);
-
-        /* load the entire partition table */
-        tb = NULL;
-        fdisk_get_partitions(pdev->ctx, &tb);
+    ret = -ENODATA;
+    if (!pa || n < pdev->npart) {
+        const struct partfs_queue * const q =
+            pa ? &pdev->part[n].queue : &pdev->queue;
 
-        /* return directory entries and information for each partition */
-        it = fdisk_new_iter(FDISK_ITER_FORWARD);
-        while (fdisk_table_next_partition(tb, it, &pa) == 0) {
-            char num[16];
+        pthread_mutex_lock(&pdev->qlock);
+        ret = snprintf(
+            buf, size,
+            "reqs=%zu bytes=%zu maxreqs=%zu maxbytes=%zu waiting=%zu "
+            "maxwaiting=%zu admitted=%llu waited=%llu wait=%.3f "
+            "maxwait=%.3f",
+            q->reqs, q->bytes, q->maxreqs, q->maxbytes,
+            q->waiting, q->maxwaiting,
+            (unsigned long long)q->admitted, (unsigned long long)q->waited,
+            q->waited ? (double)q->waitus / q->waited / 1000 : 0.0,
+            (double)q->maxwaitus / 1000);
+        pthread_mutex_unlock(&pdev->qlock);
+    }
 
-            snprintf(num, sizeof(num),
-                     PARTFS_NAME_PREFIX "%zu",
-                     fdisk_partition_get_partno(pa) + 1);
+    return ret;
+}
 
-            __partfs_stat(&st, pdev->st.st_mode, 1,
-                          __fdisk_partition_get_size(pdev->ctx, pa),
-                          &pdev->st);
+static const struct partfs_xattr partfs_xattrs[] =
+{
+    { "user.partfs.type",     __partfs_xattr_type,   NULL },
+    { "user.partfs.name",     __partfs_xattr_name,   NULL },
+    { "user.partfs.uuid",     __partfs_xattr_uuid,   NULL },
+    { "user.partfs.start",    __partfs_xattr_start,  NULL },
+    { "user.partfs.size",     __partfs_xattr_size,   NULL },
+    { "user.partfs.attrs",    __partfs_xattr_attrs,  NULL },
+    { "user.partfs.fstype",   __partfs_xattr_fstype, NULL },
+    { "user.partfs.format",   NULL,                  __partfs_xattr_format },
+    { "user.partfs.populate", NULL,                  __partfs_xattr_populate },
+    { "user.partfs.snapshot", __partfs_xattr_snaps,  __partfs_xattr_snapshot },
+    { "user.partfs.rollback", NULL,                  __partfs_xattr_rollback },
+    { "user.partfs.drop",     NULL,                  __partfs_xattr_drop },
+    { "user.partfs.queue",    __partfs_xattr_queue,  NULL },
 
-            fill(buf, num, &st, 0);
-        }
+    { NULL, NULL, NULL },
+};
 
-        fdisk_free_iter(it);
-        fdisk_unref_table(tb);
+/*
+ * statistics of the block cache, as space separated name=value
+ * pairs. blocks in the compressed tier take zbytes of memory, which
+ * includes the bookkeeping; ratio is the size of the data they hold
+ * relative to that.
+ */
+static int __partfs_xattr_cache(struct partfs_device * const pdev,
+                                const size_t n,
+                                struct fdisk_partition * const pa,
+                                char * const buf, const size_t size)
+{
+    struct partfs_cache * const cache = pdev->cache;
+    int ret;
 
-        ret = 0;
+    ret = -ENODATA;
+    if (cache) {
+        pthread_mutex_lock(&cache->lock);
+        ret = snprintf(
+            buf, size,
+            "blocks=%zu hits=%llu misses=%llu ahead=%llu "
+            "zblocks=%zu zeros=%zu zbytes=%zu zhits=%llu ratio=%.2f",
+            cache->n, (unsigned long long)cache->hits,
+            (unsigned long long)cache->misses,
+            (unsigned long long)cache->ahead,
+            cache->zn, cache->zeros, cache->zmem,
+            (unsigned long long)cache->zhits,
+            cache->zmem ?
+            (double)cache->zn * PARTFS_CACHE_BLOCK / cache->zmem : 0.0);
+        pthread_mutex_unlock(&cache->lock);
     }
 
     return ret;
 }
 
 /*
- * open a file (partition) within the device
+ * statistics of the cache file on local storage, like those of the
+ * block cache. admits counts blocks entered after being read from
+ * the device, and dirty the blocks not written back yet.
  */
-static int partfs_open(const char * const path,
-                       struct fuse_file_info * const fi)
+static int __partfs_xattr_ssd(struct partfs_device * const pdev,
+                              const size_t n,
+                              struct fdisk_partition * const pa,
+                              char * const buf, const size_t size)
 {
-    struct partfs_device * const pdev = fuse_get_context()->private_data;
-    struct partfs_file * const pfi = malloc(sizeof(*pfi));
-    int err;
-
-    err = -ENOMEM;
-    if (pfi) {
-        /* open the existing disk/device file */
-        pfi->desc = open(pdev->name, fi->flags);
+    struct partfs_ssd * const ssd = pdev->cache ? pdev->cache->ssd : NULL;
+    int ret;
 
-        if (pfi->desc < 0) {
-            err = -errno;
-        } else {
-            const ssize_t n = __partfs_parse_path(path);
+    ret = -ENODATA;
+    if (ssd) {
+        uint32_t i, used;
 
-            struct fdisk_partition * pa;
+        pthread_mutex_lock(&ssd->lock);
+        for (i = 0, used = 0; i < ssd->nslot; i++) {
+            used += ssd->slot[i].used;
+        }
+        ret = snprintf(
+            buf, size,
+            "blocks=%lu slots=%lu dirty=%zu hits=%llu misses=%llu "
+            "admits=%llu writebacks=%llu mode=%s",
+            (unsigned long)used, (unsigned long)ssd->nslot, ssd->ndirty,
+            (unsigned long long)ssd->hits, (unsigned long long)ssd->misses,
+            (unsigned long long)ssd->admits,
+            (unsigned long long)ssd->writebacks,
+            ssd->wb ? "writeback" : "writethrough");
+        pthread_mutex_unlock(&ssd->lock);
+    }
 
-            pa = NULL;
-            fdisk_get_partition(pdev->ctx, n, &pa);
+    return ret;
+}
 
-            /*
-             * get/save the starting offset
-             * and size of the partition
-             */
-            pfi->start = fdisk_get_sector_size(pdev->ctx) *
-                fdisk_partition_get_start(pa);
-            pfi->size  = __fdisk_partition_get_size(pdev->ctx, pa);
+/*
+ * statistics of the shared memory segment. hits and misses are
+ * those of all the mounts attached to it since it was created.
+ */
+static int __partfs_xattr_shm(struct partfs_device * const pdev,
+                              const size_t n,
+                              struct fdisk_partition * const pa,
+                              char * const buf, const size_t size)
+{
+    struct partfs_shm * const shm = pdev->cache ? pdev->cache->shm : NULL;
+    int ret;
 
-            fdisk_unref_partition(pa);
+    ret = -ENODATA;
+    if (shm) {
+        const uint64_t nslot = shm->nset * PARTFS_SHM_WAYS;
+        uint64_t i, used;
 
-            /* save the file structure */
-            fi->fh = (uintptr_t)pfi;
-            err = 0;
+        for (i = 0, used = 0; i < nslot; i++) {
+            used += __atomic_load_n(&shm->slot[i].blk, __ATOMIC_RELAXED) != 0;
         }
+        ret = snprintf(
+            buf, size,
+            "blocks=%llu slots=%llu users=%llu hits=%llu misses=%llu "
+            "name=%s",
+            (unsigned long long)used, (unsigned long long)nslot,
+            (unsigned long long)__atomic_load_n(&shm->hdr->users,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&shm->hdr->hits,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&shm->hdr->misses,
+                                                __ATOMIC_RELAXED),
+            shm->name);
     }
 
-    return err;
+    return ret;
 }
 
 /*
- * this function is not actually part of the fuse api but
- * has an signature similar to what it would probably look
- * like if it was.
- *
- * path is the path name to the file
- * off is the offset to which to seek within the open
- *   file/partition; whence is assumed to be SEEK_SET
- * fi is the file information associated with the open() call
- *
- * returns 0 on success or a negative errno on failure
+ * memory used for caching and buffering: the limit and what may be
+ * used in view of memory pressure, both 0 if there is none, what is
+ * used in all, at most and by each user, the share of the last ten
+ * seconds stalled waiting for memory, the times memory was found
+ * short and the bytes evicted from the caches for it
  */
-static int partfs_lseek(const char * const path,
-                        const off_t off,
-                        struct fuse_file_info * const fi)
+static int __partfs_xattr_memory(struct partfs_device * const pdev,
+                                 const size_t n,
+                                 struct fdisk_partition * const pa,
+                                 char * const buf, const size_t size)
 {
-    struct partfs_file * const pfi = (void *)fi->fh;
-    int ret;
+    struct partfs_mem * const mem = &pdev->mem;
+    const size_t target = __atomic_load_n(&mem->target, __ATOMIC_RELAXED);
+    size_t used[PARTFS_MEM_USERS];
+    size_t i;
 
-    ret = -EINVAL;
-    if (off >= 0 && off <= pfi->size) {
-        /*
-         * off refers to an offset within a partition; however,
-         * the file system actually opens the device file itself
-         * underneath the covers, so the lseek actually seeks to
-         * the appropriate location within the device file
-         */
-        ret = (lseek(pfi->desc, pfi->start + off, SEEK_SET) >= 0) ? 0 : -errno;
+    for (i = 0; i < PARTFS_MEM_USERS; i++) {
+        used[i] = __atomic_load_n(&mem->used[i], __ATOMIC_RELAXED);
     }
 
-    return ret;
+    return snprintf(
+        buf, size,
+        "limit=%zu target=%zu used=%zu peak=%zu cache=%zu zcache=%zu "
+        "ahead=%zu buffers=%zu pinned=%zu stall=%.2f squeezes=%llu "
+        "evicted=%llu",
+        mem->limit, (target == SIZE_MAX) ? 0 : target,
+        __atomic_load_n(&mem->total, __ATOMIC_RELAXED),
+        __atomic_load_n(&mem->peak, __ATOMIC_RELAXED),
+        used[PARTFS_MEM_CACHE], used[PARTFS_MEM_ZCACHE],
+        used[PARTFS_MEM_AHEAD], used[PARTFS_MEM_BUFFER],
+        used[PARTFS_MEM_PIN],
+        __atomic_load_n(&mem->stall, __ATOMIC_RELAXED) / 100.0,
+        (unsigned long long)__atomic_load_n(&mem->squeezes,
+                                            __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_load_n(&mem->evicted,
+                                            __ATOMIC_RELAXED));
 }
 
+/* attributes of the root directory, describing the mount as a whole */
+static const struct partfs_xattr partfs_root_xattrs[] =
+{
+    { "user.partfs.cache",    __partfs_xattr_cache,  NULL },
+    { "user.partfs.ssd",      __partfs_xattr_ssd,    NULL },
+    { "user.partfs.shm",      __partfs_xattr_shm,    NULL },
+    { "user.partfs.memory",   __partfs_xattr_memory, NULL },
+    { "user.partfs.queue",    __partfs_xattr_queue,  NULL },
+    { "user.partfs.snapshot", __partfs_xattr_snaps,  __partfs_xattr_snapall },
+    { "user.partfs.rollback", NULL,                  __partfs_xattr_rollall },
+    { "user.partfs.drop",     NULL,                  __partfs_xattr_dropall },
+
+    { NULL, NULL, NULL },
+};
+
 /*
- * read data from a partition
+ * look up the partition table entry for a partition file and the
+ * attributes it has. the root directory has attributes of its own
+ * and no partition table entry.
+ *
+ * returns the partition number or a negative errno on failure
  */
-static int partfs_read(const char * const path,
-                       char * const buf, size_t len,
-                       off_t off,
-                       struct fuse_file_info * const fi)
+static ssize_t __partfs_xattr_partition(
+    struct partfs_device * const pdev, const char * const path,
+    struct fdisk_partition ** const pa,
+    const struct partfs_xattr ** const xattrs)
 {
-    struct partfs_file * const pfi = (void *)fi->fh;
+    const struct partfs_format * fmt;
+    ssize_t n;
 
-    int ret;
+    *pa = NULL;
+    *xattrs = partfs_xattrs;
 
-    ret = partfs_lseek(path, off, fi);
-    if (ret == 0) {
-        ret = read(pfi->desc, buf, MIN(pfi->size - off, len));
-        if (ret < 0) {
-            ret = -errno;
+    n = __partfs_parse_path(path, &fmt);
+    if (n < 0) {
+        n = -ENOENT;
+        if (strcmp(path, "/") == 0) {
+            *xattrs = partfs_root_xattrs;
+            n = 0;
         }
+    } else if (fdisk_get_partition(pdev->ctx, n, pa) != 0) {
+        n = -ENODATA;
     }
 
-    return ret;
+    return n;
 }
 
 /*
- * write data to a partition
+ * get the value of an extended attribute of a partition file
+ * or the root directory
  */
-static int partfs_write(const char * const path,
-                        const char * const buf, const size_t len,
-                        const off_t off,
-                        struct fuse_file_info * const fi)
+static int partfs_getxattr(const char * const path, const char * const name,
+                           char * const buf, const size_t size)
 {
-    struct partfs_file * const pfi = (void *)fi->fh;
-
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    const struct partfs_xattr * x;
+    struct fdisk_partition * pa;
+    const ssize_t n = __partfs_xattr_partition(pdev, path, &pa, &x);
     int ret;
 
-    ret = partfs_lseek(path, off, fi);
-    if (off >= 0) {
-        if (ret != 0) {
+    ret = n;
+    if (n >= 0) {
+        for (; x->name && strcmp(x->name, name) != 0; x++)
+            ;
+
+        ret = -ENODATA;
+        if (x->name && x->get) {
+            char val[512];
+
             /*
-             * if offset was positive, but the lseek failed, then
-             * the offset is beyond the end of the partition
+             * values are formatted into a local buffer, which is
+             * big enough for any of them, rather than the caller's
+             * buffer, which may be too small or absent
              */
-            ret = -EFBIG;
-        } else {
-            ret = write(pfi->desc, buf, MIN(pfi->size - off, len));
-            if (ret < 0) {
-                ret = -errno;
+            ret = x->get(pdev, n, pa, val, sizeof(val));
+            if (ret >= 0 && size > 0) {
+                if ((size_t)ret > size) {
+                    ret = -ERANGE;
+                } else {
+                    memcpy(buf, val, ret);
+                }
             }
         }
+
+        fdisk_unref_partition(pa);
     }
 
     return ret;
 }
 
 /*
- * release is called when a partition is closed
+ * list the extended attributes that a partition file or the
+ * root directory has
  */
-static int partfs_release(const char * const path,
-                          struct fuse_file_info * const fi)
+static int partfs_listxattr(const char * const path,
+                            char * const buf, const size_t size)
 {
-    struct partfs_file * const pfi = (void *)fi->fh;
-    const int desc = pfi->desc;
+    struct partfs_device * const pdev = fuse_get_context()->private_data;
+    const struct partfs_xattr * x;
+    struct fdisk_partition * pa;
+    const ssize_t n = __partfs_xattr_partition(pdev, path, &pa, &x);
+    int ret;
 
-    free(pfi);
+    ret = (n == -ENODATA) ? 0 : n;
+    if (n >= 0) {
+        size_t len;
 
-    /*
-     * fuse ignores this error, but return it anyway
-     */
-    return close(desc) ? -errno : 0;
+        for (len = 0; x->name; x++) {
+            char val[512];
+
+            if (x->get && x->get(pdev, n, pa, val, sizeof(val)) >= 0) {
+                const size_t l = strlen(x->name) + 1;
+
+                if (size > 0 && len + l <= size) {
+                    memcpy(buf + len, x->name, l);
+                }
+                len += l;
+            }
+        }
+
+        ret = (size > 0 && len > size) ? -ERANGE : (int)len;
+
+        fdisk_unref_partition(pa);
+    }
+
+    return ret;
 }
 
 /*
- * truncate doesn't actually change the size of the partition, but
- * implementing it allows using the > operator on the command line
- * to cat data into it.
- *
- * function succeeds if size is less than existing size (without
- * doing anything) and fails if size is larger.
+ * write an extended attribute of a partition file or the root
+ * directory, which asks partfs to act on it. attributes aren't
+ * stored, so names partfs doesn't know are not supported.
  */
-static int partfs_truncate(const char * const path, const off_t off)
+static int partfs_setxattr(const char * const path, const char * const name,
+                           const char * const val, const size_t size,
+                           const int flags)
 {
     struct partfs_device * const pdev = fuse_get_context()->private_data;
-    const ssize_t n = __partfs_parse_path(path);
+    const struct partfs_xattr * x;
+    struct fdisk_partition * pa;
+    const ssize_t n = __partfs_xattr_partition(pdev, path, &pa, &x);
     int ret;
 
-    ret = -ENOENT;
+    ret = n;
     if (n >= 0) {
-        struct fdisk_partition * pa;
-
-        pa = NULL;
-        fdisk_get_partition(pdev->ctx, n, &pa);
+        for (; x->name && strcmp(x->name, name) != 0; x++)
+            ;
 
-        ret = -EFBIG;
-        if (off <= __fdisk_partition_get_size(pdev->ctx, pa)) {
-            ret = 0;
+        ret = -ENOTSUP;
+        if (x->name) {
+            ret = x->set ? x->set(pdev, n, val, size) : -EACCES;
         }
+
+        fdisk_unref_partition(pa);
     }
 
     return ret;
@@ -524,9 +12731,16 @@ static const struct fuse_operations partfs_ops =
     .open           = partfs_open,
     .read           = partfs_read,
     .write          = partfs_write,
+    .flush          = partfs_flush,
+    .fsync          = partfs_fsync,
     .release        = partfs_release,
 
     .truncate       = partfs_truncate,
+    .fallocate      = partfs_fallocate,
+
+    .getxattr       = partfs_getxattr,
+    .listxattr      = partfs_listxattr,
+    .setxattr       = partfs_setxattr,
 
     .init           = partfs_init,
     .destroy        = partfs_destroy,
@@ -539,18 +12753,129 @@ int main(const int argc, char * argv[])
     int err;
 
     opts.device = NULL;
+    opts.base   = NULL;
+    opts.fsmap  = 0;
+    opts.wbcache = 0;
+    opts.pinmeta = 0;
+    opts.inject = NULL;
+    opts.cache  = 0;
+    opts.zcache = 0;
+    opts.cachedir = NULL;
+    opts.ssdcache = NULL;
+    opts.ssdsize = 1024;
+    opts.ssdwb  = 0;
+    opts.shmcache = 0;
+    opts.iothreads = 0;
+    opts.snapdir = NULL;
+    opts.memlimit = 0;
+    opts.maxreqs = 0;
+    opts.maxmib = 0;
+    opts.partreqs = 0;
+    opts.partmib = 0;
     opts.help   = 0;
 
     err = fuse_opt_parse(&args, &opts, partfs_optspec, NULL);
     if (!err) {
-        struct partfs_device pdev;
+        struct partfs_device pdev, base;
 
         if (opts.device) {
             err = partfs_open_device(&pdev, opts.device);
-            if (err) {
+            if (err == -EBUSY) {
+                fprintf(stderr,
+                        "%s: partition table locked by another process\n",
+                        opts.device);
+            } else if (err) {
                 fprintf(stderr,
                         "%s: unable to read partitions\n",
                         opts.device);
+            } else {
+                size_t i;
+
+                pdev.fsmap  = opts.fsmap;
+                pdev.wbcache = opts.wbcache;
+                pdev.pinmax = opts.pinmeta << 20;
+                if (opts.memlimit > 0) {
+                    pdev.mem.limit  = (size_t)opts.memlimit << 20;
+                    pdev.mem.target = pdev.mem.limit;
+                }
+
+                pdev.queue.maxreqs  = opts.maxreqs;
+                pdev.queue.maxbytes = (size_t)opts.maxmib << 20;
+                for (i = 0; i < pdev.npart; i++) {
+                    pdev.part[i].queue.maxreqs  = opts.partreqs;
+                    pdev.part[i].queue.maxbytes = (size_t)opts.partmib << 20;
+                }
+            }
+
+            if (!err && opts.inject) {
+                err = __partfs_inject_open(&pdev, opts.inject);
+                if (err) {
+                    fprintf(stderr,
+                            "%s: invalid injection rules\n",
+                            opts.inject);
+                    partfs_close_device(&pdev);
+                }
+            }
+
+            if (!err && (opts.cache || opts.zcache || opts.ssdcache ||
+                         opts.shmcache)) {
+                const char * what = opts.device;
+
+                err = __partfs_cache_open(&pdev, opts.cache, opts.zcache);
+                if (!err && opts.cachedir) {
+                    /* fuse changes to / when it daemonizes */
+                    what = opts.cachedir;
+                    pdev.cache->dir = realpath(opts.cachedir, NULL);
+                    err = pdev.cache->dir ? 0 : -errno;
+                }
+                if (!err && opts.ssdcache) {
+                    what = opts.ssdcache;
+                    err = __partfs_ssd_open(&pdev, opts.ssdcache,
+                                            opts.ssdsize, opts.ssdwb);
+                }
+                if (!err && opts.shmcache) {
+                    what = opts.device;
+                    err = __partfs_shm_open(&pdev, opts.shmcache);
+                }
+                if (err) {
+                    fprintf(stderr,
+                            "%s: unable to set up the cache\n", what);
+                    partfs_close_device(&pdev);
+                }
+            }
+
+            if (!err && opts.iothreads > 0) {
+                err = __partfs_pool_open(&pdev, opts.iothreads);
+                if (err) {
+                    fprintf(stderr,
+                            "%s: unable to set up i/o threads\n",
+                            opts.device);
+                    partfs_close_device(&pdev);
+                }
+            }
+
+            if (!err && opts.snapdir) {
+                /* fuse changes to / when it daemonizes */
+                pdev.snapdir = realpath(opts.snapdir, NULL);
+                err = pdev.snapdir ? 0 : -errno;
+                if (err) {
+                    fprintf(stderr,
+                            "%s: unable to use the snapshot directory\n",
+                            opts.snapdir);
+                    partfs_close_device(&pdev);
+                }
+            }
+
+            if (!err && opts.base) {
+                err = partfs_open_device(&base, opts.base);
+                if (err) {
+                    fprintf(stderr,
+                            "%s: unable to read partitions\n",
+                            opts.base);
+                    partfs_close_device(&pdev);
+                } else {
+                    pdev.base = &base;
+                }
             }
         } else {
             opts.help = 1;
@@ -567,7 +12892,53 @@ int main(const int argc, char * argv[])
                 fprintf(stderr, "\n");
                 fprintf(stderr, "File system-specific options:\n");
                 fprintf(stderr, "\n");
-                fprintf(stderr, "    -o dev=FILE\n");
+                fprintf(stderr, "    -o dev=FILE            "
+                        "image, vmdk, block device or nbd uri\n");
+                fprintf(stderr, "    -o fsmap               "
+                        "only export blocks used by the file system\n");
+                fprintf(stderr, "    -o base=FILE           "
+                        "image against which pX.delta is generated\n");
+                fprintf(stderr, "    -o pinmeta=MIB         "
+                        "pin up to MIB of file system metadata\n");
+                fprintf(stderr, "    -o wbcache             "
+                        "cache writes to partitions in the kernel\n");
+                fprintf(stderr, "    -o inject=RULES        "
+                        "inject faults and delays into device i/o\n");
+                fprintf(stderr, "    -o cache=MIB           "
+                        "cache up to MIB of device blocks\n");
+                fprintf(stderr, "    -o zcache=MIB          "
+                        "keep up to MIB of evicted blocks compressed\n");
+                fprintf(stderr, "    -o cachedir=DIR        "
+                        "keep the cache's hot set in DIR between mounts\n");
+                fprintf(stderr, "    -o ssdcache=FILE       "
+                        "cache device blocks in FILE on local storage\n");
+                fprintf(stderr, "    -o ssdsize=MIB         "
+                        "size of the cache file (default: 1024)\n");
+                fprintf(stderr, "    -o ssdwb               "
+                        "write to the cache file, writing back later\n");
+                fprintf(stderr, "    -o shmcache=MIB        "
+                        "share MIB of blocks with other read-only mounts\n");
+                fprintf(stderr, "    -o iothreads=N         "
+                        "split large reads and writes among N threads\n");
+                fprintf(stderr, "    -o snapdir=DIR         "
+                        "keep blocks saved by snapshots in DIR\n");
+                fprintf(stderr, "    -o memlimit=MIB        "
+                        "use at most MIB for caching and buffering\n");
+                fprintf(stderr, "    -o maxreqs=N           "
+                        "keep at most N reads and writes in flight\n");
+                fprintf(stderr, "    -o maxmib=MIB          "
+                        "keep at most MIB of reads and writes in flight\n");
+                fprintf(stderr, "    -o partreqs=N          "
+                        "likewise, for each partition\n");
+                fprintf(stderr, "    -o partmib=MIB         "
+                        "likewise, for each partition\n");
+                fprintf(stderr, "\n");
+                fprintf(stderr, "Each partition X is presented as the file pX. It\n");
+                fprintf(stderr, "can also be read as pX.simg (android sparse image),\n");
+                fprintf(stderr, "pX.zst (seekable zstd stream) or pX.bmap (bmaptool\n");
+                fprintf(stderr, "block map). With a base image, pX.delta holds the\n");
+                fprintf(stderr, "blocks that differ from the base as a sparse image;\n");
+                fprintf(stderr, "writing such an image to pX.delta applies it.\n");
             }
         }
     }